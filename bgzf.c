@@ -33,14 +33,20 @@
 #include <pthread.h>
 #include <sys/types.h>
 #include <inttypes.h>
+#include <limits.h>
 
 #include "htslib/hts.h"
 #include "htslib/bgzf.h"
 #include "htslib/hfile.h"
+#include "hts_deflate_internal.h"
 
 #define BGZF_CACHE
 #define BGZF_MT
 
+#ifdef BGZF_MT
+#include "cram/thread_pool.h"
+#endif
+
 #define BLOCK_HEADER_LENGTH 18
 #define BLOCK_FOOTER_LENGTH 8
 
@@ -62,15 +68,100 @@
 static const uint8_t g_magic[19] = "\037\213\010\4\0\0\0\0\0\377\6\0\102\103\2\0\0\0";
 
 #ifdef BGZF_CACHE
-typedef struct {
+// A cached block, on a list in least-recently-used order
+typedef struct cache_t {
+    struct cache_t *prev, *next;
+    int64_t block_address, end_offset;
     int size;
     uint8_t *block;
-    int64_t end_offset;
 } cache_t;
 #include "htslib/khash.h"
-KHASH_MAP_INIT_INT64(cache, cache_t)
+KHASH_MAP_INIT_INT64(cache, cache_t*)
+
+struct bgzf_cache_t {
+    pthread_mutex_t lock;   // may be shared by handles in different threads
+    int ref_count;
+    khash_t(cache) *h;
+    cache_t *head, *tail;   // most and least recently used
+    int64_t n_bytes, max_bytes;
+    uint64_t hits, misses, evictions;
+};
 #endif
 
+#ifdef BGZF_MT
+// A record given to bgzf_idx_push() while its block is still uncompressed
+typedef struct {
+    int tid, beg, end, is_mapped;
+    int offset;             // offset of the record's end within the block
+} idx_ent_t;
+
+typedef struct {
+    idx_ent_t *a;
+    int n, m;
+} idx_ents_t;
+
+// A single block being inflated or deflated by a worker thread
+typedef struct bgzf_job {
+    struct bgzf_job *next;  // link in the list of free jobs
+    uint8_t *comp_data, *uncomp_data;
+    int comp_len, uncomp_len;
+    int errcode;
+    int hit_eof;            // writing: marks the end of the stream for the writer thread
+    int compress_level;
+    int check_crc;          // reading: whether to verify the block's CRC
+    int64_t block_address;
+    uint64_t uaddr;         // writing: uncompressed offset, when building a .gzi index
+    idx_ents_t ents;        // writing: index entries ending in this block
+} bgzf_job;
+
+typedef struct bgzf_mtaux_t {
+    t_pool *pool;
+    int own_pool;           // pool was created by bgzf_mt() rather than shared
+    t_results_queue *out_queue;
+
+    // Recycled jobs; shared with the writer thread when writing
+    pthread_mutex_t job_pool_m;
+    pthread_cond_t job_pool_c;  // signalled when a job is freed or written
+    bgzf_job *free_jobs;
+    int n_jobs, max_jobs;
+
+    // Writing: blocks are compressed in the pool as soon as they are queued,
+    // and a dedicated thread writes them out in order.
+    pthread_t writer;
+    int n_queued;           // jobs dispatched but not yet written
+    int errcode;            // errors from the workers or the writer thread
+    int64_t block_address;  // compressed offset of the next block written
+    idx_ents_t ents;        // entries ending in fp->uncompressed_block
+    int idx_failed;         // hts_idx_push() has failed
+
+    // Reading: the main thread reads compressed blocks ahead of the consumer
+    // and the pool inflates them; results come back in file order.
+    int64_t *inflight;      // ring of addresses of the blocks being inflated
+    int n_ahead;            // maximum number of blocks being read ahead
+    int inflight_head, n_inflight;
+    int n_discard;          // stale results to be dropped following a seek
+    int hit_eof, read_errcode;
+    int64_t block_end;      // compressed offset of the block after the current one
+} mtaux_t;
+#endif
+
+// Compressed data read in advance by bgzf_prefetch(), as sorted file spans
+#define BGZF_PREFETCH_MAX (4 * 1024 * 1024) // bytes held at once
+#define BGZF_PREFETCH_GAP BGZF_MAX_BLOCK_SIZE // read through smaller gaps
+
+typedef struct {
+    int64_t beg, end;       // file offsets
+    size_t offset;          // position in data
+} prefetch_span_t;
+
+struct bgzf_prefetch_t {
+    prefetch_span_t *spans;
+    int n, m;
+    uint8_t *data;
+    size_t size;
+    int64_t pos;            // offset of the next block while reading from the spans, or -1
+};
+
 typedef struct
 {
     uint64_t uaddr;  // offset w.r.t. uncompressed data
@@ -78,15 +169,33 @@ typedef struct
 }
 bgzidx1_t;
 
+// Where inflation of a plain gzip stream can resume: at caddr, less the last
+// bits of the byte before it, given the 32K of uncompressed data before uaddr
+typedef struct
+{
+    int bits;
+    uint32_t l_win;     // the length of the window, itself deflated
+    uint8_t *win;
+}
+gzidx_win_t;
+
 struct __bgzidx_t
 {
     int noffs, moffs;       // the size of the index, n:used, m:allocated
     bgzidx1_t *offs;        // offsets
     uint64_t ublock_addr;   // offset of the current block (uncompressed data)
+    int is_gzip, mwins;     // for plain gzip, offs are checkpoints ...
+    int64_t span;           // ... at least span bytes apart
+    gzidx_win_t *wins;      // with these windows
 };
 
+#define GZIDX_SPAN (1024*1024)
+static const char gzidx_magic[8] = "GZIDX\1\0";
+
 void bgzf_index_destroy(BGZF *fp);
 int bgzf_index_add_block(BGZF *fp);
+static int bgzf_index_add_entry(BGZF *fp, uint64_t uaddr, uint64_t caddr);
+static int gzidx_seek(BGZF *fp, int64_t uoffset);
 
 static inline void packInt16(uint8_t *buffer, uint16_t value)
 {
@@ -107,6 +216,90 @@ static inline void packInt32(uint8_t *buffer, uint32_t value)
     buffer[3] = value >> 24;
 }
 
+static inline uint32_t unpackInt32(const uint8_t *buffer)
+{
+    return buffer[0] | buffer[1] << 8 | buffer[2] << 16 | (uint32_t)buffer[3] << 24;
+}
+
+// The compressed offset following the current block.  When blocks are being
+// read ahead by other threads, the underlying hFILE is already further along;
+// when they come from prefetched data, it could be anywhere.
+static inline int64_t bgzf_htell(BGZF *fp)
+{
+    // Plain gzip is instead addressed by uncompressed offsets, in blocks that
+    // end at multiples of 64K; see inflate_gzip_block()
+    if (fp->gz_stream && !fp->is_write) return (fp->gz_stream->total_out + 0xFFFF) >> 16;
+#ifdef BGZF_MT
+    if (fp->mt && !fp->is_write) return fp->mt->block_end;
+#endif
+    if (fp->prefetch && fp->prefetch->pos >= 0) return fp->prefetch->pos;
+    return htell(fp->fp);
+}
+
+// Returns the prefetched data for [offset, offset+len), or NULL if it has not
+// all been fetched
+static const uint8_t *prefetched(const struct bgzf_prefetch_t *pf, int64_t offset, int len)
+{
+    int lo = 0, hi = pf->n;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (pf->spans[mid].end <= offset) lo = mid + 1;
+        else hi = mid;
+    }
+    if (lo == pf->n || offset < pf->spans[lo].beg || offset + len > pf->spans[lo].end)
+        return NULL;
+    return &pf->data[pf->spans[lo].offset + (offset - pf->spans[lo].beg)];
+}
+
+// Stop reading from prefetched data, and carry on from the same place in the file
+static int prefetch_leave(BGZF *fp)
+{
+    int64_t pos = fp->prefetch->pos;
+    fp->prefetch->pos = -1;
+    return hseek(fp->fp, pos, SEEK_SET) < 0? -1 : 0;
+}
+
+// Moves to a compressed offset, avoiding I/O if it has been prefetched
+static int bgzf_hseek(BGZF *fp, int64_t offset)
+{
+    struct bgzf_prefetch_t *pf = fp->prefetch;
+    if (pf && prefetched(pf, offset, BLOCK_HEADER_LENGTH)) {
+        pf->pos = offset;
+        return 0;
+    }
+    if (pf) pf->pos = -1;
+    return hseek(fp->fp, offset, SEEK_SET) < 0? -1 : 0;
+}
+
+// As per hpeek() and hreadptr(), but taking prefetched data when available
+static ssize_t bgzf_hpeek(BGZF *fp, void *buffer, size_t nbytes)
+{
+    struct bgzf_prefetch_t *pf = fp->prefetch;
+    const uint8_t *data;
+    if (pf && pf->pos >= 0) {
+        if ((data = prefetched(pf, pf->pos, nbytes)) != NULL) {
+            memcpy(buffer, data, nbytes);
+            return nbytes;
+        }
+        if (prefetch_leave(fp) < 0) return -1;
+    }
+    return hpeek(fp->fp, buffer, nbytes);
+}
+
+static const uint8_t *bgzf_hreadptr(BGZF *fp, size_t nbytes)
+{
+    struct bgzf_prefetch_t *pf = fp->prefetch;
+    const uint8_t *data;
+    if (pf && pf->pos >= 0) {
+        if ((data = prefetched(pf, pf->pos, nbytes)) != NULL) {
+            pf->pos += nbytes;
+            return data;
+        }
+        if (prefetch_leave(fp) < 0) return NULL;
+    }
+    return (const uint8_t *) hreadptr(fp->fp, nbytes);
+}
+
 static BGZF *bgzf_read_init(hFILE *hfpr)
 {
     BGZF *fp;
@@ -123,9 +316,7 @@ static BGZF *bgzf_read_init(hFILE *hfpr)
     fp->compressed_block = malloc(BGZF_MAX_BLOCK_SIZE);
     fp->is_compressed = (n==18 && magic[0]==0x1f && magic[1]==0x8b) ? 1 : 0;
     fp->is_gzip = ( !fp->is_compressed || ((magic[3]&4) && memcmp(&magic[12], "BC\2\0",4)==0) ) ? 0 : 1;
-#ifdef BGZF_CACHE
-    fp->cache = kh_init(cache);
-#endif
+    fp->check_crc = hts_crc32_is_fast();
     return fp;
 }
 
@@ -231,24 +422,17 @@ BGZF *bgzf_hopen(hFILE *hfp, const char *mode)
 static int bgzf_compress(void *_dst, int *dlen, void *src, int slen, int level)
 {
     uint32_t crc;
-    z_stream zs;
     uint8_t *dst = (uint8_t*)_dst;
+    size_t clen = *dlen - BLOCK_HEADER_LENGTH - BLOCK_FOOTER_LENGTH;
 
     // compress the body
-    zs.zalloc = NULL; zs.zfree = NULL;
-    zs.next_in  = (Bytef*)src;
-    zs.avail_in = slen;
-    zs.next_out = dst + BLOCK_HEADER_LENGTH;
-    zs.avail_out = *dlen - BLOCK_HEADER_LENGTH - BLOCK_FOOTER_LENGTH;
-    if (deflateInit2(&zs, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) return -1; // -15 to disable zlib header/footer
-    if (deflate(&zs, Z_FINISH) != Z_STREAM_END) return -1;
-    if (deflateEnd(&zs) != Z_OK) return -1;
-    *dlen = zs.total_out + BLOCK_HEADER_LENGTH + BLOCK_FOOTER_LENGTH;
+    if (hts_deflate_raw(dst + BLOCK_HEADER_LENGTH, &clen, (uint8_t*)src, slen, level) != 0) return -1;
+    *dlen = clen + BLOCK_HEADER_LENGTH + BLOCK_FOOTER_LENGTH;
     // write the header
     memcpy(dst, g_magic, BLOCK_HEADER_LENGTH); // the last two bytes are a place holder for the length of the block
     packInt16(&dst[16], *dlen - 1); // write the compressed length; -1 to fit 2 bytes
     // write the footer
-    crc = crc32(crc32(0L, NULL, 0L), (Bytef*)src, slen);
+    crc = hts_crc32(0, src, slen);
     packInt32((uint8_t*)&dst[*dlen - 8], crc);
     packInt32((uint8_t*)&dst[*dlen - 4], slen);
     return 0;
@@ -287,60 +471,107 @@ static int deflate_block(BGZF *fp, int block_length)
     return comp_size;
 }
 
-// Inflate the block in fp->compressed_block into fp->uncompressed_block
-static int inflate_block(BGZF* fp, int block_length)
+// Inflate the complete BGZF block in src into dst, which has room for *dlen
+// bytes.  On success, *dlen is set to the uncompressed size.  The CRC is
+// checked straight after inflating, while the data is still in cache.
+// Returns 0 on success or a BGZF_ERR_* code.
+static int bgzf_uncompress(uint8_t *dst, int *dlen, const uint8_t *src, int block_length, int check_crc)
 {
-    z_stream zs;
-    zs.zalloc = NULL;
-    zs.zfree = NULL;
-    zs.next_in = (Bytef*)fp->compressed_block + 18;
-    zs.avail_in = block_length - 16;
-    zs.next_out = (Bytef*)fp->uncompressed_block;
-    zs.avail_out = BGZF_MAX_BLOCK_SIZE;
+    size_t ulen = *dlen;
+    if (hts_inflate_raw(dst, &ulen, src + BLOCK_HEADER_LENGTH,
+                        block_length - BLOCK_HEADER_LENGTH - BLOCK_FOOTER_LENGTH) != 0)
+        return BGZF_ERR_ZLIB;
+    *dlen = ulen;
+    if (check_crc && hts_crc32(0, dst, ulen) != unpackInt32(src + block_length - 8))
+        return BGZF_ERR_CRC;
+    return 0;
+}
 
-    if (inflateInit2(&zs, -15) != Z_OK) {
-        fp->errcode |= BGZF_ERR_ZLIB;
+// Inflate the block in fp->compressed_block into fp->uncompressed_block
+static int inflate_block(BGZF* fp, const uint8_t *block, int block_length)
+{
+    int dlen = BGZF_MAX_BLOCK_SIZE, errcode;
+    if ((errcode = bgzf_uncompress((uint8_t*)fp->uncompressed_block, &dlen,
+                                   block, block_length, fp->check_crc)) != 0) {
+        fp->errcode |= errcode;
         return -1;
     }
-    if (inflate(&zs, Z_FINISH) != Z_STREAM_END) {
-        inflateEnd(&zs);
-        fp->errcode |= BGZF_ERR_ZLIB;
-        return -1;
+    return dlen;
+}
+
+static int gzidx_add_point(BGZF *fp, int bits)
+{
+    bgzidx_t *idx = fp->idx;
+    z_stream *zs = fp->gz_stream;
+    gzidx_win_t *w;
+    uint8_t *buf;
+    uInt len = 32768;
+    uLongf l_win;
+
+    if ( bgzf_index_add_entry(fp, zs->total_out, htell(fp->fp) - zs->avail_in) < 0 ) return -1;
+    if ( idx->noffs > idx->mwins )
+    {
+        w = (gzidx_win_t*) realloc(idx->wins, idx->moffs*sizeof(gzidx_win_t));
+        if ( !w ) return -1;
+        idx->wins = w;
+        idx->mwins = idx->moffs;
     }
-    if (inflateEnd(&zs) != Z_OK) {
-        fp->errcode |= BGZF_ERR_ZLIB;
-        return -1;
+    w = &idx->wins[idx->noffs-1];
+    w->bits = bits;
+    w->l_win = 0;
+    w->win = NULL;
+
+    l_win = compressBound(len);
+    if ( !(buf = (uint8_t*) malloc(len + l_win)) ) return -1;
+    if ( inflateGetDictionary(zs, buf, &len)!=Z_OK ) { free(buf); return -1; }
+    if ( len > 0 )
+    {
+        if ( compress(buf + 32768, &l_win, buf, len)!=Z_OK || !(w->win = (uint8_t*) malloc(l_win)) )
+        {
+            free(buf);
+            return -1;
+        }
+        memcpy(w->win, buf + 32768, l_win);
+        w->l_win = l_win;
     }
-    return zs.total_out;
+    free(buf);
+    return 0;
 }
 
-static int inflate_gzip_block(BGZF *fp, int cached)
+// Inflates a plain gzip stream up to the next multiple of 64K, so that block
+// addresses and offsets combine to give uncompressed offsets, which can be
+// sought to with a checkpoint index.  When building the index, stops at each
+// deflate block boundary to see whether a checkpoint is due.
+static int inflate_gzip_block(BGZF *fp)
 {
-    int ret = Z_OK;
-    do
+    z_stream *zs = fp->gz_stream;
+    bgzidx_t *idx = fp->idx_build_otf ? fp->idx : NULL;
+    int ret, beg = fp->block_offset;
+    zs->next_out = (Bytef*)fp->uncompressed_block + beg;
+    zs->avail_out = BGZF_MAX_BLOCK_SIZE - beg;
+    while ( zs->avail_out > 0 )
     {
-        if ( !cached && fp->gz_stream->avail_out!=0 )
+        if ( zs->avail_in==0 )
         {
-            fp->gz_stream->avail_in = hread(fp->fp, fp->compressed_block, BGZF_BLOCK_SIZE);
-            if ( fp->gz_stream->avail_in<=0 ) return fp->gz_stream->avail_in;
-            if ( fp->gz_stream->avail_in==0 ) break;
-            fp->gz_stream->next_in = fp->compressed_block;
+            ssize_t n = hread(fp->fp, fp->compressed_block, BGZF_BLOCK_SIZE);
+            if ( n<0 ) return -1;
+            if ( n==0 ) break;
+            zs->avail_in = n;
+            zs->next_in = fp->compressed_block;
         }
-        else cached = 0;
-        do
+        // Raw deflate streams do not stop at their start, so record it here
+        if ( idx && idx->noffs==0 && zs->total_out==0 && gzidx_add_point(fp, 0) < 0 ) return -1;
+        ret = inflate(zs, idx ? Z_BLOCK : Z_NO_FLUSH);
+        if ( ret==Z_BUF_ERROR ) continue;   // non-critical error
+        if ( ret<0 || ret==Z_NEED_DICT ) return -1;
+        if ( ret==Z_STREAM_END ) break;
+        if ( idx && (zs->data_type & 128) && !(zs->data_type & 64)
+             && (idx->noffs==0 || zs->total_out - idx->offs[idx->noffs-1].uaddr >= idx->span) )
         {
-            fp->gz_stream->next_out = (Bytef*)fp->uncompressed_block + fp->block_offset;
-            fp->gz_stream->avail_out = BGZF_MAX_BLOCK_SIZE - fp->block_offset;
-            ret = inflate(fp->gz_stream, Z_NO_FLUSH);
-            if ( ret==Z_BUF_ERROR ) continue;   // non-critical error
-            if ( ret<0 ) return -1;
-            unsigned int have = BGZF_MAX_BLOCK_SIZE - fp->gz_stream->avail_out;
-            if ( have ) return have;
+            if ( gzidx_add_point(fp, zs->data_type & 7) < 0 ) return -1;
         }
-        while ( fp->gz_stream->avail_out == 0 );
     }
-    while (ret != Z_STREAM_END);
-    return BGZF_MAX_BLOCK_SIZE - fp->gz_stream->avail_out;
+    return BGZF_MAX_BLOCK_SIZE - beg - zs->avail_out;
 }
 
 // Returns: 0 on success (BGZF header); -1 on non-BGZF GZIP header; -2 on error
@@ -354,73 +585,468 @@ static int check_header(const uint8_t *header)
 }
 
 #ifdef BGZF_CACHE
+static void cache_unlink(bgzf_cache_t *c, cache_t *p)
+{
+    if (p->prev) p->prev->next = p->next;
+    else c->head = p->next;
+    if (p->next) p->next->prev = p->prev;
+    else c->tail = p->prev;
+    p->prev = p->next = NULL;
+}
+
+static void cache_push_front(bgzf_cache_t *c, cache_t *p)
+{
+    p->prev = NULL;
+    p->next = c->head;
+    if (c->head) c->head->prev = p;
+    else c->tail = p;
+    c->head = p;
+}
+
+// Evict least recently used blocks until a further _extra_ bytes will fit.
+// The lock must be held.
+static void cache_evict(bgzf_cache_t *c, int64_t extra)
+{
+    while (c->tail && c->n_bytes + extra > c->max_bytes) {
+        cache_t *p = c->tail;
+        khint_t k = kh_get(cache, c->h, p->block_address);
+        if (k != kh_end(c->h)) kh_del(cache, c->h, k);
+        cache_unlink(c, p);
+        c->n_bytes -= p->size;
+        c->evictions++;
+        free(p->block);
+        free(p);
+    }
+}
+
+bgzf_cache_t *bgzf_cache_init(int64_t max_bytes)
+{
+    bgzf_cache_t *c = (bgzf_cache_t*)calloc(1, sizeof(bgzf_cache_t));
+    if (!c) return NULL;
+    if (!(c->h = kh_init(cache))) {
+        free(c);
+        return NULL;
+    }
+    pthread_mutex_init(&c->lock, NULL);
+    c->ref_count = 1;
+    c->max_bytes = max_bytes;
+    return c;
+}
+
+void bgzf_cache_destroy(bgzf_cache_t *c)
+{
+    int ref_count;
+    if (!c) return;
+    pthread_mutex_lock(&c->lock);
+    ref_count = --c->ref_count;
+    pthread_mutex_unlock(&c->lock);
+    if (ref_count > 0) return;
+
+    c->max_bytes = 0;
+    cache_evict(c, 0);
+    kh_destroy(cache, c->h);
+    pthread_mutex_destroy(&c->lock);
+    free(c);
+}
+
+void bgzf_cache_stats(bgzf_cache_t *c, bgzf_cache_stats_t *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    if (!c) return;
+    pthread_mutex_lock(&c->lock);
+    stats->hits = c->hits;
+    stats->misses = c->misses;
+    stats->evictions = c->evictions;
+    stats->n_blocks = kh_size(c->h);
+    stats->n_bytes = c->n_bytes;
+    stats->max_bytes = c->max_bytes;
+    pthread_mutex_unlock(&c->lock);
+}
+
+int bgzf_set_cache(BGZF *fp, bgzf_cache_t *c)
+{
+    if (fp->is_write) return -1;
+    if (c) {
+        pthread_mutex_lock(&c->lock);
+        c->ref_count++;
+        pthread_mutex_unlock(&c->lock);
+    }
+    bgzf_cache_destroy((bgzf_cache_t*)fp->cache);
+    fp->cache = c;
+    fp->cache_size = !c? 0 : c->max_bytes > INT_MAX? INT_MAX : c->max_bytes;
+    return 0;
+}
+
+bgzf_cache_t *bgzf_get_cache(BGZF *fp)
+{
+    return (bgzf_cache_t*)fp->cache;
+}
+
 static void free_cache(BGZF *fp)
 {
-    khint_t k;
-    khash_t(cache) *h = (khash_t(cache)*)fp->cache;
-    if (fp->is_write) return;
-    for (k = kh_begin(h); k < kh_end(h); ++k)
-        if (kh_exist(h, k)) free(kh_val(h, k).block);
-    kh_destroy(cache, h);
+    bgzf_cache_destroy((bgzf_cache_t*)fp->cache);
 }
 
-static int load_block_from_cache(BGZF *fp, int64_t block_address)
+// Copies the cached block at block_address into dst, setting its length and
+// the file offset of the next block.  Returns 1 if found, or 0 if not.
+static int cache_get(bgzf_cache_t *c, int64_t block_address, uint8_t *dst, int *length, int64_t *end_offset)
 {
     khint_t k;
     cache_t *p;
-    khash_t(cache) *h = (khash_t(cache)*)fp->cache;
-    k = kh_get(cache, h, block_address);
-    if (k == kh_end(h)) return 0;
-    p = &kh_val(h, k);
+
+    pthread_mutex_lock(&c->lock);
+    k = kh_get(cache, c->h, block_address);
+    if (k == kh_end(c->h)) {
+        c->misses++;
+        pthread_mutex_unlock(&c->lock);
+        return 0;
+    }
+    c->hits++;
+    p = kh_val(c->h, k);
+    cache_unlink(c, p);
+    cache_push_front(c, p);
+    memcpy(dst, p->block, p->size);
+    *length = p->size;
+    *end_offset = p->end_offset;
+    pthread_mutex_unlock(&c->lock);
+    return 1;
+}
+
+// Returns 1 if the block was found in the cache, 0 if not, or -1 on error
+static int load_block_from_cache(BGZF *fp, int64_t block_address)
+{
+    int64_t end_offset;
+    int length;
+
+    if (!cache_get((bgzf_cache_t*)fp->cache, block_address, fp->uncompressed_block, &length, &end_offset))
+        return 0;
     if (fp->block_length != 0) fp->block_offset = 0;
     fp->block_address = block_address;
-    fp->block_length = p->size;
-    memcpy(fp->uncompressed_block, p->block, BGZF_MAX_BLOCK_SIZE);
-    if ( hseek(fp->fp, p->end_offset, SEEK_SET) < 0 )
-    {
-        // todo: move the error up
-        fprintf(stderr,"Could not hseek to %"PRId64"\n", p->end_offset);
-        exit(1);
+    fp->block_length = length;
+    if (bgzf_hseek(fp, end_offset) < 0) {
+        fp->errcode |= BGZF_ERR_IO;
+        return -1;
     }
-    return p->size;
+    return 1;
 }
 
 static void cache_block(BGZF *fp, int size)
 {
+    bgzf_cache_t *c = (bgzf_cache_t*)fp->cache;
     int ret;
     khint_t k;
     cache_t *p;
-    khash_t(cache) *h = (khash_t(cache)*)fp->cache;
-    if (BGZF_MAX_BLOCK_SIZE >= fp->cache_size) return;
-    if ((kh_size(h) + 1) * BGZF_MAX_BLOCK_SIZE > (uint32_t)fp->cache_size) {
-        /* A better way would be to remove the oldest block in the
-         * cache, but here we remove a random one for simplicity. This
-         * should not have a big impact on performance. */
-        for (k = kh_begin(h); k < kh_end(h); ++k)
-            if (kh_exist(h, k)) break;
-        if (k < kh_end(h)) {
-            free(kh_val(h, k).block);
-            kh_del(cache, h, k);
-        }
+
+    if (!c || fp->block_length == 0) return;
+    pthread_mutex_lock(&c->lock);
+    if (fp->block_length > c->max_bytes) goto done;
+    // Already present if another handle sharing the cache got there first
+    if (kh_get(cache, c->h, fp->block_address) != kh_end(c->h)) goto done;
+    cache_evict(c, fp->block_length);
+    if (!(p = (cache_t*)calloc(1, sizeof(cache_t)))) goto done;
+    if (!(p->block = (uint8_t*)malloc(fp->block_length))) {
+        free(p);
+        goto done;
     }
-    k = kh_put(cache, h, fp->block_address, &ret);
-    if (ret == 0) return; // if this happens, a bug!
-    p = &kh_val(h, k);
-    p->size = fp->block_length;
+    k = kh_put(cache, c->h, fp->block_address, &ret);
+    if (ret < 0) {
+        free(p->block);
+        free(p);
+        goto done;
+    }
+    kh_val(c->h, k) = p;
+    p->block_address = fp->block_address;
     p->end_offset = fp->block_address + size;
-    p->block = (uint8_t*)malloc(BGZF_MAX_BLOCK_SIZE);
-    memcpy(kh_val(h, k).block, fp->uncompressed_block, BGZF_MAX_BLOCK_SIZE);
+    p->size = fp->block_length;
+    memcpy(p->block, fp->uncompressed_block, p->size);
+    cache_push_front(c, p);
+    c->n_bytes += p->size;
+ done:
+    pthread_mutex_unlock(&c->lock);
 }
 #else
+bgzf_cache_t *bgzf_cache_init(int64_t max_bytes) { return NULL; }
+void bgzf_cache_destroy(bgzf_cache_t *c) {}
+void bgzf_cache_stats(bgzf_cache_t *c, bgzf_cache_stats_t *stats) { memset(stats, 0, sizeof(*stats)); }
+int bgzf_set_cache(BGZF *fp, bgzf_cache_t *c) { return 0; }
+bgzf_cache_t *bgzf_get_cache(BGZF *fp) { return NULL; }
 static void free_cache(BGZF *fp) {}
+static int cache_get(bgzf_cache_t *c, int64_t block_address, uint8_t *dst, int *length, int64_t *end_offset) {return 0;}
 static int load_block_from_cache(BGZF *fp, int64_t block_address) {return 0;}
 static void cache_block(BGZF *fp, int size) {}
 #endif
 
+#ifdef BGZF_MT
+// Read the next BGZF block, still compressed, into buf which has room for
+// BGZF_MAX_BLOCK_SIZE bytes.  Returns the length of the block; 0 at
+// end-of-file; or a negated BGZF_ERR_* code on error.
+static int read_raw_block(hFILE *hfp, uint8_t *buf)
+{
+    int count, block_length, remaining;
+    count = hread(hfp, buf, BLOCK_HEADER_LENGTH);
+    if (count == 0) return 0;
+    if (count != BLOCK_HEADER_LENGTH || check_header(buf) != 0)
+        return -BGZF_ERR_HEADER;
+    block_length = unpackInt16(&buf[16]) + 1;
+    if (block_length < BLOCK_HEADER_LENGTH + BLOCK_FOOTER_LENGTH)
+        return -BGZF_ERR_HEADER;
+    remaining = block_length - BLOCK_HEADER_LENGTH;
+    count = hread(hfp, &buf[BLOCK_HEADER_LENGTH], remaining);
+    if (count != remaining) return -BGZF_ERR_IO;
+    return block_length;
+}
+
+// Get a job from the free list, waiting for one to be returned if the
+// maximum number are already in use.
+static bgzf_job *mt_get_job(mtaux_t *mt)
+{
+    bgzf_job *j;
+    pthread_mutex_lock(&mt->job_pool_m);
+    while (!mt->free_jobs && mt->n_jobs >= mt->max_jobs)
+        pthread_cond_wait(&mt->job_pool_c, &mt->job_pool_m);
+    if ((j = mt->free_jobs) != NULL) {
+        mt->free_jobs = j->next;
+        pthread_mutex_unlock(&mt->job_pool_m);
+        return j;
+    }
+    mt->n_jobs++;
+    pthread_mutex_unlock(&mt->job_pool_m);
+
+    j = (bgzf_job*)calloc(1, sizeof(bgzf_job));
+    if (j) {
+        j->comp_data = (uint8_t*)malloc(BGZF_MAX_BLOCK_SIZE);
+        j->uncomp_data = (uint8_t*)malloc(BGZF_MAX_BLOCK_SIZE);
+    }
+    if (!j || !j->comp_data || !j->uncomp_data) {
+        if (j) { free(j->comp_data); free(j->uncomp_data); free(j); }
+        pthread_mutex_lock(&mt->job_pool_m);
+        mt->n_jobs--;
+        pthread_mutex_unlock(&mt->job_pool_m);
+        return NULL;
+    }
+    return j;
+}
+
+static void mt_put_job(mtaux_t *mt, bgzf_job *j)
+{
+    pthread_mutex_lock(&mt->job_pool_m);
+    j->next = mt->free_jobs;
+    mt->free_jobs = j;
+    pthread_cond_signal(&mt->job_pool_c);
+    pthread_mutex_unlock(&mt->job_pool_m);
+}
+
+// Use the given pool, or create a private one with n_threads workers
+static mtaux_t *mt_init(t_pool *pool, int n_threads, int max_jobs)
+{
+    mtaux_t *mt = (mtaux_t*)calloc(1, sizeof(mtaux_t));
+    if (!mt) return NULL;
+    mt->max_jobs = max_jobs;
+    if (pool) mt->pool = pool;
+    else {
+        // The pool's queue holds every job we allow, so dispatching never blocks
+        mt->pool = t_pool_init(max_jobs, n_threads);
+        mt->own_pool = 1;
+    }
+    mt->out_queue = t_results_queue_init();
+    if (!mt->pool || !mt->out_queue) {
+        if (mt->pool && mt->own_pool) t_pool_destroy(mt->pool, 0);
+        if (mt->out_queue) t_results_queue_destroy(mt->out_queue);
+        free(mt);
+        return NULL;
+    }
+    pthread_mutex_init(&mt->job_pool_m, NULL);
+    pthread_cond_init(&mt->job_pool_c, NULL);
+    return mt;
+}
+
+// Free resources; all dispatched jobs must have been collected already
+static void mt_free(mtaux_t *mt)
+{
+    bgzf_job *j;
+    if (mt->own_pool) t_pool_destroy(mt->pool, 0);
+    t_results_queue_destroy(mt->out_queue);
+    while ((j = mt->free_jobs) != NULL) {
+        mt->free_jobs = j->next;
+        free(j->comp_data);
+        free(j->uncomp_data);
+        free(j->ents.a);
+        free(j);
+    }
+    free(mt->ents.a);
+    pthread_mutex_destroy(&mt->job_pool_m);
+    pthread_cond_destroy(&mt->job_pool_c);
+    free(mt->inflight);
+    free(mt);
+}
+
+// Runs in a worker thread
+static void *mt_inflate_job(void *arg)
+{
+    bgzf_job *j = (bgzf_job*)arg;
+    int dlen = BGZF_MAX_BLOCK_SIZE;
+    j->errcode = bgzf_uncompress(j->uncomp_data, &dlen, j->comp_data, j->comp_len, j->check_crc);
+    j->uncomp_len = dlen;
+    return j;
+}
+
+// Runs in a worker thread for a block found in the cache, so that it takes
+// its turn in the queue without being inflated again
+static void *mt_cached_job(void *arg)
+{
+    return arg;
+}
+
+static bgzf_job *mt_next_result(mtaux_t *mt)
+{
+    t_pool_result *r = t_pool_next_result_wait(mt->out_queue);
+    bgzf_job *j = (bgzf_job*)r->data;
+    t_pool_delete_result(r, 0);
+    return j;
+}
+
+// Keep up to mt->n_ahead blocks queued for inflating, taking those in the
+// block cache from there.  Read errors are held back until the blocks
+// preceding the failure have been consumed.
+static void mt_read_ahead(BGZF *fp)
+{
+    mtaux_t *mt = fp->mt;
+    while (!mt->hit_eof && mt->n_inflight + mt->n_discard < mt->n_ahead) {
+        bgzf_job *j = mt_get_job(mt);
+        void *(*func)(void*) = mt_inflate_job;
+        int64_t end_offset;
+        int ret;
+        if (!j) {
+            mt->hit_eof = 1, mt->read_errcode = BGZF_ERR_IO;
+            break;
+        }
+        j->block_address = htell(fp->fp);
+        if (fp->cache && cache_get((bgzf_cache_t*)fp->cache, j->block_address, j->uncomp_data, &j->uncomp_len, &end_offset)) {
+            if (hseek(fp->fp, end_offset, SEEK_SET) < 0) {
+                mt_put_job(mt, j);
+                mt->hit_eof = 1, mt->read_errcode = BGZF_ERR_IO;
+                break;
+            }
+            j->comp_len = end_offset - j->block_address;
+            j->errcode = 0;
+            func = mt_cached_job;
+        } else {
+            if ((ret = read_raw_block(fp->fp, j->comp_data)) <= 0) {
+                mt_put_job(mt, j);
+                mt->hit_eof = 1, mt->read_errcode = -ret;
+                break;
+            }
+            j->comp_len = ret;
+            j->check_crc = fp->check_crc;
+        }
+        if (t_pool_dispatch(mt->pool, mt->out_queue, func, j) < 0) {
+            mt_put_job(mt, j);
+            mt->hit_eof = 1, mt->read_errcode = BGZF_ERR_IO;
+            break;
+        }
+        mt->inflight[(mt->inflight_head + mt->n_inflight) % mt->n_ahead] = j->block_address;
+        mt->n_inflight++;
+    }
+}
+
+static int mt_read_block(BGZF *fp)
+{
+    mtaux_t *mt = fp->mt;
+    bgzf_job *j;
+    void *tmp;
+
+    for (; mt->n_discard > 0; mt->n_discard--)
+        mt_put_job(mt, mt_next_result(mt));
+    mt_read_ahead(fp);
+    if (mt->n_inflight == 0) {
+        if (mt->read_errcode) {
+            fp->errcode |= mt->read_errcode;
+            return -1;
+        }
+        fp->block_length = 0; // end-of-file
+        return 0;
+    }
+
+    j = mt_next_result(mt);
+    mt->inflight_head = (mt->inflight_head + 1) % mt->n_ahead;
+    mt->n_inflight--;
+    if (j->errcode) {
+        fp->errcode |= j->errcode;
+        mt_put_job(mt, j);
+        return -1;
+    }
+    // Swap buffers rather than copying the inflated data
+    tmp = fp->uncompressed_block;
+    fp->uncompressed_block = j->uncomp_data;
+    j->uncomp_data = (uint8_t*)tmp;
+    if (fp->block_length != 0) fp->block_offset = 0; // Do not reset offset if this read follows a seek.
+    fp->block_address = j->block_address;
+    fp->block_length = j->uncomp_len;
+    mt->block_end = j->block_address + j->comp_len;
+    cache_block(fp, j->comp_len);
+    mt_put_job(mt, j);
+    if ( fp->idx_build_otf )
+    {
+        bgzf_index_add_block(fp);
+        fp->idx->ublock_addr += fp->block_length;
+    }
+
+    // Give the workers something to do while the caller consumes this block
+    mt_read_ahead(fp);
+    return 0;
+}
+
+// Position the read-ahead at block_address.  If that block is already in
+// flight, as is common when an iterator skips to a nearby chunk, the blocks
+// before it are dropped and the rest are kept.
+static int mt_read_seek(BGZF *fp, int64_t block_address)
+{
+    mtaux_t *mt = fp->mt;
+    int i;
+    for (i = 0; i < mt->n_inflight; ++i)
+        if (mt->inflight[(mt->inflight_head + i) % mt->n_ahead] == block_address) break;
+    mt->n_discard += i;
+    mt->n_inflight -= i;
+    mt->inflight_head = (mt->inflight_head + i) % mt->n_ahead;
+    if (mt->n_inflight > 0) return 0;
+
+    mt->hit_eof = 0;
+    mt->read_errcode = 0;
+    return hseek(fp->fp, block_address, SEEK_SET) < 0 ? -1 : 0;
+}
+
+static int mt_reader_init(BGZF *fp, t_pool *pool, int n_threads, int max_jobs)
+{
+    mtaux_t *mt;
+    // Plain gzip and uncompressed streams can only be decoded serially
+    if (!fp->is_compressed || fp->is_gzip) return 0;
+    // Blocks are read directly from the hFILE, so it must be positioned correctly
+    if (fp->prefetch && fp->prefetch->pos >= 0 && prefetch_leave(fp) < 0) return -1;
+    if (!(mt = mt_init(pool, n_threads, max_jobs))) return -1;
+    mt->n_ahead = mt->max_jobs;
+    if (!(mt->inflight = (int64_t*)malloc(mt->n_ahead * sizeof(int64_t)))) {
+        mt_free(mt);
+        return -1;
+    }
+    mt->block_end = htell(fp->fp);
+    fp->mt = mt;
+    return 0;
+}
+
+static void mt_reader_destroy(mtaux_t *mt)
+{
+    // Wait for outstanding jobs, as workers may still be using them
+    for (mt->n_discard += mt->n_inflight; mt->n_discard > 0; mt->n_discard--)
+        mt_put_job(mt, mt_next_result(mt));
+    mt_free(mt);
+}
+#endif
+
 int bgzf_read_block(BGZF *fp)
 {
-    uint8_t header[BLOCK_HEADER_LENGTH], *compressed_block;
-    int count, size = 0, block_length, remaining;
+    uint8_t header[BLOCK_HEADER_LENGTH];
+    const uint8_t *block;
+    int count, size, block_length, ret;
 
     // Reading an uncompressed file
     if ( !fp->is_compressed )
@@ -437,28 +1063,38 @@ int bgzf_read_block(BGZF *fp)
         return 0;
     }
 
+#ifdef BGZF_MT
+    if (fp->mt) return mt_read_block(fp);
+#endif
+
     // Reading compressed file
     int64_t block_address;
-    block_address = htell(fp->fp);
+    block_address = bgzf_htell(fp);
     if ( fp->is_gzip && fp->gz_stream ) // is this is a initialized gzip stream?
     {
-        count = inflate_gzip_block(fp, 0);
+        fp->block_address = fp->gz_stream->total_out >> 16;
+        fp->block_offset = fp->gz_stream->total_out & 0xFFFF;
+        count = inflate_gzip_block(fp);
         if ( count<0 )
         {
             fp->errcode |= BGZF_ERR_ZLIB;
             return -1;
         }
-        fp->block_length = count;
-        fp->block_address = block_address;
+        if ( count==0 ) // end of data, which is addressed like bgzf_htell()
+        {
+            fp->block_address = bgzf_htell(fp);
+            fp->block_offset = 0;
+        }
+        fp->block_length = count ? fp->block_offset + count : 0;
         return 0;
     }
-    if (fp->cache_size && load_block_from_cache(fp, block_address)) return 0;
-    count = hread(fp->fp, header, sizeof(header));
+    if (fp->cache && (ret = load_block_from_cache(fp, block_address)) != 0)
+        return ret < 0? -1 : 0;
+    count = bgzf_hpeek(fp, header, sizeof(header));
     if (count == 0) { // no data read
         fp->block_length = 0;
         return 0;
     }
-    int ret;
     if ( count != sizeof(header) || (ret=check_header(header))==-2 )
     {
         fp->errcode |= BGZF_ERR_HEADER;
@@ -468,8 +1104,7 @@ int bgzf_read_block(BGZF *fp)
     {
         // GZIP, not BGZF
         uint8_t *cblock = (uint8_t*)fp->compressed_block;
-        memcpy(cblock, header, sizeof(header));
-        count = hread(fp->fp, cblock+sizeof(header), BGZF_BLOCK_SIZE - sizeof(header)) + sizeof(header);
+        count = hread(fp->fp, cblock, BGZF_BLOCK_SIZE);
         int nskip = 10;
 
         // Check optional fields to skip: FLG.FNAME,FLG.FCOMMENT,FLG.FHCRC,FLG.FEXTRA
@@ -510,29 +1145,28 @@ int bgzf_read_block(BGZF *fp)
         }
         fp->gz_stream->avail_in = count - nskip;
         fp->gz_stream->next_in  = cblock + nskip;
-        count = inflate_gzip_block(fp, 1);
+        fp->block_address = 0;
+        fp->block_offset = 0;
+        count = inflate_gzip_block(fp);
         if ( count<0 )
         {
             fp->errcode |= BGZF_ERR_ZLIB;
             return -1;
         }
         fp->block_length = count;
-        fp->block_address = block_address;
-        if ( fp->idx_build_otf ) return -1; // cannot build index for gzip
         return 0;
     }
-    size = count;
-    block_length = unpackInt16((uint8_t*)&header[16]) + 1; // +1 because when writing this number, we used "-1"
-    compressed_block = (uint8_t*)fp->compressed_block;
-    memcpy(compressed_block, header, BLOCK_HEADER_LENGTH);
-    remaining = block_length - BLOCK_HEADER_LENGTH;
-    count = hread(fp->fp, &compressed_block[BLOCK_HEADER_LENGTH], remaining);
-    if (count != remaining) {
-        fp->errcode |= BGZF_ERR_IO;
-        return -1;
+    size = block_length = unpackInt16((uint8_t*)&header[16]) + 1; // +1 because when writing this number, we used "-1"
+    // Inflate straight from prefetched data or the hFILE's buffer if the
+    // whole block is there, as it always is when the file is memory-mapped
+    if ((block = bgzf_hreadptr(fp, block_length)) == NULL) {
+        block = (const uint8_t*)fp->compressed_block;
+        if (hread(fp->fp, fp->compressed_block, block_length) != block_length) {
+            fp->errcode |= BGZF_ERR_IO;
+            return -1;
+        }
     }
-    size += count;
-    if ((count = inflate_block(fp, block_length)) < 0) return -1;
+    if ((count = inflate_block(fp, block, block_length)) < 0) return -1;
     if (fp->block_length != 0) fp->block_offset = 0; // Do not reset offset if this read follows a seek.
     fp->block_address = block_address;
     fp->block_length = count;
@@ -567,7 +1201,7 @@ ssize_t bgzf_read(BGZF *fp, void *data, size_t length)
         bytes_read += copy_length;
     }
     if (fp->block_offset == fp->block_length) {
-        fp->block_address = htell(fp->fp);
+        fp->block_address = bgzf_htell(fp);
         fp->block_offset = fp->block_length = 0;
     }
     fp->uncompressed_address += bytes_read;
@@ -581,213 +1215,194 @@ ssize_t bgzf_raw_read(BGZF *fp, void *data, size_t length)
 
 #ifdef BGZF_MT
 
-typedef struct {
-    struct bgzf_mtaux_t *mt;
-    void *buf;
-    int i, errcode, toproc, compress_level;
-} worker_t;
-
-typedef struct bgzf_mtaux_workspace_t {
-    int curr;
-    void **blk;
-    int *len;
-} bgzf_mtaux_workspace_t;
+// Runs in a worker thread
+static void *mt_deflate_job(void *arg)
+{
+    bgzf_job *j = (bgzf_job*)arg;
+    j->comp_len = BGZF_MAX_BLOCK_SIZE;
+    j->errcode = 0;
+    if (bgzf_compress(j->comp_data, &j->comp_len, j->uncomp_data, j->uncomp_len, j->compress_level) != 0)
+        j->errcode = BGZF_ERR_ZLIB;
+    return j;
+}
 
-typedef struct bgzf_mtaux_t {
-    int n_threads, n_blks, done;
-    volatile int proc_cnt;
-    // data is compressed in the 'background', while ingest continues in the 'foreground'
-    struct bgzf_mtaux_workspace_t *background, *foreground;
-    worker_t *w;
-    pthread_t *tid;
-    pthread_mutex_t lock;
-    pthread_cond_t cv_start, cv_idle;
-    struct hFILE *fp;
-} mtaux_t;
+// Passes the end-of-stream marker through the pool in order
+static void *mt_nop_job(void *arg)
+{
+    return arg;
+}
 
-static void *mt_worker(void *data)
+// Pass index entries on now that the address of their block is known.  Only
+// one thread at a time may do this: the writer, or the caller once flushed.
+// Records ending the block are given the next block's address, as readers
+// see them (cf. bgzf_flush()).
+static void mt_idx_push(BGZF *fp, idx_ents_t *e, int64_t block_address, int block_len, int comp_len)
 {
+    mtaux_t *mt = fp->mt;
     int i;
-    worker_t *w = (worker_t *) data;
-    while (1) {
-        // wait for condition: to process or all done
-        pthread_mutex_lock(&w->mt->lock);
-        while (!w->toproc && !w->mt->done)
-            pthread_cond_wait(&w->mt->cv_start, &w->mt->lock);
-        w->toproc = 0;
-        pthread_mutex_unlock(&w->mt->lock);
-        if (w->mt->done) break;
-        w->errcode = 0;
-        for (i = w->i; i < w->mt->background->curr; i += w->mt->n_threads) {
-            int clen = BGZF_MAX_BLOCK_SIZE;
-            if (bgzf_compress(w->buf, &clen, w->mt->background->blk[i], w->mt->background->len[i], w->compress_level) != 0)
-                w->errcode |= BGZF_ERR_ZLIB;
-            memcpy(w->mt->background->blk[i], w->buf, clen);
-            w->mt->background->len[i] = clen;
-        }
-        pthread_mutex_lock(&w->mt->lock);
-        w->mt->proc_cnt++;
-        if (w->mt->proc_cnt == w->mt->n_threads) {
-            // I'm the last thread to finish this round of compression. Write
-            // everybody's results out, then signal the main thread that we're
-            // now idle.
-            // NB: since we're using hwrite in a worker thread, it's critical
-            // to guarantee the main thread is not using hwrite at the same
-            // time
-            for (i = 0; i < w->mt->background->curr; ++i) {
-                if (hwrite(w->mt->fp, w->mt->background->blk[i], w->mt->background->len[i]) != w->mt->background->len[i]) {
-                    w->errcode |= BGZF_ERR_IO;
-                    break;
-                }
-            }
-            w->mt->background->curr = 0;
-            pthread_cond_signal(&w->mt->cv_idle);
+    for (i = 0; i < e->n && !mt->idx_failed; ++i) {
+        idx_ent_t *p = &e->a[i];
+        uint64_t offset = (uint64_t)block_address << 16 | p->offset;
+        if (p->offset == block_len) offset = (uint64_t)(block_address + comp_len) << 16;
+        if (hts_idx_push(fp->hidx, p->tid, p->beg, p->end, offset, p->is_mapped) < 0)
+            mt->idx_failed = 1;
+    }
+    e->n = 0;
+}
+
+// The writer thread: outputs compressed blocks in the order they were queued
+static void *mt_writer(void *arg)
+{
+    BGZF *fp = (BGZF*)arg;
+    mtaux_t *mt = fp->mt;
+    for (;;) {
+        bgzf_job *j = mt_next_result(mt);
+        int errcode = j->errcode;
+        if (j->hit_eof) break;
+        // Once an error has occurred, drain the queue without writing
+        if (!errcode && !mt->errcode) {
+            if (j->uaddr != (uint64_t)-1)
+                bgzf_index_add_entry(fp, j->uaddr, mt->block_address);
+            if (j->ents.n) mt_idx_push(fp, &j->ents, mt->block_address, j->uncomp_len, j->comp_len);
+            if (hwrite(fp->fp, j->comp_data, j->comp_len) != j->comp_len)
+                errcode = BGZF_ERR_IO;
+            mt->block_address += j->comp_len;
         }
-        pthread_mutex_unlock(&w->mt->lock);
+        j->ents.n = 0;
+        pthread_mutex_lock(&mt->job_pool_m);
+        mt->errcode |= errcode;
+        mt->n_queued--;
+        j->next = mt->free_jobs;
+        mt->free_jobs = j;
+        pthread_cond_broadcast(&mt->job_pool_c);
+        pthread_mutex_unlock(&mt->job_pool_m);
     }
-    return 0;
+    return NULL;
 }
 
-int bgzf_mt(BGZF *fp, int n_threads, int n_sub_blks)
+static int mt_writer_init(BGZF *fp, t_pool *pool, int n_threads, int max_jobs)
 {
-    int i;
     mtaux_t *mt;
-    pthread_attr_t attr;
-    if (!fp->is_write || fp->mt || n_threads < 1) return -1;
-    mt = (mtaux_t*)calloc(1, sizeof(mtaux_t));
-    mt->n_threads = n_threads;
-    mt->proc_cnt = n_threads;
-    mt->n_blks = n_threads * n_sub_blks;
-    mt->background = (struct bgzf_mtaux_workspace_t*) calloc(1, sizeof(bgzf_mtaux_workspace_t));
-    mt->background->len = (int*)calloc(mt->n_blks, sizeof(int));
-    mt->background->blk = (void**)calloc(mt->n_blks, sizeof(void*));
-    mt->foreground = (struct bgzf_mtaux_workspace_t*) calloc(1, sizeof(bgzf_mtaux_workspace_t));
-    mt->foreground->len = (int*)calloc(mt->n_blks, sizeof(int));
-    mt->foreground->blk = (void**)calloc(mt->n_blks, sizeof(void*));
-    for (i = 0; i < mt->n_blks; ++i) {
-        mt->background->blk[i] = malloc(BGZF_MAX_BLOCK_SIZE);
-        mt->foreground->blk[i] = malloc(BGZF_MAX_BLOCK_SIZE);
-    }
-    mt->tid = (pthread_t*)calloc(mt->n_threads, sizeof(pthread_t));
-    mt->w = (worker_t*)calloc(mt->n_threads, sizeof(worker_t));
-    for (i = 0; i < mt->n_threads; ++i) {
-        mt->w[i].i = i;
-        mt->w[i].mt = mt;
-        mt->w[i].compress_level = fp->compress_level;
-        mt->w[i].buf = malloc(BGZF_MAX_BLOCK_SIZE);
-    }
-    pthread_attr_init(&attr);
-    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
-    pthread_mutex_init(&mt->lock, 0);
-    pthread_cond_init(&mt->cv_start, 0);
-    pthread_cond_init(&mt->cv_idle, 0);
-    for (i = 0; i < mt->n_threads; ++i)
-        pthread_create(&mt->tid[i], &attr, mt_worker, &mt->w[i]);
+    // Plain gzip is a single stream and so is compressed serially
+    if (!fp->is_compressed || fp->is_gzip) return 0;
+    if (!(mt = mt_init(pool, n_threads, max_jobs))) return -1;
+    mt->block_address = fp->block_address;
     fp->mt = mt;
-    mt->fp = fp->fp;
+    if (pthread_create(&mt->writer, NULL, mt_writer, fp) != 0) {
+        fp->mt = NULL;
+        mt_free(mt);
+        return -1;
+    }
     return 0;
 }
 
-static void mt_destroy(mtaux_t *mt)
+int bgzf_mt(BGZF *fp, int n_threads, int n_sub_blks)
 {
-    int i;
-    // signal all workers to quit
-    pthread_mutex_lock(&mt->lock);
-    mt->done = 1; mt->proc_cnt = 0;
-    pthread_cond_broadcast(&mt->cv_start);
-    pthread_mutex_unlock(&mt->lock);
-    for (i = 0; i < mt->n_threads; ++i) pthread_join(mt->tid[i], 0);
-    // free other data allocated on heap
-    for (i = 0; i < mt->n_blks; ++i) {
-        free(mt->background->blk[i]);
-        free(mt->foreground->blk[i]);
-    }
-    for (i = 0; i < mt->n_threads; ++i) free(mt->w[i].buf);
-    free(mt->background->blk); free(mt->background->len); free(mt->background);
-    free(mt->foreground->blk); free(mt->foreground->len); free(mt->foreground);
-    free(mt->w); free(mt->tid);
-    pthread_cond_destroy(&mt->cv_start);
-    pthread_cond_destroy(&mt->cv_idle);
-    pthread_mutex_destroy(&mt->lock);
-    free(mt);
+    if (fp->mt || n_threads < 1) return -1;
+    if (!fp->is_write) return mt_reader_init(fp, NULL, n_threads, n_threads * 2);
+    // Allow a few blocks per thread so that neither the workers nor the
+    // writer thread go idle while the others catch up.
+    return mt_writer_init(fp, NULL, n_threads, n_threads * 4);
 }
 
-// ingest fp->uncompressed_block into the foreground
-static void mt_queue(BGZF *fp)
+int bgzf_thread_pool(BGZF *fp, struct hts_tpool *tpool, int qsize)
 {
-    mtaux_t *mt = fp->mt;
-    // Probable cause of assertion failure: caller ignored fp->errcode after a
-    // previous bgzf_write
-    assert(mt->foreground->curr < mt->n_blks);
-    memcpy(mt->foreground->blk[mt->foreground->curr], fp->uncompressed_block, fp->block_offset);
-    mt->foreground->len[mt->foreground->curr] = fp->block_offset;
-    fp->block_offset = 0;
-    ++mt->foreground->curr;
-}
-
-// Wait for any & all background threads to complete their current compression task.
-// Postconditions:
-//   worker threads are idle
-//   background results have been written with hwrite
-//   fp->mt->proc_cnt == fp->mt->n_threads
-//   fp->mt->background->curr == 0
-// Idempotent until workspaces are rotated.
-static int mt_flush_background(BGZF *fp) {
-    int i, ret = 0;
-    mtaux_t *mt = fp->mt;
-    // wait for all the threads to complete
-    pthread_mutex_lock(&mt->lock);
-    while (mt->proc_cnt < mt->n_threads)
-        pthread_cond_wait(&mt->cv_idle, &mt->lock);
-    pthread_mutex_unlock(&mt->lock);
-    assert(mt->background->curr == 0);
-    for (i = 0; i < mt->n_threads; ++i) {
-        if (mt->w[i].errcode) {
-            fp->errcode |= mt->w[i].errcode;
-            ret = -1;
-        }
-    }
-    return ret;
+    t_pool *pool = (t_pool*)tpool;
+    if (fp->mt || !pool) return -1;
+    if (qsize <= 0) qsize = pool->tsize * (fp->is_write? 4 : 2);
+    if (!fp->is_write) return mt_reader_init(fp, pool, 0, qsize);
+    return mt_writer_init(fp, pool, 0, qsize);
 }
 
-// flush background, rotate foreground & background, launch background compression.
-static int mt_rotate(BGZF *fp) {
-    int code, i;
+// Stop the writer thread and free everything; the queue must be flushed
+static void mt_destroy(BGZF *fp)
+{
     mtaux_t *mt = fp->mt;
-    bgzf_mtaux_workspace_t *tmp;
-
-    // await current background processing
-    if ((code = mt_flush_background(fp))) return code;
+    bgzf_job eof;
+    memset(&eof, 0, sizeof eof);
+    eof.hit_eof = 1;
+    t_pool_dispatch(mt->pool, mt->out_queue, mt_nop_job, &eof);
+    pthread_join(mt->writer, NULL);
+    mt_free(mt);
+    fp->mt = NULL;
+}
 
-    // At this point it's safe to manipulate background and foreground because
-    // the worker threads are idle, waiting on the condition to signal.
-    tmp = mt->background;
-    mt->background = mt->foreground;
-    mt->foreground = tmp;
+// Hand fp->uncompressed_block to the pool for compression.  This only
+// blocks if the maximum number of jobs are already queued.
+static int mt_queue(BGZF *fp)
+{
+    mtaux_t *mt = fp->mt;
+    bgzf_job *j;
+    idx_ents_t ents;
+    void *tmp;
+    int errcode;
+
+    pthread_mutex_lock(&mt->job_pool_m);
+    errcode = mt->errcode;
+    pthread_mutex_unlock(&mt->job_pool_m);
+    if (errcode) {
+        fp->errcode |= errcode;
+        return -1;
+    }
 
-    // signal all the workers to compress
-    pthread_mutex_lock(&mt->lock);
-    for (i = 0; i < mt->n_threads; ++i) mt->w[i].toproc = 1;
-    mt->proc_cnt = 0;
-    pthread_cond_broadcast(&mt->cv_start);
-    pthread_mutex_unlock(&mt->lock);
+    if (!(j = mt_get_job(mt))) {
+        fp->errcode |= BGZF_ERR_IO;
+        return -1;
+    }
+    // Swap buffers rather than copying the uncompressed data
+    tmp = fp->uncompressed_block;
+    fp->uncompressed_block = j->uncomp_data;
+    j->uncomp_data = (uint8_t*)tmp;
+    j->uncomp_len = fp->block_offset;
+    ents = j->ents;
+    j->ents = mt->ents;
+    mt->ents = ents;
+    j->compress_level = fp->compress_level;
+    j->hit_eof = 0;
+    j->uaddr = (uint64_t)-1;
+    if ( fp->idx_build_otf )
+    {
+        j->uaddr = fp->idx->ublock_addr;
+        fp->idx->ublock_addr += fp->block_offset;
+    }
+    fp->block_offset = 0;
 
+    pthread_mutex_lock(&mt->job_pool_m);
+    mt->n_queued++;
+    pthread_mutex_unlock(&mt->job_pool_m);
+    if (t_pool_dispatch(mt->pool, mt->out_queue, mt_deflate_job, j) < 0) {
+        pthread_mutex_lock(&mt->job_pool_m);
+        mt->n_queued--;
+        pthread_mutex_unlock(&mt->job_pool_m);
+        mt_put_job(mt, j);
+        fp->errcode |= BGZF_ERR_IO;
+        return -1;
+    }
     return 0;
 }
 
-// flush both background and foreground
+// Queue any pending data and wait until all queued blocks have been written
 static int mt_flush_queue(BGZF *fp)
 {
-    return mt_rotate(fp) || mt_flush_background(fp);
+    mtaux_t *mt = fp->mt;
+    int errcode;
+    if (fp->block_offset && mt_queue(fp) < 0) return -1;
+    pthread_mutex_lock(&mt->job_pool_m);
+    while (mt->n_queued > 0)
+        pthread_cond_wait(&mt->job_pool_c, &mt->job_pool_m);
+    errcode = mt->errcode;
+    pthread_mutex_unlock(&mt->job_pool_m);
+    fp->block_address = mt->block_address;
+    if (errcode) {
+        fp->errcode |= errcode;
+        return -1;
+    }
+    return 0;
 }
 
-// ingest fp->uncompressed_block into foreground; if foreground is now full, mt_rotate()
 static int lazy_flush(BGZF *fp)
 {
-    if (fp->mt) {
-        if (fp->block_offset) mt_queue(fp);
-        return (fp->mt->foreground->curr < fp->mt->n_blks) ? 0 : mt_rotate(fp);
-    }
+    if (fp->mt) return fp->block_offset ? mt_queue(fp) : 0;
     else return bgzf_flush(fp);
 }
 
@@ -798,6 +1413,11 @@ int bgzf_mt(BGZF *fp, int n_threads, int n_sub_blks)
     return 0;
 }
 
+int bgzf_thread_pool(BGZF *fp, struct hts_tpool *pool, int qsize)
+{
+    return 0;
+}
+
 static inline int lazy_flush(BGZF *fp)
 {
     return bgzf_flush(fp);
@@ -807,13 +1427,14 @@ static inline int lazy_flush(BGZF *fp)
 
 int bgzf_flush(BGZF *fp)
 {
+    int amend;
     if (!fp->is_write) return 0;
 #ifdef BGZF_MT
-    if (fp->mt) {
-        if (fp->block_offset) mt_queue(fp); // guaranteed that assertion does not fail
-        return mt_flush_queue(fp);
-    }
+    if (fp->mt) return mt_flush_queue(fp);
 #endif
+    // A record indexed by bgzf_idx_push() that ends this block is seen by
+    // readers as ending at the start of the next
+    amend = fp->hidx && fp->block_offset > 0 && fp->hidx_last == bgzf_tell(fp);
     while (fp->block_offset > 0) {
         if ( fp->idx_build_otf )
         {
@@ -822,13 +1443,13 @@ int bgzf_flush(BGZF *fp)
         }
         int block_length = deflate_block(fp, fp->block_offset);
         if (block_length < 0) return -1;
-        // safe to hwrite because worker threads are idle following mt_flush_queue
         if (hwrite(fp->fp, fp->compressed_block, block_length) != block_length) {
             fp->errcode |= BGZF_ERR_IO; // possibly truncated file
             return -1;
         }
         fp->block_address += block_length;
     }
+    if (amend) hts_idx_amend_last(fp->hidx, fp->hidx_last = bgzf_tell(fp));
     return 0;
 }
 
@@ -838,6 +1459,61 @@ int bgzf_flush_try(BGZF *fp, ssize_t size)
     return 0;
 }
 
+int bgzf_idx_push(BGZF *fp, hts_idx_t *hidx, int tid, int beg, int end, int is_mapped)
+{
+#ifdef BGZF_MT
+    mtaux_t *mt = fp->mt;
+    if (mt && fp->is_write) {
+        // The block's address is unknown until the writer thread reaches it,
+        // so hold the entry with the block until then.
+        idx_ent_t *p;
+        int failed;
+        pthread_mutex_lock(&mt->job_pool_m);
+        failed = mt->idx_failed;
+        pthread_mutex_unlock(&mt->job_pool_m);
+        if (failed) return -1;
+        fp->hidx = hidx;
+        if (mt->ents.n == mt->ents.m) {
+            int m = mt->ents.m? mt->ents.m<<1 : 64;
+            idx_ent_t *a = (idx_ent_t*)realloc(mt->ents.a, m * sizeof(idx_ent_t));
+            if (!a) {
+                // Stop the writer thread using the index before failing
+                mt_flush_queue(fp);
+                mt->idx_failed = 1;
+                return -1;
+            }
+            mt->ents.a = a, mt->ents.m = m;
+        }
+        p = &mt->ents.a[mt->ents.n++];
+        p->tid = tid, p->beg = beg, p->end = end, p->is_mapped = is_mapped;
+        p->offset = fp->block_offset;
+        return 0;
+    }
+#endif
+    fp->hidx = hidx;
+    fp->hidx_last = bgzf_tell(fp);
+    if (hts_idx_push(hidx, tid, beg, end, fp->hidx_last, is_mapped) < 0) {
+        fp->hidx = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+int bgzf_idx_flush(BGZF *fp)
+{
+    if (bgzf_flush(fp) != 0) return -1;
+#ifdef BGZF_MT
+    if (fp->mt && fp->is_write) {
+        // The writer thread is idle following bgzf_flush; what remains
+        // ended exactly on the last block boundary.
+        mtaux_t *mt = fp->mt;
+        if (mt->ents.n) mt_idx_push(fp, &mt->ents, fp->block_address, -1, 0);
+        return mt->idx_failed? -1 : 0;
+    }
+#endif
+    return 0;
+}
+
 ssize_t bgzf_write(BGZF *fp, const void *data, size_t length)
 {
     if ( !fp->is_compressed )
@@ -872,41 +1548,75 @@ ssize_t bgzf_raw_write(BGZF *fp, const void *data, size_t length)
 
 int bgzf_close(BGZF* fp)
 {
-    int ret, block_length;
+    int ret = 0, block_length = -1;
     if (fp == 0) return -1;
+    // Errors are recorded in ret, and everything is torn down regardless
     if (fp->is_write && fp->is_compressed) {
-        if (bgzf_flush(fp) != 0) return -1;
-        fp->compress_level = -1;
-        block_length = deflate_block(fp, 0); // write an empty block
-        // safe to hwrite because worker threads are idle following bgzf_flush
-        if (hwrite(fp->fp, fp->compressed_block, block_length) < 0
-            || hflush(fp->fp) != 0) {
-            fp->errcode |= BGZF_ERR_IO;
-            return -1;
+        if (bgzf_flush(fp) != 0) ret = -1;
+        else {
+            fp->compress_level = -1;
+            block_length = deflate_block(fp, 0); // write an empty block
         }
 #ifdef BGZF_MT
-        if (fp->mt) mt_destroy(fp->mt);
+        // The writer thread is idle following bgzf_flush, or once it has
+        // dealt with anything still queued if that failed
+        if (fp->mt) mt_destroy(fp);
 #endif
+        if (ret == 0 && (block_length < 0
+                         || hwrite(fp->fp, fp->compressed_block, block_length) < 0
+                         || hflush(fp->fp) != 0)) {
+            fp->errcode |= BGZF_ERR_IO;
+            ret = -1;
+        }
     }
+#ifdef BGZF_MT
+    else if (fp->mt && !fp->is_write) mt_reader_destroy(fp->mt);
+#endif
     if ( fp->is_gzip )
     {
         if (!fp->is_write) (void)inflateEnd(fp->gz_stream);
         else (void)deflateEnd(fp->gz_stream);
         free(fp->gz_stream);
     }
-    ret = hclose(fp->fp);
-    if (ret != 0) return -1;
+    if (hclose(fp->fp) != 0) ret = -1;
     bgzf_index_destroy(fp);
     free(fp->uncompressed_block);
     free(fp->compressed_block);
     free_cache(fp);
+    if (fp->prefetch) {
+        free(fp->prefetch->spans);
+        free(fp->prefetch->data);
+        free(fp->prefetch);
+    }
     free(fp);
-    return 0;
+    return ret;
 }
 
 void bgzf_set_cache_size(BGZF *fp, int cache_size)
 {
-    if (fp) fp->cache_size = cache_size;
+    bgzf_cache_t *c;
+    if (!fp || fp->is_write) return;
+    if (cache_size <= 0) {
+        bgzf_set_cache(fp, NULL);
+    }
+    else if ((c = bgzf_get_cache(fp)) != NULL) {
+#ifdef BGZF_CACHE
+        pthread_mutex_lock(&c->lock);
+        c->max_bytes = cache_size;
+        cache_evict(c, 0);
+        pthread_mutex_unlock(&c->lock);
+        fp->cache_size = cache_size;
+#endif
+    }
+    else if ((c = bgzf_cache_init(cache_size)) != NULL) {
+        bgzf_set_cache(fp, c);
+        bgzf_cache_destroy(c); // fp now holds the only reference
+    }
+}
+
+void bgzf_set_crc_check(BGZF *fp, int check)
+{
+    if (fp) fp->check_crc = check;
 }
 
 int bgzf_check_EOF(BGZF *fp)
@@ -931,9 +1641,25 @@ int64_t bgzf_seek(BGZF* fp, int64_t pos, int where)
         fp->errcode |= BGZF_ERR_MISUSE;
         return -1;
     }
+    if (fp->is_gzip) return gzidx_seek(fp, pos); // virtual offsets are uncompressed offsets
     block_offset = pos & 0xFFFF;
     block_address = pos >> 16;
-    if (hseek(fp->fp, block_address, SEEK_SET) < 0) {
+    if (fp->is_compressed && !fp->is_gzip && fp->block_length > 0
+        && block_address == fp->block_address && block_offset <= fp->block_length) {
+        // Within the block already loaded, so reuse it
+        fp->block_offset = block_offset;
+        return 0;
+    }
+#ifdef BGZF_MT
+    if (fp->mt) {
+        if (mt_read_seek(fp, block_address) < 0) {
+            fp->errcode |= BGZF_ERR_IO;
+            return -1;
+        }
+    }
+    else
+#endif
+    if (bgzf_hseek(fp, block_address) < 0) {
         fp->errcode |= BGZF_ERR_IO;
         return -1;
     }
@@ -943,6 +1669,87 @@ int64_t bgzf_seek(BGZF* fp, int64_t pos, int where)
     return 0;
 }
 
+int bgzf_prefetch(BGZF *fp, const uint64_t *voffs, int n)
+{
+    struct bgzf_prefetch_t *pf = fp->prefetch;
+    size_t size = 0;
+    int64_t saved;
+    int i, n_done = 0;
+
+    if (fp->is_write || !fp->is_compressed || fp->is_gzip || n <= 0) return 0;
+#ifdef BGZF_MT
+    if (fp->mt) return 0;
+#endif
+    if (pf == NULL) {
+        if (!(pf = (struct bgzf_prefetch_t*)calloc(1, sizeof(struct bgzf_prefetch_t)))) return -1;
+        pf->pos = -1;
+        fp->prefetch = pf;
+    }
+    else if (pf->pos >= 0 && prefetch_leave(fp) < 0) goto error;
+    pf->n = 0;
+
+    // Plan the spans to read, joining chunks separated by small gaps
+    for (i = 0; i < n; i++) {
+        int64_t beg = voffs[2*i] >> 16;
+        // A chunk ends part way through the block at its end offset, if any
+        int64_t end = (voffs[2*i+1] >> 16) + ((voffs[2*i+1] & 0xFFFF)? BGZF_MAX_BLOCK_SIZE : 0);
+        prefetch_span_t *last = pf->n > 0? &pf->spans[pf->n - 1] : NULL;
+        if (last && beg <= last->end + BGZF_PREFETCH_GAP) {
+            if (end > last->end) {
+                if (size + (end - last->end) > BGZF_PREFETCH_MAX) break;
+                size += end - last->end;
+                last->end = end;
+            }
+        }
+        else {
+            int partial = 0;
+            if (size + (end - beg) > BGZF_PREFETCH_MAX) {
+                if (pf->n > 0) break;
+                end = beg + BGZF_PREFETCH_MAX; // just the start of a huge chunk
+                partial = 1;
+            }
+            if (pf->n == pf->m) {
+                int m = pf->m? pf->m * 2 : 16;
+                prefetch_span_t *spans = (prefetch_span_t*)realloc(pf->spans, m * sizeof(prefetch_span_t));
+                if (spans == NULL) goto error;
+                pf->spans = spans;
+                pf->m = m;
+            }
+            pf->spans[pf->n].beg = beg;
+            pf->spans[pf->n].end = end;
+            pf->spans[pf->n].offset = size;
+            pf->n++;
+            size += end - beg;
+            if (partial) break;
+        }
+        n_done = i + 1;
+    }
+
+    if (size > pf->size) {
+        uint8_t *data = (uint8_t*)realloc(pf->data, size);
+        if (data == NULL) goto error;
+        pf->data = data;
+        pf->size = size;
+    }
+
+    saved = htell(fp->fp);
+    for (i = 0; i < pf->n; i++) {
+        prefetch_span_t *span = &pf->spans[i];
+        ssize_t count;
+        if (hseek(fp->fp, span->beg, SEEK_SET) < 0) goto error;
+        count = hread(fp->fp, &pf->data[span->offset], span->end - span->beg);
+        if (count < 0) goto error;
+        span->end = span->beg + count; // shorter at end-of-file
+    }
+    if (hseek(fp->fp, saved, SEEK_SET) < 0) goto error;
+    return n_done;
+
+ error:
+    pf->n = 0;
+    fp->errcode |= BGZF_ERR_IO;
+    return -1;
+}
+
 int bgzf_is_bgzf(const char *fn)
 {
     uint8_t buf[16];
@@ -964,7 +1771,7 @@ int bgzf_getc(BGZF *fp)
     }
     c = ((unsigned char*)fp->uncompressed_block)[fp->block_offset++];
     if (fp->block_offset == fp->block_length) {
-        fp->block_address = htell(fp->fp);
+        fp->block_address = bgzf_htell(fp);
         fp->block_offset = 0;
         fp->block_length = 0;
     }
@@ -979,16 +1786,19 @@ int bgzf_getc(BGZF *fp)
 int bgzf_getline(BGZF *fp, int delim, kstring_t *str)
 {
     int l, state = 0;
-    unsigned char *buf = (unsigned char*)fp->uncompressed_block;
+    unsigned char *buf, *end;
     str->l = 0;
     do {
         if (fp->block_offset >= fp->block_length) {
             if (bgzf_read_block(fp) != 0) { state = -2; break; }
             if (fp->block_length == 0) { state = -1; break; }
         }
-        for (l = fp->block_offset; l < fp->block_length && buf[l] != delim; ++l);
-        if (l < fp->block_length) state = 1;
-        l -= fp->block_offset;
+        // (re)load as multi-threaded reading may have swapped the buffer
+        buf = (unsigned char*)fp->uncompressed_block;
+        end = (unsigned char*)memchr(buf + fp->block_offset, delim, fp->block_length - fp->block_offset);
+        if (end) state = 1;
+        else end = buf + fp->block_length;
+        l = end - (buf + fp->block_offset);
         if (str->l + l + 1 >= str->m) {
             str->m = str->l + l + 2;
             kroundup32(str->m);
@@ -998,21 +1808,77 @@ int bgzf_getline(BGZF *fp, int delim, kstring_t *str)
         str->l += l;
         fp->block_offset += l + 1;
         if (fp->block_offset >= fp->block_length) {
-            fp->block_address = htell(fp->fp);
+            fp->block_address = bgzf_htell(fp);
             fp->block_offset = 0;
             fp->block_length = 0;
         }
     } while (state == 0);
     if (str->l == 0 && state < 0) return state;
-    fp->uncompressed_address += str->l;
+    fp->uncompressed_address += str->l + (state == 1);
     if ( delim=='\n' && str->l>0 && str->s[str->l-1]=='\r' ) str->l--;
     str->s[str->l] = 0;
     return str->l;
 }
 
+int bgzf_getline_ref(BGZF *fp, int delim, kstring_t *str, char **line)
+{
+    char *buf, *end;
+    int l, ret;
+    if (fp->block_offset >= fp->block_length) {
+        if (bgzf_read_block(fp) != 0) return -2;
+        if (fp->block_length == 0) return -1;
+    }
+    buf = (char*)fp->uncompressed_block + fp->block_offset;
+    end = (char*)memchr(buf, delim, fp->block_length - fp->block_offset);
+    if (end == NULL) {
+        // The line continues in the next block, so must be copied
+        if ((ret = bgzf_getline(fp, delim, str)) >= 0) *line = str->s;
+        return ret;
+    }
+    l = end - buf;
+    fp->block_offset += l + 1;
+    fp->uncompressed_address += l + 1;
+    if (fp->block_offset >= fp->block_length) {
+        fp->block_address = bgzf_htell(fp);
+        fp->block_offset = 0;
+        fp->block_length = 0;
+    }
+    if ( delim=='\n' && l>0 && buf[l-1]=='\r' ) l--;
+    *line = buf;
+    return l;
+}
+
+ssize_t bgzf_peek_block(BGZF *fp, const uint8_t **data)
+{
+    if (fp->block_offset >= fp->block_length) {
+        if (bgzf_read_block(fp) != 0) return -1;
+        if (fp->block_length == 0) return 0;
+    }
+    *data = (const uint8_t*)fp->uncompressed_block + fp->block_offset;
+    return fp->block_length - fp->block_offset;
+}
+
+void bgzf_consume(BGZF *fp, size_t length)
+{
+    assert(length <= fp->block_length - fp->block_offset);
+    fp->block_offset += length;
+    fp->uncompressed_address += length;
+    if (fp->block_offset >= fp->block_length) {
+        fp->block_address = bgzf_htell(fp);
+        fp->block_offset = 0;
+        fp->block_length = 0;
+    }
+}
+
 void bgzf_index_destroy(BGZF *fp)
 {
     if ( !fp->idx ) return;
+    if ( fp->idx->wins )
+    {
+        int i;
+        for (i=0; i<fp->idx->noffs; i++) free(fp->idx->wins[i].win);
+        free(fp->idx->wins);
+    }
     free(fp->idx->offs);
     free(fp->idx);
     fp->idx = NULL;
@@ -1024,11 +1890,20 @@ int bgzf_index_build_init(BGZF *fp)
     bgzf_index_destroy(fp);
     fp->idx = (bgzidx_t*) calloc(1,sizeof(bgzidx_t));
     if ( !fp->idx ) return -1;
+    fp->idx->is_gzip = fp->is_gzip && !fp->is_write;
+    fp->idx->span = GZIDX_SPAN;
     fp->idx_build_otf = 1;  // build index on the fly
     return 0;
 }
 
-int bgzf_index_add_block(BGZF *fp)
+int bgzf_index_set_span(BGZF *fp, int64_t span)
+{
+    if ( !fp->idx || !fp->idx_build_otf || fp->idx->noffs || span <= 0 ) return -1;
+    fp->idx->span = span;
+    return 0;
+}
+
+static int bgzf_index_add_entry(BGZF *fp, uint64_t uaddr, uint64_t caddr)
 {
     fp->idx->noffs++;
     if ( fp->idx->noffs > fp->idx->moffs )
@@ -1038,8 +1913,161 @@ int bgzf_index_add_block(BGZF *fp)
         fp->idx->offs = (bgzidx1_t*) realloc(fp->idx->offs, fp->idx->moffs*sizeof(bgzidx1_t));
         if ( !fp->idx->offs ) return -1;
     }
-    fp->idx->offs[ fp->idx->noffs-1 ].uaddr = fp->idx->ublock_addr;
-    fp->idx->offs[ fp->idx->noffs-1 ].caddr = fp->block_address;
+    fp->idx->offs[ fp->idx->noffs-1 ].uaddr = uaddr;
+    fp->idx->offs[ fp->idx->noffs-1 ].caddr = caddr;
+    return 0;
+}
+
+int bgzf_index_add_block(BGZF *fp)
+{
+    return bgzf_index_add_entry(fp, fp->idx->ublock_addr, fp->block_address);
+}
+
+static int gzidx_write64(FILE *fp, uint64_t x, int is_be)
+{
+    if ( is_be ) ed_swap_8p(&x);
+    return fwrite(&x, 1, sizeof(x), fp) == sizeof(x) ? 0 : -1;
+}
+
+static int gzidx_read64(FILE *fp, uint64_t *x, int is_be)
+{
+    if ( fread(x, 1, sizeof(*x), fp) != sizeof(*x) ) return -1;
+    if ( is_be ) ed_swap_8p(x);
+    return 0;
+}
+
+// The checkpoint index of a plain gzip file: the magic, span and number of
+// checkpoints, then each one's offsets, bits and deflated window
+static int gzidx_dump(const bgzidx_t *idx, FILE *fp, int is_be)
+{
+    int i;
+    if ( fwrite(gzidx_magic, 1, sizeof(gzidx_magic), fp) != sizeof(gzidx_magic) ) return -1;
+    if ( gzidx_write64(fp, idx->span, is_be) < 0 || gzidx_write64(fp, idx->noffs, is_be) < 0 ) return -1;
+    for (i=0; i<idx->noffs; i++)
+    {
+        const gzidx_win_t *w = &idx->wins[i];
+        if ( gzidx_write64(fp, idx->offs[i].caddr, is_be) < 0 ) return -1;
+        if ( gzidx_write64(fp, idx->offs[i].uaddr, is_be) < 0 ) return -1;
+        if ( gzidx_write64(fp, (uint64_t)w->bits << 32 | w->l_win, is_be) < 0 ) return -1;
+        if ( w->l_win && fwrite(w->win, 1, w->l_win, fp) != w->l_win ) return -1;
+    }
+    return 0;
+}
+
+static int gzidx_load(bgzidx_t *idx, FILE *fp, int is_be)
+{
+    uint64_t x, n;
+    int i;
+    if ( gzidx_read64(fp, &x, is_be) < 0 || gzidx_read64(fp, &n, is_be) < 0 ) return -1;
+    if ( n == 0 || n > INT_MAX ) return -1;
+    idx->is_gzip = 1;
+    idx->span = x;
+    idx->offs = (bgzidx1_t*) malloc(n*sizeof(bgzidx1_t));
+    idx->wins = (gzidx_win_t*) calloc(n, sizeof(gzidx_win_t));
+    if ( !idx->offs || !idx->wins ) return -1;
+    idx->moffs = idx->mwins = n;
+    for (i=0; i<n; i++)
+    {
+        gzidx_win_t *w = &idx->wins[i];
+        idx->noffs = i + 1;
+        if ( gzidx_read64(fp, &idx->offs[i].caddr, is_be) < 0 ) return -1;
+        if ( gzidx_read64(fp, &idx->offs[i].uaddr, is_be) < 0 ) return -1;
+        if ( gzidx_read64(fp, &x, is_be) < 0 ) return -1;
+        w->bits = x >> 32;
+        w->l_win = (uint32_t) x;
+        if ( w->bits > 7 || (i > 0 && idx->offs[i].uaddr < idx->offs[i-1].uaddr) ) return -1;
+        if ( w->l_win )
+        {
+            if ( !(w->win = (uint8_t*) malloc(w->l_win)) ) return -1;
+            if ( fread(w->win, 1, w->l_win, fp) != w->l_win ) return -1;
+        }
+    }
+    return 0;
+}
+
+// Resumes inflation at checkpoint i
+static int gzidx_restart(BGZF *fp, int i)
+{
+    const gzidx_win_t *w = &fp->idx->wins[i];
+    z_stream *zs = fp->gz_stream;
+    if ( !zs )
+    {
+        if ( !(zs = (z_stream*) calloc(1, sizeof(z_stream))) ) return -1;
+        if ( inflateInit2(zs, -15)!=Z_OK ) { free(zs); return -1; }
+        fp->gz_stream = zs;
+    }
+    else if ( inflateReset(zs)!=Z_OK ) return -1;
+    if ( bgzf_hseek(fp, fp->idx->offs[i].caddr - (w->bits ? 1 : 0)) < 0 ) return -1;
+    if ( w->bits )
+    {
+        uint8_t c;
+        if ( hread(fp->fp, &c, 1) != 1 || inflatePrime(zs, w->bits, c >> (8 - w->bits))!=Z_OK ) return -1;
+    }
+    if ( w->l_win )
+    {
+        // The block buffer is free, as what it holds is being discarded
+        uLongf len = BGZF_MAX_BLOCK_SIZE;
+        if ( uncompress(fp->uncompressed_block, &len, w->win, w->l_win)!=Z_OK ) return -1;
+        if ( inflateSetDictionary(zs, fp->uncompressed_block, len)!=Z_OK ) return -1;
+    }
+    zs->avail_in = 0;
+    zs->total_out = fp->idx->offs[i].uaddr; // only counted by zlib, so it tracks the offset
+    fp->block_length = fp->block_offset = 0;
+    return 0;
+}
+
+// Positions a plain gzip stream at an uncompressed offset.  Moves within the
+// current block, inflates forwards if no checkpoint is nearer, or otherwise
+// resumes from the last checkpoint before the offset.
+static int gzidx_seek(BGZF *fp, int64_t uoffset)
+{
+    bgzidx_t *idx = fp->idx;
+    int64_t block_address = uoffset >> 16;
+    int block_offset = uoffset & 0xFFFF;
+    int ilo = 0, ihi;
+
+    if ( !idx || !idx->is_gzip || fp->is_write || uoffset < 0 )
+    {
+        fp->errcode |= BGZF_ERR_MISUSE;
+        return -1;
+    }
+    if ( fp->gz_stream && fp->block_length > 0 && fp->block_address == block_address
+         && block_offset >= fp->block_offset && block_offset <= fp->block_length )
+    {
+        fp->block_offset = block_offset;
+        fp->uncompressed_address = uoffset;
+        return 0;
+    }
+
+    ihi = idx->noffs - 1;
+    while ( ilo<=ihi )
+    {
+        int i = (ilo+ihi)/2;
+        if ( uoffset < idx->offs[i].uaddr ) ihi = i - 1;
+        else ilo = i + 1;
+    }
+    if ( ilo == 0 )
+    {
+        fp->errcode |= BGZF_ERR_MISUSE;
+        return -1;
+    }
+    if ( !fp->gz_stream || uoffset < fp->gz_stream->total_out || idx->offs[ilo-1].uaddr > fp->gz_stream->total_out )
+    {
+        if ( gzidx_restart(fp, ilo-1) < 0 )
+        {
+            fp->errcode |= BGZF_ERR_IO;
+            return -1;
+        }
+    }
+
+    // Inflate up to the block holding the offset, or the end of the data
+    while ( fp->gz_stream->total_out <= uoffset )
+    {
+        if ( bgzf_read_block(fp) < 0 ) return -1;
+        if ( fp->block_length == fp->block_offset ) break;
+    }
+    if ( fp->gz_stream->total_out > uoffset ) fp->block_offset = block_offset;
+    fp->uncompressed_address = uoffset;
     return 0;
 }
 
@@ -1063,6 +2091,13 @@ int bgzf_index_dump(BGZF *fp, const char *bname, const char *suffix)
     if ( tmp ) free(tmp);
     if ( !idx ) return -1;
 
+    if ( fp->idx->is_gzip )
+    {
+        int ret = gzidx_dump(fp->idx, idx, fp->is_be);
+        if ( fclose(idx) != 0 ) ret = -1;
+        return ret;
+    }
+
     // Note that the index contains one extra record when indexing files opened
     // for reading. The terminating record is not present when opened for writing.
     // This is not a bug.
@@ -1110,12 +2145,24 @@ int bgzf_index_load(BGZF *fp, const char *bname, const char *suffix)
     if ( tmp ) free(tmp);
     if ( !idx ) return -1;
 
+    bgzf_index_destroy(fp);
     fp->idx = (bgzidx_t*) calloc(1,sizeof(bgzidx_t));
+    if ( !fp->idx ) goto fail;
     uint64_t x;
-    if ( fread(&x, 1, sizeof(x), idx) != sizeof(x) ) return -1;
+    if ( fread(&x, 1, sizeof(x), idx) != sizeof(x) ) goto fail;
+
+    // Plain gzip files have checkpoint indexes, which BGZF ones cannot use
+    if ( memcmp(&x, gzidx_magic, sizeof(x)) == 0 )
+    {
+        if ( !fp->is_gzip || gzidx_load(fp->idx, idx, fp->is_be) < 0 ) goto fail;
+        fclose(idx);
+        return 0;
+    }
+    if ( fp->is_gzip ) goto fail;
 
     fp->idx->noffs = fp->idx->moffs = 1 + (fp->is_be ? ed_swap_8(x) : x);
     fp->idx->offs  = (bgzidx1_t*) malloc(fp->idx->moffs*sizeof(bgzidx1_t));
+    if ( !fp->idx->offs ) goto fail;
     fp->idx->offs[0].caddr = fp->idx->offs[0].uaddr = 0;
 
     int i;
@@ -1127,7 +2174,7 @@ int bgzf_index_load(BGZF *fp, const char *bname, const char *suffix)
             ret += fread(&x, 1, sizeof(x), idx); fp->idx->offs[i].caddr = ed_swap_8(x);
             ret += fread(&x, 1, sizeof(x), idx); fp->idx->offs[i].uaddr = ed_swap_8(x);
         }
-        if ( ret != sizeof(x)*2*(fp->idx->noffs-1) ) return -1;
+        if ( ret != sizeof(x)*2*(fp->idx->noffs-1) ) goto fail;
     }
     else
     {
@@ -1137,11 +2184,15 @@ int bgzf_index_load(BGZF *fp, const char *bname, const char *suffix)
             ret += fread(&x, 1, sizeof(x), idx); fp->idx->offs[i].caddr = x;
             ret += fread(&x, 1, sizeof(x), idx); fp->idx->offs[i].uaddr = x;
         }
-        if ( ret != sizeof(x)*2*(fp->idx->noffs-1) ) return -1;
+        if ( ret != sizeof(x)*2*(fp->idx->noffs-1) ) goto fail;
     }
     fclose(idx);
     return 0;
 
+ fail:
+    bgzf_index_destroy(fp);
+    fclose(idx);
+    return -1;
 }
 
 int bgzf_useek(BGZF *fp, long uoffset, int where)
@@ -1166,6 +2217,7 @@ int bgzf_useek(BGZF *fp, long uoffset, int where)
         fp->errcode |= BGZF_ERR_IO;
         return -1;
     }
+    if ( fp->is_gzip ) return gzidx_seek(fp, uoffset);
 
     // binary search
     int ilo = 0, ihi = fp->idx->noffs - 1;
@@ -1177,15 +2229,9 @@ int bgzf_useek(BGZF *fp, long uoffset, int where)
         else break;
     }
     int i = ilo-1;
-    if (hseek(fp->fp, fp->idx->offs[i].caddr, SEEK_SET) < 0)
-    {
-        fp->errcode |= BGZF_ERR_IO;
-        return -1;
-    }
-    fp->block_length = 0;  // indicates current block has not been loaded
-    fp->block_address = fp->idx->offs[i].caddr;
-    fp->block_offset = 0;
-    if ( bgzf_read_block(fp) < 0 ) return -1;
+    if ( bgzf_seek(fp, fp->idx->offs[i].caddr << 16, SEEK_SET) < 0 ) return -1;
+    // bgzf_seek() leaves the block unloaded unless it was already current
+    if ( fp->block_length == 0 && bgzf_read_block(fp) < 0 ) return -1;
     if ( uoffset - fp->idx->offs[i].uaddr > 0 )
     {
         fp->block_offset = uoffset - fp->idx->offs[i].uaddr;
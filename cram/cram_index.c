@@ -340,6 +340,10 @@ cram_index *cram_index_query(cram_fd *fd, int refid, int pos,
     if (!from)
 	from = &fd->index[refid+1];
 
+    // Ref with nothing aligned against it.
+    if (!from->e)
+	return NULL;
+
     for (k = j/2; k != i; k = (j-i)/2 + i) {
 	if (from->e[k].refid > refid) {
 	    j = k;
@@ -393,6 +397,7 @@ cram_index *cram_index_query(cram_fd *fd, int refid, int pos,
  *
  * Returns 0 on success
  *        -1 on failure
+ *        -2 if the reference has no data in the index
  */
 int cram_seek_to_refpos(cram_fd *fd, cram_range *r) {
     cram_index *e;
@@ -403,8 +408,8 @@ int cram_seek_to_refpos(cram_fd *fd, cram_range *r) {
 	    if (0 != cram_seek(fd, e->offset - fd->first_container, SEEK_CUR))
 		return -1;
     } else {
-	fprintf(stderr, "Unknown reference ID. Missing from index?\n");
-	return -1;
+	// Absent from the index, which most likely means it has no data.
+	return -2;
     }
 
     if (fd->ctr) {
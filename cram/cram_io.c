@@ -60,6 +60,9 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #ifdef HAVE_LIBLZMA
 #include <lzma.h>
 #endif
+#ifdef HAVE_LIBDEFLATE
+#include <libdeflate.h>
+#endif
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <math.h>
@@ -85,6 +88,7 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include "htslib/hfile.h"
 #include "htslib/bgzf.h"
 #include "htslib/faidx.h"
+#include "hts_deflate_internal.h"
 
 #define TRIAL_SPAN 50
 #define NTRIALS 3
@@ -520,6 +524,81 @@ int int32_put(cram_block *b, int32_t val) {
     return b->data ? 0 : -1;
 }
 
+#ifdef HAVE_LIBDEFLATE
+/* ----------------------------------------------------------------------
+ * gzip compression via libdeflate, used in place of zlib when selected
+ * with hts_set_deflate_codec().  The output is ordinary gzip data.
+ */
+static char *ldeflate_mem_inflate(char *cdata, size_t csize, size_t *size) {
+    struct libdeflate_decompressor *z;
+    unsigned char *data = NULL, *data_tmp;
+    size_t data_alloc, in_pos = 0, out_pos = 0;
+
+    if (!(z = hts_libdeflate_decompressor()))
+	return NULL;
+
+    /* The final member's ISIZE is a good guess for single-member data */
+    data_alloc = csize*1.2+100;
+    if (csize >= 18) {
+	unsigned char *isize = (unsigned char *)cdata + csize - 4;
+	size_t n = isize[0] | (isize[1]<<8) | (isize[2]<<16) |
+	    ((size_t)isize[3]<<24);
+	if (n >= data_alloc)
+	    data_alloc = n+1;
+    }
+    if (!(data = malloc(data_alloc)))
+	return NULL;
+
+    /* Decode each gzip member in turn, growing the output as needed */
+    while (in_pos < csize) {
+	size_t in_used, out_used;
+	enum libdeflate_result r;
+	r = libdeflate_gzip_decompress_ex(z, cdata + in_pos, csize - in_pos,
+					  data + out_pos, data_alloc - out_pos,
+					  &in_used, &out_used);
+	if (r == LIBDEFLATE_INSUFFICIENT_SPACE) {
+	    data = realloc((data_tmp = data), data_alloc *= 2);
+	    if (!data) {
+		free(data_tmp);
+		return NULL;
+	    }
+	    continue;
+	}
+	if (r != LIBDEFLATE_SUCCESS) {
+	    fprintf(stderr, "libdeflate inflate error: %d\n", (int)r);
+	    free(data);
+	    return NULL;
+	}
+	in_pos  += in_used;
+	out_pos += out_used;
+    }
+
+    *size = out_pos;
+    return (char *)data;
+}
+
+static char *ldeflate_mem_deflate(char *data, size_t size,
+				  size_t *cdata_size, int level) {
+    struct libdeflate_compressor *z;
+    char *cdata;
+    size_t cdata_alloc;
+
+    if (!(z = hts_libdeflate_compressor(level)))
+	return NULL;
+
+    cdata_alloc = libdeflate_gzip_compress_bound(z, size);
+    if (!(cdata = malloc(cdata_alloc)))
+	return NULL;
+    *cdata_size = libdeflate_gzip_compress(z, data, size, cdata, cdata_alloc);
+    if (*cdata_size == 0) {
+	fprintf(stderr, "libdeflate deflate error\n");
+	free(cdata);
+	return NULL;
+    }
+    return cdata;
+}
+#endif
+
 /* ----------------------------------------------------------------------
  * zlib compression code - from Gap5's tg_iface_g.c
  * They're static here as they're only used within the cram_compress_block
@@ -531,6 +610,13 @@ char *zlib_mem_inflate(char *cdata, size_t csize, size_t *size) {
     int data_alloc = 0;
     int err;
 
+#ifdef HAVE_LIBDEFLATE
+    /* libdeflate handles gzip only, not the zlib format */
+    if (hts_use_libdeflate() && csize >= 2 &&
+	(unsigned char)cdata[0] == 0x1f && (unsigned char)cdata[1] == 0x8b)
+	return ldeflate_mem_inflate(cdata, csize, size);
+#endif
+
     /* Starting point at uncompressed size, and scale after that */
     data = malloc(data_alloc = csize*1.2+100);
     if (!data)
@@ -593,6 +679,13 @@ static char *zlib_mem_deflate(char *data, size_t size, size_t *cdata_size,
     int cdata_pos = 0;
     int err;
 
+#ifdef HAVE_LIBDEFLATE
+    /* libdeflate has no equivalent to zlib's strategies, so Z_RLE etc.
+     * still go via zlib, as do stored (level 0) blocks. */
+    if (hts_use_libdeflate() && strat == Z_DEFAULT_STRATEGY && level != 0)
+	return ldeflate_mem_deflate(data, size, cdata_size, level);
+#endif
+
     cdata = malloc(cdata_alloc = size*1.05+100);
     if (!cdata)
 	return NULL;
@@ -2575,12 +2668,19 @@ void cram_free_container(cram_container *c) {
 	cram_free_block(c->comp_hdr_block);
 
     if (c->slices) {
-	for (i = 0; i < c->max_slice; i++)
+	for (i = 0; i < c->max_slice; i++) {
+	    if (c->slices[i] == c->slice)
+		c->slice = NULL;
 	    if (c->slices[i])
 		cram_free_slice(c->slices[i]);
+	}
 	free(c->slices);
     }
 
+    /* A reader's current slice is not kept in c->slices */
+    if (c->slice)
+	cram_free_slice(c->slice);
+
     for (id = DS_RN; id < DS_TN; id++)
 	if (c->stats[id]) cram_stats_free(c->stats[id]);
 
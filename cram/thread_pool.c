@@ -389,8 +389,10 @@ static void *t_pool_worker(void *arg) {
 	if (!(p->head = j->next))
 	    p->tail = NULL;
 
+	// Several threads may be waiting to dispatch to a shared pool, and
+	// only this first slot freed after the queue was full wakes them
 	if (p->njobs-- >= p->qsize)
-	    pthread_cond_signal(&p->full_c);
+	    pthread_cond_broadcast(&p->full_c);
 
 	if (p->njobs == 0)
 	    pthread_cond_signal(&p->empty_c);
@@ -217,7 +217,7 @@ int fai_build(const char *fn)
     fai = fai_build_core(bgzf);
     if ( !fai )
     {
-        if ( bgzf->is_compressed && bgzf->is_gzip ) fprintf(stderr,"Cannot index files compressed with gzip, please use bgzip\n");
+        bgzf_close(bgzf);
         free(str);
         return -1;
     }
@@ -41,6 +41,7 @@ DEALINGS IN THE SOFTWARE.  */
 
    off_t offset;     // Offset within the stream of buffer position 0
    int at_eof:1;     // For reading, whether EOF has been seen
+   int mapped:1;     // Whether buffer is a read-only mapping of the whole file
    int has_errno;    // Error number from the last failure on this stream
 
 For reading, begin is the first unread character in the buffer and end is the
@@ -59,7 +60,11 @@ equal to buffer:
 Thus if begin > end then there is a non-empty write buffer, if begin < end
 then there is a non-empty read buffer, and if begin == end then both buffers
 are empty.  In all cases, the stream's file position indicator corresponds
-to the position pointed to by begin.  */
+to the position pointed to by begin.
+
+A memory-mapped stream's buffer is the entire file, so end == limit, at_eof
+is always set and offset is always 0.  Reading never refills the buffer and
+seeking just moves begin.  */
 
 hFILE *hfile_init(size_t struct_size, const char *mode, size_t capacity)
 {
@@ -78,6 +83,7 @@ hFILE *hfile_init(size_t struct_size, const char *mode, size_t capacity)
 
     fp->offset = 0;
     fp->at_eof = 0;
+    fp->mapped = 0;
     fp->has_errno = 0;
     return fp;
 
@@ -89,7 +95,7 @@ error:
 void hfile_destroy(hFILE *fp)
 {
     int save = errno;
-    if (fp) free(fp->buffer);
+    if (fp && !fp->mapped) free(fp->buffer);
     free(fp);
     errno = save;
 }
@@ -106,6 +112,9 @@ static ssize_t refill_buffer(hFILE *fp)
 {
     ssize_t n;
 
+    // A memory-mapped file is already entirely in the (read-only) buffer
+    if (fp->mapped) return 0;
+
     // Move any unread characters to the start of the buffer
     if (fp->begin > fp->buffer) {
         fp->offset += fp->begin - fp->buffer;
@@ -264,6 +273,12 @@ off_t hseek(hFILE *fp, off_t offset, int whence)
     pos = fp->backend->seek(fp, offset, whence);
     if (pos < 0) { fp->has_errno = errno; return pos; }
 
+    if (fp->mapped) {
+        // The whole file is buffered, so just reposition within the buffer
+        fp->begin = &fp->buffer[pos];
+        return pos;
+    }
+
     // Seeking succeeded, so discard any non-empty read buffer
     fp->begin = fp->end = fp->buffer;
     fp->at_eof = 0;
@@ -449,6 +464,86 @@ int hfile_oflags(const char *mode)
 }
 
 
+/*************************
+ * Memory-mapped backend *
+ *************************/
+
+#ifndef _WIN32
+#include <sys/mman.h>
+
+/* The mapping is the hFILE's buffer, so the backend itself has no state.
+   Its notional stream position is always at the end of the mapping, as
+   though the whole file had been read into the buffer.  */
+
+static ssize_t mmap_read(hFILE *fp, void *buffer, size_t nbytes)
+{
+    return 0;  // Never called, as at_eof is always set
+}
+
+static off_t mmap_seek(hFILE *fp, off_t offset, int whence)
+{
+    off_t length = fp->limit - fp->buffer, pos;
+
+    switch (whence) {
+    case SEEK_SET: pos = offset; break;
+    case SEEK_CUR:
+    case SEEK_END: pos = length + offset; break;
+    default: errno = EINVAL; return -1;
+    }
+
+    if (pos < 0 || pos > length) { errno = EINVAL; return -1; }
+    return pos;
+}
+
+static int mmap_close(hFILE *fp)
+{
+    return munmap(fp->buffer, fp->limit - fp->buffer);
+}
+
+static const struct hFILE_backend mmap_backend =
+{
+    mmap_read, NULL, mmap_seek, NULL, mmap_close
+};
+
+static hFILE *hopen_mmap(const char *filename, const char *mode)
+{
+    hFILE *fp;
+    struct stat sbuf;
+    void *map = MAP_FAILED;
+    int fd = open(filename, hfile_oflags(mode), 0666);
+    if (fd < 0) return NULL;
+
+    // Fall back to ordinary I/O for anything that can't usefully be mapped
+    if (fstat(fd, &sbuf) != 0 || !S_ISREG(sbuf.st_mode) || sbuf.st_size == 0
+        || (off_t) (size_t) sbuf.st_size != sbuf.st_size
+        || (map = mmap(NULL, sbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0))
+           == MAP_FAILED) {
+        fp = hdopen(fd, mode);
+        if (fp == NULL) { int save = errno; (void) close(fd); errno = save; }
+        return fp;
+    }
+
+    (void) close(fd);  // The mapping remains valid without the descriptor
+
+    fp = hfile_init(sizeof (hFILE), mode, 0);
+    if (fp == NULL) {
+        int save = errno;
+        (void) munmap(map, sbuf.st_size);
+        errno = save;
+        return NULL;
+    }
+
+    free(fp->buffer);
+    fp->buffer = fp->begin = (char *) map;
+    fp->end = fp->limit = &fp->buffer[sbuf.st_size];
+    fp->at_eof = 1;
+    fp->mapped = 1;
+    fp->backend = &mmap_backend;
+    return fp;
+}
+#endif
+
+
 /*********************
  * In-memory backend *
  *********************/
@@ -518,11 +613,212 @@ static hFILE *hopen_mem(const char *data, const char *mode)
 }
 
 
+/**********************
+ * Read-ahead wrapper *
+ **********************/
+
+#include <pthread.h>
+
+/* A background thread reads the wrapped stream into a ring of buffers,
+   staying up to n_bufs buffers ahead of the consumer.  Only that thread
+   touches the inner stream while reading, so seeking first waits for any
+   read in progress and then discards everything prefetched.  */
+
+typedef struct {
+    char *data;
+    ssize_t len;        // bytes read, or negative on error
+    int err;            // errno, when len < 0
+} ra_buffer;
+
+typedef struct {
+    hFILE base;
+    hFILE *inner;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t filled;      // signalled when a read completes
+    pthread_cond_t emptied;     // signalled when a buffer becomes free
+    ra_buffer *bufs;
+    size_t buf_size;
+    int n_bufs, head, n_full;
+    size_t head_offset;         // bytes of bufs[head] already consumed
+    off_t pos;                  // stream offset of the next byte to consume
+    unsigned generation;        // incremented by each seek
+    int busy, stopped, shutdown;
+} hFILE_ra;
+
+static void *ra_thread(void *arg)
+{
+    hFILE_ra *fp = (hFILE_ra *) arg;
+    pthread_mutex_lock(&fp->lock);
+    while (!fp->shutdown) {
+        ra_buffer *buf;
+        unsigned generation;
+        ssize_t n;
+        int err;
+
+        if (fp->stopped || fp->n_full == fp->n_bufs) {
+            pthread_cond_wait(&fp->emptied, &fp->lock);
+            continue;
+        }
+
+        buf = &fp->bufs[(fp->head + fp->n_full) % fp->n_bufs];
+        generation = fp->generation;
+        fp->busy = 1;
+        pthread_mutex_unlock(&fp->lock);
+
+        n = hread(fp->inner, buf->data, fp->buf_size);
+        err = errno;
+
+        pthread_mutex_lock(&fp->lock);
+        fp->busy = 0;
+        if (fp->generation == generation) {
+            buf->len = n;
+            buf->err = err;
+            fp->n_full++;
+            // Stop at EOF or on an error, until the next seek
+            if (n <= 0) fp->stopped = 1;
+        }
+        pthread_cond_signal(&fp->filled);
+    }
+    pthread_mutex_unlock(&fp->lock);
+    return NULL;
+}
+
+static ssize_t ra_read(hFILE *fpv, void *buffer, size_t nbytes)
+{
+    hFILE_ra *fp = (hFILE_ra *) fpv;
+    ra_buffer *buf;
+    ssize_t n;
+
+    pthread_mutex_lock(&fp->lock);
+    while (fp->n_full == 0) pthread_cond_wait(&fp->filled, &fp->lock);
+
+    buf = &fp->bufs[fp->head];
+    if (buf->len <= 0) {
+        // Leave the EOF or error in place, to be reported again if retried
+        n = buf->len;
+        errno = buf->err;
+        pthread_mutex_unlock(&fp->lock);
+        return n;
+    }
+
+    n = buf->len - fp->head_offset;
+    if ((size_t) n > nbytes) n = nbytes;
+    memcpy(buffer, &buf->data[fp->head_offset], n);
+    fp->head_offset += n;
+    fp->pos += n;
+    if (fp->head_offset == (size_t) buf->len) {
+        fp->head = (fp->head + 1) % fp->n_bufs;
+        fp->n_full--;
+        fp->head_offset = 0;
+        pthread_cond_signal(&fp->emptied);
+    }
+    pthread_mutex_unlock(&fp->lock);
+    return n;
+}
+
+static off_t ra_seek(hFILE *fpv, off_t offset, int whence)
+{
+    hFILE_ra *fp = (hFILE_ra *) fpv;
+    off_t pos;
+
+    pthread_mutex_lock(&fp->lock);
+    // Invalidate any read in progress, and wait for it to finish
+    fp->generation++;
+    while (fp->busy) pthread_cond_wait(&fp->filled, &fp->lock);
+
+    if (whence == SEEK_CUR) offset += fp->pos, whence = SEEK_SET;
+    pos = hseek(fp->inner, offset, whence);
+    if (pos >= 0) {
+        fp->pos = pos;
+        fp->head = fp->n_full = 0;
+        fp->head_offset = 0;
+        fp->stopped = 0;
+        pthread_cond_signal(&fp->emptied);
+    }
+    pthread_mutex_unlock(&fp->lock);
+    return pos;
+}
+
+static int ra_close(hFILE *fpv)
+{
+    hFILE_ra *fp = (hFILE_ra *) fpv;
+    int i;
+
+    pthread_mutex_lock(&fp->lock);
+    fp->shutdown = 1;
+    pthread_cond_signal(&fp->emptied);
+    pthread_mutex_unlock(&fp->lock);
+    pthread_join(fp->thread, NULL);
+
+    pthread_mutex_destroy(&fp->lock);
+    pthread_cond_destroy(&fp->filled);
+    pthread_cond_destroy(&fp->emptied);
+    for (i = 0; i < fp->n_bufs; i++) free(fp->bufs[i].data);
+    free(fp->bufs);
+    return hclose(fp->inner);
+}
+
+static const struct hFILE_backend ra_backend =
+{
+    ra_read, NULL, ra_seek, NULL, ra_close
+};
+
+hFILE *hreadahead(hFILE *inner, int n_buffers, size_t buffer_size)
+{
+    hFILE_ra *fp;
+    int i;
+
+    if (n_buffers <= 0) n_buffers = 4;
+    if (buffer_size == 0) buffer_size = 65536;
+
+    fp = (hFILE_ra *) hfile_init(sizeof (hFILE_ra), "r", 0);
+    if (fp == NULL) return NULL;
+
+    fp->bufs = (ra_buffer *) calloc(n_buffers, sizeof (ra_buffer));
+    if (fp->bufs == NULL) goto error;
+    for (i = 0; i < n_buffers; i++)
+        if ((fp->bufs[i].data = (char *) malloc(buffer_size)) == NULL)
+            goto error;
+
+    fp->inner = inner;
+    fp->buf_size = buffer_size;
+    fp->n_bufs = n_buffers;
+    fp->head = fp->n_full = 0;
+    fp->head_offset = 0;
+    fp->pos = fp->base.offset = htell(inner);
+    fp->generation = 0;
+    fp->busy = fp->stopped = fp->shutdown = 0;
+    pthread_mutex_init(&fp->lock, NULL);
+    pthread_cond_init(&fp->filled, NULL);
+    pthread_cond_init(&fp->emptied, NULL);
+    if ((errno = pthread_create(&fp->thread, NULL, ra_thread, fp)) != 0) {
+        pthread_mutex_destroy(&fp->lock);
+        pthread_cond_destroy(&fp->filled);
+        pthread_cond_destroy(&fp->emptied);
+        goto error;
+    }
+
+    fp->base.backend = &ra_backend;
+    return &fp->base;
+
+error:
+    if (fp->bufs) {
+        int save = errno;
+        for (i = 0; i < n_buffers; i++) free(fp->bufs[i].data);
+        free(fp->bufs);
+        errno = save;
+    }
+    hfile_destroy(&fp->base);
+    return NULL;
+}
+
+
 /******************************
  * hopen() backend dispatcher *
  ******************************/
 
-hFILE *hopen(const char *fname, const char *mode)
+static hFILE *hopen_backend(const char *fname, const char *mode)
 {
     if (strncmp(fname, "http://", 7) == 0 ||
         strncmp(fname, "ftp://", 6) == 0) return hopen_net(fname, mode);
@@ -531,9 +827,23 @@ hFILE *hopen(const char *fname, const char *mode)
 #endif
     else if (strncmp(fname, "data:", 5) == 0) return hopen_mem(fname + 5, mode);
     else if (strcmp(fname, "-") == 0) return hopen_fd_stdinout(mode);
+#ifndef _WIN32
+    else if (strchr(mode, 'm') && hfile_oflags(mode) == hfile_oflags("r"))
+        return hopen_mmap(fname, mode);
+#endif
     else return hopen_fd(fname, mode);
 }
 
+hFILE *hopen(const char *fname, const char *mode)
+{
+    hFILE *fp = hopen_backend(fname, mode), *rafp;
+    if (fp == NULL || !strchr(mode, 'p') || fp->mapped
+        || hfile_oflags(mode) != hfile_oflags("r")) return fp;
+
+    if ((rafp = hreadahead(fp, 0, 0)) == NULL) hclose_abruptly(fp);
+    return rafp;
+}
+
 int hisremote(const char *fname)
 {
     // FIXME Make a new backend entry to return this
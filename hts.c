@@ -32,10 +32,13 @@ DEALINGS IN THE SOFTWARE.  */
 #include <fcntl.h>
 #include <errno.h>
 #include <sys/stat.h>
+#include <pthread.h>
 #include "htslib/bgzf.h"
 #include "htslib/hts.h"
 #include "cram/cram.h"
 #include "htslib/hfile.h"
+#include "htslib/regidx.h"
+#include "hts_internal.h"
 #include "version.h"
 
 #include "htslib/kseq.h"
@@ -445,6 +448,9 @@ htsFile *hts_hopen(struct hFILE *hfile, const char *fn, const char *mode)
         if (!fp->is_write) {
         #if KS_BGZF
             BGZF *gzfp = bgzf_hopen(hfile, mode);
+            // Plain gzip can be sought in, and so queried, given its .gzi
+            if (gzfp && fp->format.compression == gzip && strcmp(fn, "-") != 0)
+                bgzf_index_load(gzfp, fn, ".gzi");
         #else
             // TODO Implement gzip hFILE adaptor
             hclose(hfile); // This won't work, especially for stdin
@@ -479,9 +485,17 @@ error:
     return NULL;
 }
 
+static int hts_idx_close(htsFile *fp);
+typedef struct hts_text_mt hts_text_mt_t;
+static t_pool *text_mt_free(htsFile *fp);
+
 int hts_close(htsFile *fp)
 {
-    int ret, save;
+    int ret, save, idx_ret = 0;
+    t_pool *text_pool = NULL;
+
+    if (fp->idx) idx_ret = hts_idx_close(fp);
+    if (fp->text_mt) text_pool = text_mt_free(fp);
 
     switch (fp->format.format) {
     case binary_format:
@@ -530,7 +544,9 @@ int hts_close(htsFile *fp)
         break;
     }
 
+    if (idx_ret < 0) ret = -1;
     save = errno;
+    hts_tpool_destroy((hts_tpool*)text_pool); // after any BGZF stream using it is closed
     free(fp->fn);
     free(fp->fn_aux);
     free(fp->line.s);
@@ -544,6 +560,8 @@ const htsFormat *hts_get_format(htsFile *fp)
     return fp? &fp->format : NULL;
 }
 
+BGZF *hts_get_bgzfp(htsFile *fp);
+
 int hts_set_opt(htsFile *fp, enum cram_option opt, ...) {
     int r;
     va_list args;
@@ -558,16 +576,378 @@ int hts_set_opt(htsFile *fp, enum cram_option opt, ...) {
     return r;
 }
 
+static int text_mt_init(htsFile *fp, t_pool *pool, int qsize, int own_pool);
+
+// Text input being read with threads is parsed on them too
+static inline int is_text_input(const htsFile *fp)
+{
+    return !fp->is_write && (fp->format.format == sam || fp->format.format == vcf);
+}
+
 int hts_set_threads(htsFile *fp, int n)
 {
-    if (fp->format.compression == bgzf) {
-        return bgzf_mt(fp->fp.bgzf, n, 256);
+    if (is_text_input(fp) && n > 0) {
+        // Lines are parsed, and any BGZF blocks inflated, on a private pool
+        t_pool *pool = (t_pool*)hts_tpool_init(n);
+        if (pool == NULL || text_mt_init(fp, pool, 0, 1) < 0) {
+            hts_tpool_destroy((hts_tpool*)pool);
+            return -1;
+        }
+        return 0;
+    }
+    else if (fp->format.compression == bgzf) {
+        return bgzf_mt(hts_get_bgzfp(fp), n, 256);
     } else if (fp->format.format == cram) {
         return hts_set_opt(fp, CRAM_OPT_NTHREADS, n);
     }
     else return 0;
 }
 
+// hts_tpool is only ever a t_pool, kept opaque in the public headers
+hts_tpool *hts_tpool_init(int n)
+{
+    if (n < 1) return NULL;
+    return (hts_tpool*)t_pool_init(n * 4, n);
+}
+
+void hts_tpool_destroy(hts_tpool *p)
+{
+    if (p) t_pool_destroy((t_pool*)p, 0);
+}
+
+int hts_set_thread_pool(htsFile *fp, htsThreadPool *p)
+{
+    if (is_text_input(fp)) {
+        return text_mt_init(fp, (t_pool*)p->pool, p->qsize, 0);
+    }
+    else if (fp->format.compression == bgzf) {
+        return bgzf_thread_pool(hts_get_bgzfp(fp), p->pool, p->qsize);
+    } else if (fp->format.format == cram) {
+        return hts_set_opt(fp, CRAM_OPT_THREAD_POOL, (t_pool*)p->pool);
+    }
+    else return 0;
+}
+
+/************************************
+ *** Multi-threaded text parsing ***
+ ************************************/
+
+#define TEXT_BATCH_LINES 1024      // lines per batch
+#define TEXT_BATCH_SIZE  (1<<18)   // or this much text, whichever is first
+
+typedef struct text_batch_t {
+    struct text_batch_t *next;     // in the list of batches read, or free
+    struct hts_text_mt *mt;
+    kstring_t text;                // the lines, each NUL-terminated
+    size_t *off;                   // where each line starts, and one more
+    int n, m;                      // lines, and space for lines and records
+    int64_t lineno;                // number of the first line
+    void **recs;
+    int *ret;                      // parse results
+    int parsed;
+    kstring_t line, tmp;           // the line being parsed, and scratch space
+} text_batch_t;
+
+struct hts_text_mt {
+    t_pool *pool;
+    int own_pool, started;
+    int serial;                    // the threads could not be started
+    const hts_text_parser_t *parser;
+    void *hdr, *proto, *swap;      // the workers' header, and record templates
+    int64_t hdr_size;              // parser->hdr_size() of the header copied
+    pthread_t reader;
+    int64_t lineno;                // of the last line read, for the reader
+    kstring_t line;                // the reader's current line
+    text_batch_t *cur;             // the batch being returned from
+    int i;                         // and its next line
+    pthread_rwlock_t hdr_lock;     // held exclusively to replace hdr
+    pthread_mutex_t lock;          // guards the rest
+    pthread_cond_t cond;           // signalled when a batch is parsed or freed
+    text_batch_t *head, *tail;     // batches read, in file order
+    text_batch_t *free;
+    int n_batches, max_batches;
+    int stop, reader_done, error;
+};
+
+// Parses lines, and inflates any BGZF blocks, on the pool
+static int text_mt_init(htsFile *fp, t_pool *pool, int qsize, int own_pool)
+{
+    hts_text_mt_t *mt;
+    if (fp->text_mt) {
+        if (hts_verbose >= 1)
+            fprintf(stderr, "[E::%s] threads have already been set for this file\n", __func__);
+        return -1;
+    }
+    if (pool == NULL || (mt = (hts_text_mt_t*)calloc(1, sizeof(hts_text_mt_t))) == NULL)
+        return -1;
+    mt->pool = pool;
+    mt->max_batches = pool->tsize * 2 + 2;
+    pthread_rwlock_init(&mt->hdr_lock, NULL);
+    pthread_mutex_init(&mt->lock, NULL);
+    pthread_cond_init(&mt->cond, NULL);
+    fp->text_mt = mt;
+    if (fp->format.compression == bgzf
+        && bgzf_thread_pool(hts_get_bgzfp(fp), (hts_tpool*)pool, qsize) < 0) {
+        text_mt_free(fp);
+        return -1;
+    }
+    mt->own_pool = own_pool;
+    return 0;
+}
+
+static void text_batch_free(hts_text_mt_t *mt, text_batch_t *b)
+{
+    int i;
+    if (b == NULL) return;
+    for (i = 0; i < b->m; ++i) mt->parser->destroy(b->recs[i]);
+    free(b->text.s); free(b->off); free(b->recs); free(b->ret);
+    free(b->line.s); free(b->tmp.s);
+    free(b);
+}
+
+// Stops the pipeline and frees it.  Returns the pool if it was private to
+// the file, for the caller to destroy once the file is closed.
+static t_pool *text_mt_free(htsFile *fp)
+{
+    hts_text_mt_t *mt = fp->text_mt;
+    t_pool *pool = mt->own_pool? mt->pool : NULL;
+    text_batch_t *b;
+
+    if (mt->started) {
+        pthread_mutex_lock(&mt->lock);
+        mt->stop = 1;
+        pthread_cond_broadcast(&mt->cond);
+        pthread_mutex_unlock(&mt->lock);
+        pthread_join(mt->reader, NULL);
+        // Batches already dispatched must finish before they are freed
+        pthread_mutex_lock(&mt->lock);
+        for (b = mt->head; b; b = b->next)
+            while (!b->parsed) pthread_cond_wait(&mt->cond, &mt->lock);
+        pthread_mutex_unlock(&mt->lock);
+        while ((b = mt->head) != NULL) {
+            mt->head = b->next;
+            text_batch_free(mt, b);
+        }
+        while ((b = mt->free) != NULL) {
+            mt->free = b->next;
+            text_batch_free(mt, b);
+        }
+        text_batch_free(mt, mt->cur);
+    }
+    if (mt->proto) mt->parser->destroy(mt->proto);
+    if (mt->hdr) mt->parser->hdr_destroy(mt->hdr);
+    free(mt->swap);
+    free(mt->line.s);
+    pthread_rwlock_destroy(&mt->hdr_lock);
+    pthread_mutex_destroy(&mt->lock);
+    pthread_cond_destroy(&mt->cond);
+    free(mt);
+    fp->text_mt = NULL;
+    return pool;
+}
+
+// Runs in a worker thread.  Lines are parsed from a copy, so that any left
+// for the reading thread to parse serially are still intact.
+static void *text_batch_parse(void *arg)
+{
+    text_batch_t *b = (text_batch_t*)arg;
+    hts_text_mt_t *mt = b->mt;
+    int i;
+    pthread_rwlock_rdlock(&mt->hdr_lock);
+    for (i = 0; i < b->n; ++i) {
+        b->line.l = 0;
+        if (kputsn(b->text.s + b->off[i], b->off[i+1] - b->off[i] - 1, &b->line) < 0)
+            b->ret[i] = HTS_TEXT_SERIAL;
+        else
+            b->ret[i] = mt->parser->parse(&b->line, mt->hdr, b->recs[i], &b->tmp);
+    }
+    pthread_rwlock_unlock(&mt->hdr_lock);
+    pthread_mutex_lock(&mt->lock);
+    b->parsed = 1;
+    pthread_cond_broadcast(&mt->cond);
+    pthread_mutex_unlock(&mt->lock);
+    return NULL;
+}
+
+// Makes room for one more line in the batch
+static int text_batch_reserve(hts_text_mt_t *mt, text_batch_t *b)
+{
+    int m = b->m? b->m * 2 : 64;
+    size_t *off;
+    void **recs;
+    int *ret;
+    if (b->n < b->m) return 0;
+    if ((off = (size_t*)realloc(b->off, (m + 1) * sizeof(size_t))) == NULL) return -1;
+    b->off = off;
+    if ((ret = (int*)realloc(b->ret, m * sizeof(int))) == NULL) return -1;
+    b->ret = ret;
+    if ((recs = (void**)realloc(b->recs, m * sizeof(void*))) == NULL) return -1;
+    b->recs = recs;
+    for (; b->m < m; ++b->m)
+        if ((b->recs[b->m] = mt->parser->init(mt->proto)) == NULL) return -1;
+    return 0;
+}
+
+// Reads lines into the batch until it is full.  Returns 1 if there may be
+// more, 0 at end-of-file, or -1 if reading failed or memory ran out.
+static int text_batch_fill(hts_text_mt_t *mt, kstream_t *ks, text_batch_t *b)
+{
+    int dret, ret;
+    b->n = 0;
+    b->text.l = 0;
+    b->lineno = mt->lineno + 1;
+    while (b->n < TEXT_BATCH_LINES && b->text.l < TEXT_BATCH_SIZE) {
+        if ((ret = ks_getuntil(ks, KS_SEP_LINE, &mt->line, &dret)) < 0) {
+            if (ret == -1) return 0;
+            if (hts_verbose >= 1)
+                fprintf(stderr, "[E::%s] read error after line %lld\n", __func__, (long long) mt->lineno);
+            return -1;
+        }
+        mt->lineno++;
+        if (text_batch_reserve(mt, b) < 0
+            || kputsn(mt->line.s, mt->line.l + 1, &b->text) < 0) {
+            if (hts_verbose >= 1)
+                fprintf(stderr, "[E::%s] out of memory at line %lld\n", __func__, (long long) mt->lineno);
+            return -1;
+        }
+        b->off[b->n++] = b->text.l - mt->line.l - 1;
+    }
+    return 1;
+}
+
+static void *text_mt_reader(void *arg)
+{
+    htsFile *fp = (htsFile*)arg;
+    hts_text_mt_t *mt = fp->text_mt;
+    int more = 1;
+    while (more > 0) {
+        text_batch_t *b;
+        pthread_mutex_lock(&mt->lock);
+        while (!mt->stop && mt->free == NULL && mt->n_batches >= mt->max_batches)
+            pthread_cond_wait(&mt->cond, &mt->lock);
+        if (mt->stop) b = NULL;
+        else if ((b = mt->free) != NULL) mt->free = b->next;
+        else if ((b = (text_batch_t*)calloc(1, sizeof(text_batch_t))) != NULL) {
+            b->mt = mt;
+            mt->n_batches++;
+        }
+        pthread_mutex_unlock(&mt->lock);
+        if (b == NULL) {
+            if (!mt->stop) more = -1;
+            break;
+        }
+        if (b->off == NULL && text_batch_reserve(mt, b) < 0) {
+            text_batch_free(mt, b);
+            more = -1;
+            break;
+        }
+
+        more = text_batch_fill(mt, (kstream_t*)fp->fp.voidp, b);
+        b->off[b->n] = b->text.l;
+        b->next = NULL;
+        b->parsed = 0;
+        pthread_mutex_lock(&mt->lock);
+        if (mt->tail) mt->tail->next = b;
+        else mt->head = b;
+        mt->tail = b;
+        pthread_mutex_unlock(&mt->lock);
+        if (b->n == 0 || t_pool_dispatch(mt->pool, NULL, text_batch_parse, b) < 0)
+            text_batch_parse(b);
+    }
+    pthread_mutex_lock(&mt->lock);
+    mt->reader_done = 1;
+    mt->error = (more < 0);
+    pthread_cond_broadcast(&mt->cond);
+    pthread_mutex_unlock(&mt->lock);
+    return NULL;
+}
+
+static int text_mt_start(htsFile *fp, const hts_text_parser_t *parser, void *hdr, void *rec)
+{
+    hts_text_mt_t *mt = fp->text_mt;
+    mt->parser = parser;
+    mt->lineno = fp->lineno;
+    if ((mt->hdr = parser->hdr_dup(hdr)) == NULL) return -1;
+    if (parser->hdr_size) mt->hdr_size = parser->hdr_size(hdr);
+    if ((mt->proto = parser->init(rec)) == NULL) return -1;
+    if ((mt->swap = malloc(parser->size)) == NULL) return -1;
+    if (pthread_create(&mt->reader, NULL, text_mt_reader, fp) != 0) return -1;
+    mt->started = 1;
+    return 0;
+}
+
+// Reads and parses the next line on the calling thread
+static int text_serial_read(htsFile *fp, const hts_text_parser_t *parser, void *hdr, void *rec)
+{
+    int ret = hts_getline(fp, KS_SEP_LINE, &fp->line);
+    if (ret < 0) return (ret == -1)? -1 : -3;
+    ret = parser->parse(&fp->line, hdr, rec, NULL);
+    fp->line.l = 0;
+    return ret;
+}
+
+int hts_text_mt_read(htsFile *fp, const hts_text_parser_t *parser, void *hdr, void *rec)
+{
+    hts_text_mt_t *mt = fp->text_mt;
+    text_batch_t *b;
+    int i, ret;
+
+    if (mt->serial) return text_serial_read(fp, parser, hdr, rec);
+    if (!mt->started && text_mt_start(fp, parser, hdr, rec) < 0) {
+        if (hts_verbose >= 1)
+            fprintf(stderr, "[W::%s] failed to start parsing threads; parsing serially\n", __func__);
+        // Any BGZF decompression is still using the pool, so the pipeline
+        // is kept, to free it in hts_close(), but reads are serial from now on
+        mt->serial = 1;
+        return text_serial_read(fp, parser, hdr, rec);
+    }
+    while (mt->cur == NULL || mt->i == mt->cur->n) {
+        pthread_mutex_lock(&mt->lock);
+        if (mt->cur) {
+            mt->cur->next = mt->free;
+            mt->free = mt->cur;
+            mt->cur = NULL;
+            pthread_cond_broadcast(&mt->cond);
+        }
+        while (mt->head? !mt->head->parsed : !mt->reader_done)
+            pthread_cond_wait(&mt->cond, &mt->lock);
+        if ((b = mt->head) != NULL) {
+            if ((mt->head = b->next) == NULL) mt->tail = NULL;
+            mt->cur = b;
+            mt->i = 0;
+        }
+        pthread_mutex_unlock(&mt->lock);
+        if (b == NULL) return mt->error? -3 : -1; // all lines read
+    }
+
+    b = mt->cur;
+    i = mt->i++;
+    fp->lineno = b->lineno + i;
+    ret = b->ret[i];
+    if (ret == HTS_TEXT_SERIAL) {
+        kstring_t line;
+        void *copy;
+        line.s = b->text.s + b->off[i];
+        line.l = b->off[i+1] - b->off[i] - 1;
+        line.m = line.l + 1;
+        ret = parser->parse(&line, hdr, b->recs[i], NULL);
+        // Let the workers see anything added to the header.  Should that
+        // fail, lines needing the additions just keep coming back here.
+        if (parser->hdr_size && parser->hdr_size(hdr) != mt->hdr_size
+            && (copy = parser->hdr_dup(hdr)) != NULL) {
+            pthread_rwlock_wrlock(&mt->hdr_lock);
+            parser->hdr_destroy(mt->hdr);
+            mt->hdr = copy;
+            pthread_rwlock_unlock(&mt->hdr_lock);
+            mt->hdr_size = parser->hdr_size(hdr);
+        }
+    }
+    memcpy(mt->swap, rec, parser->size);
+    memcpy(rec, b->recs[i], parser->size);
+    memcpy(b->recs[i], mt->swap, parser->size);
+    return ret;
+}
+
 int hts_set_fai_filename(htsFile *fp, const char *fn_aux)
 {
     free(fp->fn_aux);
@@ -587,7 +967,8 @@ int hts_set_fai_filename(htsFile *fp, const char *fn_aux)
 // future is uncertain. Things will probably have to change with hFILE...
 BGZF *hts_get_bgzfp(htsFile *fp)
 {
-    if ( fp->is_bin )
+    // Compressed text is written straight to BGZF, without a kstream
+    if ( fp->is_bin || fp->is_write )
         return fp->fp.bgzf;
     else
         return ((kstream_t*)fp->fp.voidp)->f;
@@ -775,6 +1156,56 @@ typedef struct {
     uint64_t *offset;
 } lidx_t;
 
+// A loaded index, whose references are decoded on first use
+#define IDX_LAZY_FAILED ((size_t)-1)
+typedef struct {
+    const uint8_t *data;    // the index following its header
+    size_t size;
+    size_t *off;            // where each reference starts in data
+    hFILE *hfp;             // the memory-mapped file that data points into
+    uint8_t *buf;           // or the data, when read into memory
+    pthread_mutex_t lock;
+} idx_lazy_t;
+
+// Recently computed chunk lists, keyed by reference, the range of linear
+// windows queried and the dense linear index sample used, which determine
+// the chunks exactly
+typedef struct {
+    int tid, wbeg, wend, dense, n_off;
+    hts_pair64_t *off;      // NULL for an empty slot
+} idx_cache_ent_t;
+
+typedef struct {
+    int n;
+    idx_cache_ent_t *ent;
+    pthread_mutex_t lock;
+} idx_cache_t;
+
+// A dense linear index, stored in a CSI's meta: the smallest offset of any
+// record overlapping each of a series of positions, sampled every n records
+typedef struct {
+    int32_t pos;
+    uint64_t loff;
+} dense_ent_t;
+
+typedef struct {
+    int32_t n, m;
+    dense_ent_t *a;
+} dense_list_t;
+
+typedef struct {
+    int every, n_since;
+    int32_t n_ref;
+    dense_list_t *ref;
+    // While building: records overlapping the current position, in file
+    // order and with increasing ends, as later ones ending sooner never
+    // have the smallest offset
+    struct { int end; uint64_t off; } *q;
+    int q_beg, q_end, q_m;
+} idx_dense_t;
+
+#define DENSE_MAGIC "DLI\1"
+
 struct __hts_idx_t {
     int fmt, min_shift, n_lvls, n_bins;
     uint32_t l_meta;
@@ -783,6 +1214,9 @@ struct __hts_idx_t {
     bidx_t **bidx;
     lidx_t *lidx;
     uint8_t *meta;
+    idx_lazy_t *lazy;
+    idx_cache_t *cache;
+    idx_dense_t *dense;
     struct {
         uint32_t last_bin, save_bin;
         int last_coor, last_tid, save_tid, finished;
@@ -951,9 +1385,80 @@ void hts_idx_finish(hts_idx_t *idx, uint64_t final_offset)
         update_loff(idx, i, (idx->fmt == HTS_FMT_CSI));
         compress_binning(idx, i);
     }
+    if (idx->dense) {
+        free(idx->dense->q);
+        idx->dense->q = NULL;
+        idx->dense->q_beg = idx->dense->q_end = idx->dense->q_m = 0;
+    }
     idx->z.finished = 1;
 }
 
+void hts_idx_amend_last(hts_idx_t *idx, uint64_t offset)
+{
+    if (idx && !idx->z.finished) idx->z.last_off = offset;
+}
+
+int hts_idx_set_dense(hts_idx_t *idx, int n_recs)
+{
+    if (idx == NULL || idx->fmt != HTS_FMT_CSI || n_recs <= 0 || idx->dense
+        || idx->z.save_bin != 0xffffffffu) return -1;
+    if ((idx->dense = (idx_dense_t*)calloc(1, sizeof(idx_dense_t))) == NULL) return -1;
+    idx->dense->every = n_recs;
+    return 0;
+}
+
+static void idx_dense_destroy(idx_dense_t *d)
+{
+    int i;
+    if (d == NULL) return;
+    for (i = 0; i < d->n_ref; ++i) free(d->ref[i].a);
+    free(d->ref); free(d->q); free(d);
+}
+
+// Adds a record starting at offset off, sampling the smallest offset of the
+// records overlapping its position every d->every records
+static int dense_push(idx_dense_t *d, int tid, int beg, int end, uint64_t off, int new_tid)
+{
+    dense_list_t *l;
+    if (tid >= d->n_ref) {
+        int32_t n = tid + 1;
+        dense_list_t *ref = (dense_list_t*)realloc(d->ref, n * sizeof(dense_list_t));
+        if (ref == NULL) return -1;
+        memset(&ref[d->n_ref], 0, (n - d->n_ref) * sizeof(dense_list_t));
+        d->ref = ref, d->n_ref = n;
+    }
+    if (new_tid) d->q_beg = d->q_end = 0, d->n_since = 0;
+    while (d->q_beg < d->q_end && d->q[d->q_beg].end <= beg) ++d->q_beg;
+    if (d->q_beg == d->q_end || d->q[d->q_end-1].end < end) {
+        if (d->q_end == d->q_m && d->q_beg > 0) {
+            memmove(d->q, &d->q[d->q_beg], (d->q_end - d->q_beg) * sizeof(*d->q));
+            d->q_end -= d->q_beg, d->q_beg = 0;
+        }
+        if (d->q_end == d->q_m) {
+            int m = d->q_m? d->q_m<<1 : 64;
+            void *q = realloc(d->q, m * sizeof(*d->q));
+            if (q == NULL) return -1;
+            d->q = q, d->q_m = m;
+        }
+        d->q[d->q_end].end = end, d->q[d->q_end].off = off;
+        ++d->q_end;
+    }
+    if (++d->n_since < d->every) return 0;
+    l = &d->ref[tid];
+    // A sample is only worth keeping if it moves the smallest offset on
+    if (l->n > 0 && (l->a[l->n-1].pos == beg || l->a[l->n-1].loff == d->q[d->q_beg].off)) return 0;
+    if (l->n == l->m) {
+        int32_t m = l->m? l->m<<1 : 16;
+        dense_ent_t *a = (dense_ent_t*)realloc(l->a, m * sizeof(dense_ent_t));
+        if (a == NULL) return -1;
+        l->a = a, l->m = m;
+    }
+    l->a[l->n].pos = beg, l->a[l->n].loff = d->q[d->q_beg].off;
+    ++l->n;
+    d->n_since = 0;
+    return 0;
+}
+
 int hts_idx_push(hts_idx_t *idx, int tid, int beg, int end, uint64_t offset, int is_mapped)
 {
     int bin;
@@ -987,9 +1492,11 @@ int hts_idx_push(hts_idx_t *idx, int tid, int beg, int end, uint64_t offset, int
     }
     if ( tid>=0 )
     {
-        if (idx->bidx[tid] == 0) idx->bidx[tid] = kh_init(bin);
+        int new_tid = idx->bidx[tid] == 0;
+        if (new_tid) idx->bidx[tid] = kh_init(bin);
         if ( is_mapped)
             insert_to_l(&idx->lidx[tid], beg, end, idx->z.last_off, idx->min_shift); // last_off points to the start of the current record
+        if (idx->dense && dense_push(idx->dense, tid, beg, end, idx->z.last_off, new_tid) < 0) return -1;
     }
     else idx->n_no_coor++;
     bin = hts_reg2bin(beg, end, idx->min_shift, idx->n_lvls);
@@ -1014,6 +1521,406 @@ int hts_idx_push(hts_idx_t *idx, int tid, int beg, int end, uint64_t offset, int
     return 0;
 }
 
+/*
+ * Parallel indexing: the main thread gathers inflated blocks into jobs
+ * ending on record boundaries, workers parse each job's records, and the
+ * main thread pushes the results in order.  A record split between jobs
+ * is carried over to the start of the next one.
+ */
+
+#define IDX_JOB_SIZE (1<<20)  // approximate amount of inflated data per job
+
+typedef struct {
+    int64_t addr;   // compressed offset of the block
+    size_t beg;     // position in the job's data of...
+    int off;        // ...this offset within the block
+} idx_job_block_t;
+
+typedef struct {
+    hts_idx_rec_t r;
+    uint64_t end_off;  // virtual offset just past the record
+} idx_job_rec_t;
+
+typedef struct {
+    uint8_t *data;
+    size_t len, size, m_data;  // data[0..len) is complete records, of size bytes
+    idx_job_block_t *blocks;
+    int n_blocks, m_blocks;
+    int64_t end_addr;  // the block after the last, for offsets at the very end
+    hts_idx_parse_func *parse;
+    void *cb_data;
+    // Results
+    idx_job_rec_t *recs;
+    int n_recs, m_recs;
+    int failed;        // parse() rejected a record, which starts at stop_off
+    uint64_t stop_off;
+} idx_job_t;
+
+static void idx_job_free(idx_job_t *j)
+{
+    if (j == NULL) return;
+    free(j->data); free(j->blocks); free(j->recs); free(j);
+}
+
+static uint64_t idx_job_voffset(const idx_job_t *j, int *b, size_t pos)
+{
+    while (*b + 1 < j->n_blocks && j->blocks[*b + 1].beg <= pos) ++*b;
+    if (pos == j->size) return (uint64_t)j->end_addr << 16;
+    return (uint64_t)j->blocks[*b].addr << 16 | (j->blocks[*b].off + (pos - j->blocks[*b].beg));
+}
+
+static int idx_job_append(idx_job_t *j, int64_t addr, int off, const uint8_t *data, size_t len)
+{
+    if (j->size + len > j->m_data) {
+        size_t m = j->size + len + IDX_JOB_SIZE;
+        uint8_t *tmp = (uint8_t*)realloc(j->data, m);
+        if (tmp == NULL) return -1;
+        j->data = tmp, j->m_data = m;
+    }
+    if (j->n_blocks == j->m_blocks) {
+        int m = j->m_blocks? j->m_blocks<<1 : 32;
+        idx_job_block_t *tmp = (idx_job_block_t*)realloc(j->blocks, m * sizeof(idx_job_block_t));
+        if (tmp == NULL) return -1;
+        j->blocks = tmp, j->m_blocks = m;
+    }
+    j->blocks[j->n_blocks].addr = addr;
+    j->blocks[j->n_blocks].beg = j->size;
+    j->blocks[j->n_blocks++].off = off;
+    memcpy(j->data + j->size, data, len);
+    j->size += len;
+    return 0;
+}
+
+// Adds blocks until the job holds at least target bytes and the following
+// block has been loaded.  Returns 1, or 0 at end-of-file or on error.
+static int idx_job_fill(idx_job_t *j, BGZF *fp, size_t target)
+{
+    for (;;) {
+        if (fp->block_offset >= fp->block_length) {
+            if (bgzf_read_block(fp) < 0 || fp->block_length == 0) return 0;
+        }
+        if (j->size >= target) return 1;
+        if (idx_job_append(j, fp->block_address, fp->block_offset, (uint8_t*)fp->uncompressed_block + fp->block_offset, fp->block_length - fp->block_offset) < 0) return 0;
+        fp->block_offset = fp->block_length;
+    }
+}
+
+// Moves the incomplete record after j->len to the start of a new job
+static idx_job_t *idx_job_carry(idx_job_t *j)
+{
+    idx_job_t *next = (idx_job_t*)calloc(1, sizeof(idx_job_t));
+    int b = 0;
+    if (next == NULL) return NULL;
+    next->parse = j->parse;
+    next->cb_data = j->cb_data;
+    if (j->len == j->size) return next;
+    idx_job_voffset(j, &b, j->len);
+    for (; b < j->n_blocks; ++b) {
+        size_t beg = b+1 < j->n_blocks? j->blocks[b+1].beg : j->size;
+        size_t from = j->blocks[b].beg > j->len? j->blocks[b].beg : j->len;
+        if (idx_job_append(next, j->blocks[b].addr, j->blocks[b].off + (from - j->blocks[b].beg), j->data + from, beg - from) < 0) {
+            idx_job_free(next);
+            return NULL;
+        }
+    }
+    return next;
+}
+
+// Runs in a worker thread
+static void *idx_job_parse(void *arg)
+{
+    idx_job_t *j = (idx_job_t*)arg;
+    size_t pos = 0;
+    int b = 0;
+    while (pos < j->len) {
+        hts_idx_rec_t r;
+        int l = j->parse(j->cb_data, j->data + pos, j->len - pos, &r);
+        if (l <= 0) {
+            j->failed = 1;
+            j->stop_off = idx_job_voffset(j, &b, pos);
+            break;
+        }
+        pos += l;
+        if (r.tid == HTS_IDX_NONE) continue;
+        if (j->n_recs == j->m_recs) {
+            int m = j->m_recs? j->m_recs<<1 : 1024;
+            idx_job_rec_t *tmp = (idx_job_rec_t*)realloc(j->recs, m * sizeof(idx_job_rec_t));
+            if (tmp == NULL) {
+                j->failed = 1;
+                j->stop_off = idx_job_voffset(j, &b, pos - l);
+                break;
+            }
+            j->recs = tmp, j->m_recs = m;
+        }
+        j->recs[j->n_recs].r = r;
+        j->recs[j->n_recs++].end_off = idx_job_voffset(j, &b, pos);
+    }
+    return j;
+}
+
+int hts_idx_push_mt(hts_idx_t *idx, BGZF *fp, hts_tpool *tpool, hts_idx_split_func *split, hts_idx_parse_func *parse, hts_name2id_f getid, void *data)
+{
+    t_pool *pool = (t_pool*)tpool;
+    t_results_queue *q;
+    idx_job_t *cur;
+    uint64_t resume = bgzf_tell(fp); // the first record not yet pushed
+    int n_inflight = 0, max_inflight, stopped = 0, done = 0, ret = 0;
+
+    if (pool == NULL || fp->is_write || !fp->is_compressed || fp->is_gzip) return 0;
+    if ((q = t_results_queue_init()) == NULL) return 0;
+    if ((cur = (idx_job_t*)calloc(1, sizeof(idx_job_t))) == NULL) {
+        t_results_queue_destroy(q);
+        return 0;
+    }
+    cur->parse = parse;
+    cur->cb_data = data;
+    max_inflight = pool->tsize * 2;
+
+    for (;;) {
+        t_pool_result *r;
+        idx_job_t *j;
+        const char *last_name = NULL;
+        int i, last_tid = -1;
+
+        while (!stopped && n_inflight < max_inflight) {
+            size_t target = IDX_JOB_SIZE;
+            idx_job_t *next;
+            // Stop before the final block, which the caller handles serially
+            while (idx_job_fill(cur, fp, target) && (cur->len = split(data, cur->data, cur->size)) == 0)
+                target = cur->size + IDX_JOB_SIZE; // records longer than a job
+            if (cur->len == 0 || (next = idx_job_carry(cur)) == NULL) {
+                stopped = 1;
+                break;
+            }
+            cur->end_addr = fp->block_address;
+            if (t_pool_dispatch(pool, q, idx_job_parse, cur) < 0) {
+                idx_job_free(next);
+                stopped = 1;
+                break;
+            }
+            n_inflight++;
+            cur = next;
+        }
+        if (n_inflight == 0) break;
+
+        r = t_pool_next_result_wait(q);
+        j = (idx_job_t*)r->data;
+        t_pool_delete_result(r, 0);
+        n_inflight--;
+        if (done) { // discard jobs after a failure
+            idx_job_free(j);
+            continue;
+        }
+        for (i = 0; i < j->n_recs && ret == 0; ++i) {
+            hts_idx_rec_t *rec = &j->recs[i].r;
+            if (rec->name) {
+                if (last_name == NULL || strcmp(rec->name, last_name) != 0)
+                    last_tid = getid(data, rec->name), last_name = rec->name;
+                rec->tid = last_tid;
+            }
+            ret = hts_idx_push(idx, rec->tid, rec->beg, rec->end, j->recs[i].end_off, rec->is_mapped);
+        }
+        if (ret < 0 || j->failed) {
+            resume = j->stop_off;
+            stopped = done = 1;
+        } else {
+            int b = 0;
+            resume = idx_job_voffset(j, &b, j->len);
+        }
+        idx_job_free(j);
+    }
+    idx_job_free(cur);
+    t_results_queue_destroy(q);
+    if (ret < 0) return ret;
+    return bgzf_seek(fp, resume, SEEK_SET) < 0? -1 : 0;
+}
+
+static inline uint32_t lazy_u32(const uint8_t *p)
+{
+    uint32_t x;
+    memcpy(&x, p, 4);
+    return ed_is_big()? ed_swap_4(x) : x;
+}
+
+static inline uint64_t lazy_u64(const uint8_t *p)
+{
+    uint64_t x;
+    memcpy(&x, p, 8);
+    return ed_is_big()? ed_swap_8(x) : x;
+}
+
+// Finds where each reference's bins start in the raw index, checking that
+// the records fit, and reads n_no_coor from the end
+static int idx_lazy_scan(hts_idx_t *idx)
+{
+    idx_lazy_t *z = idx->lazy;
+    size_t p = 0, bin_size = (idx->fmt == HTS_FMT_CSI)? 16 : 8; // key, [loff,] n_chunk
+    uint32_t i, j, n_bin, n;
+    for (i = 0; i < (uint32_t)idx->n; ++i) {
+        z->off[i] = p;
+        if (z->size - p < 4) return -1;
+        n_bin = lazy_u32(z->data + p); p += 4;
+        for (j = 0; j < n_bin; ++j) {
+            if (z->size - p < bin_size) return -1;
+            n = lazy_u32(z->data + p + bin_size - 4); p += bin_size;
+            if ((z->size - p) / 16 < n) return -1;
+            p += (size_t)n * 16;
+        }
+        if (idx->fmt != HTS_FMT_CSI) { // linear index
+            if (z->size - p < 4) return -1;
+            n = lazy_u32(z->data + p); p += 4;
+            if ((z->size - p) / 8 < n) return -1;
+            p += (size_t)n * 8;
+        }
+    }
+    idx->n_no_coor = (z->size - p >= 8)? lazy_u64(z->data + p) : 0;
+    return 0;
+}
+
+// Decodes the bins and linear index of reference i, already checked by
+// idx_lazy_scan()
+static int idx_lazy_decode(hts_idx_t *idx, int i)
+{
+    const uint8_t *p = idx->lazy->data + idx->lazy->off[i];
+    bidx_t *h = kh_init(bin);
+    lidx_t *l = &idx->lidx[i];
+    uint32_t j, n_bin;
+    n_bin = lazy_u32(p); p += 4;
+    for (j = 0; j < n_bin; ++j) {
+        int absent, c;
+        bins_t *b;
+        khint_t k = kh_put(bin, h, lazy_u32(p), &absent);
+        if (absent <= 0) goto fail; // Duplicate bin number
+        b = &kh_val(h, k);
+        b->list = NULL;
+        if (idx->fmt == HTS_FMT_CSI) {
+            b->loff = lazy_u64(p + 4);
+            p += 8;
+        } else b->loff = 0;
+        b->n = b->m = lazy_u32(p + 4);
+        p += 8;
+        if ((b->list = (hts_pair64_t*)malloc(b->m * sizeof(hts_pair64_t))) == NULL) goto fail;
+        for (c = 0; c < b->n; ++c, p += 16)
+            b->list[c].u = lazy_u64(p), b->list[c].v = lazy_u64(p + 8);
+    }
+    if (idx->fmt != HTS_FMT_CSI) { // load linear index
+        uint32_t n = lazy_u32(p);
+        uint64_t *offset = (uint64_t*)malloc((n > 0? n : 1) * sizeof(uint64_t));
+        p += 4;
+        if (offset == NULL) goto fail;
+        for (j = 0; j < n; ++j, p += 8)
+            offset[j] = lazy_u64(p);
+        for (j = 1; j < n; ++j) // fill missing values; may happen given older samtools and tabix
+            if (offset[j] == 0) offset[j] = offset[j-1];
+        l->offset = offset;
+        l->n = l->m = n;
+    }
+    // Published only once complete, so a failure leaves nothing half-decoded
+    idx->bidx[i] = h;
+    if (idx->fmt != HTS_FMT_CSI) update_loff(idx, i, 1);
+    return 0;
+
+ fail:
+    for (j = kh_begin(h); j != kh_end(h); ++j)
+        if (kh_exist(h, j)) free(kh_val(h, j).list);
+    kh_destroy(bin, h);
+    return -1;
+}
+
+// Returns the bins of reference tid, decoding them on first use.  Queries
+// may run concurrently on a shared index, so this is serialised.
+static bidx_t *idx_bidx(const hts_idx_t *idx, int tid)
+{
+    idx_lazy_t *z = idx->lazy;
+    bidx_t *bidx;
+    if (z == NULL) return idx->bidx[tid];
+    pthread_mutex_lock(&z->lock);
+    if (idx->bidx[tid] == NULL && z->off[tid] != IDX_LAZY_FAILED) {
+        if (idx_lazy_decode((hts_idx_t*)idx, tid) < 0) {
+            if (hts_verbose >= 1) fprintf(stderr, "[E::%s] corrupted index for reference %d\n", __func__, tid);
+            z->off[tid] = IDX_LAZY_FAILED;
+        }
+    }
+    bidx = idx->bidx[tid];
+    pthread_mutex_unlock(&z->lock);
+    return bidx;
+}
+
+static void idx_lazy_destroy(idx_lazy_t *z)
+{
+    if (z == NULL) return;
+    if (z->hfp) hclose_abruptly(z->hfp);
+    free(z->buf);
+    free(z->off);
+    pthread_mutex_destroy(&z->lock);
+    free(z);
+}
+
+// Takes the rest of the index, after the header, for decoding on demand.
+// A memory-mapped BAI is used in place; otherwise it is read into memory,
+// inflating CSI and TBI, but no bins are decoded yet.
+static int idx_lazy_init(hts_idx_t *idx, BGZF *bgzf, hFILE *hfp)
+{
+    idx_lazy_t *z = (idx_lazy_t*)calloc(1, sizeof(idx_lazy_t));
+    size_t m = 0;
+    ssize_t got;
+    if (z == NULL) return -1;
+    pthread_mutex_init(&z->lock, NULL);
+    idx->lazy = z;
+    if ((z->off = (size_t*)malloc((idx->n? idx->n : 1) * sizeof(size_t))) == NULL) return -1;
+    if (hfp && hfp->mapped) {
+        off_t here = htell(hfp), size = hseek(hfp, 0, SEEK_END);
+        if (size >= here && hseek(hfp, here, SEEK_SET) == here
+            && (z->data = (const uint8_t*)hreadptr(hfp, size - here)) != NULL) {
+            z->size = size - here;
+            z->hfp = hfp;
+            return idx_lazy_scan(idx);
+        }
+    }
+    do {
+        if (m - z->size < 65536) {
+            uint8_t *tmp;
+            m = m? m<<1 : 1<<20;
+            if ((tmp = (uint8_t*)realloc(z->buf, m)) == NULL) return -1;
+            z->buf = tmp;
+        }
+        got = bgzf? bgzf_read(bgzf, z->buf + z->size, m - z->size)
+                  : hread(hfp, z->buf + z->size, m - z->size);
+        if (got < 0) return -1;
+        z->size += got;
+    } while (got > 0);
+    z->data = z->buf;
+    return idx_lazy_scan(idx);
+}
+
+static void idx_cache_destroy(idx_cache_t *c)
+{
+    int i;
+    if (c == NULL) return;
+    for (i = 0; i < c->n; ++i) free(c->ent[i].off);
+    free(c->ent);
+    pthread_mutex_destroy(&c->lock);
+    free(c);
+}
+
+int hts_idx_set_cache(hts_idx_t *idx, int n_entries)
+{
+    idx_cache_t *c = NULL;
+    if (idx == NULL || idx->fmt == HTS_FMT_CRAI || n_entries < 0) return -1;
+    if (n_entries > 0) {
+        if ((c = (idx_cache_t*)calloc(1, sizeof(idx_cache_t))) == NULL) return -1;
+        if ((c->ent = (idx_cache_ent_t*)calloc(n_entries, sizeof(idx_cache_ent_t))) == NULL) {
+            free(c);
+            return -1;
+        }
+        c->n = n_entries;
+        pthread_mutex_init(&c->lock, NULL);
+    }
+    idx_cache_destroy(idx->cache);
+    idx->cache = c;
+    return 0;
+}
+
 void hts_idx_destroy(hts_idx_t *idx)
 {
     khint_t k;
@@ -1032,15 +1939,12 @@ void hts_idx_destroy(hts_idx_t *idx)
         kh_destroy(bin, bidx);
     }
     free(idx->bidx); free(idx->lidx); free(idx->meta);
+    idx_lazy_destroy(idx->lazy);
+    idx_cache_destroy(idx->cache);
+    idx_dense_destroy(idx->dense);
     free(idx);
 }
 
-static inline long idx_read(int is_bgzf, void *fp, void *buf, long l)
-{
-    if (is_bgzf) return bgzf_read((BGZF*)fp, buf, l);
-    else return (long)fread(buf, 1, l, (FILE*)fp);
-}
-
 static inline long idx_write(int is_bgzf, void *fp, const void *buf, long l)
 {
     if (is_bgzf) return bgzf_write((BGZF*)fp, buf, l);
@@ -1120,96 +2024,231 @@ write_lidx:
     } else idx_write(is_bgzf, fp, &idx->n_no_coor, 8);
 }
 
-void hts_idx_save(const hts_idx_t *idx, const char *fn, int fmt)
+static inline uint8_t *dense_put(uint8_t *p, uint64_t x, int len)
+{
+    int i;
+    for (i = 0; i < len; ++i) *p++ = x >> (8 * i);
+    return p;
+}
+
+// Encodes the dense linear index for appending to a CSI's meta, as
+//   for each reference: int32 n, then n * (int32 pos, uint64 loff)
+//   int32 n_ref, int32 every, uint32 length of the above, char[4] magic
+// all little-endian.  Readers not knowing of it see it as part of the meta.
+static uint8_t *dense_encode(const hts_idx_t *idx, size_t *len)
+{
+    const idx_dense_t *d = idx->dense;
+    size_t l = 0;
+    uint8_t *buf, *p;
+    int i, j;
+    for (i = 0; i < idx->n; ++i) l += 4 + (i < d->n_ref? 12 * (size_t)d->ref[i].n : 0);
+    if ((buf = (uint8_t*)malloc(l + 16)) == NULL) { *len = 0; return NULL; }
+    for (i = 0, p = buf; i < idx->n; ++i) {
+        const dense_list_t *r = i < d->n_ref? &d->ref[i] : NULL;
+        p = dense_put(p, r? r->n : 0, 4);
+        for (j = 0; r && j < r->n; ++j) {
+            p = dense_put(p, (uint32_t)r->a[j].pos, 4);
+            p = dense_put(p, r->a[j].loff, 8);
+        }
+    }
+    p = dense_put(p, idx->n, 4);
+    p = dense_put(p, d->every, 4);
+    p = dense_put(p, l, 4);
+    memcpy(p, DENSE_MAGIC, 4);
+    *len = l + 16;
+    return buf;
+}
+
+// Takes the dense linear index, if any, off the end of a loaded CSI's meta
+static int dense_decode(hts_idx_t *idx)
+{
+    const uint8_t *p, *end;
+    uint32_t l, n_ref;
+    idx_dense_t *d;
+    int i, j;
+    if (idx->l_meta < 16 || memcmp(idx->meta + idx->l_meta - 4, DENSE_MAGIC, 4) != 0) return 0;
+    end = idx->meta + idx->l_meta - 16;
+    n_ref = lazy_u32(end);
+    l = lazy_u32(end + 8);
+    if (l > idx->l_meta - 16 || n_ref > l / 4) return -1;
+    if ((d = (idx_dense_t*)calloc(1, sizeof(idx_dense_t))) == NULL) return -1;
+    d->every = lazy_u32(end + 4);
+    idx->dense = d;
+    if (n_ref && (d->ref = (dense_list_t*)calloc(n_ref, sizeof(dense_list_t))) == NULL) return -1;
+    d->n_ref = n_ref;
+    for (i = 0, p = end - l; i < d->n_ref; ++i) {
+        dense_list_t *r = &d->ref[i];
+        if (end - p < 4) return -1;
+        r->n = r->m = lazy_u32(p);
+        p += 4;
+        if (r->n < 0 || (end - p) / 12 < r->n) return -1;
+        if (r->n && (r->a = (dense_ent_t*)malloc(r->n * sizeof(dense_ent_t))) == NULL) return -1;
+        for (j = 0; j < r->n; ++j, p += 12) {
+            r->a[j].pos = lazy_u32(p);
+            r->a[j].loff = lazy_u64(p + 4);
+        }
+    }
+    idx->l_meta -= l + 16;
+    if (idx->l_meta == 0) { free(idx->meta); idx->meta = NULL; }
+    return 0;
+}
+
+int hts_idx_save(const hts_idx_t *idx, const char *fn, int fmt)
 {
     char *fnidx;
-    fnidx = (char*)calloc(1, strlen(fn) + 5);
+    int i, ret = 0;
+    // Every reference must be decoded, lest one that failed be saved as empty
+    for (i = 0; idx->lazy && i < idx->n; ++i) {
+        if (idx_bidx(idx, i) == NULL && idx->lazy->off[i] == IDX_LAZY_FAILED) {
+            if (hts_verbose >= 1)
+                fprintf(stderr, "[E::%s] not saving the index of %s, as reference %d could not be decoded\n", __func__, fn, i);
+            return -1;
+        }
+    }
+    if ((fnidx = (char*)calloc(1, strlen(fn) + 5)) == NULL) return -1;
     strcpy(fnidx, fn);
     if (fmt == HTS_FMT_CSI) {
         BGZF *fp;
         uint32_t x[3];
         int is_be, i;
         is_be = ed_is_big();
-        fp = bgzf_open(strcat(fnidx, ".csi"), "w");
+        size_t l_dense = 0;
+        uint8_t *dense = idx->dense? dense_encode(idx, &l_dense) : NULL;
+        if ((fp = bgzf_open(strcat(fnidx, ".csi"), "w")) == NULL) {
+            free(dense);
+            goto fail;
+        }
         bgzf_write(fp, "CSI\1", 4);
-        x[0] = idx->min_shift; x[1] = idx->n_lvls; x[2] = idx->l_meta;
+        x[0] = idx->min_shift; x[1] = idx->n_lvls; x[2] = idx->l_meta + l_dense;
         if (is_be) {
             for (i = 0; i < 3; ++i)
                 bgzf_write(fp, ed_swap_4p(&x[i]), 4);
         } else bgzf_write(fp, &x, 12);
         if (idx->l_meta) bgzf_write(fp, idx->meta, idx->l_meta);
+        if (l_dense) bgzf_write(fp, dense, l_dense);
+        free(dense);
         hts_idx_save_core(idx, fp, HTS_FMT_CSI);
-        bgzf_close(fp);
+        if (bgzf_close(fp) < 0) ret = -1;
     } else if (fmt == HTS_FMT_TBI) {
         BGZF *fp;
-        fp = bgzf_open(strcat(fnidx, ".tbi"), "w");
+        if ((fp = bgzf_open(strcat(fnidx, ".tbi"), "w")) == NULL) goto fail;
         bgzf_write(fp, "TBI\1", 4);
         hts_idx_save_core(idx, fp, HTS_FMT_TBI);
-        bgzf_close(fp);
+        if (bgzf_close(fp) < 0) ret = -1;
     } else if (fmt == HTS_FMT_BAI) {
         FILE *fp;
-        fp = fopen(strcat(fnidx, ".bai"), "w");
+        if ((fp = fopen(strcat(fnidx, ".bai"), "w")) == NULL) goto fail;
         fwrite("BAI\1", 1, 4, fp);
         hts_idx_save_core(idx, fp, HTS_FMT_BAI);
-        fclose(fp);
+        if (fclose(fp) != 0) ret = -1;
     } else abort();
+    if (ret < 0 && hts_verbose >= 1) fprintf(stderr, "[E::%s] failed to write %s\n", __func__, fnidx);
+    free(fnidx);
+    return ret;
+
+ fail:
+    if (hts_verbose >= 1) fprintf(stderr, "[E::%s] could not open %s\n", __func__, fnidx);
     free(fnidx);
+    return -1;
 }
 
-static int hts_idx_load_core(hts_idx_t *idx, void *fp, int fmt)
+typedef struct {
+    uint64_t off;
+    int tid;
+} ref_off_t;
+
+static int cmp_ref_off(const void *av, const void *bv)
 {
-    int32_t i, n, is_be;
-    int is_bgzf = (fmt != HTS_FMT_BAI);
-    is_be = ed_is_big();
-    if (idx == NULL) return -4;
+    const ref_off_t *a = (const ref_off_t *) av, *b = (const ref_off_t *) bv;
+    return a->off < b->off? -1 : a->off > b->off;
+}
+
+// The VCF index made by bcf_idx_init() numbers the references as the header
+// does.  Renumber them in the order their records start in the file, as
+// tabix numbers them as it finds them, dropping those with no records along
+// with their names in the tabix meta data.
+static int idx_renumber_refs(hts_idx_t *idx)
+{
+    uint8_t *name = idx->meta + 28, *end = idx->meta + idx->l_meta, *meta = NULL, **names = NULL;
+    ref_off_t *refs = NULL;
+    bidx_t **bidx = NULL;
+    lidx_t *lidx = NULL;
+    uint32_t l_nm = 0;
+    int i, n = 0;
+
+    if (idx->l_meta < 28 || idx->dense || idx->n == 0) return 0;
+    if (!(names = (uint8_t**)malloc(idx->n * sizeof(uint8_t*)))) goto fail;
+    for (i = 0; i < idx->n; ++i, name += strlen((char *) name) + 1) {
+        if (name >= end || !memchr(name, 0, end - name)) { // not one name per reference
+            free(names);
+            return 0;
+        }
+        names[i] = name;
+    }
+    if (!(refs = (ref_off_t*)malloc(idx->n * sizeof(ref_off_t)))
+        || !(bidx = (bidx_t**)calloc(idx->n, sizeof(bidx_t*)))
+        || !(lidx = (lidx_t*)calloc(idx->n, sizeof(lidx_t)))
+        || !(meta = (uint8_t*)malloc(idx->l_meta))) goto fail;
     for (i = 0; i < idx->n; ++i) {
-        bidx_t *h;
-        lidx_t *l = &idx->lidx[i];
-        uint32_t key;
-        int j, absent;
-        bins_t *p;
-        h = idx->bidx[i] = kh_init(bin);
-        if (idx_read(is_bgzf, fp, &n, 4) != 4) return -1;
-        if (is_be) ed_swap_4p(&n);
-        for (j = 0; j < n; ++j) {
-            khint_t k;
-            if (idx_read(is_bgzf, fp, &key, 4) != 4) return -1;
-            if (is_be) ed_swap_4p(&key);
-            k = kh_put(bin, h, key, &absent);
-            if (absent <= 0) return -3; // Duplicate bin number
-            p = &kh_val(h, k);
-            if (fmt == HTS_FMT_CSI) {
-                if (idx_read(is_bgzf, fp, &p->loff, 8) != 8) return -1;
-                if (is_be) ed_swap_8p(&p->loff);
-            } else p->loff = 0;
-            if (idx_read(is_bgzf, fp, &p->n, 4) != 4) return -1;
-            if (is_be) ed_swap_4p(&p->n);
-            p->m = p->n;
-            p->list = (hts_pair64_t*)malloc(p->m * sizeof(hts_pair64_t));
-            if (p->list == NULL) return -2;
-            if (idx_read(is_bgzf, fp, p->list, p->n<<4) != p->n<<4) return -1;
-            if (is_be) swap_bins(p);
-        }
-        if (fmt != HTS_FMT_CSI) { // load linear index
-            int j;
-            if (idx_read(is_bgzf, fp, &l->n, 4) != 4) return -1;
-            if (is_be) ed_swap_4p(&l->n);
-            l->m = l->n;
-            l->offset = (uint64_t*)malloc(l->n * sizeof(uint64_t));
-            if (l->offset == NULL) return -2;
-            if (idx_read(is_bgzf, fp, l->offset, l->n << 3) != l->n << 3) return -1;
-            if (is_be) for (j = 0; j < l->n; ++j) ed_swap_8p(&l->offset[j]);
-            for (j = 1; j < l->n; ++j) // fill missing values; may happen given older samtools and tabix
-                if (l->offset[j] == 0) l->offset[j] = l->offset[j-1];
-            update_loff(idx, i, 1);
-        }
-    }
-    if (idx_read(is_bgzf, fp, &idx->n_no_coor, 8) != 8) idx->n_no_coor = 0;
-    if (is_be) ed_swap_8p(&idx->n_no_coor);
+        khint_t k;
+        if (!idx->bidx[i]) continue;
+        k = kh_get(bin, idx->bidx[i], META_BIN(idx));
+        refs[n].off = k != kh_end(idx->bidx[i])? kh_val(idx->bidx[i], k).list[0].u : 0;
+        refs[n++].tid = i;
+    }
+    qsort(refs, n, sizeof(ref_off_t), cmp_ref_off);
+
+    memcpy(meta, idx->meta, 28);
+    for (i = 0; i < n; ++i) {
+        size_t l = strlen((char *) names[refs[i].tid]) + 1;
+        memcpy(meta + 28 + l_nm, names[refs[i].tid], l);
+        l_nm += l;
+        bidx[i] = idx->bidx[refs[i].tid];
+        lidx[i] = idx->lidx[refs[i].tid];
+    }
+    for (i = 0; i < idx->n; ++i)
+        if (!idx->bidx[i]) free(idx->lidx[i].offset);
+    memcpy(idx->bidx, bidx, idx->n * sizeof(bidx_t*));
+    memcpy(idx->lidx, lidx, idx->n * sizeof(lidx_t));
+    idx->n = n;
+    free(idx->meta);
+    idx->meta = meta;
+    idx->l_meta = 28 + l_nm;
+    if (ed_is_big()) ed_swap_4p(&l_nm);
+    memcpy(idx->meta + 24, &l_nm, 4);
+    free(names); free(refs); free(bidx); free(lidx);
     return 0;
+
+ fail:
+    if (hts_verbose >= 1) fprintf(stderr, "[E::%s] out of memory\n", __func__);
+    free(names); free(refs); free(bidx); free(lidx); free(meta);
+    return -1;
 }
 
-hts_idx_t *hts_idx_load_local(const char *fn, int fmt)
+// Finish and save the index built by sam_idx_init() or bcf_idx_init()
+static int hts_idx_close(htsFile *fp)
+{
+    BGZF *bgzf = fp->fp.bgzf;
+    int ret = bgzf_idx_flush(bgzf);
+    if (ret == 0) {
+        // End where the offline builders do, so the indexes are identical:
+        // bam_index() and bcf_index() read past the 28-byte EOF marker that
+        // bgzf_close() is about to write, while tbx_index() stops at its start
+        uint64_t eof = fp->is_bin? (uint64_t)28 << 16 : 0;
+        hts_idx_finish(fp->idx, bgzf_tell(bgzf) + eof);
+        if (!fp->is_bin) ret = idx_renumber_refs(fp->idx);
+        if (ret == 0) ret = hts_idx_save(fp->idx, fp->fn, fp->idx->fmt);
+    }
+    if (ret < 0 && hts_verbose >= 1)
+        fprintf(stderr, "[E::%s] failed to build the index for %s\n", __func__, fp->fn);
+    hts_idx_destroy(fp->idx);
+    fp->idx = NULL;
+    return ret;
+}
+
+// Loads an index file, opening it with mode "r", or "rm" to decode a BAI
+// from a mapping of the file
+static hts_idx_t *idx_load_local(const char *fn, int fmt, const char *mode)
 {
     uint8_t magic[4];
     int i, is_be;
@@ -1219,7 +2258,7 @@ hts_idx_t *hts_idx_load_local(const char *fn, int fmt)
         BGZF *fp;
         uint32_t x[3], n;
         uint8_t *meta = 0;
-        if ((fp = bgzf_open(fn, "r")) == 0) return NULL;
+        if ((fp = bgzf_open(fn, mode)) == 0) return NULL;
         if (bgzf_read(fp, magic, 4) != 4) goto csi_fail;
         if (memcmp(magic, "CSI\1", 4) != 0) goto csi_fail;
         if (bgzf_read(fp, x, 12) != 12) goto csi_fail;
@@ -1234,7 +2273,8 @@ hts_idx_t *hts_idx_load_local(const char *fn, int fmt)
         idx->l_meta = x[2];
         idx->meta = meta;
         meta = NULL;
-        if (hts_idx_load_core(idx, fp, HTS_FMT_CSI) < 0) goto csi_fail;
+        if (dense_decode(idx) < 0) goto csi_fail;
+        if (idx_lazy_init(idx, fp, NULL) < 0) goto csi_fail;
         bgzf_close(fp);
         return idx;
 
@@ -1247,7 +2287,7 @@ hts_idx_t *hts_idx_load_local(const char *fn, int fmt)
     } else if (fmt == HTS_FMT_TBI) {
         BGZF *fp;
         uint32_t x[8];
-        if ((fp = bgzf_open(fn, "r")) == 0) return NULL;
+        if ((fp = bgzf_open(fn, mode)) == 0) return NULL;
         if (bgzf_read(fp, magic, 4) != 4) goto tbi_fail;
         if (memcmp(magic, "TBI\1", 4) != 0) goto tbi_fail;
         if (bgzf_read(fp, x, 32) != 32) goto tbi_fail;
@@ -1257,7 +2297,7 @@ hts_idx_t *hts_idx_load_local(const char *fn, int fmt)
         if ((idx->meta = (uint8_t*)malloc(idx->l_meta)) == NULL) goto tbi_fail;
         memcpy(idx->meta, &x[1], 28);
         if (bgzf_read(fp, idx->meta + 28, x[7]) != x[7]) goto tbi_fail;
-        if (hts_idx_load_core(idx, fp, HTS_FMT_TBI) < 0) goto tbi_fail;
+        if (idx_lazy_init(idx, fp, NULL) < 0) goto tbi_fail;
         bgzf_close(fp);
         return idx;
 
@@ -1268,25 +2308,31 @@ hts_idx_t *hts_idx_load_local(const char *fn, int fmt)
 
     } else if (fmt == HTS_FMT_BAI) {
         uint32_t n;
-        FILE *fp;
-        if ((fp = fopen(fn, "rb")) == 0) return NULL;
-        if (fread(magic, 1, 4, fp) != 4) goto bai_fail;
+        hFILE *fp;
+        if ((fp = hopen(fn, mode)) == 0) return NULL;
+        if (hread(fp, magic, 4) != 4) goto bai_fail;
         if (memcmp(magic, "BAI\1", 4) != 0) goto bai_fail;
-        if (fread(&n, 4, 1, fp) != 1) goto bai_fail;
+        if (hread(fp, &n, 4) != 4) goto bai_fail;
         if (is_be) ed_swap_4p(&n);
-        idx = hts_idx_init(n, fmt, 0, 14, 5);
-        if (hts_idx_load_core(idx, fp, HTS_FMT_BAI) < 0) goto bai_fail;
-        fclose(fp);
+        if ((idx = hts_idx_init(n, fmt, 0, 14, 5)) == NULL) goto bai_fail;
+        if (idx_lazy_init(idx, NULL, fp) < 0) goto bai_fail;
+        // A mapped index is decoded from the mapping, so stays open
+        if (idx->lazy->hfp == NULL) hclose_abruptly(fp);
         return idx;
 
     bai_fail:
-        fclose(fp);
+        if (idx == NULL || idx->lazy == NULL || idx->lazy->hfp == NULL) hclose_abruptly(fp);
         hts_idx_destroy(idx);
         return NULL;
 
     } else abort();
 }
 
+hts_idx_t *hts_idx_load_local(const char *fn, int fmt)
+{
+    return idx_load_local(fn, fmt, "r");
+}
+
 void hts_idx_set_meta(hts_idx_t *idx, int l_meta, uint8_t *meta, int is_copy)
 {
     if (idx->meta) free(idx->meta);
@@ -1315,8 +2361,9 @@ const char **hts_idx_seqnames(const hts_idx_t *idx, int *n, hts_id2name_f getid,
     const char **names = (const char**) calloc(idx->n,sizeof(const char*));
     for (i=0; i<idx->n; i++)
     {
+        // Loaded references all have bins, so need not be decoded here
         bidx_t *bidx = idx->bidx[i];
-        if ( !bidx ) continue;
+        if ( !bidx && !idx->lazy ) continue;
         names[tid++] = getid(hdr,i);
     }
     *n = tid;
@@ -1330,9 +2377,9 @@ int hts_idx_get_stat(const hts_idx_t* idx, int tid, uint64_t* mapped, uint64_t*
         return -1;
     }
 
-    bidx_t *h = idx->bidx[tid];
-    khint_t k = kh_get(bin, h, META_BIN(idx));
-    if (k != kh_end(h)) {
+    bidx_t *h = (tid >= 0 && tid < idx->n)? idx_bidx(idx, tid) : NULL;
+    khint_t k = h? kh_get(bin, h, META_BIN(idx)) : 0;
+    if (h && k != kh_end(h)) {
         *mapped = kh_val(h, k).list[1].u;
         *unmapped = kh_val(h, k).list[1].v;
         return 0;
@@ -1369,13 +2416,143 @@ static inline int reg2bins(int64_t beg, int64_t end, hts_itr_t *itr, int min_shi
     return itr->bins.n;
 }
 
+static int itr_grow_off(hts_pair64_t **off, int *m_off, int n)
+{
+    if (n > *m_off) {
+        int m = n;
+        hts_pair64_t *tmp;
+        kroundup32(m);
+        if ((tmp = (hts_pair64_t*)realloc(*off, m * sizeof(hts_pair64_t))) == NULL) return -1;
+        *off = tmp, *m_off = m;
+    }
+    return 0;
+}
+
+// Returns the index of the last dense linear index sample at or before beg
+// on tid, or -1 if there is none
+static int dense_find(const hts_idx_t *idx, int tid, int beg)
+{
+    const dense_list_t *r;
+    int lo = 0, hi;
+    if (idx->dense == NULL || tid >= idx->dense->n_ref) return -1;
+    r = &idx->dense->ref[tid];
+    hi = r->n;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (r->a[mid].pos <= beg) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo - 1;
+}
+
+// Appends the chunks that may hold records overlapping tid:beg-end to *off,
+// using iter->bins as workspace.  Returns 0, or -1 on error.
+static int itr_add_chunks(const hts_idx_t *idx, int tid, int beg, int end, hts_itr_t *iter, hts_pair64_t **off, int *n_off, int *m_off)
+{
+    int i, bin;
+    khint_t k;
+    bidx_t *bidx = idx_bidx(idx, tid);
+    uint64_t min_off, dense_off = 0;
+
+    // compute min_off
+    bin = hts_bin_first(idx->n_lvls) + (beg>>idx->min_shift);
+    do {
+        int first;
+        k = kh_get(bin, bidx, bin);
+        if (k != kh_end(bidx)) break;
+        first = (hts_bin_parent(bin)<<3) + 1;
+        if (bin > first) --bin;
+        else bin = hts_bin_parent(bin);
+    } while (bin);
+    if (bin == 0) k = kh_get(bin, bidx, bin);
+    min_off = k != kh_end(bidx)? kh_val(bidx, k).loff : 0;
+    // and the dense linear index, whose offset also starts chunks part way
+    if ((i = dense_find(idx, tid, beg)) >= 0) dense_off = idx->dense->ref[tid].a[i].loff;
+    if (min_off < dense_off) min_off = dense_off;
+    // retrieve bins
+    iter->bins.n = 0;
+    reg2bins(beg, end, iter, idx->min_shift, idx->n_lvls);
+    for (i = 0; i < iter->bins.n; ++i) {
+        if ((k = kh_get(bin, bidx, iter->bins.a[i])) != kh_end(bidx)) {
+            int j;
+            bins_t *p = &kh_value(bidx, k);
+            if (itr_grow_off(off, m_off, *n_off + p->n) < 0) return -1;
+            for (j = 0; j < p->n; ++j)
+                if (p->list[j].v > min_off) {
+                    (*off)[*n_off] = p->list[j];
+                    if ((*off)[*n_off].u < dense_off) (*off)[*n_off].u = dense_off;
+                    ++*n_off;
+                }
+        }
+    }
+    return 0;
+}
+
+// Sorts chunks and merges overlapping and adjacent ones, returning the new count
+static int merge_chunks(hts_pair64_t *off, int n_off)
+{
+    int i, l;
+    ks_introsort(_off, n_off, off);
+    // resolve completely contained adjacent blocks
+    for (i = 1, l = 0; i < n_off; ++i)
+        if (off[l].v < off[i].v) off[++l] = off[i];
+    n_off = l + 1;
+    // resolve overlaps between adjacent blocks; this may happen due to the merge in indexing
+    for (i = 1; i < n_off; ++i)
+        if (off[i-1].v >= off[i].u) off[i-1].v = off[i].u;
+    // merge adjacent blocks
+    for (i = 1, l = 0; i < n_off; ++i) {
+        if (off[l].v>>16 == off[i].u>>16) off[l].v = off[i].v;
+        else off[++l] = off[i];
+    }
+    return l + 1;
+}
+
+// Fills *off, of capacity *m_off, with the merged chunks for tid:beg-end,
+// consulting and updating the index's cache if it has one.  Returns the
+// number of chunks, or -1 on error.
+static int itr_chunks(const hts_idx_t *idx, int tid, int beg, int end, hts_itr_t *iter, hts_pair64_t **off, int *m_off)
+{
+    idx_cache_t *c = idx->cache;
+    idx_cache_ent_t *e = NULL;
+    int n_off = 0, wbeg = 0, wend = 0, dense = 0;
+
+    if (c && beg < end) {
+        wbeg = beg >> idx->min_shift, wend = (end - 1) >> idx->min_shift;
+        dense = dense_find(idx, tid, beg);
+        e = &c->ent[((uint32_t)tid * 2654435761U ^ (uint32_t)wbeg * 40503U ^ (uint32_t)wend ^ (uint32_t)dense * 97U) % (uint32_t)c->n];
+        pthread_mutex_lock(&c->lock);
+        if (e->off && e->tid == tid && e->wbeg == wbeg && e->wend == wend && e->dense == dense) {
+            n_off = e->n_off;
+            if (itr_grow_off(off, m_off, n_off) < 0) n_off = -1;
+            else memcpy(*off, e->off, n_off * sizeof(hts_pair64_t));
+            pthread_mutex_unlock(&c->lock);
+            return n_off;
+        }
+        pthread_mutex_unlock(&c->lock);
+    }
+
+    if (itr_add_chunks(idx, tid, beg, end, iter, off, &n_off, m_off) < 0) return -1;
+    if (n_off > 0) n_off = merge_chunks(*off, n_off);
+
+    if (e) {
+        // Cache misses are not fatal, so the entry is simply left empty
+        hts_pair64_t *copy = (hts_pair64_t*)malloc((n_off? n_off : 1) * sizeof(hts_pair64_t));
+        if (copy) memcpy(copy, *off, n_off * sizeof(hts_pair64_t));
+        pthread_mutex_lock(&c->lock);
+        free(e->off);
+        e->tid = tid, e->wbeg = wbeg, e->wend = wend, e->dense = dense, e->n_off = n_off;
+        e->off = copy;
+        pthread_mutex_unlock(&c->lock);
+    }
+    return n_off;
+}
+
 hts_itr_t *hts_itr_query(const hts_idx_t *idx, int tid, int beg, int end, hts_readrec_func *readrec)
 {
-    int i, n_off, l, bin;
+    int i, n_off, m_off;
     hts_pair64_t *off;
-    khint_t k;
     bidx_t *bidx;
-    uint64_t min_off;
     hts_itr_t *iter = 0;
     if (tid < 0) {
         int finished0 = 0;
@@ -1386,7 +2563,7 @@ hts_itr_t *hts_itr_query(const hts_idx_t *idx, int tid, int beg, int end, hts_re
             // Find the smallest offset, note that sequence ids may not be ordered sequentially
             for (i=0; i<idx->n; i++)
             {
-                bidx = idx->bidx[i];
+                if ((bidx = idx_bidx(idx, i)) == NULL) continue;
                 k = kh_get(bin, bidx, META_BIN(idx));
                 if (k == kh_end(bidx)) continue;
                 if ( off0 > kh_val(bidx, k).list[0].u ) off0 = kh_val(bidx, k).list[0].u;
@@ -1395,9 +2572,8 @@ hts_itr_t *hts_itr_query(const hts_idx_t *idx, int tid, int beg, int end, hts_re
             break;
 
         case HTS_IDX_NOCOOR:
-            if ( idx->n>0 )
+            if ( idx->n>0 && (bidx = idx_bidx(idx, idx->n - 1)) != NULL )
             {
-                bidx = idx->bidx[idx->n - 1];
                 k = kh_get(bin, bidx, META_BIN(idx));
                 if (k != kh_end(bidx)) off0 = kh_val(bidx, k).list[0].v;
             }
@@ -1428,63 +2604,212 @@ hts_itr_t *hts_itr_query(const hts_idx_t *idx, int tid, int beg, int end, hts_re
 
     if (beg < 0) beg = 0;
     if (end < beg) return 0;
-    if (tid >= idx->n || (bidx = idx->bidx[tid]) == NULL) return 0;
+    if (tid >= idx->n || (bidx = idx_bidx(idx, tid)) == NULL) return 0;
 
     iter = (hts_itr_t*)calloc(1, sizeof(hts_itr_t));
     iter->tid = tid, iter->beg = beg, iter->end = end; iter->i = -1;
+    iter->prev_tid = -1;
     iter->readrec = readrec;
 
-    // compute min_off
-    bin = hts_bin_first(idx->n_lvls) + (beg>>idx->min_shift);
-    do {
-        int first;
-        k = kh_get(bin, bidx, bin);
-        if (k != kh_end(bidx)) break;
-        first = (hts_bin_parent(bin)<<3) + 1;
-        if (bin > first) --bin;
-        else bin = hts_bin_parent(bin);
-    } while (bin);
-    if (bin == 0) k = kh_get(bin, bidx, bin);
-    min_off = k != kh_end(bidx)? kh_val(bidx, k).loff : 0;
-    // retrieve bins
-    reg2bins(beg, end, iter, idx->min_shift, idx->n_lvls);
-    for (i = n_off = 0; i < iter->bins.n; ++i)
-        if ((k = kh_get(bin, bidx, iter->bins.a[i])) != kh_end(bidx))
-            n_off += kh_value(bidx, k).n;
-    if (n_off == 0) return iter;
-    off = (hts_pair64_t*)calloc(n_off, sizeof(hts_pair64_t));
-    for (i = n_off = 0; i < iter->bins.n; ++i) {
-        if ((k = kh_get(bin, bidx, iter->bins.a[i])) != kh_end(bidx)) {
-            int j;
-            bins_t *p = &kh_value(bidx, k);
-            for (j = 0; j < p->n; ++j)
-                if (p->list[j].v > min_off) off[n_off++] = p->list[j];
-        }
+    off = NULL;
+    m_off = 0;
+    if ((n_off = itr_chunks(idx, tid, beg, end, iter, &off, &m_off)) < 0) {
+        free(off);
+        hts_itr_destroy(iter);
+        return 0;
     }
     if (n_off == 0) {
         free(off); return iter;
     }
-    ks_introsort(_off, n_off, off);
-    // resolve completely contained adjacent blocks
-    for (i = 1, l = 0; i < n_off; ++i)
-        if (off[l].v < off[i].v) off[++l] = off[i];
-    n_off = l + 1;
-    // resolve overlaps between adjacent blocks; this may happen due to the merge in indexing
-    for (i = 1; i < n_off; ++i)
-        if (off[i-1].v >= off[i].u) off[i-1].v = off[i].u;
-    // merge adjacent blocks
-    for (i = 1, l = 0; i < n_off; ++i) {
-        if (off[l].v>>16 == off[i].u>>16) off[l].v = off[i].v;
-        else off[++l] = off[i];
+    iter->n_off = n_off; iter->off = off; iter->m_off = m_off;
+    return iter;
+}
+
+// Trims the parts of the chunks in off[] that lie within the chunks in
+// done[], which have already been read.  Both are sorted; a chunk of off[]
+// that would be split is left whole.  Returns the new number of chunks.
+static int itr_trim_chunks(hts_pair64_t *off, int n_off, const hts_pair64_t *done, int n_done)
+{
+    int i, j = 0, k = 0;
+    for (i = 0; i < n_off; ++i) {
+        uint64_t u = off[i].u, v = off[i].v;
+        while (j < n_done && done[j].v <= u) ++j;
+        while (j < n_done && done[j].u <= u && u < done[j].v) {
+            u = done[j].v;
+            if (j + 1 < n_done && done[j+1].u <= u) ++j;
+            else break;
+        }
+        while (j < n_done && done[j].v <= u) ++j;
+        if (j < n_done && done[j].u < v && v <= done[j].v) v = done[j].u;
+        if (u < v) off[k].u = u, off[k++].v = v;
+    }
+    return k;
+}
+
+int hts_itr_requery(const hts_idx_t *idx, hts_itr_t *iter, int tid, int beg, int end)
+{
+    int n_off, n_done = 0;
+    hts_pair64_t *done = NULL;
+    if (iter->read_rest || iter->multi || tid < 0 || idx->fmt == HTS_FMT_CRAI) return -1;
+    if (beg < 0) beg = 0;
+    if (end < beg) return -1;
+
+    // A monotonic iterator moving forwards does not read again the chunks
+    // read for the previous region, up to the last record it read, and
+    // skips records already returned for earlier regions
+    if (iter->monotonic && (tid > iter->tid || (tid == iter->tid && beg >= iter->beg))) {
+        if (tid != iter->tid) iter->prev_tid = -1;
+        else if (iter->prev_tid != tid) iter->prev_tid = tid, iter->prev_end = iter->end;
+        else if (iter->prev_end < iter->end) iter->prev_end = iter->end;
+        if (iter->i >= 0 && iter->i < iter->n_off) {
+            n_done = iter->i + 1;
+            if ((done = (hts_pair64_t*)malloc(n_done * sizeof(hts_pair64_t))) == NULL) return -1;
+            memcpy(done, iter->off, n_done * sizeof(hts_pair64_t));
+            if (done[n_done-1].v > iter->rec_off) done[n_done-1].v = iter->rec_off;
+        }
+    }
+    else iter->prev_tid = -1;
+
+    iter->tid = tid, iter->beg = beg, iter->end = end; iter->i = -1;
+    iter->curr_off = 0;
+    iter->n_fetched = 0;
+    iter->finished = 0;
+    if (tid >= idx->n || idx_bidx(idx, tid) == NULL) n_off = 0;
+    else if ((n_off = itr_chunks(idx, tid, beg, end, iter, &iter->off, &iter->m_off)) < 0) {
+        free(done);
+        iter->n_off = 0;
+        iter->finished = 1;
+        return -1;
+    }
+    if (n_done > 0) n_off = itr_trim_chunks(iter->off, n_off, done, n_done);
+    free(done);
+    iter->n_off = n_off;
+    if (n_off == 0) iter->finished = 1;
+    return 0;
+}
+
+struct hts_itr_multi_t {
+    hts_region_t *regs;
+    int n_regs, curr_reg;
+    int range_beg, range_end, in_range; // regions covered by the last seek_regions() call
+    hts_seek_regions_func *seek_regions;
+};
+
+static int region_cmp(const void *av, const void *bv)
+{
+    const hts_region_t *a = (const hts_region_t *) av, *b = (const hts_region_t *) bv;
+    if (a->tid != b->tid) return a->tid < b->tid? -1 : 1;
+    return a->beg < b->beg? -1 : a->beg > b->beg;
+}
+
+// Checks a record against the sorted regions before n_limit, skipping those
+// that end before it.  Returns 1 if it overlaps a region, 0 if not, or -1 if
+// it and all later records lie beyond every region.
+static int itr_multi_match(struct hts_itr_multi_t *m, int n_limit, int tid, int beg, int end)
+{
+    const hts_region_t *reg;
+    while (m->curr_reg < n_limit) {
+        reg = &m->regs[m->curr_reg];
+        if (reg->tid > tid || (reg->tid == tid && reg->end > beg)) break;
+        ++m->curr_reg;
+    }
+    if (m->curr_reg >= n_limit) return -1;
+    return reg->tid == tid && reg->beg < end;
+}
+
+hts_itr_t *hts_itr_regions(const hts_idx_t *idx, const hts_region_t *regs, int n_regs, hts_seek_regions_func *seek_regions, hts_readrec_func *readrec)
+{
+    hts_itr_t *iter;
+    struct hts_itr_multi_t *m;
+    int i, n;
+
+    iter = (hts_itr_t*)calloc(1, sizeof(hts_itr_t));
+    m = (struct hts_itr_multi_t*)calloc(1, sizeof(struct hts_itr_multi_t));
+    if (iter == NULL || m == NULL) goto fail;
+    iter->multi = m;
+    iter->readrec = readrec;
+    iter->i = -1;
+    iter->tid = -1;
+
+    // copy the valid regions, then sort them and merge those that overlap or touch
+    if (n_regs > 0 && (m->regs = (hts_region_t*)malloc(n_regs * sizeof(hts_region_t))) == NULL) goto fail;
+    for (i = n = 0; i < n_regs; ++i) {
+        hts_region_t r = regs[i];
+        if (r.tid < 0) continue;
+        if (r.beg < 0) r.beg = 0;
+        if (r.end <= r.beg) continue;
+        m->regs[n++] = r;
+    }
+    qsort(m->regs, n, sizeof(hts_region_t), region_cmp);
+    for (i = 1, n_regs = n, n = n_regs? 1 : 0; i < n_regs; ++i) {
+        hts_region_t *last = &m->regs[n-1];
+        if (m->regs[i].tid == last->tid && m->regs[i].beg <= last->end) {
+            if (last->end < m->regs[i].end) last->end = m->regs[i].end;
+        }
+        else m->regs[n++] = m->regs[i];
+    }
+    m->n_regs = n;
+    if (n == 0) { iter->finished = 1; return iter; }
+
+    if (seek_regions) {
+        m->seek_regions = seek_regions;
+        iter->read_rest = 1;
+    }
+    else {
+        int n_off = 0, m_off = 0;
+        for (i = 0; i < m->n_regs; ++i) {
+            const hts_region_t *r = &m->regs[i];
+            if (r->tid >= idx->n || idx_bidx(idx, r->tid) == NULL) continue;
+            if (itr_add_chunks(idx, r->tid, r->beg, r->end, iter, &iter->off, &n_off, &m_off) < 0) goto fail;
+        }
+        if (n_off > 0) iter->n_off = merge_chunks(iter->off, n_off);
     }
-    n_off = l + 1;
-    iter->n_off = n_off; iter->off = off;
     return iter;
+
+ fail:
+    if (iter) iter->multi = m;
+    hts_itr_destroy(iter);
+    return NULL;
+}
+
+hts_region_t *hts_regidx_regions(regidx_t *ridx, hts_name2id_f getid, void *hdr, int *n_regs)
+{
+    hts_region_t *regs = NULL;
+    int i, n_seq, n = 0, m = 0;
+    char **seqs = regidx_seq_names(ridx, &n_seq);
+
+    for (i = 0; i < n_seq; ++i) {
+        regitr_t itr;
+        int tid = getid(hdr, seqs[i]);
+        if (tid < 0 || !regidx_overlap(ridx, seqs[i], 0, UINT32_MAX, &itr)) continue;
+        for (; itr.i < itr.n; itr.i++) {
+            if (REGITR_START(itr) >= INT_MAX) break;
+            if (n == m) {
+                hts_region_t *tmp;
+                m = m? m<<1 : 16;
+                if ((tmp = (hts_region_t*)realloc(regs, m * sizeof(hts_region_t))) == NULL) {
+                    free(regs);
+                    return NULL;
+                }
+                regs = tmp;
+            }
+            regs[n].tid = tid;
+            regs[n].beg = REGITR_START(itr);
+            regs[n].end = REGITR_END(itr) >= INT_MAX? INT_MAX : REGITR_END(itr) + 1;
+            ++n;
+        }
+    }
+    if (regs == NULL) regs = (hts_region_t*)malloc(sizeof(hts_region_t));
+    *n_regs = n;
+    return regs;
 }
 
 void hts_itr_destroy(hts_itr_t *iter)
 {
-    if (iter) { free(iter->off); free(iter->bins.a); free(iter); }
+    if (iter) {
+        if (iter->multi) { free(iter->multi->regs); free(iter->multi); }
+        free(iter->off); free(iter->bins.a); free(iter);
+    }
 }
 
 const char *hts_parse_reg(const char *s, int *beg, int *end)
@@ -1536,16 +2861,58 @@ hts_itr_t *hts_itr_querys(const hts_idx_t *idx, const char *reg, hts_name2id_f g
     } else return itr_query(idx, HTS_IDX_NOCOOR, 0, 0, readrec);
 }
 
+// hts_itr_next() for multi-region iterators whose seek_regions function
+// restricts readrec to a range covering one or more regions at a time
+static int itr_multi_next_range(hts_itr_t *iter, void *r, void *data)
+{
+    struct hts_itr_multi_t *m = iter->multi;
+    int ret, tid, beg, end, match;
+    for (;;) {
+        if (!m->in_range) { // seek to the next batch of regions
+            if (m->range_end == m->n_regs) { ret = -1; break; }
+            if ((ret = m->seek_regions(data, &m->regs[m->range_end], m->n_regs - m->range_end)) < 0) {
+                ret = -2; break;
+            }
+            m->range_beg = m->range_end;
+            m->range_end += ret > 0? ret : 1; // skip a region with no data
+            m->curr_reg = m->range_beg;
+            m->in_range = ret > 0;
+            continue;
+        }
+        if ((ret = iter->readrec(NULL, data, r, &tid, &beg, &end)) < 0) {
+            if (ret < -1) break;
+            m->in_range = 0;
+            continue;
+        }
+        if (m->range_beg > 0) { // already returned, or between regions
+            const hts_region_t *prev = &m->regs[m->range_beg - 1];
+            if (tid == prev->tid && beg < prev->end) continue;
+        }
+        match = itr_multi_match(m, m->range_end, tid, beg, end);
+        if (match < 0) m->in_range = 0; // past this batch of regions
+        else if (match > 0) {
+            iter->curr_tid = tid;
+            iter->curr_beg = beg;
+            iter->curr_end = end;
+            return ret;
+        }
+    }
+    iter->finished = 1;
+    return ret;
+}
+
 int hts_itr_next(BGZF *fp, hts_itr_t *iter, void *r, void *data)
 {
-    int ret, tid, beg, end;
+    int ret, tid = -1, beg = 0, end = 0;
     if (iter == NULL || iter->finished) return -1;
+    if (iter->read_rest && iter->multi) return itr_multi_next_range(iter, r, data);
     if (iter->read_rest) {
         if (iter->curr_off) { // seek to the start
             bgzf_seek(fp, iter->curr_off, SEEK_SET);
             iter->curr_off = 0; // only seek once
         }
-        ret = iter->readrec(fp, data, r, &tid, &beg, &end);
+        do ret = iter->readrec(fp, data, r, &tid, &beg, &end);
+        while (ret >= 0 && tid >= 0 && tid == iter->prev_tid && beg < iter->prev_end);
         if (ret < 0) iter->finished = 1;
         iter->curr_tid = tid;
         iter->curr_beg = beg;
@@ -1557,15 +2924,31 @@ int hts_itr_next(BGZF *fp, hts_itr_t *iter, void *r, void *data)
         if (iter->curr_off == 0 || iter->curr_off >= iter->off[iter->i].v) { // then jump to the next chunk
             if (iter->i == iter->n_off - 1) { ret = -1; break; } // no more chunks
             if (iter->i < 0 || iter->off[iter->i].v != iter->off[iter->i+1].u) { // not adjacent chunks; then seek
+                if (iter->i + 1 >= iter->n_fetched) { // read the next batch of chunks in as few reads as possible
+                    int n = bgzf_prefetch(fp, (const uint64_t*)&iter->off[iter->i+1], iter->n_off - (iter->i+1));
+                    iter->n_fetched = iter->i + 1 + (n > 0? n : 0);
+                }
                 bgzf_seek(fp, iter->off[iter->i+1].u, SEEK_SET);
                 iter->curr_off = bgzf_tell(fp);
             }
             ++iter->i;
         }
+        iter->rec_off = iter->curr_off;
         if ((ret = iter->readrec(fp, data, r, &tid, &beg, &end)) >= 0) {
             iter->curr_off = bgzf_tell(fp);
+            if (iter->multi) {
+                int match = itr_multi_match(iter->multi, iter->multi->n_regs, tid, beg, end);
+                if (match < 0) { ret = -1; break; } // past the last region
+                else if (match == 0) continue;
+                iter->curr_tid = tid;
+                iter->curr_beg = beg;
+                iter->curr_end = end;
+                return ret;
+            }
             if (tid != iter->tid || beg >= iter->end) { // no need to proceed
                 ret = -1; break;
+            } else if (tid == iter->prev_tid && beg < iter->prev_end) {
+                continue; // already returned for an earlier region
             } else if (end > iter->beg && iter->end > beg) {
                 iter->curr_tid = tid;
                 iter->curr_beg = beg;
@@ -1578,6 +2961,344 @@ int hts_itr_next(BGZF *fp, hts_itr_t *iter, void *r, void *data)
     return ret;
 }
 
+/**************
+ *** Shards ***
+ **************/
+
+typedef struct {
+    int pos;
+    int64_t size;
+} shard_bin_t;
+
+static int shard_bin_cmp(const void *av, const void *bv)
+{
+    const shard_bin_t *a = (const shard_bin_t *) av, *b = (const shard_bin_t *) bv;
+    return (a->pos > b->pos) - (a->pos < b->pos);
+}
+
+// Approximates the compressed size of the data between two virtual offsets,
+// taking data within a block to compress about 3:1
+static inline int64_t voff_span(uint64_t u, uint64_t v)
+{
+    int64_t d = (int64_t)(v >> 16) - (int64_t)(u >> 16) + ((int64_t)(v & 0xffff) - (int64_t)(u & 0xffff)) / 3;
+    return d > 0? d : 1;
+}
+
+// Returns the level of a bin, setting *beg and *end to the positions it covers
+static int bin_range(const hts_idx_t *idx, int bin, int64_t *beg, int64_t *end)
+{
+    int l, shift;
+    for (l = 0; l < idx->n_lvls && bin >= hts_bin_first(l + 1); ++l) ;
+    shift = idx->min_shift + 3 * (idx->n_lvls - l);
+    *beg = (int64_t)(bin - hts_bin_first(l)) << shift;
+    *end = *beg + ((int64_t)1 << shift);
+    return l;
+}
+
+// Lists each bin's start and the size of its chunks, sorted by position
+static int shard_bins(const hts_idx_t *idx, int tid, shard_bin_t **a, int *m)
+{
+    bidx_t *bidx = idx_bidx(idx, tid);
+    khint_t k;
+    int n = 0;
+    if (bidx == NULL) return 0;
+    if (kh_size(bidx) > *m) {
+        shard_bin_t *tmp = (shard_bin_t*)realloc(*a, kh_size(bidx) * sizeof(shard_bin_t));
+        if (tmp == NULL) return -1;
+        *a = tmp, *m = kh_size(bidx);
+    }
+    for (k = kh_begin(bidx); k != kh_end(bidx); ++k) {
+        int64_t beg, end;
+        int bin, j;
+        bins_t *p;
+        if (!kh_exist(bidx, k) || (bin = kh_key(bidx, k)) == META_BIN(idx)) continue;
+        bin_range(idx, bin, &beg, &end);
+        p = &kh_val(bidx, k);
+        (*a)[n].pos = beg;
+        (*a)[n].size = 0;
+        for (j = 0; j < p->n; ++j) (*a)[n].size += voff_span(p->list[j].u, p->list[j].v);
+        ++n;
+    }
+    qsort(*a, n, sizeof(shard_bin_t), shard_bin_cmp);
+    return n;
+}
+
+int hts_push_region(hts_region_t **regs, int *n, int *m, int tid, int beg, int end)
+{
+    if (*n == *m) {
+        int new_m = *m? *m * 2 : 16;
+        hts_region_t *tmp = (hts_region_t*)realloc(*regs, new_m * sizeof(hts_region_t));
+        if (tmp == NULL) return -1;
+        *regs = tmp, *m = new_m;
+    }
+    (*regs)[*n].tid = tid, (*regs)[*n].beg = beg, (*regs)[*n].end = end;
+    ++*n;
+    return 0;
+}
+
+hts_region_t *hts_idx_shards(const hts_idx_t *idx, int n_shards, int *n_regs)
+{
+    hts_region_t *regs = NULL;
+    shard_bin_t *a = NULL;
+    int64_t total = 0, target, max_end;
+    int tid, i, n, m = 0, m_regs = 0;
+    *n_regs = -1;
+    if (idx == NULL || idx->fmt == HTS_FMT_CRAI) return NULL;
+    *n_regs = 0;
+    if (n_shards < 1) n_shards = 1;
+    max_end = (int64_t)1 << (idx->min_shift + 3 * idx->n_lvls);
+    if (max_end > INT_MAX) max_end = INT_MAX;
+
+    for (tid = 0; tid < idx->n; ++tid) {
+        if ((n = shard_bins(idx, tid, &a, &m)) < 0) goto fail;
+        for (i = 0; i < n; ++i) total += a[i].size;
+    }
+    target = total / n_shards + 1;
+
+    // Each reference is cut where the bins seen so far reach the target
+    for (tid = 0; tid < idx->n; ++tid) {
+        uint64_t mapped, unmapped;
+        int64_t acc = 0;
+        int beg = 0;
+        if (hts_idx_get_stat(idx, tid, &mapped, &unmapped) == 0 && mapped + unmapped == 0) continue;
+        if ((n = shard_bins(idx, tid, &a, &m)) < 0) goto fail;
+        if (n == 0) continue;
+        for (i = 0; i < n; ++i) {
+            if (acc >= target && a[i].pos > beg) {
+                if (hts_push_region(&regs, n_regs, &m_regs, tid, beg, a[i].pos) < 0) goto fail;
+                beg = a[i].pos, acc = 0;
+            }
+            acc += a[i].size;
+        }
+        if (hts_push_region(&regs, n_regs, &m_regs, tid, beg, max_end) < 0) goto fail;
+    }
+    if (hts_idx_get_n_no_coor(idx) > 0
+        && hts_push_region(&regs, n_regs, &m_regs, HTS_IDX_NOCOOR, 0, 0) < 0) goto fail;
+    free(a);
+    return regs;
+
+ fail:
+    free(a);
+    free(regs);
+    *n_regs = -1;
+    return NULL;
+}
+
+typedef struct {
+    const char *fn;
+    const hts_idx_t *idx;
+    const hts_region_t *shards;
+    int n_shards, next, ret;
+    const hts_shard_ops_t *ops;
+    hts_shard_func *func;
+    void *data;
+    pthread_mutex_t lock;
+} shard_run_t;
+
+// Processes shards with its own file, header, iterators and, if need be,
+// index until none are left or one fails
+static void *shard_worker(void *arg)
+{
+    shard_run_t *r = (shard_run_t *) arg;
+    const hts_idx_t *idx = r->idx;
+    hts_idx_t *own_idx = NULL;
+    void *hdr = NULL;
+    htsFile *fp;
+    int ret = 0;
+
+    if ((fp = hts_open(r->fn, "r")) == NULL || (hdr = r->ops->hdr_read(fp)) == NULL) ret = -1;
+    else if (r->ops->idx_load && (idx = own_idx = r->ops->idx_load(fp, r->fn)) == NULL) ret = -1;
+    for (;;) {
+        const hts_region_t *shard;
+        hts_itr_t *iter;
+        pthread_mutex_lock(&r->lock);
+        if (ret < 0 && r->ret == 0) r->ret = ret;
+        if (r->ret < 0 || r->next == r->n_shards) {
+            pthread_mutex_unlock(&r->lock);
+            break;
+        }
+        shard = &r->shards[r->next++];
+        pthread_mutex_unlock(&r->lock);
+
+        if ((iter = r->ops->itr_query(idx, shard->tid, shard->beg, shard->end)) == NULL) {
+            if (hts_verbose >= 1) fprintf(stderr, "[E::%s] failed to query tid %d:%d-%d\n", __func__, shard->tid, shard->beg, shard->end);
+            ret = -1;
+            continue;
+        }
+        // Records starting in an earlier shard of the reference belong to it
+        if (shard->tid >= 0) iter->prev_tid = shard->tid, iter->prev_end = shard->beg;
+        if ((ret = r->func(fp, hdr, iter, shard, r->data)) > 0) ret = 0;
+        hts_itr_destroy(iter);
+    }
+    hts_idx_destroy(own_idx);
+    if (hdr) r->ops->hdr_destroy(hdr);
+    if (fp) hts_close(fp);
+    return NULL;
+}
+
+int hts_process_shards(const char *fn, const hts_idx_t *idx, const hts_region_t *shards, int n_shards, int n_threads, const hts_shard_ops_t *ops, hts_shard_func *func, void *data)
+{
+    shard_run_t r;
+    pthread_t *tid;
+    int i, n;
+
+    r.fn = fn, r.idx = idx, r.shards = shards, r.n_shards = n_shards;
+    r.next = 0, r.ret = 0;
+    r.ops = ops, r.func = func, r.data = data;
+    pthread_mutex_init(&r.lock, NULL);
+    if (n_threads > n_shards) n_threads = n_shards;
+    if (n_threads <= 1 || (tid = (pthread_t*)malloc(n_threads * sizeof(pthread_t))) == NULL) {
+        shard_worker(&r);
+    }
+    else {
+        for (n = 0; n < n_threads; ++n)
+            if (pthread_create(&tid[n], NULL, shard_worker, &r) != 0) break;
+        if (n == 0) shard_worker(&r);
+        for (i = 0; i < n; ++i) pthread_join(tid[i], NULL);
+        free(tid);
+    }
+    pthread_mutex_destroy(&r.lock);
+    return r.ret;
+}
+
+/************************
+ *** Index statistics ***
+ ************************/
+
+static int bin_stat_cmp(const void *av, const void *bv)
+{
+    const hts_bin_stat_t *a = (const hts_bin_stat_t *) av, *b = (const hts_bin_stat_t *) bv;
+    if (a->beg != b->beg) return (a->beg > b->beg) - (a->beg < b->beg);
+    return (a->level > b->level) - (a->level < b->level);
+}
+
+typedef struct {
+    int w;
+    uint64_t loff;
+} window_off_t;
+
+static int window_off_cmp(const void *av, const void *bv)
+{
+    const window_off_t *a = (const window_off_t *) av, *b = (const window_off_t *) bv;
+    if (a->w != b->w) return (a->w > b->w) - (a->w < b->w);
+    return (a->loff > b->loff) - (a->loff < b->loff);
+}
+
+// Shares the data between successive linear index offsets among the windows
+// from the first up to the next one with a known offset, scaled to add up to
+// the reference's size.  Loaded indexes keep the linear index only as the
+// offset at the start of each bin.
+static int ref_stat_windows(const hts_idx_t *idx, bidx_t *bidx, uint64_t off_end, hts_ref_stat_t *st)
+{
+    window_off_t *a;
+    khint_t k;
+    uint64_t sum = 0;
+    int i, j, n = 0;
+    if ((a = (window_off_t*)malloc(kh_size(bidx) * sizeof(window_off_t))) == NULL) return -1;
+    for (k = kh_begin(bidx); k != kh_end(bidx); ++k) {
+        int64_t beg, end;
+        if (!kh_exist(bidx, k) || kh_key(bidx, k) >= (khint32_t)idx->n_bins) continue;
+        if (kh_val(bidx, k).loff == 0) continue; // linear index disabled for this bin
+        bin_range(idx, kh_key(bidx, k), &beg, &end);
+        if ((beg >> idx->min_shift) >= INT_MAX) continue;
+        a[n].w = beg >> idx->min_shift;
+        a[n++].loff = kh_val(bidx, k).loff;
+    }
+    if (n == 0) { free(a); return 0; }
+    qsort(a, n, sizeof(window_off_t), window_off_cmp);
+    for (i = j = 1; i < n; ++i) // keep the smallest offset for each window
+        if (a[i].w != a[j-1].w) a[j++] = a[i];
+    n = j;
+
+    st->n_windows = a[n-1].w + 1;
+    if ((st->window_bytes = (uint64_t*)calloc(st->n_windows, sizeof(uint64_t))) == NULL) {
+        free(a);
+        return -1;
+    }
+    for (i = 0; i < n; ++i) {
+        uint64_t next = i + 1 < n? a[i+1].loff : off_end;
+        int n_w = i + 1 < n? a[i+1].w - a[i].w : 1;
+        uint64_t span = next > a[i].loff? voff_span(a[i].loff, next) : 0;
+        for (j = 0; j < n_w; ++j)
+            st->window_bytes[a[i].w + j] = span / n_w + (j == 0? span % n_w : 0);
+        sum += span;
+    }
+    for (i = 0; i < st->n_windows && sum > 0; ++i)
+        st->window_bytes[i] = (uint64_t)((double)st->window_bytes[i] / sum * st->bytes + 0.5);
+    free(a);
+    return 0;
+}
+
+hts_ref_stat_t *hts_idx_ref_stat(const hts_idx_t *idx, int tid)
+{
+    hts_ref_stat_t *st;
+    bidx_t *bidx;
+    khint_t k;
+    uint64_t sum = 0, off_beg = (uint64_t)-1, off_end = 0, n_recs;
+    int i;
+    if (idx == NULL || idx->fmt == HTS_FMT_CRAI || tid < 0) return NULL;
+    if ((st = (hts_ref_stat_t*)calloc(1, sizeof(hts_ref_stat_t))) == NULL) return NULL;
+    st->tid = tid;
+    st->window = 1 << idx->min_shift;
+    if (tid >= idx->n || (bidx = idx_bidx(idx, tid)) == NULL || kh_size(bidx) == 0) return st;
+    hts_idx_get_stat(idx, tid, &st->n_mapped, &st->n_unmapped);
+
+    if ((st->bins = (hts_bin_stat_t*)malloc(kh_size(bidx) * sizeof(hts_bin_stat_t))) == NULL) goto fail;
+    for (k = kh_begin(bidx); k != kh_end(bidx); ++k) {
+        hts_bin_stat_t *b;
+        bins_t *p;
+        int j;
+        if (!kh_exist(bidx, k) || kh_key(bidx, k) == META_BIN(idx)) continue;
+        p = &kh_val(bidx, k);
+        b = &st->bins[st->n_bins++];
+        b->bin = kh_key(bidx, k);
+        b->level = bin_range(idx, b->bin, &b->beg, &b->end);
+        b->n_chunks = p->n;
+        b->bytes = 0;
+        for (j = 0; j < p->n; ++j) {
+            b->bytes += voff_span(p->list[j].u, p->list[j].v);
+            if (p->list[j].u < off_beg) off_beg = p->list[j].u;
+            if (p->list[j].v > off_end) off_end = p->list[j].v;
+        }
+        sum += b->bytes;
+    }
+    qsort(st->bins, st->n_bins, sizeof(hts_bin_stat_t), bin_stat_cmp);
+
+    // The pseudo-bin, if any, holds the offsets of the reference's first
+    // record and of the end of its last; otherwise the chunks span them
+    k = kh_get(bin, bidx, META_BIN(idx));
+    if (k != kh_end(bidx) && kh_val(bidx, k).list[0].v > kh_val(bidx, k).list[0].u) {
+        st->bytes = voff_span(kh_val(bidx, k).list[0].u, kh_val(bidx, k).list[0].v);
+        off_beg = kh_val(bidx, k).list[0].u;
+        off_end = kh_val(bidx, k).list[0].v;
+    } else st->bytes = sum;
+    if (st->n_bins > 0) st->off_beg = off_beg, st->off_end = off_end;
+
+    // The bins hold each record once, so share out the reference's size and
+    // count, which are more accurate than the sizes of many small chunks
+    n_recs = st->n_mapped + st->n_unmapped;
+    for (i = 0; i < st->n_bins && sum > 0; ++i) {
+        double f = (double)st->bins[i].bytes / sum;
+        st->bins[i].bytes = (uint64_t)(f * st->bytes + 0.5);
+        st->bins[i].n_records = (uint64_t)(f * n_recs + 0.5);
+    }
+
+    if (ref_stat_windows(idx, bidx, off_end, st) < 0) goto fail;
+    return st;
+
+ fail:
+    hts_ref_stat_destroy(st);
+    return NULL;
+}
+
+void hts_ref_stat_destroy(hts_ref_stat_t *st)
+{
+    if (st == NULL) return;
+    free(st->bins);
+    free(st->window_bytes);
+    free(st);
+}
+
 /**********************
  *** Retrieve index ***
  **********************/
@@ -1643,7 +3364,7 @@ char *hts_idx_getfn(const char *fn, const char *ext)
     return fnidx;
 }
 
-hts_idx_t *hts_idx_load(const char *fn, int fmt)
+static hts_idx_t *idx_load(const char *fn, int fmt, const char *mode)
 {
     char *fnidx;
     hts_idx_t *idx;
@@ -1659,7 +3380,17 @@ hts_idx_t *hts_idx_load(const char *fn, int fmt)
         if ( stat_idx.st_mtime < stat_main.st_mtime )
             fprintf(stderr, "Warning: The index file is older than the data file: %s\n", fnidx);
     }
-    idx = hts_idx_load_local(fnidx, fmt);
+    idx = idx_load_local(fnidx, fmt, mode);
     free(fnidx);
     return idx;
 }
+
+hts_idx_t *hts_idx_load(const char *fn, int fmt)
+{
+    return idx_load(fn, fmt, "r");
+}
+
+hts_idx_t *hts_idx_load_mapped(const char *fn, int fmt)
+{
+    return idx_load(fn, fmt, "rm");
+}
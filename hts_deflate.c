@@ -0,0 +1,231 @@
+/*  hts_deflate.c -- selectable DEFLATE codec used by BGZF and CRAM.
+
+    Copyright (C) 2015 DNAnexus, Inc.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.  */
+
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#ifdef HAVE_LIBDEFLATE
+#include <pthread.h>
+#include <libdeflate.h>
+#endif
+
+#include "htslib/hts.h"
+#include "hts_deflate_internal.h"
+
+#ifdef HAVE_LIBDEFLATE
+static int use_libdeflate = 1;
+#else
+static int use_libdeflate = 0;
+#endif
+
+int hts_set_deflate_codec(const char *name)
+{
+    if (name == NULL) {
+#ifdef HAVE_LIBDEFLATE
+        use_libdeflate = 1;
+#else
+        use_libdeflate = 0;
+#endif
+        return 0;
+    }
+    else if (strcmp(name, "zlib") == 0) {
+        use_libdeflate = 0;
+        return 0;
+    }
+#ifdef HAVE_LIBDEFLATE
+    else if (strcmp(name, "libdeflate") == 0) {
+        use_libdeflate = 1;
+        return 0;
+    }
+#endif
+    return -1;
+}
+
+int hts_use_libdeflate(void)
+{
+    return use_libdeflate;
+}
+
+static int zlib_deflate_raw(uint8_t *dst, size_t *dlen,
+                            const uint8_t *src, size_t slen, int level)
+{
+    z_stream zs;
+    int ret;
+    zs.zalloc = NULL; zs.zfree = NULL;
+    zs.next_in  = (Bytef*)src;
+    zs.avail_in = slen;
+    zs.next_out = dst;
+    zs.avail_out = *dlen;
+    if (deflateInit2(&zs, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) return -1; // -15 to disable zlib header/footer
+    ret = deflate(&zs, Z_FINISH);
+    if (deflateEnd(&zs) != Z_OK || ret != Z_STREAM_END) return -1;
+    *dlen = zs.total_out;
+    return 0;
+}
+
+static int zlib_inflate_raw(uint8_t *dst, size_t *dlen,
+                            const uint8_t *src, size_t slen)
+{
+    z_stream zs;
+    int ret;
+    zs.zalloc = NULL; zs.zfree = NULL;
+    zs.next_in = (Bytef*)src;
+    zs.avail_in = slen;
+    zs.next_out = (Bytef*)dst;
+    zs.avail_out = *dlen;
+    if (inflateInit2(&zs, -15) != Z_OK) return -1;
+    ret = inflate(&zs, Z_FINISH);
+    if (inflateEnd(&zs) != Z_OK || ret != Z_STREAM_END) return -1;
+    *dlen = zs.total_out;
+    return 0;
+}
+
+#ifdef HAVE_LIBDEFLATE
+#define LDEFLATE_MAX_LEVEL 12
+
+// The (de)compressors a thread has used.  Allocating one costs more than
+// compressing a BGZF block with it, so they are kept until the thread exits.
+typedef struct {
+    struct libdeflate_compressor *comp[LDEFLATE_MAX_LEVEL + 1];  // by level
+    struct libdeflate_decompressor *decomp;
+} ldeflate_cache_t;
+
+static pthread_key_t ldeflate_key;
+static pthread_once_t ldeflate_once = PTHREAD_ONCE_INIT;
+static int ldeflate_key_ok = 0;
+
+static void ldeflate_cache_free(void *p)
+{
+    ldeflate_cache_t *c = (ldeflate_cache_t *) p;
+    int i;
+    for (i = 0; i <= LDEFLATE_MAX_LEVEL; i++)
+        if (c->comp[i]) libdeflate_free_compressor(c->comp[i]);
+    if (c->decomp) libdeflate_free_decompressor(c->decomp);
+    free(c);
+}
+
+static void ldeflate_key_init(void)
+{
+    ldeflate_key_ok = (pthread_key_create(&ldeflate_key, ldeflate_cache_free) == 0);
+}
+
+static ldeflate_cache_t *ldeflate_cache(void)
+{
+    ldeflate_cache_t *c;
+    pthread_once(&ldeflate_once, ldeflate_key_init);
+    if (!ldeflate_key_ok) return NULL;
+    if ((c = (ldeflate_cache_t *) pthread_getspecific(ldeflate_key)) == NULL) {
+        if ((c = (ldeflate_cache_t *) calloc(1, sizeof(ldeflate_cache_t))) == NULL) return NULL;
+        if (pthread_setspecific(ldeflate_key, c) != 0) {
+            free(c);
+            return NULL;
+        }
+    }
+    return c;
+}
+
+struct libdeflate_compressor *hts_libdeflate_compressor(int level)
+{
+    ldeflate_cache_t *c = ldeflate_cache();
+    // libdeflate's levels 1-9 are comparable to zlib's
+    if (level < 0) level = 6;
+    if (c == NULL || level > LDEFLATE_MAX_LEVEL) return NULL;
+    if (c->comp[level] == NULL) c->comp[level] = libdeflate_alloc_compressor(level);
+    return c->comp[level];
+}
+
+struct libdeflate_decompressor *hts_libdeflate_decompressor(void)
+{
+    ldeflate_cache_t *c = ldeflate_cache();
+    if (c == NULL) return NULL;
+    if (c->decomp == NULL) c->decomp = libdeflate_alloc_decompressor();
+    return c->decomp;
+}
+
+static int ldeflate_deflate_raw(uint8_t *dst, size_t *dlen,
+                                const uint8_t *src, size_t slen, int level)
+{
+    struct libdeflate_compressor *z;
+    size_t clen;
+    if ((z = hts_libdeflate_compressor(level)) == NULL) return -1;
+    clen = libdeflate_deflate_compress(z, src, slen, dst, *dlen);
+    if (clen == 0) return -1; // did not fit
+    *dlen = clen;
+    return 0;
+}
+
+static int ldeflate_inflate_raw(uint8_t *dst, size_t *dlen,
+                                const uint8_t *src, size_t slen)
+{
+    struct libdeflate_decompressor *z;
+    enum libdeflate_result ret;
+    size_t ulen;
+    if ((z = hts_libdeflate_decompressor()) == NULL) return -1;
+    ret = libdeflate_deflate_decompress(z, src, slen, dst, *dlen, &ulen);
+    if (ret != LIBDEFLATE_SUCCESS) return -1;
+    *dlen = ulen;
+    return 0;
+}
+#endif
+
+int hts_deflate_raw(uint8_t *dst, size_t *dlen,
+                    const uint8_t *src, size_t slen, int level)
+{
+#ifdef HAVE_LIBDEFLATE
+    // Level 0 (stored blocks) is left to zlib, which all versions handle,
+    // and so is empty input, for which zlib gives the bytes of the standard
+    // BGZF EOF marker block while libdeflate does not
+    if (use_libdeflate && level != 0 && slen > 0)
+        return ldeflate_deflate_raw(dst, dlen, src, slen, level);
+#endif
+    return zlib_deflate_raw(dst, dlen, src, slen, level);
+}
+
+int hts_inflate_raw(uint8_t *dst, size_t *dlen,
+                    const uint8_t *src, size_t slen)
+{
+#ifdef HAVE_LIBDEFLATE
+    if (use_libdeflate)
+        return ldeflate_inflate_raw(dst, dlen, src, slen);
+#endif
+    return zlib_inflate_raw(dst, dlen, src, slen);
+}
+
+int hts_crc32_is_fast(void)
+{
+#ifdef HAVE_LIBDEFLATE
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+uint32_t hts_crc32(uint32_t crc, const void *buf, size_t len)
+{
+#ifdef HAVE_LIBDEFLATE
+    // Same result as zlib's, whichever codec is selected
+    return libdeflate_crc32(crc, buf, len);
+#else
+    return crc32(crc, (const Bytef *)buf, len);
+#endif
+}
@@ -0,0 +1,67 @@
+/*  hts_deflate_internal.h -- selectable DEFLATE codec used by BGZF and CRAM.
+
+    Copyright (C) 2015 DNAnexus, Inc.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.  */
+
+#ifndef HTS_DEFLATE_INTERNAL_H
+#define HTS_DEFLATE_INTERNAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Whole-buffer compression as used for BGZF blocks.  zlib is always
+   available; when built with -DHAVE_LIBDEFLATE, libdeflate is used by
+   default instead, unless hts_set_deflate_codec("zlib") has been called.
+   Either way the output is a standard DEFLATE stream.  */
+
+/* Returns non-zero if libdeflate is compiled in and currently selected.  */
+int hts_use_libdeflate(void);
+
+/* Compresses src into a raw DEFLATE stream (without zlib or gzip wrapping)
+   in dst, which has room for *dlen bytes.  level is a zlib compression level,
+   or -1 for the default.  Returns 0 and sets *dlen to the compressed size,
+   or -1 on error, including when the output does not fit.  */
+int hts_deflate_raw(uint8_t *dst, size_t *dlen,
+                    const uint8_t *src, size_t slen, int level);
+
+/* Inflates the raw DEFLATE stream in src into dst, which has room for *dlen
+   bytes.  Returns 0 and sets *dlen to the uncompressed size, or -1 if the
+   data is corrupt or does not fit.  */
+int hts_inflate_raw(uint8_t *dst, size_t *dlen,
+                    const uint8_t *src, size_t slen);
+
+#ifdef HAVE_LIBDEFLATE
+/* The calling thread's libdeflate compressor for a zlib compression level
+   (-1 for the default) and its decompressor, allocated on first use and
+   freed when the thread exits.  Callers must not free them.  Return NULL
+   if out of memory.  */
+struct libdeflate_compressor *hts_libdeflate_compressor(int level);
+struct libdeflate_decompressor *hts_libdeflate_decompressor(void);
+#endif
+
+/* CRC-32 as per zlib's crc32(), using libdeflate's PCLMUL/ARMv8 CRC code
+   when available.  Start with crc = 0.  */
+uint32_t hts_crc32(uint32_t crc, const void *buf, size_t len);
+
+/* Returns non-zero if hts_crc32() uses libdeflate's code, whichever codec
+   is selected, and so is cheap enough to verify every block by default.  */
+int hts_crc32_is_fast(void);
+
+#endif
@@ -0,0 +1,33 @@
+/*  hts_internal.h -- internal functions shared by hts.c and sam.c.
+
+    Copyright (C) 2015 DNAnexus, Inc.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.  */
+
+#ifndef HTS_INTERNAL_H
+#define HTS_INTERNAL_H
+
+#include "htslib/hts.h"
+
+/* Appends tid:beg-end to the array *regs of *n regions, which has room for
+   *m, growing it as needed.  Used to build the shards of hts_idx_shards()
+   and of CRAM files.  Returns 0, or -1 if out of memory.  */
+int hts_push_region(hts_region_t **regs, int *n, int *m, int tid, int beg, int end);
+
+#endif
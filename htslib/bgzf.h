@@ -41,10 +41,20 @@
 #define BGZF_ERR_HEADER 2
 #define BGZF_ERR_IO     4
 #define BGZF_ERR_MISUSE 8
+#define BGZF_ERR_CRC    16
 
 struct hFILE;
 struct bgzf_mtaux_t;
+struct hts_tpool;
+struct __hts_idx_t;
 typedef struct __bgzidx_t bgzidx_t;
+typedef struct bgzf_cache_t bgzf_cache_t;
+
+typedef struct {
+    uint64_t hits, misses, evictions;
+    int64_t n_bytes, max_bytes; // uncompressed bytes held, and the limit
+    int n_blocks;
+} bgzf_cache_stats_t;
 
 struct BGZF {
     int errcode:16, is_write:2, is_be:2, compress_level:9, is_compressed:2, is_gzip:1;
@@ -52,12 +62,16 @@ struct BGZF {
     int block_length, block_offset;
     int64_t block_address, uncompressed_address;
     void *uncompressed_block, *compressed_block;
-    void *cache; // a pointer to a hash table
+    void *cache; // a bgzf_cache_t, possibly shared with other handles
     struct hFILE *fp; // actual file handle
     struct bgzf_mtaux_t *mt; // only used for multi-threading
     bgzidx_t *idx;      // BGZF index
     int idx_build_otf;  // build index on the fly, set by bgzf_index_build_init()
     z_stream *gz_stream;// for gzip-compressed files
+    int check_crc;      // verify block CRCs, set by bgzf_set_crc_check()
+    struct bgzf_prefetch_t *prefetch; // compressed data read by bgzf_prefetch()
+    struct __hts_idx_t *hidx; // index fed by bgzf_idx_push()
+    uint64_t hidx_last; // offset given with the last record pushed to hidx
 };
 #ifndef HTS_BGZF_TYPEDEF
 typedef struct BGZF BGZF;
@@ -169,12 +183,16 @@ extern "C" {
      * Return a virtual file pointer to the current location in the file.
      * No interpetation of the value should be made, other than a subsequent
      * call to bgzf_seek can be used to position the file at the same point.
-     * Return value is non-negative on success.
+     * Return value is non-negative on success.  For plain gzip files being
+     * read, this is the offset in the uncompressed data.
      */
     #define bgzf_tell(fp) (((fp)->block_address << 16) | ((fp)->block_offset & 0xFFFF))
 
     /**
-     * Set the file to read from the location specified by _pos_.
+     * Set the file to read from the location specified by _pos_.  A location
+     * within the block already loaded reuses it without reading it again.
+     * Plain gzip files can be sought in once their checkpoint index has been
+     * loaded with bgzf_index_load().
      *
      * @param fp     BGZF file handler
      * @param pos    virtual file offset returned by bgzf_tell()
@@ -183,6 +201,25 @@ extern "C" {
      */
     int64_t bgzf_seek(BGZF *fp, int64_t pos, int whence);
 
+    /**
+     * Read the compressed data for a list of chunks in as few reads as
+     * possible, so that later seeks to them and reads within them need no
+     * further I/O.  Chunks that are close together are fetched in a single
+     * read, along with the gap between them.  At most a few megabytes are
+     * held at once, replacing any data from an earlier call.
+     *
+     * This has no effect when reading with multiple threads, or on files
+     * that are not BGZF-compressed.
+     *
+     * @param fp     BGZF file handler
+     * @param voffs  _n_ pairs of start and end virtual offsets, sorted by
+     *               start, laid out as an array of hts_pair64_t
+     * @param n      number of chunks
+     * @return       number of leading chunks fetched completely (possibly 0),
+     *               or -1 on error
+     */
+    int bgzf_prefetch(BGZF *fp, const uint64_t *voffs, int n);
+
     /**
      * Check if the BGZF end-of-file (EOF) marker is present
      *
@@ -208,18 +245,90 @@ extern "C" {
 
     /**
      * Set the cache size. Only effective when compiled with -DBGZF_CACHE.
+     * Decompressed blocks are kept in least-recently-used order, and are
+     * counted by their actual uncompressed size.  If the cache is shared,
+     * the new size applies to all handles using it.  With bgzf_mt(), blocks
+     * are looked up as they are read ahead, and only misses are inflated.
      *
      * @param fp    BGZF file handler
      * @param size  size of cache in bytes; 0 to disable caching (default)
      */
     void bgzf_set_cache_size(BGZF *fp, int size);
 
+    /**
+     * Create a block cache that can be shared by several handles reading
+     * the same file, possibly from different threads.
+     *
+     * @param max_bytes  maximum uncompressed bytes to hold
+     * @return           the cache, or NULL on error
+     */
+    bgzf_cache_t *bgzf_cache_init(int64_t max_bytes);
+
+    /**
+     * Release a reference to a cache.  It is freed once it has been
+     * released by its creator and by every handle that was using it.
+     */
+    void bgzf_cache_destroy(bgzf_cache_t *cache);
+
+    /**
+     * Use _cache_ for this file, replacing any previous cache.  Cache
+     * entries are keyed by file offset, so all handles sharing a cache
+     * must be reading the same file.
+     *
+     * @param fp     BGZF file handler opened for reading
+     * @param cache  cache to use, or NULL to disable caching
+     * @return       0 on success and -1 on error
+     */
+    int bgzf_set_cache(BGZF *fp, bgzf_cache_t *cache);
+
+    /**
+     * Return the cache used by _fp_, e.g. to share it with bgzf_set_cache()
+     * or to pass to bgzf_cache_stats(); NULL if there is none.
+     */
+    bgzf_cache_t *bgzf_get_cache(BGZF *fp);
+
+    /**
+     * Fill in _stats_ with the cache's hit and miss counts and current size.
+     */
+    void bgzf_cache_stats(bgzf_cache_t *cache, bgzf_cache_stats_t *stats);
+
+    /**
+     * Enable or disable verification of each block's CRC when reading; a
+     * corrupt block then sets BGZF_ERR_CRC.  Checking is on by default only
+     * when HTSlib is built with libdeflate, whose CRC-32 code is fast
+     * enough to cost little next to inflating.  zlib's crc32() would add a
+     * noticeable pass over every block, so otherwise it must be asked for.
+     *
+     * @param fp     BGZF file handler
+     * @param check  1 to verify CRCs; 0 to skip verification
+     */
+    void bgzf_set_crc_check(BGZF *fp, int check);
+
     /**
      * Flush the file if the remaining buffer size is smaller than _size_
      * @return      0 if flushing succeeded or was not needed; negative on error
      */
     int bgzf_flush_try(BGZF *fp, ssize_t size);
 
+    /**
+     * Add the record that was just written to an index, ending at the
+     * current virtual offset; see hts_idx_push().  With a multi-threaded
+     * writer the entry is held until its block has been compressed and
+     * written, so the offset is still exact.
+     *
+     * @return      0 on success; negative on error, including an earlier
+     *              deferred hts_idx_push() failure, after which the index
+     *              is no longer used and may be destroyed
+     */
+    int bgzf_idx_push(BGZF *fp, struct __hts_idx_t *hidx, int tid, int beg, int end, int is_mapped);
+
+    /**
+     * Flush the file and any index entries still held by bgzf_idx_push(),
+     * after which bgzf_tell() gives the offset of the EOF marker.
+     * @return      0 on success; negative on error
+     */
+    int bgzf_idx_flush(BGZF *fp);
+
     /**
      * Read one byte from a BGZF file. It is faster than bgzf_read()
      * @param fp     BGZF file handler
@@ -237,21 +346,87 @@ extern "C" {
      */
     int bgzf_getline(BGZF *fp, int delim, kstring_t *str);
 
+    /**
+     * Read one line from a BGZF file, avoiding a copy where possible.
+     * If the line lies within the current block, *line points directly
+     * into fp's uncompressed data; otherwise the line is assembled in
+     * _str_ as per bgzf_getline() and *line is set to str->s.
+     *
+     * The line excludes the delimiter (and any '\r' before a '\n') and is
+     * not NUL-terminated when it points into the block: use the returned
+     * length.  It is valid until the next read or seek on _fp_.
+     *
+     * @param fp     BGZF file handler
+     * @param delim  delimitor
+     * @param str    string used for lines spanning blocks; must be initialized
+     * @param line   set to the start of the line
+     * @return       length of the line; -1 on end-of-file; <= -2 on error
+     */
+    int bgzf_getline_ref(BGZF *fp, int delim, kstring_t *str, char **line);
+
+    /**
+     * Expose the unread data in the current block without copying it,
+     * reading the next block first if the current one is used up.  The
+     * data is valid until the next read or seek on _fp_, and is not marked
+     * as read until bgzf_consume() is called.
+     *
+     * @param fp     BGZF file handler
+     * @param data   set to the start of the unread data
+     * @return       number of bytes available; 0 on end-of-file and -1 on error
+     */
+    ssize_t bgzf_peek_block(BGZF *fp, const uint8_t **data);
+
+    /**
+     * Mark _length_ bytes exposed by bgzf_peek_block() as read.  _length_
+     * must not exceed the number of bytes it returned.
+     */
+    void bgzf_consume(BGZF *fp, size_t length);
+
     /**
      * Read the next BGZF block.
+     *
+     * @return      0 on success (fp->block_length is 0 at end-of-file);
+     *              -1 on error
      */
     int bgzf_read_block(BGZF *fp);
 
     /**
-     * Enable multi-threading (only effective on writing and when the
-     * library was compiled with -DBGZF_MT)
+     * Enable multi-threading (only effective when the library was compiled
+     * with -DBGZF_MT)
+     *
+     * When reading, blocks are read ahead and inflated by n_threads worker
+     * threads, and are returned in order by bgzf_read(), bgzf_getline(),
+     * etc.  This works across bgzf_seek(); seeking to a block that is
+     * already being read ahead reuses it.  Plain gzip and uncompressed
+     * input is still read serially.  Note that fp->uncompressed_block may
+     * change between calls to bgzf_read_block().
+     *
+     * When writing, each full block is handed to the worker threads for
+     * compression as soon as it is filled, and a separate thread writes
+     * the compressed blocks out in order.  bgzf_write() only waits when
+     * about 4*n_threads blocks are outstanding.
      *
-     * @param fp          BGZF file handler; must be opened for writing
-     * @param n_threads   #threads used for writing
-     * @param n_sub_blks  #blocks processed by each thread; a value 64-256 is recommended
+     * @param fp          BGZF file handler
+     * @param n_threads   #threads used for reading or writing
+     * @param n_sub_blks  unused; retained for backward compatibility
+     * @return            0 on success and -1 on error
      */
     int bgzf_mt(BGZF *fp, int n_threads, int n_sub_blks);
 
+    /**
+     * Enable multi-threading using an existing thread pool, which may be
+     * shared with other files (only effective when the library was compiled
+     * with -DBGZF_MT).  Behaves as bgzf_mt() otherwise; the pool must
+     * outlive the file.
+     *
+     * @param fp     BGZF file handler
+     * @param pool   pool created with hts_tpool_init()
+     * @param qsize  maximum #blocks this file may have in the pool at once;
+     *               0 for a default based on the pool's size
+     * @return       0 on success and -1 on error
+     */
+    int bgzf_thread_pool(BGZF *fp, struct hts_tpool *pool, int qsize);
+
 
     /*******************
      * bgzidx routines *
@@ -282,10 +457,28 @@ extern "C" {
      *
      * @param fp          BGZF file handler; can be opened for reading or writing.
      *
+     * When reading a plain gzip file, the index instead records checkpoints
+     * from which decompression can resume: the compressed offset reached at
+     * the end of a deflate block and the 32K of data preceding it, at least
+     * every megabyte of uncompressed data.  bgzf_useek() and bgzf_seek() then
+     * decompress from the nearest checkpoint.
+     *
      * Returns 0 on success and -1 on error.
      */
     int bgzf_index_build_init(BGZF *fp);
 
+    /**
+     * Set how much uncompressed data a plain gzip index's checkpoints are
+     * apart, trading the size of the index for the time taken by seeks.
+     *
+     * @param fp          BGZF file handler, after bgzf_index_build_init()
+     *                    and before reading
+     * @param span        bytes between checkpoints
+     *
+     * Returns 0 on success and -1 on error.
+     */
+    int bgzf_index_set_span(BGZF *fp, int64_t span);
+
     /**
      * Load BGZF index
      *
@@ -44,12 +44,19 @@ typedef struct hFILE {
     const struct hFILE_backend *backend;
     off_t offset;
     int at_eof:1;
+    int mapped:1;
     int has_errno;
 } hFILE;
 
 /*!
   @abstract  Open the named file or URL as a stream
   @return    An hFILE pointer, or NULL (with errno set) if an error occurred.
+  @notes     If mode contains 'm' as well as 'r', a local regular file is
+    memory-mapped rather than read via read(2).  Reads and seeks then become
+    pointer arithmetic within the mapping.  Other files silently fall back
+    to ordinary I/O.  The file must not be truncated while it is open.
+    If mode contains 'p' as well as 'r', the stream is read ahead in a
+    background thread, as per hreadahead().
 */
 hFILE *hopen(const char *filename, const char *mode) HTS_RESULT_USED;
 
@@ -60,6 +67,22 @@ hFILE *hopen(const char *filename, const char *mode) HTS_RESULT_USED;
 */
 hFILE *hdopen(int fd, const char *mode) HTS_RESULT_USED;
 
+/*!
+  @abstract  Wrap an input stream so that it is read ahead in the background
+  @param fp           The stream to read from, which must be open for reading
+  @param n_buffers    Number of buffers to keep filled ahead of the reader,
+                      or 0 for the default (4)
+  @param buffer_size  Size of each buffer, or 0 for the default (64K)
+  @return    A new hFILE, or NULL (with errno set) if an error occurred.
+  @notes     A background thread reads fp, so that I/O latency overlaps with
+    the caller's processing, e.g. decompression.  Seeking waits for any read
+    in progress and discards the prefetched data.  On success the new stream
+    owns fp, which is closed along with it and must not otherwise be used;
+    on failure fp is left untouched.  hopen() does this itself when mode
+    contains 'p' as well as 'r'.
+*/
+hFILE *hreadahead(hFILE *fp, int n_buffers, size_t buffer_size) HTS_RESULT_USED;
+
 /*!
   @abstract  Report whether the file name or URL denotes remote storage
   @return    0 if local, 1 if remote.
@@ -155,6 +178,23 @@ hread(hFILE *fp, void *buffer, size_t nbytes)
     return (n == nbytes)? (ssize_t) n : hread2(fp, buffer, nbytes, n);
 }
 
+/*!
+  @abstract  Read a block of characters in place, without copying
+  @return    Pointer to the next nbytes of the stream, or NULL if they are
+    not all already in the stream's internal buffer.
+  @notes     On success the bytes are consumed as per hread().  The pointer
+    is valid until the next operation on the stream.  On NULL nothing has
+    been consumed, and the caller should use hread() instead.  For a
+    memory-mapped stream this succeeds whenever nbytes remain in the file.
+*/
+static inline const char *hreadptr(hFILE *fp, size_t nbytes)
+{
+    const char *ptr = fp->begin;
+    if ((size_t) (fp->end - fp->begin) < nbytes) return NULL;
+    fp->begin += nbytes;
+    return ptr;
+}
+
 /*!
   @abstract  Write a character to the stream
   @return    The character written, or EOF if an error occurred.
@@ -109,6 +109,7 @@ typedef struct htsFormat {
 //  - is_write and is_cram are used directly in samtools <= 1.1
 //  - fp is used directly in samtools (up to and including current develop)
 //  - line is used directly in bcftools (up to and including current develop)
+struct __hts_idx_t;
 typedef struct {
     uint32_t is_bin:1, is_write:1, is_be:1, is_cram:1, dummy:28;
     int64_t lineno;
@@ -121,8 +122,17 @@ typedef struct {
         void *voidp;
     } fp;
     htsFormat format;
+    struct __hts_idx_t *idx;  // built while writing; saved by hts_close()
+    struct hts_text_mt *text_mt;  // parses SAM/VCF lines on worker threads
 } htsFile;
 
+// A pool of worker threads, shared by any number of files; opaque
+typedef struct hts_tpool hts_tpool;
+typedef struct {
+    hts_tpool *pool;     // from hts_tpool_init()
+    int qsize;           // max #jobs each file may queue; 0 for the default
+} htsThreadPool;
+
 // REQUIRED_FIELDS
 enum sam_fields {
     SAM_QNAME = 0x00000001,
@@ -217,7 +227,9 @@ char *hts_format_description(const htsFormat *format);
   @discussion
       With 'r' opens for reading; any further format mode letters are ignored
       as the format is detected by checking the first few bytes or BGZF blocks
-      of the file.  With 'w' or 'a' opens for writing or appending, with format
+      of the file; adding 'm' memory-maps local files, and 'p' reads ahead
+      in a background thread, as per hopen().
+      With 'w' or 'a' opens for writing or appending, with format
       specifier letters:
         b  binary format (BAM, BCF, etc) rather than text (SAM, VCF, etc)
         c  CRAM format
@@ -287,6 +299,93 @@ char **hts_readlist(const char *fn, int is_file, int *_n);
 */
 int hts_set_threads(htsFile *fp, int n);
 
+/*!
+  @abstract  Create a pool of worker threads that can be shared between files
+  @param n   The number of worker threads to create
+  @return    The new pool, or NULL if an error occurred.
+*/
+hts_tpool *hts_tpool_init(int n);
+
+/*!
+  @abstract  Stop the worker threads and free the pool
+  @param p   The pool; all files using it must have been closed already
+*/
+void hts_tpool_destroy(hts_tpool *p);
+
+/*!
+  @abstract  Use an existing thread pool to compress/decompress this file
+  @param fp  The file handle
+  @param p   The pool and per-file queue size
+  @return    0 for success, or negative if an error occurred.
+  @discussion
+    Many files, whether open for reading or writing, may use the same pool.
+    This limits the total number of threads used, as opposed to calling
+    hts_set_threads() on each file.  The pool must outlive the files.
+*/
+int hts_set_thread_pool(htsFile *fp, htsThreadPool *p);
+
+/*
+ * Reading SAM or VCF text with threads set by hts_set_threads() or
+ * hts_set_thread_pool() runs a pipeline: a reader thread splits the text
+ * into batches of lines and the pool's workers parse the batches, while
+ * sam_read1() and bcf_read() return the records in their original order.
+ * It starts at the first record read, after the header, and is only for
+ * reading through the file: hts_getline(), seeking and iterators must not
+ * be used on the file afterwards.  The workers parse with a copy of the
+ * header taken then, so changes made to the header later are not seen.
+ */
+
+// Returned by a parser running on a worker thread for a line it can parse
+// only on the reading thread, e.g. because it must add to the header
+#define HTS_TEXT_SERIAL (-100)
+
+// How the pipeline creates and parses records of one type
+typedef struct {
+    size_t size;                       // sizeof the record type
+    void *(*init)(const void *proto);  // a new record, set up like proto
+    void (*destroy)(void *rec);
+    void *(*hdr_dup)(const void *hdr);  // a copy of hdr for the workers
+    void (*hdr_destroy)(void *hdr);
+    // Parses line into rec.  On the pool's workers, hdr is their copy of the
+    // header, which must not be changed, and tmp is scratch space for the
+    // thread.  Lines left to be parsed serially get the caller's header and
+    // a NULL tmp.
+    int (*parse)(kstring_t *line, void *hdr, void *rec, kstring_t *tmp);
+    // A count that grows whenever parse() adds to hdr, so that the workers'
+    // copy is only replaced when it is out of date; NULL if it never adds
+    int64_t (*hdr_size)(const void *hdr);
+} hts_text_parser_t;
+
+/*!
+  @abstract  Read and parse the next line of a file with a text pipeline
+  @param fp      The file handle, whose fp->text_mt is set
+  @param parser  How to parse the lines, which must be the same on each call
+  @param hdr     The header
+  @param rec     The record to fill in, whose contents are swapped with the
+                 parsed record; the first call sets up others like it
+  @return    The result of parser->parse(), -1 at end-of-file, or -3 if
+             the file could not be read.
+  @discussion
+    Sets fp->lineno to the number of the line parsed.  Used by sam_read1()
+    and bcf_read().  If the threads cannot be started, this and later calls
+    read and parse each line on the calling thread instead; the pipeline,
+    and the pool that any BGZF decompression still uses, are kept until
+    hts_close().
+*/
+int hts_text_mt_read(htsFile *fp, const hts_text_parser_t *parser, void *hdr, void *rec);
+
+/*!
+  @abstract  Select the library used for DEFLATE compression
+  @param name  "zlib", "libdeflate", or NULL for the default
+  @return    0 for success, or -1 if that library is not available.
+  @discussion
+    This affects BGZF blocks and CRAM gzip blocks throughout the process.
+    libdeflate is the default when HTSlib has been built with it, and zlib
+    is used otherwise.  Either produces standard BGZF and gzip data, though
+    the compressed bytes differ.
+*/
+int hts_set_deflate_codec(const char *name);
+
 /*!
   @abstract  Set .fai filename for a file opened for reading
   @return    0 for success, negative on failure
@@ -334,7 +433,36 @@ typedef struct {
 typedef int hts_readrec_func(BGZF *fp, void *data, void *r, int *tid, int *beg, int *end);
 
 typedef struct {
-    uint32_t read_rest:1, finished:1, dummy:29;
+    int tid, beg, end;  // 0-based, half-open
+} hts_region_t;
+
+// Positions data's file to read the records overlapping regs[0], and perhaps
+// some of the following regions too, returning how many regions it covers,
+// 0 if the file has no data for regs[0], or negative on error.  Used by
+// multi-region iterators for formats, like CRAM, whose readrec functions
+// handle ranges themselves.
+typedef int hts_seek_regions_func(void *data, const hts_region_t *regs, int n_regs);
+
+struct hts_itr_multi_t;
+
+// A record's index entry, as found by an hts_idx_parse_func
+typedef struct {
+    int tid, beg, end, is_mapped;
+    char *name;  // if non-NULL, tid is instead looked up from this name
+} hts_idx_rec_t;
+
+// Returns the length of the complete records at the start of buf[0..len),
+// which is 0 if the first record continues beyond len.
+typedef size_t hts_idx_split_func(void *data, const uint8_t *buf, size_t len);
+
+// Parses the record at the start of buf, which holds complete records only,
+// filling in r; r->tid is HTS_IDX_NONE for records that are not indexed.
+// Returns the record's length, or negative if it cannot be parsed.  May be
+// called from several threads at once.
+typedef int hts_idx_parse_func(void *data, uint8_t *buf, size_t len, hts_idx_rec_t *r);
+
+typedef struct {
+    uint32_t read_rest:1, finished:1, monotonic:1, dummy:28;
     int tid, beg, end, n_off, i;
     int curr_tid, curr_beg, curr_end;
     uint64_t curr_off;
@@ -344,6 +472,13 @@ typedef struct {
         int n, m;
         int *a;
     } bins;
+    int n_fetched;  // chunks before this one have been read by bgzf_prefetch()
+    struct hts_itr_multi_t *multi;  // regions, for multi-region iterators
+    int m_off;      // allocated size of off, reused by hts_itr_requery()
+    uint64_t rec_off;       // where the last record read started
+    int prev_tid, prev_end; // records on prev_tid starting before prev_end are
+                            // skipped: earlier regions of monotonic iterators,
+                            // or earlier shards
 } hts_itr_t;
 
 #ifdef __cplusplus
@@ -353,32 +488,246 @@ extern "C" {
     #define hts_bin_first(l) (((1<<(((l)<<1) + (l))) - 1) / 7)
     #define hts_bin_parent(l) (((l) - 1) >> 3)
 
+    typedef int (*hts_name2id_f)(void*, const char*);
+    typedef const char *(*hts_id2name_f)(void*, int);
+
     hts_idx_t *hts_idx_init(int n, int fmt, uint64_t offset0, int min_shift, int n_lvls);
     void hts_idx_destroy(hts_idx_t *idx);
     int hts_idx_push(hts_idx_t *idx, int tid, int beg, int end, uint64_t offset, int is_mapped);
     void hts_idx_finish(hts_idx_t *idx, uint64_t final_offset);
+    /**
+     * hts_idx_amend_last() - replace the offset given with the last record
+     *
+     * For indexing while writing: a record that turns out to end its BGZF
+     * block is given the offset of the next block, as a reader would see it.
+     */
+    void hts_idx_amend_last(hts_idx_t *idx, uint64_t offset);
+
+    /**
+     * hts_idx_set_dense() - also build a dense linear index
+     *
+     * Samples, about every n_recs records, the smallest offset of any record
+     * overlapping a position, so that queries on deep data start within a
+     * few records of their region rather than at the start of its linear
+     * window.  The samples are saved in the meta data of a CSI, where other
+     * readers ignore them.  Call before the first hts_idx_push().
+     *
+     * Returns 0 on success, or -1 on error or for other formats.
+     */
+    int hts_idx_set_dense(hts_idx_t *idx, int n_recs);
+
+    /**
+     * hts_idx_push_mt() - index the rest of a BGZF file using a thread pool
+     *
+     * Inflates the file's blocks and parses them into records on the pool's
+     * threads, then passes the records to hts_idx_push() in file order, so
+     * the index is the same as that built by reading the file serially.
+     * getid() is used, on the calling thread, to look up the records' names.
+     *
+     * Stops early at the last few blocks, at a record that parse() rejects,
+     * or if the file is not BGZF-compressed, leaving fp positioned at the
+     * first record not yet indexed.  So callers must continue with their
+     * usual serial loop to index any remaining records.
+     *
+     * Returns 0 on success, or negative if hts_idx_push() failed.
+     */
+    int hts_idx_push_mt(hts_idx_t *idx, BGZF *fp, hts_tpool *pool, hts_idx_split_func *split, hts_idx_parse_func *parse, hts_name2id_f getid, void *data);
 
-    void hts_idx_save(const hts_idx_t *idx, const char *fn, int fmt);
+    // Saves the index next to fn, with fn's name plus .bai, .csi or .tbi.
+    // Returns 0 on success, or -1 if the file could not be written or if a
+    // reference of a lazily loaded index could not be decoded.
+    int hts_idx_save(const hts_idx_t *idx, const char *fn, int fmt);
+    /**
+     * hts_idx_load() - load the index of a data file
+     *
+     * The index is read into memory, but only its layout is examined on
+     * loading; the bins of each reference are decoded when first queried.
+     * Loaded indexes may be queried from several threads at once.
+     */
     hts_idx_t *hts_idx_load(const char *fn, int fmt);
 
+    /**
+     * hts_idx_load_mapped() - load the index of a data file, memory-mapped
+     *
+     * As hts_idx_load(), but a local BAI is memory-mapped, as by hopen()'s
+     * 'm' mode, and decoded from the mapping rather than copied, which saves
+     * memory and time for large indexes of which few references are queried.
+     * The mapping stays open until hts_idx_destroy(), so the index file must
+     * not be truncated or rewritten meanwhile: the process would be killed by
+     * SIGBUS when querying a reference not yet decoded.
+     */
+    hts_idx_t *hts_idx_load_mapped(const char *fn, int fmt);
+
     uint8_t *hts_idx_get_meta(hts_idx_t *idx, int *l_meta);
     void hts_idx_set_meta(hts_idx_t *idx, int l_meta, uint8_t *meta, int is_copy);
 
     int hts_idx_get_stat(const hts_idx_t* idx, int tid, uint64_t* mapped, uint64_t* unmapped);
     uint64_t hts_idx_get_n_no_coor(const hts_idx_t* idx);
 
+    // Estimates for one bin of a reference, made from the index alone
+    typedef struct {
+        uint32_t bin;
+        int level;              // 0 for the bin covering the whole reference
+        int64_t beg, end;       // the positions the bin covers, 0-based and half-open
+        int n_chunks;
+        uint64_t bytes;         // its share of the reference's compressed size
+        uint64_t n_records;     // and of its records
+    } hts_bin_stat_t;
+
+    // Estimates for one reference, made from the index alone
+    typedef struct {
+        int tid;
+        uint64_t n_mapped, n_unmapped;  // as hts_idx_get_stat(); 0 if not recorded
+        uint64_t bytes;         // compressed size of the reference's records
+        uint64_t off_beg, off_end;  // virtual offsets of its first record
+                                    // and of the end of its last
+        int n_bins;
+        hts_bin_stat_t *bins;   // sorted by beg, then by level
+        int window;             // size of the linear index's windows
+        int n_windows;
+        uint64_t *window_bytes; // compressed size of the records starting in
+                                // each window, a proxy for coverage
+    } hts_ref_stat_t;
+
+    /**
+     * hts_idx_ref_stat() - summarise a reference without reading the data
+     *
+     * Estimates how much data reference tid holds, in all and in each bin and
+     * linear index window, from the virtual offsets in its bins' chunks and
+     * linear index.  Compressed sizes take data within a BGZF block to be
+     * about a third of its uncompressed size.  The bins share out the
+     * reference's size and its record count, when the index records one, in
+     * proportion to the sizes of their chunks.  A reference with no records
+     * gives an empty summary.
+     *
+     * Returns a summary to be freed with hts_ref_stat_destroy(), or NULL on
+     * error or for CRAM indexes.
+     */
+    hts_ref_stat_t *hts_idx_ref_stat(const hts_idx_t *idx, int tid);
+    void hts_ref_stat_destroy(hts_ref_stat_t *st);
+
+    /**
+     * hts_idx_set_cache() - cache the chunk lists of recent queries
+     *
+     * Keeps the merged chunks of up to n_entries queries, keyed by reference
+     * and the range of min_shift-sized windows queried, so that repeated
+     * queries of the same or nearby coordinates skip the bin lookups and
+     * sorting.  The cache is shared by all threads querying the index.
+     * n_entries of 0 disables caching, which is the default.  The index must
+     * not be modified while it has a cache.
+     *
+     * Returns 0 on success, -1 on error or for CRAM indexes.
+     */
+    int hts_idx_set_cache(hts_idx_t *idx, int n_entries);
+
     const char *hts_parse_reg(const char *s, int *beg, int *end);
     hts_itr_t *hts_itr_query(const hts_idx_t *idx, int tid, int beg, int end, hts_readrec_func *readrec);
     void hts_itr_destroy(hts_itr_t *iter);
 
-    typedef int (*hts_name2id_f)(void*, const char*);
-    typedef const char *(*hts_id2name_f)(void*, int);
+    /**
+     * hts_itr_requery() - point an iterator at another region
+     *
+     * Resets an iterator returned by hts_itr_query() for a single region to
+     * iterate over tid:beg-end instead, reusing its memory rather than
+     * allocating a new iterator for each of a series of regions.
+     *
+     * If iter->monotonic is set and the regions are visited in sorted order,
+     * the parts of the new region's chunks already read for the previous
+     * region are skipped, so the iterator carries on from the block it has
+     * loaded rather than going back, and records returned for an earlier
+     * region are not returned again.  Each record is then returned once, for
+     * the first region it overlaps, as with hts_itr_regions(), provided each
+     * region is read to the end.  A region before the previous one is
+     * queried afresh.
+     *
+     * Returns 0 on success, or -1 on error or for iterators over special
+     * or multiple regions, which should be destroyed and recreated.
+     */
+    int hts_itr_requery(const hts_idx_t *idx, hts_itr_t *iter, int tid, int beg, int end);
+
     typedef hts_itr_t *hts_itr_query_func(const hts_idx_t *idx, int tid, int beg, int end, hts_readrec_func *readrec);
 
     hts_itr_t *hts_itr_querys(const hts_idx_t *idx, const char *reg, hts_name2id_f getid, void *hdr, hts_itr_query_func *itr_query, hts_readrec_func *readrec);
     int hts_itr_next(BGZF *fp, hts_itr_t *iter, void *r, void *data);
+
+    /**
+     * hts_itr_regions() - iterate over the records overlapping any of a list
+     * of regions
+     *
+     * The regions are sorted and overlapping ones merged, and the index
+     * chunks of all of them are combined.  Each compressed block is then
+     * read at most once, and each record is returned at most once, in file
+     * order, even if it overlaps several regions.  Use hts_itr_next() and
+     * hts_itr_destroy() as usual.
+     *
+     * If seek_regions is non-NULL, idx is not used; instead seek_regions is
+     * called with hts_itr_next()'s data to read each batch of regions.
+     *
+     * Returns NULL on error.
+     */
+    hts_itr_t *hts_itr_regions(const hts_idx_t *idx, const hts_region_t *regs, int n_regs, hts_seek_regions_func *seek_regions, hts_readrec_func *readrec);
+
+
+    /**
+     * hts_regidx_regions() - convert the regions in a regidx_t, as loaded
+     * from a BED file for example, for use with hts_itr_regions()
+     *
+     * Sequences that getid() does not recognise are skipped.  Returns an
+     * array to be freed by the caller, setting *n_regs, or NULL on error.
+     */
+    struct _regidx_t;
+    hts_region_t *hts_regidx_regions(struct _regidx_t *ridx, hts_name2id_f getid, void *hdr, int *n_regs);
     const char **hts_idx_seqnames(const hts_idx_t *idx, int *n, hts_id2name_f getid, void *hdr); // free only the array, not the values
 
+    /**
+     * hts_idx_shards() - divide the indexed data into balanced regions
+     *
+     * Cuts the references into regions holding similar amounts of data, about
+     * n_shards of them in all, judging by the sizes of the chunks in each bin
+     * rather than by the references' lengths.  A region never spans two
+     * references, so each reference with records gets at least one region
+     * and n_shards is only a guide to how finely the data are cut: with many
+     * small references (e.g. the contigs of a draft assembly) there are up
+     * to about n_shards plus one region per reference.  References with no records are left out, and a final
+     * HTS_IDX_NOCOOR region covers any unplaced records.  A record overlapping two regions is returned by both of
+     * their iterators, unless they are run by hts_process_shards().  Not for
+     * CRAM indexes; see sam_process_shards().
+     *
+     * Returns an array to be freed by the caller, setting *n_regs, or NULL
+     * with *n_regs set to 0 if there are no records or -1 on error.
+     */
+    hts_region_t *hts_idx_shards(const hts_idx_t *idx, int n_shards, int *n_regs);
+
+    // Called by hts_process_shards() for each shard, in one of its threads,
+    // with that thread's own file and header and an iterator over the shard.
+    // Returns negative to stop the processing of further shards.
+    typedef int hts_shard_func(htsFile *fp, void *hdr, hts_itr_t *iter, const hts_region_t *shard, void *data);
+
+    // How hts_process_shards() reads a particular format
+    typedef struct {
+        void *(*hdr_read)(htsFile *fp);
+        void (*hdr_destroy)(void *hdr);
+        hts_idx_t *(*idx_load)(htsFile *fp, const char *fn);  // for per-file indexes (CRAM); otherwise NULL
+        hts_itr_t *(*itr_query)(const hts_idx_t *idx, int tid, int beg, int end);
+    } hts_shard_ops_t;
+
+    /**
+     * hts_process_shards() - process regions of a file in parallel
+     *
+     * Calls func on each of the shards, in n_threads threads that each open
+     * fn, read its header and, if ops->idx_load is set, its index, and take
+     * the next shard until none are left.  Each record is given only to the
+     * shard in which it starts, so none is processed twice.  Shards are taken
+     * in order but processed concurrently, so func must synchronise any
+     * shared state.
+     * sam_process_shards() and bcf_process_shards() call this for their
+     * formats.
+     *
+     * Returns 0 on success, or the first negative value returned by func or
+     * -1 if a file or iterator could not be opened.
+     */
+    int hts_process_shards(const char *fn, const hts_idx_t *idx, const hts_region_t *shards, int n_shards, int n_threads, const hts_shard_ops_t *ops, hts_shard_func *func, void *data);
+
     /**
      * hts_file_type() - Convenience function to determine file type
      * DEPRECATED:  This function has been replaced by hts_detect_format().
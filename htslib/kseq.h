@@ -72,6 +72,7 @@
 			ks->begin = 0; \
 			ks->end = __read(ks->f, ks->buf, ks->bufsize); \
 			if (ks->end == 0) { ks->is_eof = 1; return -1; } \
+			if (ks->end == -1) { ks->is_eof = 1; return -3; } \
 		} \
         ks->seek_pos++; \
 		return (int)ks->buf[ks->begin++]; \
@@ -105,14 +106,12 @@ typedef struct __kstring_t {
 					ks->begin = 0; \
 					ks->end = __read(ks->f, ks->buf, ks->bufsize); \
 					if (ks->end == 0) { ks->is_eof = 1; break; } \
+					if (ks->end == -1) { ks->is_eof = 1; return -3; } \
 				} else break; \
 			} \
-			if (delimiter == KS_SEP_LINE) {  \
-				for (i = ks->begin; i < ks->end; ++i)  \
-					if (ks->buf[i] == '\n') break; \
-			} else if (delimiter > KS_SEP_MAX) { \
-				for (i = ks->begin; i < ks->end; ++i) \
-					if (ks->buf[i] == delimiter) break; \
+			if (delimiter == KS_SEP_LINE || delimiter > KS_SEP_MAX) { \
+				unsigned char *sep = (unsigned char*)memchr(ks->buf + ks->begin, delimiter == KS_SEP_LINE? '\n' : delimiter, ks->end - ks->begin); \
+				i = sep? sep - ks->buf : ks->end; \
 			} else if (delimiter == KS_SEP_SPACE) { \
 				for (i = ks->begin; i < ks->end; ++i) \
 					if (isspace(ks->buf[i])) break; \
@@ -176,6 +176,55 @@ typedef struct {
 #endif
 } bam1_t;
 
+/*! @typedef
+ @abstract Structure for a batch of alignments read by bam_read_batch().
+ @field  n          number of alignments read
+ @field  m          maximum number of alignments per batch
+ @field  b          the alignments
+ @field  l_arena    current length of bam_batch_t::arena
+ @field  m_arena    maximum length of bam_batch_t::arena
+ @field  arena      the alignments' variable-length data, concatenated
+ @field  err        error to be returned by the next bam_read_batch()
+
+ @discussion The alignments' data point into the arena rather than being
+ allocated separately, so must not be freed or grown.  They are valid until
+ the next read into the batch; use bam_dup1() to keep one for longer.
+ */
+typedef struct {
+    int n, m;
+    bam1_t *b;
+    size_t l_arena, m_arena;
+    uint8_t *arena;
+    int err;
+} bam_batch_t;
+
+/*! @typedef
+ @abstract Structure for the fields of a batch of alignments, stored by
+ column, as read by sam_read_columns().
+ @field  n          number of alignments read
+ @field  m          maximum number of alignments per batch
+ @field  fields     SAM_* bits (see enum sam_fields) selecting the columns
+ @field  tid        reference IDs (SAM_RNAME)
+ @field  pos        0-based leftmost positions (SAM_POS)
+ @field  endpos     positions after the alignments, as bam_endpos() (SAM_CIGAR)
+ @field  flag       flags (SAM_FLAG)
+ @field  mapq       mapping qualities (SAM_MAPQ)
+ @field  mtid       mates' reference IDs (SAM_RNEXT)
+ @field  mpos       mates' 0-based positions (SAM_PNEXT)
+ @field  isize      template lengths (SAM_TLEN)
+
+ @discussion Columns that were not selected are NULL.  The variable-length
+ fields (SAM_QNAME, SAM_SEQ, SAM_QUAL and SAM_AUX) have no columns.
+ */
+typedef struct {
+    int n, m;
+    uint32_t fields;
+    int32_t *tid, *pos, *endpos;
+    uint16_t *flag;
+    uint8_t *mapq;
+    int32_t *mtid, *mpos, *isize;
+} bam_columns_t;
+
 /*! @function
  @abstract  Get whether the query is on the reverse strand
  @param  b  pointer to an alignment
@@ -267,6 +316,16 @@ extern "C" {
     bam1_t *bam_copy1(bam1_t *bdst, const bam1_t *bsrc);
     bam1_t *bam_dup1(const bam1_t *bsrc);
 
+    // Read up to batch->m records at once.  Records lying within a single
+    // BGZF block are copied straight from it into the batch's arena, which
+    // is reused from batch to batch.  Returns the number of records read,
+    // -1 on end-of-file, or < -1 on error as per bam_read1(), except that
+    // -5 means out of memory.  An error after some records have been read
+    // returns those records, and the error comes from the following call.
+    bam_batch_t *bam_batch_init(int size);
+    void bam_batch_destroy(bam_batch_t *batch);
+    int bam_read_batch(BGZF *fp, bam_batch_t *batch);
+
     int bam_cigar2qlen(int n_cigar, const uint32_t *cigar);
     int bam_cigar2rlen(int n_cigar, const uint32_t *cigar);
 
@@ -295,6 +354,8 @@ extern "C" {
     #define bam_itr_destroy(iter) hts_itr_destroy(iter)
     #define bam_itr_queryi(idx, tid, beg, end) sam_itr_queryi(idx, tid, beg, end)
     #define bam_itr_querys(idx, hdr, region) sam_itr_querys(idx, hdr, region)
+    #define bam_itr_regions(idx, regs, n_regs) sam_itr_regions(idx, regs, n_regs)
+    #define bam_itr_requery(idx, itr, tid, beg, end) sam_itr_requery(idx, itr, tid, beg, end)
     #define bam_itr_next(htsfp, itr, r) hts_itr_next((htsfp)->fp.bgzf, (itr), (r), 0)
 
     // Load .csi or .bai BAM index file.
@@ -302,12 +363,34 @@ extern "C" {
 
     int bam_index_build(const char *fn, int min_shift);
 
+    // As bam_index_build(), but using n_threads threads for BAM files.  The
+    // index is the same as that built by bam_index_build().
+    int bam_index_build_mt(const char *fn, int min_shift, int n_threads);
+
+    // As bam_index_build_mt(), also sampling the smallest record offset every
+    // n_recs records for a CSI (min_shift > 0); see hts_idx_set_dense().
+    // Fails if n_recs > 0 and min_shift <= 0, as a BAI cannot store them.
+    int bam_index_build_dense(const char *fn, int min_shift, int n_threads, int n_recs);
+
+    // Build an index while writing a BAM file, avoiding a second pass over
+    // it.  Call after sam_hdr_write() and before the first sam_write1(); the
+    // index (.bai, or .csi if min_shift > 0) is saved next to the file by
+    // hts_close(), which fails if the records were not sorted.  Returns 0 on
+    // success, or -1 for other formats or when writing to standard output.
+    int sam_idx_init(htsFile *fp, bam_hdr_t *h, int min_shift);
+
     // Load BAM (.csi or .bai) or CRAM (.crai) index file.
     hts_idx_t *sam_index_load(htsFile *fp, const char *fn);
 
     #define sam_itr_destroy(iter) hts_itr_destroy(iter)
     hts_itr_t *sam_itr_queryi(const hts_idx_t *idx, int tid, int beg, int end);
     hts_itr_t *sam_itr_querys(const hts_idx_t *idx, bam_hdr_t *hdr, const char *region);
+    // Point a single-region iterator at another region; see hts_itr_requery().
+    // Also works for CRAM iterators, by moving the CRAM file's range.
+    int sam_itr_requery(const hts_idx_t *idx, hts_itr_t *iter, int tid, int beg, int end);
+    // Iterate over the records overlapping any of the regions, each once and in
+    // file order; see hts_itr_regions().
+    hts_itr_t *sam_itr_regions(const hts_idx_t *idx, const hts_region_t *regs, int n_regs);
     #define sam_itr_next(htsfp, itr, r) hts_itr_next((htsfp)->fp.bgzf, (itr), (r), (htsfp))
 
     /***************
@@ -329,6 +412,25 @@ extern "C" {
     int sam_read1(samFile *fp, bam_hdr_t *h, bam1_t *b);
     int sam_write1(samFile *fp, const bam_hdr_t *h, const bam1_t *b);
 
+    // Divide the indexed file fn into balanced shards (see hts_idx_shards(),
+    // and for CRAM, by the sizes of its slices) and call func on each in one
+    // of n_threads threads, each with its own file, header and iterator.
+    // Returns 0 on success, or negative on error or if func returns so.
+    typedef int sam_shard_func(samFile *fp, bam_hdr_t *h, hts_itr_t *iter, const hts_region_t *shard, void *data);
+    int sam_process_shards(const char *fn, const hts_idx_t *idx, int n_threads, sam_shard_func *func, void *data);
+
+    // Read up to cols->m records from a BAM or CRAM file, storing only the
+    // fields selected by cols->fields.  BAM records are read in place from
+    // their BGZF blocks; for CRAM, CRAM_OPT_REQUIRED_FIELDS is narrowed
+    // during the call so that only the data series needed are decoded, and
+    // then restored.  Slices decoded during the call still lack the other
+    // fields, so sam_read1() should not continue from where the columns
+    // stopped.  Returns the number of records read, -1 on end-of-file, or
+    // < -1 on error.
+    bam_columns_t *bam_columns_init(int size, uint32_t fields);
+    void bam_columns_destroy(bam_columns_t *cols);
+    int sam_read_columns(samFile *fp, bam_hdr_t *h, bam_columns_t *cols);
+
     /*************************************
      *** Manipulating auxiliary fields ***
      *************************************/
@@ -56,6 +56,8 @@ extern "C" {
     #define tbx_itr_destroy(iter) hts_itr_destroy(iter)
     #define tbx_itr_queryi(tbx, tid, beg, end) hts_itr_query((tbx)->idx, (tid), (beg), (end), tbx_readrec)
     #define tbx_itr_querys(tbx, s) hts_itr_querys((tbx)->idx, (s), (hts_name2id_f)(tbx_name2id), (tbx), hts_itr_query, tbx_readrec)
+    #define tbx_itr_regions(tbx, regs, n_regs) hts_itr_regions((tbx)->idx, (regs), (n_regs), NULL, tbx_readrec)
+    #define tbx_itr_requery(tbx, itr, tid, beg, end) hts_itr_requery((tbx)->idx, (itr), (tid), (beg), (end))
     #define tbx_itr_next(htsfp, tbx, itr, r) hts_itr_next(hts_get_bgzfp(htsfp), (itr), (r), (tbx))
     #define tbx_bgzf_itr_next(bgzfp, tbx, itr, r) hts_itr_next((bgzfp), (itr), (r), (tbx))
 
@@ -66,6 +68,10 @@ extern "C" {
     int tbx_readrec(BGZF *fp, void *tbxv, void *sv, int *tid, int *beg, int *end);
 
     int tbx_index_build(const char *fn, int min_shift, const tbx_conf_t *conf);
+
+    // As tbx_index_build(), but using n_threads threads.  The index is the
+    // same as that built by tbx_index_build().
+    int tbx_index_build_mt(const char *fn, int min_shift, const tbx_conf_t *conf, int n_threads);
     tbx_t *tbx_index_load(const char *fn);
     const char **tbx_seqnames(tbx_t *tbx, int *n);  // free the array but not the values
     void tbx_destroy(tbx_t *tbx);
@@ -722,12 +722,33 @@ extern "C" {
     #define bcf_itr_destroy(iter) hts_itr_destroy(iter)
     #define bcf_itr_queryi(idx, tid, beg, end) hts_itr_query((idx), (tid), (beg), (end), bcf_readrec)
     #define bcf_itr_querys(idx, hdr, s) hts_itr_querys((idx), (s), (hts_name2id_f)(bcf_hdr_name2id), (hdr), hts_itr_query, bcf_readrec)
+    #define bcf_itr_regions(idx, regs, n_regs) hts_itr_regions((idx), (regs), (n_regs), NULL, bcf_readrec)
+    #define bcf_itr_requery(idx, itr, tid, beg, end) hts_itr_requery((idx), (itr), (tid), (beg), (end))
     #define bcf_itr_next(htsfp, itr, r) hts_itr_next((htsfp)->fp.bgzf, (itr), (r), 0)
     #define bcf_index_load(fn) hts_idx_load(fn, HTS_FMT_CSI)
     #define bcf_index_seqnames(idx, hdr, nptr) hts_idx_seqnames((idx),(nptr),(hts_id2name_f)(bcf_hdr_id2name),(hdr))
 
+    // Divide the indexed BCF file fn into balanced shards and call func on
+    // each in one of n_threads threads, each with its own file, header and
+    // iterator; see hts_process_shards().  Returns 0 on success, or negative
+    // on error or if func returns so.
+    typedef int bcf_shard_func(htsFile *fp, bcf_hdr_t *h, hts_itr_t *iter, const hts_region_t *shard, void *data);
+    int bcf_process_shards(const char *fn, const hts_idx_t *idx, int n_threads, bcf_shard_func *func, void *data);
+
     int bcf_index_build(const char *fn, int min_shift);
 
+    // As bcf_index_build(), but using n_threads threads.  The index is the
+    // same as that built by bcf_index_build().
+    int bcf_index_build_mt(const char *fn, int min_shift, int n_threads);
+
+    // Build an index while writing a BCF or bgzipped VCF file, avoiding a
+    // second pass over it.  Call after bcf_hdr_write() and before the first
+    // bcf_write(); the index is saved next to the file by hts_close(), which
+    // fails if the records were not sorted.  BCF gets a CSI index (with
+    // min_shift 14 if min_shift <= 0), VCF a tabix .tbi, or .csi if
+    // min_shift > 0.  Returns 0 on success, or -1 for uncompressed output.
+    int bcf_idx_init(htsFile *fp, bcf_hdr_t *h, int min_shift);
+
 #ifdef __cplusplus
 }
 #endif
@@ -28,11 +28,19 @@ DEALINGS IN THE SOFTWARE.  */
 #include <string.h>
 #include <errno.h>
 #include <ctype.h>
+#include <limits.h>
 #include <zlib.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __SSSE3__
+#include <tmmintrin.h>
+#endif
 #include "htslib/sam.h"
 #include "htslib/bgzf.h"
 #include "cram/cram.h"
 #include "htslib/hfile.h"
+#include "hts_internal.h"
 
 #include "htslib/khash.h"
 KHASH_DECLARE(s2i, kh_cstr_t, int64_t)
@@ -321,18 +329,13 @@ static void swap_data(const bam1_core_t *c, int l_data, uint8_t *data, int is_ho
     }
 }
 
-int bam_read1(BGZF *fp, bam1_t *b)
+// Fills in b's core from the fixed-length fields following block_len, and
+// sets b->l_data; returns 0, or -4 if the record is malformed
+static int bam_unpack_core(bam1_t *b, int32_t block_len, uint32_t *x, int is_be)
 {
     bam1_core_t *c = &b->core;
-    int32_t block_len, ret, i;
-    uint32_t x[8];
-    if ((ret = bgzf_read(fp, &block_len, 4)) != 4) {
-        if (ret == 0) return -1; // normal end-of-file
-        else return -2; // truncated
-    }
-    if (bgzf_read(fp, x, 32) != 32) return -3;
-    if (fp->is_be) {
-        ed_swap_4p(&block_len);
+    int i;
+    if (is_be) {
         for (i = 0; i < 8; ++i) ed_swap_4p(x + i);
     }
     c->tid = x[0]; c->pos = x[1];
@@ -344,6 +347,21 @@ int bam_read1(BGZF *fp, bam1_t *b)
     if (b->l_data < 0 || c->l_qseq < 0) return -4;
     if ((char *)bam_get_aux(b) - (char *)b->data > b->l_data)
         return -4;
+    return 0;
+}
+
+int bam_read1(BGZF *fp, bam1_t *b)
+{
+    bam1_core_t *c = &b->core;
+    int32_t block_len, ret;
+    uint32_t x[8];
+    if ((ret = bgzf_read(fp, &block_len, 4)) != 4) {
+        if (ret == 0) return -1; // normal end-of-file
+        else return -2; // truncated
+    }
+    if (bgzf_read(fp, x, 32) != 32) return -3;
+    if (fp->is_be) ed_swap_4p(&block_len);
+    if (bam_unpack_core(b, block_len, x, fp->is_be) < 0) return -4;
     if (b->m_data < b->l_data) {
         b->m_data = b->l_data;
         kroundup32(b->m_data);
@@ -357,6 +375,111 @@ int bam_read1(BGZF *fp, bam1_t *b)
     return 4 + block_len;
 }
 
+bam_batch_t *bam_batch_init(int size)
+{
+    bam_batch_t *batch;
+    if (size <= 0) return NULL;
+    if (!(batch = (bam_batch_t*)calloc(1, sizeof(bam_batch_t)))) return NULL;
+    if (!(batch->b = (bam1_t*)calloc(size, sizeof(bam1_t)))) {
+        free(batch);
+        return NULL;
+    }
+    batch->m = size;
+    return batch;
+}
+
+void bam_batch_destroy(bam_batch_t *batch)
+{
+    if (batch == NULL) return;
+    free(batch->arena);
+    free(batch->b);
+    free(batch);
+}
+
+// Makes room for another len bytes in the arena, which may move it
+static int bam_batch_reserve(bam_batch_t *batch, size_t len)
+{
+    size_t m = batch->m_arena;
+    uint8_t *arena;
+    if (batch->l_arena + len <= m) return 0;
+    if (m == 0) m = 0x10000;
+    while (m < batch->l_arena + len) m *= 2;
+    if (!(arena = (uint8_t*)realloc(batch->arena, m))) return -1;
+    batch->arena = arena;
+    batch->m_arena = m;
+    return 0;
+}
+
+int bam_read_batch(BGZF *fp, bam_batch_t *batch)
+{
+    int32_t block_len;
+    uint32_t x[8];
+    int i, ret = 0;
+    batch->n = 0;
+    batch->l_arena = 0;
+    if (batch->err) { // left over from a call that returned records
+        ret = batch->err;
+        batch->err = 0;
+        return ret;
+    }
+    while (batch->n < batch->m) {
+        bam1_t *b = &batch->b[batch->n];
+        const uint8_t *p;
+        ssize_t avail = bgzf_peek_block(fp, &p);
+        if (avail < 0) { ret = -2; break; }
+        if (avail == 0) break;
+        // Records lying wholly within the block are copied straight from it
+        while (avail >= 36) {
+            memcpy(&block_len, p, 4);
+            if (fp->is_be) ed_swap_4p(&block_len);
+            if (block_len < 32 || 4 + (int64_t)block_len > avail) break;
+            memcpy(x, p + 4, 32);
+            if (bam_unpack_core(b, block_len, x, fp->is_be) < 0) { ret = -4; break; }
+            if (bam_batch_reserve(batch, b->l_data) < 0) { ret = -5; break; }
+            b->data = batch->arena + batch->l_arena;
+            memcpy(b->data, p + 36, b->l_data);
+            if (fp->is_be) swap_data(&b->core, b->l_data, b->data, 0);
+            batch->l_arena += b->l_data;
+            p += 4 + block_len;
+            avail -= 4 + block_len;
+            bgzf_consume(fp, 4 + block_len);
+            if (++batch->n == batch->m) break;
+            b = &batch->b[batch->n];
+        }
+        if (ret < 0 || batch->n == batch->m) break;
+        if (avail == 0) continue;
+
+        // This record continues into the next block
+        if ((ret = bgzf_read(fp, &block_len, 4)) != 4) {
+            ret = (ret == 0)? 0 : -2;
+            break;
+        }
+        if (bgzf_read(fp, x, 32) != 32) { ret = -3; break; }
+        if (fp->is_be) ed_swap_4p(&block_len);
+        if (bam_unpack_core(b, block_len, x, fp->is_be) < 0) { ret = -4; break; }
+        if (bam_batch_reserve(batch, b->l_data) < 0) { ret = -5; break; }
+        b->data = batch->arena + batch->l_arena;
+        if (bgzf_read(fp, b->data, b->l_data) != b->l_data) { ret = -4; break; }
+        if (fp->is_be) swap_data(&b->core, b->l_data, b->data, 0);
+        batch->l_arena += b->l_data;
+        batch->n++;
+        ret = 0;
+    }
+
+    // Point the records into the arena, now that it has stopped moving
+    for (i = 0, batch->l_arena = 0; i < batch->n; i++) {
+        bam1_t *b = &batch->b[i];
+        b->data = batch->arena + batch->l_arena;
+        b->m_data = b->l_data;
+        batch->l_arena += b->l_data;
+    }
+    if (ret < 0) {
+        if (batch->n == 0) return ret;
+        batch->err = ret; // hand back the good records first
+    }
+    return batch->n > 0? batch->n : -1;
+}
+
 int bam_write1(BGZF *fp, const bam1_t *b)
 {
     const bam1_core_t *c = &b->core;
@@ -389,13 +512,53 @@ int bam_write1(BGZF *fp, const bam1_t *b)
  *** BAM indexing ***
  ********************/
 
-static hts_idx_t *bam_index(BGZF *fp, int min_shift)
+// Callbacks for hts_idx_push_mt(), which only uses them on little-endian hosts
+static size_t bam_idx_split(void *data, const uint8_t *buf, size_t len)
+{
+    size_t pos = 0;
+    while (len - pos >= 4) {
+        int32_t block_len;
+        memcpy(&block_len, buf + pos, 4);
+        // A bad length ends the record here, so bam_idx_parse() rejects it
+        if (block_len < 32) return pos + 4;
+        if ((size_t)block_len > len - pos - 4) break;
+        pos += 4 + block_len;
+    }
+    return pos;
+}
+
+static int bam_idx_parse(void *data, uint8_t *buf, size_t len, hts_idx_rec_t *r)
+{
+    int32_t block_len, x[8], l_qseq;
+    uint32_t n_cigar, l_qname, i, c;
+    int64_t l;
+    const uint8_t *cigar;
+    memcpy(&block_len, buf, 4);
+    if (block_len < 32 || (size_t)block_len > len - 4) return -1;
+    memcpy(x, buf + 4, 32);
+    l_qname = x[2]&0xff;
+    n_cigar = x[3]&0xffff;
+    l_qseq = x[4];
+    // As checked by bam_read1()
+    if (l_qseq < 0 || l_qname + (n_cigar<<2) + (int64_t)l_qseq + ((l_qseq+1)>>1) > block_len - 32) return -1;
+    cigar = buf + 36 + l_qname;
+    for (i = 0, l = 0; i < n_cigar; ++i) {
+        memcpy(&c, cigar + i * 4, 4);
+        if (bam_cigar_type(bam_cigar_op(c))&2) l += bam_cigar_oplen(c);
+    }
+    if (l == 0) l = 1; // no zero-length records
+    r->tid = x[0];
+    r->beg = x[1];
+    r->end = x[1] + (int)l;
+    r->is_mapped = !(((uint32_t)x[3]>>16) & BAM_FUNMAP);
+    r->name = NULL;
+    return 4 + block_len;
+}
+
+// A BAI index, or CSI if min_shift > 0, with levels to cover the references
+static hts_idx_t *bam_idx_new(const bam_hdr_t *h, int min_shift, uint64_t offset0)
 {
     int n_lvls, i, fmt;
-    bam1_t *b;
-    hts_idx_t *idx;
-    bam_hdr_t *h;
-    h = bam_hdr_read(fp);
     if (min_shift > 0) {
         int64_t max_len = 0, s;
         for (i = 0; i < h->n_targets; ++i)
@@ -404,8 +567,25 @@ static hts_idx_t *bam_index(BGZF *fp, int min_shift)
         for (n_lvls = 0, s = 1<<min_shift; max_len > s; ++n_lvls, s <<= 3);
         fmt = HTS_FMT_CSI;
     } else min_shift = 14, n_lvls = 5, fmt = HTS_FMT_BAI;
-    idx = hts_idx_init(h->n_targets, fmt, bgzf_tell(fp), min_shift, n_lvls);
+    return hts_idx_init(h->n_targets, fmt, offset0, min_shift, n_lvls);
+}
+
+static hts_idx_t *bam_index(BGZF *fp, int min_shift, int n_dense, hts_tpool *pool)
+{
+    bam1_t *b;
+    hts_idx_t *idx;
+    bam_hdr_t *h;
+    h = bam_hdr_read(fp);
+    idx = bam_idx_new(h, min_shift, bgzf_tell(fp));
     bam_hdr_destroy(h);
+    if (n_dense > 0 && hts_idx_set_dense(idx, n_dense) < 0) {
+        hts_idx_destroy(idx);
+        return NULL;
+    }
+    if (!fp->is_be && hts_idx_push_mt(idx, fp, pool, bam_idx_split, bam_idx_parse, NULL, NULL) < 0) {
+        hts_idx_destroy(idx);
+        return NULL;
+    }
     b = bam_init1();
     while (bam_read1(fp, b) >= 0) {
         int l, ret;
@@ -426,11 +606,26 @@ static hts_idx_t *bam_index(BGZF *fp, int min_shift)
 }
 
 int bam_index_build(const char *fn, int min_shift)
+{
+    return bam_index_build_mt(fn, min_shift, 0);
+}
+
+int bam_index_build_mt(const char *fn, int min_shift, int n_threads)
+{
+    return bam_index_build_dense(fn, min_shift, n_threads, 0);
+}
+
+int bam_index_build_dense(const char *fn, int min_shift, int n_threads, int n_recs)
 {
     hts_idx_t *idx;
     htsFile *fp;
+    hts_tpool *pool = NULL;
     int ret = 0;
 
+    if (n_recs > 0 && min_shift <= 0) {
+        if (hts_verbose >= 1) fprintf(stderr, "[E::%s] dense offsets need a CSI index (min_shift > 0)\n", __func__);
+        return -1;
+    }
     if ((fp = hts_open(fn, "r")) == 0) return -1;
     switch (fp->format.format) {
     case cram:
@@ -438,9 +633,11 @@ int bam_index_build(const char *fn, int min_shift)
         break;
 
     case bam:
-        idx = bam_index(fp->fp.bgzf, min_shift);
+        if (n_threads > 0 && (pool = hts_tpool_init(n_threads)) != NULL)
+            bgzf_thread_pool(fp->fp.bgzf, pool, 0);
+        idx = bam_index(fp->fp.bgzf, min_shift, n_recs, pool);
         if (idx) {
-            hts_idx_save(idx, fn, (min_shift > 0)? HTS_FMT_CSI : HTS_FMT_BAI);
+            ret = hts_idx_save(idx, fn, (min_shift > 0)? HTS_FMT_CSI : HTS_FMT_BAI);
             hts_idx_destroy(idx);
         }
         else ret = -1;
@@ -451,6 +648,7 @@ int bam_index_build(const char *fn, int min_shift)
         break;
     }
     hts_close(fp);
+    hts_tpool_destroy(pool);
 
     return ret;
 }
@@ -466,12 +664,18 @@ static int bam_readrec(BGZF *fp, void *ignored, void *bv, int *tid, int *beg, in
     return ret;
 }
 
-// This is used only with read_rest=1 iterators, so need not set tid/beg/end.
+// This is used only with read_rest=1 iterators, but multi-region ones need
+// tid/beg/end too.
 static int cram_readrec(BGZF *ignored, void *fpv, void *bv, int *tid, int *beg, int *end)
 {
     htsFile *fp = fpv;
     bam1_t *b = bv;
-    return cram_get_bam_seq(fp->fp.cram, &b);
+    int ret;
+    if ((ret = cram_get_bam_seq(fp->fp.cram, &b)) >= 0) {
+        *tid = b->core.tid; *beg = b->core.pos;
+        *end = b->core.pos + (b->core.n_cigar? bam_cigar2rlen(b->core.n_cigar, bam_get_cigar(b)) : 1);
+    }
+    return ret;
 }
 
 // This is used only with read_rest=1 iterators, so need not set tid/beg/end.
@@ -534,7 +738,9 @@ static hts_itr_t *cram_itr_query(const hts_idx_t *idx, int tid, int beg, int end
 
     if (tid >= 0) {
         cram_range r = { tid, beg+1, end };
-        if (cram_set_option(cidx->cram, CRAM_OPT_RANGE, &r) != 0) { free(iter); return NULL; }
+        int ret = cram_set_option(cidx->cram, CRAM_OPT_RANGE, &r);
+        if (ret == -2) iter->finished = 1; // no data for this reference
+        else if (ret != 0) { free(iter); return NULL; }
         iter->curr_off = 0;
         // The following fields are not required by hts_itr_next(), but are
         // filled in in case user code wants to look at them.
@@ -546,6 +752,16 @@ static hts_itr_t *cram_itr_query(const hts_idx_t *idx, int tid, int beg, int end
     case HTS_IDX_REST:
         iter->curr_off = 0;
         break;
+    case HTS_IDX_NOCOOR: {
+        // Unplaced reads are indexed as reference -1, with no positions
+        cram_range r = { -1, INT_MIN, INT_MAX };
+        int ret = cram_set_option(cidx->cram, CRAM_OPT_RANGE, &r);
+        if (ret == -2) iter->finished = 1;
+        else if (ret != 0) { free(iter); return NULL; }
+        iter->curr_off = 0;
+        iter->tid = tid;
+        break;
+    }
     case HTS_IDX_NONE:
         iter->curr_off = 0;
         iter->finished = 1;
@@ -570,6 +786,25 @@ hts_itr_t *sam_itr_queryi(const hts_idx_t *idx, int tid, int beg, int end)
         return hts_itr_query(idx, tid, beg, end, bam_readrec);
 }
 
+int sam_itr_requery(const hts_idx_t *idx, hts_itr_t *iter, int tid, int beg, int end)
+{
+    const hts_cram_idx_t *cidx = (const hts_cram_idx_t *) idx;
+    if (idx == NULL || iter == NULL) return -1;
+    if (cidx->fmt == HTS_FMT_CRAI) {
+        cram_range r = { tid, beg+1, end };
+        int ret;
+        if (tid < 0 || !iter->read_rest || iter->multi) return -1;
+        if ((ret = cram_set_option(cidx->cram, CRAM_OPT_RANGE, &r)) != 0 && ret != -2) return -1;
+        iter->curr_off = 0;
+        iter->finished = (ret == -2); // no data for this reference
+        iter->tid = tid;
+        iter->beg = beg;
+        iter->end = end;
+        return 0;
+    }
+    return hts_itr_requery(idx, iter, tid, beg, end);
+}
+
 static int cram_name2id(void *fdv, const char *ref)
 {
     cram_fd *fd = (cram_fd *) fdv;
@@ -585,6 +820,125 @@ hts_itr_t *sam_itr_querys(const hts_idx_t *idx, bam_hdr_t *hdr, const char *regi
         return hts_itr_querys(idx, region, (hts_name2id_f)(bam_name2id), hdr, hts_itr_query, bam_readrec);
 }
 
+// Sets the CRAM range to cover regs[0] and as many of the following regions
+// on the same reference as share its containers, so each is decoded once.
+static int cram_seek_regions(void *fpv, const hts_region_t *regs, int n_regs)
+{
+    htsFile *fp = fpv;
+    cram_fd *fd = fp->fp.cram;
+    cram_range r;
+    int k, tid = regs[0].tid;
+
+    if (tid + 1 >= fd->index_sz || fd->index[tid+1].nslice == 0) return 0;
+    for (k = 1; k < n_regs && regs[k].tid == tid; ++k) {
+        cram_index *prev = cram_index_query(fd, tid, regs[k-1].end, NULL);
+        cram_index *next = cram_index_query(fd, tid, regs[k].beg+1, NULL);
+        if (prev == NULL || next == NULL || next->offset > prev->offset) break;
+    }
+    r.refid = tid; r.start = regs[0].beg+1; r.end = regs[k-1].end;
+    if (cram_set_option(fd, CRAM_OPT_RANGE, &r) != 0) return -1;
+    return k;
+}
+
+hts_itr_t *sam_itr_regions(const hts_idx_t *idx, const hts_region_t *regs, int n_regs)
+{
+    const hts_cram_idx_t *cidx = (const hts_cram_idx_t *) idx;
+    if (cidx->fmt == HTS_FMT_CRAI)
+        return hts_itr_regions(idx, regs, n_regs, cram_seek_regions, cram_readrec);
+    else
+        return hts_itr_regions(idx, regs, n_regs, NULL, bam_readrec);
+}
+
+static int64_t cram_index_size(const cram_index *e)
+{
+    int64_t size = e->len;
+    int i;
+    for (i = 0; i < e->nslice; ++i) size += cram_index_size(&e->e[i]);
+    return size;
+}
+
+// As hts_idx_shards(), cutting references at the starts of the slices listed
+// in the CRAM index, with a final HTS_IDX_NOCOOR region for unplaced reads
+static hts_region_t *cram_shards(cram_fd *fd, int n_shards, int *n_regs)
+{
+    hts_region_t *regs = NULL;
+    int64_t total = 0, target;
+    int i, j, m_regs = 0;
+    *n_regs = 0;
+    for (i = 1; i < fd->index_sz; ++i)
+        for (j = 0; j < fd->index[i].nslice; ++j) total += cram_index_size(&fd->index[i].e[j]);
+    target = total / (n_shards > 0? n_shards : 1) + 1;
+    for (i = 1; i < fd->index_sz; ++i) {
+        const cram_index *idx = &fd->index[i];
+        int64_t acc = 0;
+        int beg = 0, end;
+        if (idx->nslice == 0) continue;
+        for (j = 0; j <= idx->nslice; ++j) {
+            if (j < idx->nslice) {
+                end = idx->e[j].start - 1;
+                if (acc < target || end <= beg) {
+                    acc += cram_index_size(&idx->e[j]);
+                    continue;
+                }
+            } else end = INT_MAX;
+            if (hts_push_region(&regs, n_regs, &m_regs, i - 1, beg, end) < 0) goto fail;
+            beg = end, acc = 0;
+            if (j < idx->nslice) acc += cram_index_size(&idx->e[j]);
+        }
+    }
+    if (fd->index_sz > 0 && fd->index[0].nslice > 0
+        && hts_push_region(&regs, n_regs, &m_regs, HTS_IDX_NOCOOR, 0, 0) < 0) goto fail;
+    return regs;
+
+ fail:
+    free(regs);
+    *n_regs = -1;
+    return NULL;
+}
+
+typedef struct {
+    sam_shard_func *func;
+    void *data;
+} sam_shard_data_t;
+
+static void *sam_shard_hdr_read(htsFile *fp)
+{
+    return sam_hdr_read(fp);
+}
+
+static void sam_shard_hdr_destroy(void *h)
+{
+    bam_hdr_destroy((bam_hdr_t *) h);
+}
+
+static int sam_shard_call(htsFile *fp, void *h, hts_itr_t *iter, const hts_region_t *shard, void *data)
+{
+    sam_shard_data_t *d = (sam_shard_data_t *) data;
+    return d->func(fp, (bam_hdr_t *) h, iter, shard, d->data);
+}
+
+int sam_process_shards(const char *fn, const hts_idx_t *idx, int n_threads, sam_shard_func *func, void *data)
+{
+    const hts_cram_idx_t *cidx = (const hts_cram_idx_t *) idx;
+    hts_shard_ops_t ops = { sam_shard_hdr_read, sam_shard_hdr_destroy, NULL, sam_itr_queryi };
+    sam_shard_data_t d = { func, data };
+    hts_region_t *shards;
+    // A few shards per thread keep the threads busy when shards take
+    // different times to process
+    int n, ret, n_shards = 4 * (n_threads > 1? n_threads : 1);
+
+    if (idx == NULL) return -1;
+    if (cidx->fmt == HTS_FMT_CRAI) {
+        shards = cram_shards(cidx->cram, n_shards, &n);
+        ops.idx_load = sam_index_load;
+    }
+    else shards = hts_idx_shards(idx, n_shards, &n);
+    if (shards == NULL) return n;
+    ret = hts_process_shards(fn, idx, shards, n, n_threads, &ops, sam_shard_call, &d);
+    free(shards);
+    return ret;
+}
+
 /**********************
  *** SAM header I/O ***
  **********************/
@@ -723,16 +1077,129 @@ int sam_hdr_write(htsFile *fp, const bam_hdr_t *h)
  *** SAM record I/O ***
  **********************/
 
+// Returns the first tab or NUL at or after p, looking at 16 bytes at a time
+// while they lie before the end of the line
+static inline char *sam_find_tab(char *p, const char *end)
+{
+#ifdef __SSE2__
+    const __m128i tab = _mm_set1_epi8('\t'), nul = _mm_setzero_si128();
+    while (end - p >= 16) {
+        __m128i x = _mm_loadu_si128((const __m128i*)p);
+        int m = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(x, tab), _mm_cmpeq_epi8(x, nul)));
+        if (m) return p + __builtin_ctz(m);
+        p += 16;
+    }
+#endif
+    while (*p && *p != '\t') ++p;
+    return p;
+}
+
+// Parses the plain decimal digits at q, by far the commonest form of number
+// in SAM; returns how many there were, or 0 if strtol() is needed instead to
+// handle anything else (whitespace, signs, other bases, overflow)
+static inline int sam_dec(const char *q, int base, long *x)
+{
+    long v = 0;
+    int n;
+    const int max = sizeof(long) > 4? 18 : 9;
+    for (n = 0; n < max && (unsigned char)(q[n] - '0') < 10; n++)
+        v = v*10 + (q[n] - '0');
+    if (n == max || (base == 0 && q[0] == '0' && (n > 1 || q[1] == 'x' || q[1] == 'X')))
+        return 0;
+    *x = v;
+    return n;
+}
+
+static inline long sam_strtol(char *p, char **end, int base)
+{
+    int neg = (*p == '-'), n;
+    long x;
+    if ((n = sam_dec(p + neg, base, &x)) == 0) return strtol(p, end, base);
+    *end = p + neg + n;
+    return neg? -x : x;
+}
+
+static inline unsigned long sam_strtoul(char *p, char **end, int base)
+{
+    int n;
+    long x;
+    if ((n = sam_dec(p, base, &x)) == 0) return strtoul(p, end, base);
+    *end = p + n;
+    return x;
+}
+
+// Packs l bases into nybbles, 32 at a time while they are all from ACGTN
+static void sam_pack_seq(uint8_t *t, const char *q, int l)
+{
+    int i = 0;
+#ifdef __SSE2__
+    const __m128i A = _mm_set1_epi8('A'), C = _mm_set1_epi8('C'),
+        G = _mm_set1_epi8('G'), T = _mm_set1_epi8('T'), N = _mm_set1_epi8('N'),
+        c1 = _mm_set1_epi8(1), c2 = _mm_set1_epi8(2), c4 = _mm_set1_epi8(4),
+        c8 = _mm_set1_epi8(8), c15 = _mm_set1_epi8(15), hi = _mm_set1_epi16(0xf0);
+    for (; i + 32 <= l; i += 32) {
+        __m128i v[2];
+        int j, ok = 1;
+        for (j = 0; j < 2; j++) {
+            __m128i x = _mm_loadu_si128((const __m128i*)(q + i + 16*j));
+            __m128i a = _mm_cmpeq_epi8(x, A), c = _mm_cmpeq_epi8(x, C),
+                g = _mm_cmpeq_epi8(x, G), t = _mm_cmpeq_epi8(x, T), n = _mm_cmpeq_epi8(x, N);
+            if (_mm_movemask_epi8(_mm_or_si128(_mm_or_si128(_mm_or_si128(a, c), _mm_or_si128(g, t)), n)) != 0xffff)
+                ok = 0;
+            x = _mm_or_si128(_mm_or_si128(_mm_and_si128(a, c1), _mm_and_si128(c, c2)),
+                             _mm_or_si128(_mm_and_si128(g, c4), _mm_or_si128(_mm_and_si128(t, c8), _mm_and_si128(n, c15))));
+            // Each even base goes in the high nybble, and the odd one after it in the low
+            v[j] = _mm_or_si128(_mm_and_si128(_mm_slli_epi16(x, 4), hi), _mm_srli_epi16(x, 8));
+        }
+        if (ok) _mm_storeu_si128((__m128i*)(t + (i>>1)), _mm_packus_epi16(v[0], v[1]));
+        else {
+            for (j = i; j < i + 32; j += 2)
+                t[j>>1] = seq_nt16_table[(uint8_t)q[j]] << 4 | seq_nt16_table[(uint8_t)q[j+1]];
+        }
+    }
+#endif
+    for (; i + 1 < l; i += 2)
+        t[i>>1] = seq_nt16_table[(uint8_t)q[i]] << 4 | seq_nt16_table[(uint8_t)q[i+1]];
+    if (i < l) t[i>>1] = seq_nt16_table[(uint8_t)q[i]] << 4;
+}
+
+// Converts l quality characters to Phred scores
+static void sam_pack_qual(uint8_t *t, const char *q, int l)
+{
+    int i = 0;
+#ifdef __SSE2__
+    const __m128i c33 = _mm_set1_epi8(33);
+    for (; i + 16 <= l; i += 16)
+        _mm_storeu_si128((__m128i*)(t + i), _mm_sub_epi8(_mm_loadu_si128((const __m128i*)(q + i)), c33));
+#endif
+    for (; i < l; ++i) t[i] = q[i] - 33;
+}
+
+// Sets up the header's lookup tables, which sam_parse1() otherwise does on
+// first use, so that it can then run on several threads at once
+static void sam_parse_init(bam_hdr_t *h)
+{
+    int i;
+    if (h->cigar_tab == 0) {
+        h->cigar_tab = (int8_t*) malloc(128);
+        for (i = 0; i < 128; ++i)
+            h->cigar_tab[i] = -1;
+        for (i = 0; BAM_CIGAR_STR[i]; ++i)
+            h->cigar_tab[(int)BAM_CIGAR_STR[i]] = i;
+    }
+    if (h->sdict == 0) bam_name2id(h, "*");
+}
+
 int sam_parse1(kstring_t *s, bam_hdr_t *h, bam1_t *b)
 {
-#define _read_token(_p) (_p); for (; *(_p) && *(_p) != '\t'; ++(_p)); if (*(_p) != '\t') goto err_ret; *(_p)++ = 0
-#define _read_token_aux(_p) (_p); for (; *(_p) && *(_p) != '\t'; ++(_p)); *(_p)++ = 0 // this is different in that it does not test *(_p)=='\t'
+#define _read_token(_p) (_p); (_p) = sam_find_tab((_p), end); if (*(_p) != '\t') goto err_ret; *(_p)++ = 0
+#define _read_token_aux(_p) (_p); (_p) = sam_find_tab((_p), end); *(_p)++ = 0 // this is different in that it does not test *(_p)=='\t'
 #define _get_mem(type_t, _x, _s, _l) ks_resize((_s), (_s)->l + (_l)); *(_x) = (type_t*)((_s)->s + (_s)->l); (_s)->l += (_l)
 #define _parse_err(cond, msg) do { if ((cond) && hts_verbose >= 1) { fprintf(stderr, "[E::%s] " msg "\n", __func__); goto err_ret; } } while (0)
 #define _parse_warn(cond, msg) if ((cond) && hts_verbose >= 2) fprintf(stderr, "[W::%s] " msg "\n", __func__)
 
     uint8_t *t;
-    char *p = s->s, *q;
+    char *p = s->s, *q, *end = s->s + s->l;
     int i;
     kstring_t str;
     bam1_core_t *c = &b->core;
@@ -740,19 +1207,13 @@ int sam_parse1(kstring_t *s, bam_hdr_t *h, bam1_t *b)
     str.l = b->l_data = 0;
     str.s = (char*)b->data; str.m = b->m_data;
     memset(c, 0, 32);
-    if (h->cigar_tab == 0) {
-        h->cigar_tab = (int8_t*) malloc(128);
-        for (i = 0; i < 128; ++i)
-            h->cigar_tab[i] = -1;
-        for (i = 0; BAM_CIGAR_STR[i]; ++i)
-            h->cigar_tab[(int)BAM_CIGAR_STR[i]] = i;
-    }
+    if (h->cigar_tab == 0) sam_parse_init(h);
     // qname
     q = _read_token(p);
     kputsn_(q, p - q, &str);
     c->l_qname = p - q;
     // flag
-    c->flag = strtol(p, &p, 0);
+    c->flag = sam_strtol(p, &p, 0);
     if (*p++ != '\t') goto err_ret; // malformated flag
     // chr
     q = _read_token(p);
@@ -762,7 +1223,7 @@ int sam_parse1(kstring_t *s, bam_hdr_t *h, bam1_t *b)
         _parse_warn(c->tid < 0, "urecognized reference name; treated as unmapped");
     } else c->tid = -1;
     // pos
-    c->pos = strtol(p, &p, 10) - 1;
+    c->pos = sam_strtol(p, &p, 10) - 1;
     if (*p++ != '\t') goto err_ret;
     if (c->pos < 0 && c->tid >= 0) {
         _parse_warn(1, "mapped query cannot have zero coordinate; treated as unmapped");
@@ -770,21 +1231,22 @@ int sam_parse1(kstring_t *s, bam_hdr_t *h, bam1_t *b)
     }
     if (c->tid < 0) c->flag |= BAM_FUNMAP;
     // mapq
-    c->qual = strtol(p, &p, 10);
+    c->qual = sam_strtol(p, &p, 10);
     if (*p++ != '\t') goto err_ret;
     // cigar
     if (*p != '*') {
         uint32_t *cigar;
         size_t n_cigar = 0;
-        for (q = p; *p && *p != '\t'; ++p)
-            if (!isdigit(*p)) ++n_cigar;
+        char *r;
+        for (q = r = p, p = sam_find_tab(p, end); r < p; ++r)
+            if (!isdigit(*r)) ++n_cigar;
         if (*p++ != '\t') goto err_ret;
         _parse_err(n_cigar >= 65536, "too many CIGAR operations");
         c->n_cigar = n_cigar;
         _get_mem(uint32_t, &cigar, &str, c->n_cigar<<2);
         for (i = 0; i < c->n_cigar; ++i, ++q) {
             int op;
-            cigar[i] = strtol(q, &q, 10)<<BAM_CIGAR_SHIFT;
+            cigar[i] = sam_strtol(q, &q, 10)<<BAM_CIGAR_SHIFT;
             op = (uint8_t)*q >= 128? -1 : h->cigar_tab[(int)*q];
             _parse_err(op < 0, "unrecognized CIGAR operator");
             cigar[i] |= op;
@@ -803,14 +1265,14 @@ int sam_parse1(kstring_t *s, bam_hdr_t *h, bam1_t *b)
     else if (strcmp(q, "*") == 0) c->mtid = -1;
     else c->mtid = bam_name2id(h, q);
     // mpos
-    c->mpos = strtol(p, &p, 10) - 1;
+    c->mpos = sam_strtol(p, &p, 10) - 1;
     if (*p++ != '\t') goto err_ret;
     if (c->mpos < 0 && c->mtid >= 0) {
         _parse_warn(1, "mapped mate cannot have zero coordinate; treated as unmapped");
         c->mtid = -1;
     }
     // tlen
-    c->isize = strtol(p, &p, 10);
+    c->isize = sam_strtol(p, &p, 10);
     if (*p++ != '\t') goto err_ret;
     // seq
     q = _read_token(p);
@@ -818,18 +1280,15 @@ int sam_parse1(kstring_t *s, bam_hdr_t *h, bam1_t *b)
         c->l_qseq = p - q - 1;
         i = bam_cigar2qlen(c->n_cigar, (uint32_t*)(str.s + c->l_qname));
         _parse_err(c->n_cigar && i != c->l_qseq, "CIGAR and query sequence are of different length");
-        i = (c->l_qseq + 1) >> 1;
-        _get_mem(uint8_t, &t, &str, i);
-        memset(t, 0, i);
-        for (i = 0; i < c->l_qseq; ++i)
-            t[i>>1] |= seq_nt16_table[(int)q[i]] << ((~i&1)<<2);
+        _get_mem(uint8_t, &t, &str, (c->l_qseq + 1) >> 1);
+        sam_pack_seq(t, q, c->l_qseq);
     } else c->l_qseq = 0;
     // qual
     q = _read_token_aux(p);
     _get_mem(uint8_t, &t, &str, c->l_qseq);
     if (strcmp(q, "*")) {
         _parse_err(p - q - 1 != c->l_qseq, "SEQ and QUAL are of different length");
-        for (i = 0; i < c->l_qseq; ++i) t[i] = q[i] - 33;
+        sam_pack_qual(t, q, c->l_qseq);
     } else memset(t, 0xff, c->l_qseq);
     // aux
     // Note that (like the bam1_core_t fields) this aux data in b->data is
@@ -845,7 +1304,7 @@ int sam_parse1(kstring_t *s, bam_hdr_t *h, bam1_t *b)
             kputc_(*q, &str);
         } else if (type == 'i' || type == 'I') {
             if (*q == '-') {
-                long x = strtol(q, &q, 10);
+                long x = sam_strtol(q, &q, 10);
                 if (x >= INT8_MIN) {
                     kputc_('c', &str); kputc_(x, &str);
                 } else if (x >= INT16_MIN) {
@@ -856,7 +1315,7 @@ int sam_parse1(kstring_t *s, bam_hdr_t *h, bam1_t *b)
                     kputc_('i', &str); kputsn_(&y, 4, &str);
                 }
             } else {
-                unsigned long x = strtoul(q, &q, 10);
+                unsigned long x = sam_strtoul(q, &q, 10);
                 if (x <= UINT8_MAX) {
                     kputc_('C', &str); kputc_(x, &str);
                 } else if (x <= UINT16_MAX) {
@@ -885,13 +1344,14 @@ int sam_parse1(kstring_t *s, bam_hdr_t *h, bam1_t *b)
             for (r = q, n = 0; *r; ++r)
                 if (*r == ',') ++n;
             kputc_('B', &str); kputc_(type, &str); kputsn_(&n, 4, &str);
-            // FIXME: to evaluate which is faster: a) aligned array and then memmove(); b) unaligned array; c) kputsn_()
-            if (type == 'c')      while (q + 1 < p) { int8_t   x = strtol(q + 1, &q, 0); kputc_(x, &str); }
-            else if (type == 'C') while (q + 1 < p) { uint8_t  x = strtoul(q + 1, &q, 0); kputc_(x, &str); }
-            else if (type == 's') while (q + 1 < p) { int16_t  x = strtol(q + 1, &q, 0); kputsn_(&x, 2, &str); }
-            else if (type == 'S') while (q + 1 < p) { uint16_t x = strtoul(q + 1, &q, 0); kputsn_(&x, 2, &str); }
-            else if (type == 'i') while (q + 1 < p) { int32_t  x = strtol(q + 1, &q, 0); kputsn_(&x, 4, &str); }
-            else if (type == 'I') while (q + 1 < p) { uint32_t x = strtoul(q + 1, &q, 0); kputsn_(&x, 4, &str); }
+            // Make room for all the values at once
+            if ((i = aux_type2size(type)) <= 8 && ks_resize(&str, str.l + (size_t)n * i) < 0) goto err_ret;
+            if (type == 'c')      while (q + 1 < p) { int8_t   x = sam_strtol(q + 1, &q, 0); kputc_(x, &str); }
+            else if (type == 'C') while (q + 1 < p) { uint8_t  x = sam_strtoul(q + 1, &q, 0); kputc_(x, &str); }
+            else if (type == 's') while (q + 1 < p) { int16_t  x = sam_strtol(q + 1, &q, 0); kputsn_(&x, 2, &str); }
+            else if (type == 'S') while (q + 1 < p) { uint16_t x = sam_strtoul(q + 1, &q, 0); kputsn_(&x, 2, &str); }
+            else if (type == 'i') while (q + 1 < p) { int32_t  x = sam_strtol(q + 1, &q, 0); kputsn_(&x, 4, &str); }
+            else if (type == 'I') while (q + 1 < p) { uint32_t x = sam_strtoul(q + 1, &q, 0); kputsn_(&x, 4, &str); }
             else if (type == 'f') while (q + 1 < p) { float    x = strtod(q + 1, &q);    kputsn_(&x, 4, &str); }
             else _parse_err(1, "unrecognized type");
         } else _parse_err(1, "unrecognized type");
@@ -909,6 +1369,38 @@ err_ret:
     return -2;
 }
 
+static void *sam_text_init(const void *proto)
+{
+    return bam_init1();
+}
+
+static void sam_text_destroy(void *rec)
+{
+    bam_destroy1((bam1_t*)rec);
+}
+
+static void *sam_text_hdr_dup(const void *hdr)
+{
+    bam_hdr_t *h = bam_hdr_dup((const bam_hdr_t*)hdr);
+    if (h) sam_parse_init(h);
+    return h;
+}
+
+static void sam_text_hdr_destroy(void *hdr)
+{
+    bam_hdr_destroy((bam_hdr_t*)hdr);
+}
+
+static int sam_text_parse(kstring_t *line, void *hdr, void *rec, kstring_t *tmp)
+{
+    return sam_parse1(line, (bam_hdr_t*)hdr, (bam1_t*)rec);
+}
+
+static const hts_text_parser_t sam_text_parser = {
+    sizeof(bam1_t), sam_text_init, sam_text_destroy,
+    sam_text_hdr_dup, sam_text_hdr_destroy, sam_text_parse, NULL
+};
+
 int sam_read1(htsFile *fp, bam_hdr_t *h, bam1_t *b)
 {
     switch (fp->format.format) {
@@ -928,12 +1420,19 @@ int sam_read1(htsFile *fp, bam_hdr_t *h, bam1_t *b)
     case sam: {
         int ret;
 err_recover:
-        if (fp->line.l == 0) {
-            ret = hts_getline(fp, KS_SEP_LINE, &fp->line);
-            if (ret < 0) return -1;
+        // A line left by sam_hdr_read() is parsed before any threads start
+        if (fp->text_mt && fp->line.l == 0) {
+            ret = hts_text_mt_read(fp, &sam_text_parser, h, b);
+            if (ret == -1) return -1;
+            if (ret == -3) return -2; // read error
+        } else {
+            if (fp->line.l == 0) {
+                ret = hts_getline(fp, KS_SEP_LINE, &fp->line);
+                if (ret < 0) return (ret == -1)? -1 : -2;
+            }
+            ret = sam_parse1(&fp->line, h, b);
+            fp->line.l = 0;
         }
-        ret = sam_parse1(&fp->line, h, b);
-        fp->line.l = 0;
         if (ret < 0) {
             if (hts_verbose >= 1)
                 fprintf(stderr, "[W::%s] parse error at line %lld\n", __func__, (long long)fp->lineno);
@@ -947,136 +1446,415 @@ err_recover:
     }
 }
 
+/*************************
+ *** Columnar decoding ***
+ *************************/
+
+bam_columns_t *bam_columns_init(int size, uint32_t fields)
+{
+    bam_columns_t *cols;
+    int ok = 1;
+    if (size <= 0) return NULL;
+    if (!(cols = (bam_columns_t*)calloc(1, sizeof(bam_columns_t)))) return NULL;
+    cols->m = size;
+    cols->fields = fields;
+    if (fields & SAM_RNAME) ok &= (cols->tid    = (int32_t*)malloc(size * sizeof(int32_t))) != NULL;
+    if (fields & SAM_POS)   ok &= (cols->pos    = (int32_t*)malloc(size * sizeof(int32_t))) != NULL;
+    if (fields & SAM_CIGAR) ok &= (cols->endpos = (int32_t*)malloc(size * sizeof(int32_t))) != NULL;
+    if (fields & SAM_FLAG)  ok &= (cols->flag   = (uint16_t*)malloc(size * sizeof(uint16_t))) != NULL;
+    if (fields & SAM_MAPQ)  ok &= (cols->mapq   = (uint8_t*)malloc(size)) != NULL;
+    if (fields & SAM_RNEXT) ok &= (cols->mtid   = (int32_t*)malloc(size * sizeof(int32_t))) != NULL;
+    if (fields & SAM_PNEXT) ok &= (cols->mpos   = (int32_t*)malloc(size * sizeof(int32_t))) != NULL;
+    if (fields & SAM_TLEN)  ok &= (cols->isize  = (int32_t*)malloc(size * sizeof(int32_t))) != NULL;
+    if (!ok) {
+        bam_columns_destroy(cols);
+        return NULL;
+    }
+    return cols;
+}
+
+void bam_columns_destroy(bam_columns_t *cols)
+{
+    if (cols == NULL) return;
+    free(cols->tid);
+    free(cols->pos);
+    free(cols->endpos);
+    free(cols->flag);
+    free(cols->mapq);
+    free(cols->mtid);
+    free(cols->mpos);
+    free(cols->isize);
+    free(cols);
+}
+
+static inline uint32_t le_u32(const uint8_t *p, int is_be)
+{
+    uint32_t x;
+    memcpy(&x, p, 4);
+    if (is_be) ed_swap_4p(&x);
+    return x;
+}
+
+// Stores the selected fields of a record, given its fixed-length fields x
+// (as in the BAM record after block_size) and, if the end position is
+// wanted, its CIGAR; returns 0, or -3 if its references are out of range
+static int bam_columns_set(bam_columns_t *cols, int i, const uint8_t *x,
+                           const uint8_t *cigar, int is_be, const bam_hdr_t *h)
+{
+    int32_t tid = le_u32(x, is_be), mtid = le_u32(x + 20, is_be);
+    if (tid >= h->n_targets || tid < -1 || mtid >= h->n_targets || mtid < -1)
+        return -3;
+    if (cols->tid) cols->tid[i] = tid;
+    if (cols->pos) cols->pos[i] = le_u32(x + 4, is_be);
+    if (cols->mapq) cols->mapq[i] = le_u32(x + 8, is_be) >> 8 & 0xff;
+    if (cols->flag) cols->flag[i] = le_u32(x + 12, is_be) >> 16;
+    if (cols->mtid) cols->mtid[i] = mtid;
+    if (cols->mpos) cols->mpos[i] = le_u32(x + 24, is_be);
+    if (cols->isize) cols->isize[i] = le_u32(x + 28, is_be);
+    if (cols->endpos) {
+        // As bam_endpos(), without unpacking the CIGAR
+        int32_t pos = le_u32(x + 4, is_be);
+        uint32_t flag_nc = le_u32(x + 12, is_be), k, n_cigar = flag_nc & 0xffff, rlen = 0;
+        if (!((flag_nc >> 16) & BAM_FUNMAP) && n_cigar > 0) {
+            for (k = 0; k < n_cigar; k++) {
+                uint32_t op = le_u32(cigar + 4*k, is_be);
+                if (bam_cigar_type(bam_cigar_op(op))&2) rlen += bam_cigar_oplen(op);
+            }
+            cols->endpos[i] = pos + rlen;
+        }
+        else cols->endpos[i] = pos + 1;
+    }
+    return 0;
+}
+
+static int bam_read_columns(BGZF *fp, const bam_hdr_t *h, bam_columns_t *cols)
+{
+    kstring_t buf = { 0, 0, NULL };
+    int32_t block_len;
+    int ret = 0;
+    while (cols->n < cols->m) {
+        const uint8_t *p;
+        ssize_t avail = bgzf_peek_block(fp, &p);
+        if (avail < 0) { ret = -2; break; }
+        if (avail == 0) break;
+        // Records lying wholly within the block are read from it in place,
+        // looking only at the fields selected
+        while (avail >= 36) {
+            block_len = le_u32(p, fp->is_be);
+            if (block_len < 32 || 4 + (int64_t)block_len > avail) break;
+            if (cols->endpos && 32 + p[12] + 4 * (int64_t)(le_u32(p + 16, fp->is_be) & 0xffff) > block_len) {
+                ret = -4;
+                break;
+            }
+            if ((ret = bam_columns_set(cols, cols->n, p + 4, p + 36 + p[12], fp->is_be, h)) < 0) break;
+            p += 4 + block_len;
+            avail -= 4 + block_len;
+            bgzf_consume(fp, 4 + block_len);
+            if (++cols->n == cols->m) break;
+        }
+        if (ret < 0 || cols->n == cols->m) break;
+        if (avail == 0) continue;
+
+        // This record continues into the next block, so is copied out
+        if ((ret = bgzf_read(fp, &block_len, 4)) != 4) {
+            ret = -2;
+            break;
+        }
+        if (fp->is_be) ed_swap_4p(&block_len);
+        if (block_len < 32) { ret = -4; break; }
+        buf.l = 0;
+        if (ks_resize(&buf, block_len) < 0) { ret = -4; break; }
+        if (bgzf_read(fp, buf.s, block_len) != block_len) { ret = -4; break; }
+        if (cols->endpos && 32 + (uint8_t)buf.s[8] + 4 * (int64_t)(le_u32((uint8_t*)buf.s + 12, fp->is_be) & 0xffff) > block_len) {
+            ret = -4;
+            break;
+        }
+        if ((ret = bam_columns_set(cols, cols->n, (uint8_t*)buf.s, (uint8_t*)buf.s + 32 + (uint8_t)buf.s[8], fp->is_be, h)) < 0) break;
+        cols->n++;
+    }
+    free(buf.s);
+    return ret;
+}
+
+static int cram_read_columns(cram_fd *fd, bam_columns_t *cols)
+{
+    while (cols->n < cols->m) {
+        cram_record *cr = cram_get_seq(fd);
+        int i = cols->n;
+        if (cr == NULL) return fd->err? -2 : 0;
+        if (cols->tid) cols->tid[i] = cr->ref_id;
+        if (cols->pos) cols->pos[i] = cr->apos - 1;
+        if (cols->endpos)
+            cols->endpos[i] = (!(cr->flags & BAM_FUNMAP) && cr->ncigar > 0)? cr->aend : cr->apos;
+        if (cols->flag) cols->flag[i] = cr->flags;
+        if (cols->mapq) cols->mapq[i] = cr->mqual;
+        if (cols->mtid) cols->mtid[i] = cr->mate_ref_id;
+        if (cols->mpos) cols->mpos[i] = cr->mate_pos - 1;
+        if (cols->isize) cols->isize[i] = cr->tlen;
+        cols->n++;
+    }
+    return 0;
+}
+
+int sam_read_columns(samFile *fp, bam_hdr_t *h, bam_columns_t *cols)
+{
+    int ret;
+    cols->n = 0;
+    switch (fp->format.format) {
+    case bam:
+        ret = bam_read_columns(fp->fp.bgzf, h, cols);
+        break;
+
+    case cram: {
+        // Only the selected data series are decoded, but CRAM only finds
+        // where alignments end, which template lengths also depend on,
+        // while decoding their sequences.  The caller's mask is restored
+        // afterwards.
+        int fields = cols->fields, saved = fp->fp.cram->required_fields;
+        if (fields & (SAM_CIGAR | SAM_TLEN)) fields |= SAM_SEQ;
+        if (hts_set_opt(fp, CRAM_OPT_REQUIRED_FIELDS, fields) != 0) return -2;
+        ret = cram_read_columns(fp->fp.cram, cols);
+        hts_set_opt(fp, CRAM_OPT_REQUIRED_FIELDS, saved);
+        break;
+        }
+
+    default:
+        if (hts_verbose >= 1)
+            fprintf(stderr, "[E::%s] only BAM and CRAM can be read in columns\n", __func__);
+        return -2;
+    }
+    if (ret < 0) return ret;
+    return cols->n > 0? cols->n : -1;
+}
+
+// Decimal digit pairs, for writing numbers two digits per division
+static const char sam_digit_pairs[200] =
+    "0001020304050607080910111213141516171819"
+    "2021222324252627282930313233343536373839"
+    "4041424344454647484950515253545556575859"
+    "6061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+// Writes x in decimal at p, returning the end of the digits
+static inline char *sam_utoa(char *p, uint32_t x)
+{
+    char buf[10], *q = buf + sizeof buf;
+    while (x >= 100) {
+        q -= 2; memcpy(q, sam_digit_pairs + 2*(x % 100), 2);
+        x /= 100;
+    }
+    if (x >= 10) { q -= 2; memcpy(q, sam_digit_pairs + 2*x, 2); }
+    else *--q = '0' + x;
+    memcpy(p, q, buf + sizeof buf - q);
+    return p + (buf + sizeof buf - q);
+}
+
+static inline char *sam_itoa(char *p, int32_t x)
+{
+    if (x >= 0) return sam_utoa(p, x);
+    *p++ = '-';
+    return sam_utoa(p, -(uint32_t)x);
+}
+
+// The two bases encoded by each byte of packed SEQ
+static const char sam_nt16_pairs[512] =
+    "===A=C=M=G=R=S=V=T=W=Y=H=K=D=B=N"
+    "A=AAACAMAGARASAVATAWAYAHAKADABAN"
+    "C=CACCCMCGCRCSCVCTCWCYCHCKCDCBCN"
+    "M=MAMCMMMGMRMSMVMTMWMYMHMKMDMBMN"
+    "G=GAGCGMGGGRGSGVGTGWGYGHGKGDGBGN"
+    "R=RARCRMRGRRRSRVRTRWRYRHRKRDRBRN"
+    "S=SASCSMSGSRSSSVSTSWSYSHSKSDSBSN"
+    "V=VAVCVMVGVRVSVVVTVWVYVHVKVDVBVN"
+    "T=TATCTMTGTRTSTVTTTWTYTHTKTDTBTN"
+    "W=WAWCWMWGWRWSWVWTWWWYWHWKWDWBWN"
+    "Y=YAYCYMYGYRYSYVYTYWYYYHYKYDYBYN"
+    "H=HAHCHMHGHRHSHVHTHWHYHHHKHDHBHN"
+    "K=KAKCKMKGKRKSKVKTKWKYKHKKKDKBKN"
+    "D=DADCDMDGDRDSDVDTDWDYDHDKDDDBDN"
+    "B=BABCBMBGBRBSBVBTBWBYBHBKBDBBBN"
+    "N=NANCNMNGNRNSNVNTNWNYNHNKNDNBNN";
+
+// Writes l bases from nybbles, 32 at a time with SSSE3 table lookups and
+// otherwise a byte (two bases) at a time
+static void sam_unpack_seq(char *p, const uint8_t *s, int l)
+{
+    int i = 0;
+#ifdef __SSSE3__
+    const __m128i lut = _mm_loadu_si128((const __m128i*)seq_nt16_str), c15 = _mm_set1_epi8(15);
+    for (; i + 32 <= l; i += 32) {
+        __m128i x = _mm_loadu_si128((const __m128i*)(s + (i>>1)));
+        __m128i hi = _mm_shuffle_epi8(lut, _mm_and_si128(_mm_srli_epi16(x, 4), c15));
+        __m128i lo = _mm_shuffle_epi8(lut, _mm_and_si128(x, c15));
+        _mm_storeu_si128((__m128i*)(p + i), _mm_unpacklo_epi8(hi, lo));
+        _mm_storeu_si128((__m128i*)(p + i + 16), _mm_unpackhi_epi8(hi, lo));
+    }
+#endif
+    for (; i + 1 < l; i += 2) memcpy(p + i, sam_nt16_pairs + 2*s[i>>1], 2);
+    if (i < l) p[i] = seq_nt16_str[s[i>>1] >> 4];
+}
+
+// Converts l Phred scores to quality characters
+static void sam_unpack_qual(char *p, const uint8_t *s, int l)
+{
+    int i = 0;
+#ifdef __SSE2__
+    const __m128i c33 = _mm_set1_epi8(33);
+    for (; i + 16 <= l; i += 16)
+        _mm_storeu_si128((__m128i*)(p + i), _mm_add_epi8(_mm_loadu_si128((const __m128i*)(s + i)), c33));
+#endif
+    for (; i < l; ++i) p[i] = s[i] + 33;
+}
+
 int sam_format1(const bam_hdr_t *h, const bam1_t *b, kstring_t *str)
 {
     int i;
-    uint8_t *s;
+    uint8_t *s, *end = b->data + b->l_data;
     const bam1_core_t *c = &b->core;
-
+    const char *rname = c->tid >= 0? h->target_name[c->tid] : "*";
+    const char *mname = c->mtid < 0? "*" : c->mtid == c->tid? "=" : h->target_name[c->mtid];
+    size_t l_rname = strlen(rname), l_mname = strlen(mname), l_aux;
+    char *p;
+
+    // Size the string once for the whole record, then write to it directly.
+    // Nothing in an aux field takes more than five characters per byte: the
+    // worst is a B:c element such as ",-128"
+    s = bam_get_aux(b);
+    l_aux = s < end? end - s : 0;
     str->l = 0;
-    kputsn(bam_get_qname(b), c->l_qname-1, str); kputc('\t', str); // query name
-    kputw(c->flag, str); kputc('\t', str); // flag
-    if (c->tid >= 0) { // chr
-        kputs(h->target_name[c->tid] , str);
-        kputc('\t', str);
-    } else kputsn("*\t", 2, str);
-    kputw(c->pos + 1, str); kputc('\t', str); // pos
-    kputw(c->qual, str); kputc('\t', str); // qual
+    if (c->l_qseq < 0
+        || ks_resize(str, c->l_qname + l_rname + l_mname + (size_t)c->n_cigar * 11
+                     + 2 * (size_t)c->l_qseq + 5 * l_aux + 64) < 0)
+        return -1;
+    p = str->s;
+
+    memcpy(p, bam_get_qname(b), c->l_qname-1); p += c->l_qname-1; *p++ = '\t'; // query name
+    p = sam_utoa(p, c->flag); *p++ = '\t'; // flag
+    memcpy(p, rname, l_rname); p += l_rname; *p++ = '\t'; // chr
+    p = sam_itoa(p, c->pos + 1); *p++ = '\t'; // pos
+    p = sam_utoa(p, c->qual); *p++ = '\t'; // qual
     if (c->n_cigar) { // cigar
         uint32_t *cigar = bam_get_cigar(b);
         for (i = 0; i < c->n_cigar; ++i) {
-            kputw(bam_cigar_oplen(cigar[i]), str);
-            kputc(bam_cigar_opchr(cigar[i]), str);
+            p = sam_utoa(p, bam_cigar_oplen(cigar[i]));
+            *p++ = bam_cigar_opchr(cigar[i]);
         }
-    } else kputc('*', str);
-    kputc('\t', str);
-    if (c->mtid < 0) kputsn("*\t", 2, str); // mate chr
-    else if (c->mtid == c->tid) kputsn("=\t", 2, str);
-    else {
-        kputs(h->target_name[c->mtid], str);
-        kputc('\t', str);
-    }
-    kputw(c->mpos + 1, str); kputc('\t', str); // mate pos
-    kputw(c->isize, str); kputc('\t', str); // template len
+    } else *p++ = '*';
+    *p++ = '\t';
+    memcpy(p, mname, l_mname); p += l_mname; *p++ = '\t'; // mate chr
+    p = sam_itoa(p, c->mpos + 1); *p++ = '\t'; // mate pos
+    p = sam_itoa(p, c->isize); *p++ = '\t'; // template len
     if (c->l_qseq) { // seq and qual
-        uint8_t *s = bam_get_seq(b);
-        for (i = 0; i < c->l_qseq; ++i) kputc("=ACMGRSVTWYHKDBN"[bam_seqi(s, i)], str);
-        kputc('\t', str);
+        sam_unpack_seq(p, bam_get_seq(b), c->l_qseq);
+        p += c->l_qseq; *p++ = '\t';
         s = bam_get_qual(b);
-        if (s[0] == 0xff) kputc('*', str);
-        else for (i = 0; i < c->l_qseq; ++i) kputc(s[i] + 33, str);
-    } else kputsn("*\t*", 3, str);
+        if (s[0] == 0xff) *p++ = '*';
+        else { sam_unpack_qual(p, s, c->l_qseq); p += c->l_qseq; }
+    } else { memcpy(p, "*\t*", 3); p += 3; }
     s = bam_get_aux(b); // aux
-    while (s+4 <= b->data + b->l_data) {
-        uint8_t type, key[2];
-        key[0] = s[0]; key[1] = s[1];
+    while (s+4 <= end) {
+        uint8_t type;
+        *p++ = '\t'; *p++ = s[0]; *p++ = s[1]; *p++ = ':';
         s += 2; type = *s++;
-        kputc('\t', str); kputsn((char*)key, 2, str); kputc(':', str);
         if (type == 'A') {
-            kputsn("A:", 2, str);
-            kputc(*s, str);
-            ++s;
+            *p++ = 'A'; *p++ = ':';
+            *p++ = *s++;
         } else if (type == 'C') {
-            kputsn("i:", 2, str);
-            kputw(*s, str);
-            ++s;
+            *p++ = 'i'; *p++ = ':';
+            p = sam_utoa(p, *s++);
         } else if (type == 'c') {
-            kputsn("i:", 2, str);
-            kputw(*(int8_t*)s, str);
-            ++s;
+            *p++ = 'i'; *p++ = ':';
+            p = sam_itoa(p, *(int8_t*)s++);
         } else if (type == 'S') {
-            if (s+2 <= b->data + b->l_data) {
-                kputsn("i:", 2, str);
-                kputw(*(uint16_t*)s, str);
-                s += 2;
-            } else return -1;
+            if (s+2 > end) return -1;
+            *p++ = 'i'; *p++ = ':';
+            p = sam_utoa(p, *(uint16_t*)s);
+            s += 2;
         } else if (type == 's') {
-            if (s+2 <= b->data + b->l_data) {
-                kputsn("i:", 2, str);
-                kputw(*(int16_t*)s, str);
-                s += 2;
-            } else return -1;
+            if (s+2 > end) return -1;
+            *p++ = 'i'; *p++ = ':';
+            p = sam_itoa(p, *(int16_t*)s);
+            s += 2;
         } else if (type == 'I') {
-            if (s+4 <= b->data + b->l_data) {
-                kputsn("i:", 2, str);
-                kputuw(*(uint32_t*)s, str);
-                s += 4;
-            } else return -1;
+            if (s+4 > end) return -1;
+            *p++ = 'i'; *p++ = ':';
+            p = sam_utoa(p, *(uint32_t*)s);
+            s += 4;
         } else if (type == 'i') {
-            if (s+4 <= b->data + b->l_data) {
-                kputsn("i:", 2, str);
-                kputw(*(int32_t*)s, str);
-                s += 4;
-            } else return -1;
+            if (s+4 > end) return -1;
+            *p++ = 'i'; *p++ = ':';
+            p = sam_itoa(p, *(int32_t*)s);
+            s += 4;
         } else if (type == 'f') {
-            if (s+4 <= b->data + b->l_data) {
-                ksprintf(str, "f:%g", *(float*)s);
-                s += 4;
-            } else return -1;
-
+            if (s+4 > end) return -1;
+            p += sprintf(p, "f:%g", *(float*)s);
+            s += 4;
         } else if (type == 'd') {
-            if (s+8 <= b->data + b->l_data) {
-                ksprintf(str, "d:%g", *(double*)s);
-                s += 8;
-            } else return -1;
+            if (s+8 > end) return -1;
+            p += sprintf(p, "d:%g", *(double*)s);
+            s += 8;
         } else if (type == 'Z' || type == 'H') {
-            kputc(type, str); kputc(':', str);
-            while (s < b->data + b->l_data && *s) kputc(*s++, str);
-            if (s >= b->data + b->l_data)
-                return -1;
-            ++s;
+            uint8_t *z = memchr(s, 0, end - s);
+            if (z == NULL) return -1;
+            *p++ = type; *p++ = ':';
+            memcpy(p, s, z - s); p += z - s;
+            s = z + 1;
         } else if (type == 'B') {
             uint8_t sub_type = *(s++);
+            int size = aux_type2size(sub_type);
             int32_t n;
+            if (size == 0 || size > 4 || s+4 > end) return -1;
             memcpy(&n, s, 4);
             s += 4; // no point to the start of the array
-            if (s + n >= b->data + b->l_data)
-                return -1;
-            kputsn("B:", 2, str); kputc(sub_type, str); // write the typing
-            for (i = 0; i < n; ++i) { // FIXME: for better performance, put the loop after "if"
-                kputc(',', str);
-                if ('c' == sub_type)      { kputw(*(int8_t*)s, str); ++s; }
-                else if ('C' == sub_type) { kputw(*(uint8_t*)s, str); ++s; }
-                else if ('s' == sub_type) { kputw(*(int16_t*)s, str); s += 2; }
-                else if ('S' == sub_type) { kputw(*(uint16_t*)s, str); s += 2; }
-                else if ('i' == sub_type) { kputw(*(int32_t*)s, str); s += 4; }
-                else if ('I' == sub_type) { kputuw(*(uint32_t*)s, str); s += 4; }
-                else if ('f' == sub_type) { ksprintf(str, "%g", *(float*)s); s += 4; }
+            if (n > 0 && (end - s) / size < n) return -1;
+            *p++ = 'B'; *p++ = ':'; *p++ = sub_type; // write the typing
+            switch (sub_type) {
+            case 'c': for (i = 0; i < n; ++i, ++s) { *p++ = ','; p = sam_itoa(p, *(int8_t*)s); } break;
+            case 'C': for (i = 0; i < n; ++i, ++s) { *p++ = ','; p = sam_utoa(p, *s); } break;
+            case 's': for (i = 0; i < n; ++i, s += 2) { *p++ = ','; p = sam_itoa(p, *(int16_t*)s); } break;
+            case 'S': for (i = 0; i < n; ++i, s += 2) { *p++ = ','; p = sam_utoa(p, *(uint16_t*)s); } break;
+            case 'i': for (i = 0; i < n; ++i, s += 4) { *p++ = ','; p = sam_itoa(p, *(int32_t*)s); } break;
+            case 'I': for (i = 0; i < n; ++i, s += 4) { *p++ = ','; p = sam_utoa(p, *(uint32_t*)s); } break;
+            case 'f': for (i = 0; i < n; ++i, s += 4) p += sprintf(p, ",%g", *(float*)s); break;
+            default: return -1;
             }
         }
     }
+    *p = 0;
+    str->l = p - str->s;
     return str->l;
 }
 
+int sam_idx_init(htsFile *fp, bam_hdr_t *h, int min_shift)
+{
+    if (!fp->is_write || fp->idx || strcmp(fp->fn, "-") == 0) return -1;
+    if (fp->format.format != bam && fp->format.format != binary_format) return -1;
+    // Start the records in a new block, so that the initial offset is
+    // known even if compression is multi-threaded
+    if (bgzf_flush(fp->fp.bgzf) < 0) return -1;
+    fp->idx = bam_idx_new(h, min_shift, bgzf_tell(fp->fp.bgzf));
+    return fp->idx? 0 : -1;
+}
+
 int sam_write1(htsFile *fp, const bam_hdr_t *h, const bam1_t *b)
 {
+    int ret, l;
     switch (fp->format.format) {
     case binary_format:
         fp->format.category = sequence_data;
         fp->format.format = bam;
         /* fall-through */
     case bam:
-        return bam_write1(fp->fp.bgzf, b);
+        if ((ret = bam_write1(fp->fp.bgzf, b)) < 0 || !fp->idx) return ret;
+        l = bam_cigar2rlen(b->core.n_cigar, bam_get_cigar(b));
+        if (l == 0) l = 1; // no zero-length records, as in bam_index()
+        if (bgzf_idx_push(fp->fp.bgzf, fp->idx, b->core.tid, b->core.pos, b->core.pos + l, !(b->core.flag&BAM_FUNMAP)) < 0) {
+            // unsorted; abandon the index
+            hts_idx_destroy(fp->idx);
+            fp->idx = NULL;
+            return -1;
+        }
+        return ret;
 
     case cram:
         return cram_put_bam_seq(fp->fp.cram, (bam1_t *)b);
@@ -343,12 +343,14 @@ static int usage(void)
     fprintf(stderr, "   -b, --begin INT            column number for region start [4]\n");
     fprintf(stderr, "   -c, --comment CHAR         skip comment lines starting with CHAR [null]\n");
     fprintf(stderr, "   -C, --csi                  generate CSI index for VCF (default is TBI)\n");
+    fprintf(stderr, "   -D, --dense INT            for BAM, also store the first offset every INT records (implies -C) [0]\n");
     fprintf(stderr, "   -e, --end INT              column number for region end (if no end, set INT to -b) [5]\n");
     fprintf(stderr, "   -f, --force                overwrite existing index without asking\n");
     fprintf(stderr, "   -m, --min-shift INT        set minimal interval size for CSI indices to 2^INT [14]\n");
     fprintf(stderr, "   -p, --preset STR           gff, bed, sam, vcf\n");
     fprintf(stderr, "   -s, --sequence INT         column number for sequence names (suppressed by -p) [1]\n");
     fprintf(stderr, "   -S, --skip-lines INT       skip first INT lines [0]\n");
+    fprintf(stderr, "   -@, --threads INT          number of threads to use when indexing [0]\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "Querying and other options:\n");
     fprintf(stderr, "   -h, --print-header         print also the header lines\n");
@@ -363,7 +365,7 @@ static int usage(void)
 
 int main(int argc, char *argv[])
 {
-    int c, min_shift = 0, is_force = 0, list_chroms = 0, do_csi = 0;
+    int c, min_shift = 0, is_force = 0, list_chroms = 0, do_csi = 0, n_threads = 0, n_dense = 0;
     tbx_conf_t conf = tbx_conf_gff, *conf_ptr = NULL;
     char *reheader = NULL;
     args_t args;
@@ -387,10 +389,12 @@ int main(int argc, char *argv[])
         {"skip-lines",1,0,'S'},
         {"list-chroms",0,0,'l'},
         {"reheader",1,0,'r'},
+        {"threads",1,0,'@'},
+        {"dense",1,0,'D'},
         {0,0,0,0}
     };
 
-    while ((c = getopt_long(argc, argv, "hH?0b:c:e:fm:p:s:S:lr:CR:T:", loptions,NULL)) >= 0)
+    while ((c = getopt_long(argc, argv, "hH?0b:c:e:fm:p:s:S:lr:CR:T:@:D:", loptions,NULL)) >= 0)
     {
         switch (c)
         {
@@ -418,6 +422,8 @@ int main(int argc, char *argv[])
                       break;
             case 's': conf.sc = atoi(optarg); break;
             case 'S': conf.line_skip = atoi(optarg); break;
+            case '@': n_threads = atoi(optarg); break;
+            case 'D': n_dense = atoi(optarg); break;
             default: return usage();
         }
     }
@@ -457,6 +463,11 @@ int main(int argc, char *argv[])
             if ( !min_shift ) min_shift = 14;
         }
     }
+    if ( n_dense )
+    {
+        if ( ftype!=IS_BAM ) error("[tabix] -D applies only to BAM files\n");
+        if ( !do_csi ) do_csi = 1;  // the dense offsets are stored in a CSI
+    }
     if ( do_csi )
     {
         if ( !min_shift ) min_shift = 14;
@@ -499,20 +510,20 @@ int main(int argc, char *argv[])
     {
         if ( ftype==IS_BCF )
         {
-            if ( bcf_index_build(fname, min_shift)!=0 ) error("bcf_index_build failed: %s\n", fname);
+            if ( bcf_index_build_mt(fname, min_shift, n_threads)!=0 ) error("bcf_index_build failed: %s\n", fname);
             return 0;
         }
         if ( ftype==IS_BAM )
         {
-            if ( bam_index_build(fname, min_shift)!=0 ) error("bam_index_build failed: %s\n", fname);
+            if ( bam_index_build_dense(fname, min_shift, n_threads, n_dense)!=0 ) error("bam_index_build failed: %s\n", fname);
             return 0;
         }
-        if ( tbx_index_build(fname, min_shift, &conf)!=0 ) error("tbx_index_build failed: %s\n", fname);
+        if ( tbx_index_build_mt(fname, min_shift, &conf, n_threads)!=0 ) error("tbx_index_build failed: %s\n", fname);
         return 0;
     }
     else    // TBI index
     {
-        if ( tbx_index_build(fname, min_shift, &conf) ) error("tbx_index_build failed: %s\n", fname);
+        if ( tbx_index_build_mt(fname, min_shift, &conf, n_threads) ) error("tbx_index_build failed: %s\n", fname);
         return 0;
     }
     return 0;
@@ -74,7 +74,7 @@ int tbx_parse1(const tbx_conf_t *conf, int len, char *line, tbx_intv_t *intv)
     char *s;
     intv->ss = intv->se = 0; intv->beg = intv->end = -1;
     for (i = 0; i <= len; ++i) {
-        if (line[i] == '\t' || line[i] == 0) {
+        if (i == len || line[i] == '\t' || line[i] == 0) {
             ++ncols;
             if (id == conf->sc) {
                 intv->ss = line + b; intv->se = line + i;
@@ -146,7 +146,7 @@ static inline int get_intv(tbx_t *tbx, kstring_t *str, tbx_intv_t *intv, int is_
             case TBX_UCSC: type = "TBX_UCSC"; break;
             default: type = "TBX_GENERIC"; break;
         }
-        fprintf(stderr, "[E::%s] failed to parse %s, was wrong -p [type] used?\nThe offending line was: \"%s\"\n", __func__, type, str->s);
+        fprintf(stderr, "[E::%s] failed to parse %s, was wrong -p [type] used?\nThe offending line was: \"%.*s\"\n", __func__, type, (int)str->l, str->s);
         return -1;
     }
 }
@@ -195,10 +195,43 @@ void tbx_set_meta(tbx_t *tbx)
     hts_idx_set_meta(tbx->idx, l, meta, 0);
 }
 
-tbx_t *tbx_index(BGZF *fp, int min_shift, const tbx_conf_t *conf)
+// Callbacks for hts_idx_push_mt()
+static size_t tbx_idx_split(void *data, const uint8_t *buf, size_t len)
+{
+    while (len > 0 && buf[len-1] != '\n') --len;
+    return len;
+}
+
+static int tbx_idx_parse(void *data, uint8_t *buf, size_t len, hts_idx_rec_t *r)
+{
+    tbx_t *tbx = (tbx_t *) data;
+    char *line = (char *) buf, *end = (char *) memchr(buf, '\n', len);
+    int l = end - line;
+    tbx_intv_t intv;
+    if (l > 0 && line[l-1] == '\r') l--;
+    if (l > 0 && line[0] == tbx->conf.meta_char) {
+        r->tid = HTS_IDX_NONE;
+        return end - line + 1;
+    }
+    if (tbx_parse1(&tbx->conf, l, line, &intv) != 0) return -1;
+    *intv.se = '\0';
+    r->tid = -1; // looked up from the name
+    r->name = intv.ss;
+    r->beg = intv.beg;
+    r->end = intv.end;
+    r->is_mapped = 1;
+    return end - line + 1;
+}
+
+static int tbx_name2id_add(void *tbx, const char *ss)
+{
+    return get_tid((tbx_t *) tbx, ss, 1);
+}
+
+static tbx_t *tbx_index_mt(BGZF *fp, int min_shift, const tbx_conf_t *conf, hts_tpool *pool)
 {
     tbx_t *tbx;
-    kstring_t str;
+    kstring_t str, line;
     int ret, first = 0, n_lvls, fmt;
     int64_t lineno = 0;
     uint64_t last_off = 0;
@@ -209,9 +242,12 @@ tbx_t *tbx_index(BGZF *fp, int min_shift, const tbx_conf_t *conf)
     tbx->conf = *conf;
     if (min_shift > 0) n_lvls = (TBX_MAX_SHIFT - min_shift + 2) / 3, fmt = HTS_FMT_CSI;
     else min_shift = 14, n_lvls = 5, fmt = HTS_FMT_TBI;
-    while ((ret = bgzf_getline(fp, '\n', &str)) >= 0) {
+    line.m = 0;
+    // Most lines are parsed in place within the BGZF block, without copying
+    while ((ret = bgzf_getline_ref(fp, '\n', &str, &line.s)) >= 0) {
+        line.l = ret;
         ++lineno;
-        if (lineno <= tbx->conf.line_skip || str.s[0] == tbx->conf.meta_char) {
+        if (lineno <= tbx->conf.line_skip || (line.l > 0 && line.s[0] == tbx->conf.meta_char)) {
             last_off = bgzf_tell(fp);
             continue;
         }
@@ -219,8 +255,13 @@ tbx_t *tbx_index(BGZF *fp, int min_shift, const tbx_conf_t *conf)
             tbx->idx = hts_idx_init(0, fmt, last_off, min_shift, n_lvls);
             first = 1;
         }
-        get_intv(tbx, &str, &intv, 1);
+        get_intv(tbx, &line, &intv, 1);
         ret = hts_idx_push(tbx->idx, intv.tid, intv.beg, intv.end, bgzf_tell(fp), 1);
+        // Index the rest in parallel once past the header
+        if (ret == 0 && pool) {
+            ret = hts_idx_push_mt(tbx->idx, fp, pool, tbx_idx_split, tbx_idx_parse, tbx_name2id_add, tbx);
+            pool = NULL;
+        }
         if (ret < 0)
         {
             free(str.s);
@@ -250,19 +291,42 @@ void tbx_destroy(tbx_t *tbx)
     free(tbx);
 }
 
+tbx_t *tbx_index(BGZF *fp, int min_shift, const tbx_conf_t *conf)
+{
+    return tbx_index_mt(fp, min_shift, conf, NULL);
+}
+
 int tbx_index_build(const char *fn, int min_shift, const tbx_conf_t *conf)
+{
+    return tbx_index_build_mt(fn, min_shift, conf, 0);
+}
+
+int tbx_index_build_mt(const char *fn, int min_shift, const tbx_conf_t *conf, int n_threads)
 {
     tbx_t *tbx;
     BGZF *fp;
-    if ( bgzf_is_bgzf(fn)!=1 ) { fprintf(stderr,"Not a BGZF file: %s\n", fn); return -1; }
+    hts_tpool *pool = NULL;
+    int ret;
     if ((fp = bgzf_open(fn, "r")) == 0) return -1;
-    if ( !fp->is_compressed ) { bgzf_close(fp); return -1; }
-    tbx = tbx_index(fp, min_shift, conf);
+    if ( !fp->is_compressed ) { fprintf(stderr,"Not a compressed file: %s\n", fn); bgzf_close(fp); return -1; }
+    // Plain gzip is indexed in one thread, saving checkpoints to seek from
+    if ( fp->is_gzip ) {
+        if ( bgzf_index_build_init(fp) < 0 ) { bgzf_close(fp); return -1; }
+    }
+    else if ( n_threads > 0 && (pool = hts_tpool_init(n_threads)) != NULL )
+        bgzf_thread_pool(fp, pool, 0);
+    tbx = tbx_index_mt(fp, min_shift, conf, pool);
+    if ( tbx && fp->is_gzip && bgzf_index_dump(fp, fn, ".gzi") < 0 ) {
+        fprintf(stderr,"Failed to write %s.gzi\n", fn);
+        tbx_destroy(tbx);
+        tbx = NULL;
+    }
     bgzf_close(fp);
+    hts_tpool_destroy(pool);
     if ( !tbx ) return -1;
-    hts_idx_save(tbx->idx, fn, min_shift > 0? HTS_FMT_CSI : HTS_FMT_TBI);
+    ret = hts_idx_save(tbx->idx, fn, min_shift > 0? HTS_FMT_CSI : HTS_FMT_TBI);
     tbx_destroy(tbx);
-    return 0;
+    return ret;
 }
 
 tbx_t *tbx_index_load(const char *fn)
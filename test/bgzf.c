@@ -0,0 +1,490 @@
+/*  test/bgzf.c -- Test cases for BGZF compression and multi-threading.
+
+    Copyright (C) 2015 DNAnexus, Inc.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.  */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <zlib.h>
+
+#include "htslib/bgzf.h"
+#include "htslib/hts.h"
+#include "htslib/hts_defs.h"
+#include "htslib/kstring.h"
+
+#define N_LINES 200000
+
+void HTS_NORETURN fail(const char *format, ...)
+{
+    int err = errno;
+    va_list args;
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+    if (err != 0) fprintf(stderr, ": %s", strerror(err));
+    fprintf(stderr, "\n");
+    exit(EXIT_FAILURE);
+}
+
+// Deterministic, moderately compressible text spanning many BGZF blocks
+static void make_line(int i, kstring_t *str)
+{
+    str->l = 0;
+    ksprintf(str, "line%d\t%u\t%s", i, (unsigned) i * 2654435761u,
+             (i % 7 == 0)? "ACGTACGTTTGACCA" : "N");
+}
+
+// Write the test file, and its .gzi index alongside
+static void write_file(const char *fn, const char *mode, int n_threads)
+{
+    kstring_t str = { 0, 0, NULL };
+    BGZF *fp = bgzf_open(fn, mode);
+    int i;
+    if (fp == NULL) fail("bgzf_open(\"%s\", \"%s\")", fn, mode);
+    if (n_threads > 0 && bgzf_mt(fp, n_threads, 16) < 0) fail("bgzf_mt (writing)");
+    if (bgzf_index_build_init(fp) < 0) fail("bgzf_index_build_init");
+    for (i = 0; i < N_LINES; i++) {
+        make_line(i, &str);
+        kputc('\n', &str);
+        if (bgzf_write(fp, str.s, str.l) != str.l) fail("bgzf_write");
+    }
+    if (bgzf_index_dump(fp, fn, ".gzi") < 0) fail("bgzf_index_dump");
+    if (bgzf_close(fp) < 0) fail("bgzf_close (writing)");
+    free(str.s);
+}
+
+// Write the test file indexing each line as it goes, with line i covering
+// position i, and save a .csi index alongside
+static void write_indexed(const char *fn, int n_threads)
+{
+    kstring_t str = { 0, 0, NULL };
+    BGZF *fp = bgzf_open(fn, "w");
+    hts_idx_t *idx = hts_idx_init(1, HTS_FMT_CSI, 0, 14, 5);
+    int i;
+    if (fp == NULL) fail("bgzf_open(\"%s\", \"w\")", fn);
+    if (n_threads > 0 && bgzf_mt(fp, n_threads, 16) < 0) fail("bgzf_mt (writing)");
+    for (i = 0; i < N_LINES; i++) {
+        make_line(i, &str);
+        kputc('\n', &str);
+        if (bgzf_write(fp, str.s, str.l) != str.l) fail("bgzf_write");
+        if (bgzf_idx_push(fp, idx, 0, i, i + 1, 1) < 0) fail("bgzf_idx_push");
+    }
+    if (bgzf_idx_flush(fp) < 0) fail("bgzf_idx_flush");
+    hts_idx_finish(idx, bgzf_tell(fp));
+    if (hts_idx_save(idx, fn, HTS_FMT_CSI) < 0) fail("hts_idx_save");
+    hts_idx_destroy(idx);
+    if (bgzf_close(fp) < 0) fail("bgzf_close (writing)");
+    free(str.s);
+}
+
+// The same index, from the offsets seen by read_file()
+static void index_offsets(const char *fn, const int64_t *voffs)
+{
+    hts_idx_t *idx = hts_idx_init(1, HTS_FMT_CSI, 0, 14, 5);
+    int i;
+    for (i = 0; i < N_LINES; i++)
+        if (hts_idx_push(idx, 0, i, i + 1, voffs[i + 1], 1) < 0) fail("hts_idx_push");
+    hts_idx_finish(idx, voffs[N_LINES]);
+    if (hts_idx_save(idx, fn, HTS_FMT_CSI) < 0) fail("hts_idx_save");
+    hts_idx_destroy(idx);
+}
+
+static void compare_files(const char *fn1, const char *fn2)
+{
+    char buf1[4096], buf2[4096];
+    size_t n1, n2;
+    FILE *f1 = fopen(fn1, "rb"), *f2 = fopen(fn2, "rb");
+    if (f1 == NULL || f2 == NULL) fail("fopen");
+    do {
+        n1 = fread(buf1, 1, sizeof buf1, f1);
+        n2 = fread(buf2, 1, sizeof buf2, f2);
+        if (n1 != n2 || memcmp(buf1, buf2, n1) != 0)
+            fail("\"%s\" and \"%s\" differ", fn1, fn2);
+    } while (n1 > 0);
+    fclose(f1);
+    fclose(f2);
+}
+
+static void check_line(int i, const kstring_t *line, kstring_t *str)
+{
+    make_line(i, str);
+    if (line->l != str->l || memcmp(line->s, str->s, str->l) != 0)
+        fail("line %d differs: got \"%s\", expected \"%s\"", i, line->s, str->s);
+}
+
+// Read the whole file with bgzf_getline() and record each line's offset
+static void read_file(const char *fn, const char *mode, int n_threads,
+                      int64_t *voffs)
+{
+    kstring_t line = { 0, 0, NULL }, str = { 0, 0, NULL };
+    BGZF *fp = bgzf_open(fn, mode);
+    int i, ret;
+    if (fp == NULL) fail("bgzf_open(\"%s\", \"%s\")", fn, mode);
+    if (n_threads > 0 && bgzf_mt(fp, n_threads, 16) < 0) fail("bgzf_mt (reading)");
+    for (i = 0; i < N_LINES; i++) {
+        if (voffs) voffs[i] = bgzf_tell(fp);
+        if ((ret = bgzf_getline(fp, '\n', &line)) < 0)
+            fail("bgzf_getline returned %d at line %d", ret, i);
+        check_line(i, &line, &str);
+    }
+    if (voffs) voffs[N_LINES] = bgzf_tell(fp);
+    if (bgzf_getline(fp, '\n', &line) != -1) fail("expected end-of-file");
+    if (bgzf_close(fp) < 0) fail("bgzf_close (reading)");
+    free(line.s);
+    free(str.s);
+}
+
+// As read_file(), but with bgzf_getline_ref(); also checks that the offsets
+// match those recorded by read_file()
+static void read_file_ref(const char *fn, int n_threads, const int64_t *voffs)
+{
+    kstring_t line = { 0, 0, NULL }, buf = { 0, 0, NULL }, str = { 0, 0, NULL };
+    BGZF *fp = bgzf_open(fn, "r");
+    int i, ret;
+    if (fp == NULL) fail("bgzf_open(\"%s\", \"r\")", fn);
+    if (n_threads > 0 && bgzf_mt(fp, n_threads, 16) < 0) fail("bgzf_mt (reading)");
+    for (i = 0; i < N_LINES; i++) {
+        if (bgzf_tell(fp) != voffs[i]) fail("bgzf_tell differs at line %d", i);
+        if ((ret = bgzf_getline_ref(fp, '\n', &buf, &line.s)) < 0)
+            fail("bgzf_getline_ref returned %d at line %d", ret, i);
+        line.l = ret;
+        make_line(i, &str);
+        if (line.l != str.l || memcmp(line.s, str.s, str.l) != 0)
+            fail("line %d differs: got \"%.*s\", expected \"%s\"",
+                 i, (int) line.l, line.s, str.s);
+    }
+    if (bgzf_getline_ref(fp, '\n', &buf, &line.s) != -1) fail("expected end-of-file");
+    if (bgzf_close(fp) < 0) fail("bgzf_close (reading)");
+    free(buf.s);
+    free(str.s);
+}
+
+// Seek to a selection of lines, both forwards and backwards
+static void seek_file(const char *fn, const char *mode, int n_threads,
+                      const int64_t *voffs, bgzf_cache_t *cache)
+{
+    kstring_t line = { 0, 0, NULL }, str = { 0, 0, NULL };
+    BGZF *fp = bgzf_open(fn, mode);
+    int i, j;
+    if (fp == NULL) fail("bgzf_open(\"%s\", \"%s\")", fn, mode);
+    if (n_threads > 0 && bgzf_mt(fp, n_threads, 16) < 0) fail("bgzf_mt (reading)");
+    if (cache && bgzf_set_cache(fp, cache) < 0) fail("bgzf_set_cache");
+    for (i = 0; i < 500; i++) {
+        int start = (i % 2)? (i * 7919) % N_LINES : N_LINES - 1 - (i * 104729) % N_LINES;
+        if (bgzf_seek(fp, voffs[start], SEEK_SET) < 0) fail("bgzf_seek to line %d", start);
+        for (j = start; j < start + 50 && j < N_LINES; j++) {
+            if (bgzf_getline(fp, '\n', &line) < 0) fail("bgzf_getline after seek");
+            check_line(j, &line, &str);
+        }
+    }
+    if (bgzf_close(fp) < 0) fail("bgzf_close (seeking)");
+    free(line.s);
+    free(str.s);
+}
+
+// Seek to a selection of lines by uncompressed offset, returning each time
+// to a later line within the same stretch
+static void useek_file(const char *fn, const int64_t *uoffs)
+{
+    kstring_t line = { 0, 0, NULL }, str = { 0, 0, NULL };
+    BGZF *fp = bgzf_open(fn, "r");
+    int i, j, k;
+    if (fp == NULL) fail("bgzf_open(\"%s\", \"r\")", fn);
+    if (bgzf_index_load(fp, fn, ".gzi") < 0) fail("bgzf_index_load");
+    for (i = 0; i < 500; i++) {
+        int start = (i % 2)? (i * 7919) % N_LINES : N_LINES - 1 - (i * 104729) % N_LINES;
+        for (k = 0; k < 2; k++, start += 25) {
+            if (start >= N_LINES) break;
+            if (bgzf_useek(fp, uoffs[start], SEEK_SET) < 0) fail("bgzf_useek to line %d", start);
+            for (j = start; j < start + 50 && j < N_LINES; j++) {
+                if (bgzf_getline(fp, '\n', &line) < 0) fail("bgzf_getline after useek");
+                check_line(j, &line, &str);
+            }
+        }
+    }
+    if (bgzf_close(fp) < 0) fail("bgzf_close (useeking)");
+    free(line.s);
+    free(str.s);
+}
+
+// Read a scattered set of chunks after fetching them with bgzf_prefetch()
+static void prefetch_file(const char *fn, const int64_t *voffs)
+{
+    kstring_t line = { 0, 0, NULL }, str = { 0, 0, NULL };
+    uint64_t chunks[2 * 200];
+    BGZF *fp = bgzf_open(fn, "r");
+    int i, j, n, n_done = 0;
+    if (fp == NULL) fail("bgzf_open(\"%s\", \"r\")", fn);
+    for (i = 0; i < 200; i++) {
+        // Alternately near and far apart, so that some reads are joined
+        chunks[2*i] = voffs[i * 997 + (i % 2) * 400];
+        chunks[2*i+1] = voffs[i * 997 + (i % 2) * 400 + 50];
+    }
+    for (i = 0; i < 200; i++) {
+        if (i == n_done) {
+            if ((n = bgzf_prefetch(fp, &chunks[2*i], 200 - i)) < 0) fail("bgzf_prefetch");
+            n_done = i + (n > 0? n : 1);
+        }
+        if (bgzf_seek(fp, chunks[2*i], SEEK_SET) < 0) fail("bgzf_seek to chunk %d", i);
+        for (j = 0; bgzf_tell(fp) < chunks[2*i+1]; j++) {
+            if (bgzf_getline(fp, '\n', &line) < 0) fail("bgzf_getline in chunk %d", i);
+            check_line(i * 997 + (i % 2) * 400 + j, &line, &str);
+        }
+        if (j != 50) fail("read %d lines from chunk %d", j, i);
+    }
+    if (bgzf_close(fp) < 0) fail("bgzf_close (prefetching)");
+    free(line.s);
+    free(str.s);
+}
+
+// Copy fn to fn_out, with the reader and writer sharing one thread pool
+static void copy_file(const char *fn, const char *fn_out, hts_tpool *pool)
+{
+    kstring_t line = { 0, 0, NULL };
+    BGZF *in = bgzf_open(fn, "r"), *out = bgzf_open(fn_out, "w");
+    int ret;
+    if (in == NULL || out == NULL) fail("bgzf_open (copying)");
+    if (bgzf_thread_pool(in, pool, 0) < 0) fail("bgzf_thread_pool (reading)");
+    if (bgzf_thread_pool(out, pool, 0) < 0) fail("bgzf_thread_pool (writing)");
+    while ((ret = bgzf_getline(in, '\n', &line)) >= 0) {
+        kputc('\n', &line);
+        if (bgzf_write(out, line.s, line.l) != line.l) fail("bgzf_write");
+    }
+    if (ret != -1) fail("bgzf_getline returned %d", ret);
+    if (bgzf_close(in) < 0) fail("bgzf_close (reading)");
+    if (bgzf_close(out) < 0) fail("bgzf_close (writing)");
+    free(line.s);
+}
+
+// Corrupt the CRC of a one-block file, which should then only be readable
+// with CRC checking disabled
+static void test_crc(const char *fn)
+{
+    static const char text[] = "hello, world!\n";
+    char buf[256];
+    BGZF *fp;
+    FILE *f;
+    size_t n;
+    ssize_t ret;
+
+    if ((fp = bgzf_open(fn, "w")) == NULL) fail("bgzf_open(\"%s\", \"w\")", fn);
+    if (bgzf_write(fp, text, sizeof text - 1) != sizeof text - 1) fail("bgzf_write");
+    if (bgzf_close(fp) < 0) fail("bgzf_close (writing)");
+
+    if ((f = fopen(fn, "r+b")) == NULL) fail("fopen(\"%s\")", fn);
+    n = fread(buf, 1, sizeof buf, f);
+    n -= 28; // skip the EOF block
+    buf[n - 8] ^= 0x55;
+    if (fseek(f, 0, SEEK_SET) != 0 || fwrite(buf, 1, n, f) != n) fail("fwrite");
+    if (fclose(f) != 0) fail("fclose");
+
+    if ((fp = bgzf_open(fn, "r")) == NULL) fail("bgzf_open(\"%s\", \"r\")", fn);
+    bgzf_set_crc_check(fp, 1);
+    if (bgzf_read(fp, buf, sizeof buf) >= 0 || !(fp->errcode & BGZF_ERR_CRC))
+        fail("CRC error not detected");
+    bgzf_close(fp);
+
+    if ((fp = bgzf_open(fn, "r")) == NULL) fail("bgzf_open(\"%s\", \"r\")", fn);
+    bgzf_set_crc_check(fp, 0);
+    if ((ret = bgzf_read(fp, buf, sizeof buf)) != sizeof text - 1
+        || memcmp(buf, text, ret) != 0) fail("bgzf_read without CRC checks");
+    if (bgzf_close(fp) < 0) fail("bgzf_close (reading)");
+}
+
+// Writing to a full device must fail at bgzf_close() at the latest, which
+// must still stop any writer thread and free the handle
+static void test_close_error(int n_threads)
+{
+    kstring_t str = { 0, 0, NULL };
+    BGZF *fp = bgzf_open("/dev/full", "w");
+    int i;
+    if (fp == NULL) return; // no such device here
+    if (n_threads > 0 && bgzf_mt(fp, n_threads, 16) < 0) fail("bgzf_mt (writing)");
+    for (i = 0; i < 10000; i++) {
+        make_line(i, &str);
+        kputc('\n', &str);
+        if (bgzf_write(fp, str.s, str.l) < 0) break;
+    }
+    if (bgzf_close(fp) == 0) fail("bgzf_close succeeded on /dev/full");
+    free(str.s);
+}
+
+// Write the test lines as a single ordinary gzip stream, then build a
+// checkpoint index with a short span and use it to seek, both by the
+// offsets seen while reading and by uncompressed offset; the latter is
+// also checked against fn_bgzf, indexed by write_file()
+static void test_gzip(const char *fn, const char *fn_bgzf)
+{
+    kstring_t line = { 0, 0, NULL }, str = { 0, 0, NULL };
+    int64_t *voffs = malloc((N_LINES + 1) * sizeof(int64_t));
+    int64_t *uoffs = malloc((N_LINES + 1) * sizeof(int64_t));
+    gzFile gz = gzopen(fn, "wb");
+    BGZF *fp;
+    int i, j;
+    if (voffs == NULL || uoffs == NULL) fail("malloc");
+    if (gz == NULL) fail("gzopen(\"%s\")", fn);
+    for (i = 0, uoffs[0] = 0; i < N_LINES; i++) {
+        make_line(i, &str);
+        kputc('\n', &str);
+        if (gzwrite(gz, str.s, str.l) != str.l) fail("gzwrite");
+        uoffs[i + 1] = uoffs[i] + str.l;
+    }
+    if (gzclose(gz) != Z_OK) fail("gzclose");
+
+    if ((fp = bgzf_open(fn, "r")) == NULL) fail("bgzf_open(\"%s\", \"r\")", fn);
+    if (bgzf_index_build_init(fp) < 0) fail("bgzf_index_build_init");
+    if (bgzf_index_set_span(fp, 100000) < 0) fail("bgzf_index_set_span");
+    for (i = 0; i < N_LINES; i++) {
+        voffs[i] = bgzf_tell(fp);
+        if (bgzf_getline(fp, '\n', &line) < 0) fail("bgzf_getline at line %d", i);
+        check_line(i, &line, &str);
+    }
+    if (bgzf_getline(fp, '\n', &line) != -1) fail("expected end-of-file");
+    if (bgzf_index_dump(fp, fn, ".gzi") < 0) fail("bgzf_index_dump");
+    if (bgzf_close(fp) < 0) fail("bgzf_close (indexing)");
+
+    if ((fp = bgzf_open(fn, "r")) == NULL) fail("bgzf_open(\"%s\", \"r\")", fn);
+    if (bgzf_seek(fp, voffs[1], SEEK_SET) == 0) fail("bgzf_seek without an index");
+    if (bgzf_index_load(fp, fn, ".gzi") < 0) fail("bgzf_index_load");
+    for (i = 0; i < 500; i++) {
+        int start = (i % 2)? (i * 7919) % N_LINES : N_LINES - 1 - (i * 104729) % N_LINES;
+        if (bgzf_seek(fp, voffs[start], SEEK_SET) < 0) fail("bgzf_seek to line %d", start);
+        for (j = start; j < start + 50 && j < N_LINES; j++) {
+            if (bgzf_getline(fp, '\n', &line) < 0) fail("bgzf_getline after seek");
+            check_line(j, &line, &str);
+        }
+    }
+    if (bgzf_close(fp) < 0) fail("bgzf_close (seeking)");
+    useek_file(fn, uoffs);
+    useek_file(fn_bgzf, uoffs);
+    free(voffs);
+    free(uoffs);
+    free(line.s);
+    free(str.s);
+}
+
+int main(int argc, char **argv)
+{
+    const char *fn = "test/bgzf.tmp.gz", *fn_mt = "test/bgzf.tmp.mt.gz";
+    int64_t *voffs = malloc((N_LINES + 1) * sizeof(int64_t));
+    int64_t *uoffs = malloc((N_LINES + 1) * sizeof(int64_t));
+    kstring_t str = { 0, 0, NULL };
+    int i, threads[] = { 0, 1, 4 };
+    hts_tpool *pool;
+    bgzf_cache_t *cache;
+    bgzf_cache_stats_t stats;
+    if (voffs == NULL || uoffs == NULL) fail("malloc");
+    for (i = 0, uoffs[0] = 0; i < N_LINES; i++) {
+        make_line(i, &str);
+        uoffs[i + 1] = uoffs[i] + str.l + 1;
+    }
+
+    write_file(fn, "w", 0);
+    read_file(fn, "r", 0, voffs);
+
+    // Multi-threaded compression must produce identical output
+    for (i = 1; i < sizeof threads / sizeof threads[0]; i++) {
+        write_file(fn_mt, "w", threads[i]);
+        compare_files(fn, fn_mt);
+        compare_files("test/bgzf.tmp.gz.gzi", "test/bgzf.tmp.mt.gz.gzi");
+    }
+
+    // Indexing while writing must give the offsets a reader sees, even
+    // though the multi-threaded writer learns block addresses late
+    index_offsets(fn, voffs);
+    for (i = 0; i < sizeof threads / sizeof threads[0]; i++) {
+        write_indexed(fn_mt, threads[i]);
+        compare_files(fn, fn_mt);
+        compare_files("test/bgzf.tmp.gz.csi", "test/bgzf.tmp.mt.gz.csi");
+    }
+
+    for (i = 0; i < sizeof threads / sizeof threads[0]; i++) {
+        read_file(fn, "r", threads[i], NULL);
+        read_file_ref(fn, threads[i], voffs);
+        seek_file(fn, "r", threads[i], voffs, NULL);
+    }
+
+    // Seeking by uncompressed offset through the .gzi, which also returns
+    // to the block already loaded
+    useek_file(fn, uoffs);
+
+    // Memory-mapped input, which BGZF inflates from in place
+    read_file(fn, "rm", 0, NULL);
+    seek_file(fn, "rm", 0, voffs, NULL);
+    seek_file(fn, "rm", 4, voffs, NULL);
+
+    // Background read-ahead
+    read_file(fn, "rp", 4, NULL);
+    seek_file(fn, "rp", 0, voffs, NULL);
+
+    prefetch_file(fn, voffs);
+
+    // Two passes sharing an LRU cache that holds only some of the blocks
+    cache = bgzf_cache_init(8 * BGZF_MAX_BLOCK_SIZE);
+    if (cache == NULL) fail("bgzf_cache_init");
+    seek_file(fn, "r", 0, voffs, cache);
+    seek_file(fn, "r", 0, voffs, cache);
+    bgzf_cache_stats(cache, &stats);
+    if (stats.hits == 0 || stats.misses == 0 || stats.evictions == 0
+        || stats.n_bytes > stats.max_bytes || stats.n_blocks < 8)
+        fail("unexpected cache stats: %"PRIu64" hits, %"PRIu64" misses, "
+             "%"PRIu64" evictions, %d blocks", stats.hits, stats.misses,
+             stats.evictions, stats.n_blocks);
+    bgzf_cache_destroy(cache);
+
+    // ...and reading ahead on threads, which also takes blocks from it
+    cache = bgzf_cache_init(8 * BGZF_MAX_BLOCK_SIZE);
+    if (cache == NULL) fail("bgzf_cache_init");
+    seek_file(fn, "r", 4, voffs, cache);
+    seek_file(fn, "r", 4, voffs, cache);
+    bgzf_cache_stats(cache, &stats);
+    if (stats.hits == 0 || stats.misses == 0 || stats.n_bytes > stats.max_bytes)
+        fail("unexpected threaded cache stats: %"PRIu64" hits, %"PRIu64" misses",
+             stats.hits, stats.misses);
+    bgzf_cache_destroy(cache);
+
+    pool = hts_tpool_init(4);
+    if (pool == NULL) fail("hts_tpool_init");
+    copy_file(fn, fn_mt, pool);
+    compare_files(fn, fn_mt);
+    hts_tpool_destroy(pool);
+
+    // Data written with either DEFLATE codec must be readable by the other
+    if (hts_set_deflate_codec("bogus") == 0) fail("accepted a bogus codec");
+    if (hts_set_deflate_codec("zlib") < 0) fail("hts_set_deflate_codec(zlib)");
+    read_file(fn, "r", 0, NULL);
+    write_file(fn_mt, "w", 0);
+    if (hts_set_deflate_codec(NULL) < 0) fail("hts_set_deflate_codec(NULL)");
+    read_file(fn_mt, "r", 4, NULL);
+
+    test_crc(fn_mt);
+    test_close_error(0);
+    test_close_error(4);
+    test_gzip(fn_mt, fn);
+
+    free(voffs);
+    free(uoffs);
+    free(str.s);
+    return EXIT_SUCCESS;
+}
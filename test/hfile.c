@@ -96,6 +96,7 @@ int main(void)
 
     char buffer[40000];
     char *original;
+    const char *ptr;
     int c, i;
     ssize_t n;
     off_t off;
@@ -200,5 +201,68 @@ int main(void)
     if (strcmp(buffer, "hello, world!\n") != 0) fail("hread result");
     if (hclose(fin) != 0) fail("hclose(\"data:...\")");
 
+    original = slurp("vcf.c");
+    fin = hopen("test/hfile5.tmp", "rm");
+    if (fin == NULL) fail("hopen(\"test/hfile5.tmp\", \"rm\")");
+    if (hpeek(fin, buffer, 50) != 50) fail("mmap: hpeek");
+    if (memcmp(buffer, original, 50) != 0) fail("mmap: hpeek result");
+    n = hread(fin, buffer, 200);
+    if (n != 200 || memcmp(buffer, original, 200) != 0) fail("mmap: hread");
+    if ((c = hgetc(fin)) != (unsigned char) original[200]) fail("mmap: hgetc");
+    if (hseek(fin, 799, SEEK_CUR) < 0) fail("mmap: hseek/cur");
+    check_offset(fin, 1000, "mmap/seek");
+    if ((ptr = hreadptr(fin, 3000)) == NULL) fail("mmap: hreadptr");
+    if (memcmp(ptr, &original[1000], 3000) != 0) fail("mmap: hreadptr result");
+    check_offset(fin, 4000, "mmap/hreadptr");
+    if (hseek(fin, -10, SEEK_END) < 0) fail("mmap: hseek/end");
+    n = hread(fin, buffer, sizeof buffer);
+    if (n != 10 || memcmp(buffer, &original[strlen(original) - 10], 10) != 0)
+        fail("mmap: hread at end");
+    if (hreadptr(fin, 1) != NULL) fail("mmap: hreadptr at end");
+    if ((c = hgetc(fin)) != EOF) fail("mmap: hgetc (EOF) returned %d", c);
+    if (hseek(fin, 1, SEEK_END) >= 0) fail("mmap: hseek past the end");
+    hclearerr(fin);
+    if (hseek(fin, 20, SEEK_SET) < 0) fail("mmap: hseek/set");
+    n = hread(fin, buffer, 30);
+    if (n != 30 || memcmp(buffer, &original[20], 30) != 0) fail("mmap: hread after seek");
+    if (hclose(fin) != 0) fail("hclose(\"test/hfile5.tmp\", \"rm\")");
+    free(original);
+
+    // Read-ahead, with buffers small enough to wrap around the ring often
+    original = slurp("vcf.c");
+    fin = hopen("test/hfile5.tmp", "r");
+    if (fin == NULL) fail("hopen(\"test/hfile5.tmp\")");
+    fin = hreadahead(fin, 3, 1000);
+    if (fin == NULL) fail("hreadahead");
+    for (i = 0, off = 0; (n = hread(fin, buffer, size[i++ % 5])) > 0; off += n)
+        if (memcmp(buffer, &original[off], n) != 0)
+            fail("readahead: hread at %ld", (long) off);
+    if (n < 0) fail("readahead: hread");
+    if (off != strlen(original)) fail("readahead: only read %ld", (long) off);
+    if (hseek(fin, 5000, SEEK_SET) < 0) fail("readahead: hseek/set");
+    if ((c = hgetc(fin)) != (unsigned char) original[5000]) fail("readahead: hgetc");
+    if (hseek(fin, -2000, SEEK_CUR) < 0) fail("readahead: hseek/cur");
+    check_offset(fin, 3001, "readahead/seek");
+    n = hread(fin, buffer, 20000);
+    if (n != 20000 || memcmp(buffer, &original[3001], n) != 0)
+        fail("readahead: hread after seek");
+    if (hclose(fin) != 0) fail("hclose(readahead)");
+
+    fin = hopen("test/hfile5.tmp", "rp");
+    if (fin == NULL) fail("hopen(\"test/hfile5.tmp\", \"rp\")");
+    n = hread(fin, buffer, sizeof buffer);
+    if (n != sizeof buffer || memcmp(buffer, original, n) != 0)
+        fail("readahead: hread via hopen");
+    if (hclose(fin) != 0) fail("hclose(\"test/hfile5.tmp\", \"rp\")");
+    free(original);
+
+    // Empty files can't be mapped, so fall back to ordinary reads
+    fout = hopen("test/hfile_empty.tmp", "w");
+    if (fout == NULL || hclose(fout) != 0) fail("creating test/hfile_empty.tmp");
+    fin = hopen("test/hfile_empty.tmp", "rm");
+    if (fin == NULL) fail("hopen(\"test/hfile_empty.tmp\", \"rm\")");
+    if ((c = hgetc(fin)) != EOF) fail("empty: hgetc returned %d", c);
+    if (hclose(fin) != 0) fail("hclose(\"test/hfile_empty.tmp\")");
+
     return EXIT_SUCCESS;
 }
@@ -0,0 +1,528 @@
+/*  test/sam_parse.c -- Check and benchmark sam_parse1() against the
+    original scalar SAM parser.
+
+    Copyright (C) 2015 DNAnexus, Inc.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.  */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "htslib/sam.h"
+#include "htslib/kstring.h"
+
+// The scalar parser that sam_parse1() replaced, kept as the reference
+static int ref_parse1(kstring_t *s, bam_hdr_t *h, bam1_t *b)
+{
+#define _read_token(_p) (_p); for (; *(_p) && *(_p) != '\t'; ++(_p)); if (*(_p) != '\t') goto err_ret; *(_p)++ = 0
+#define _read_token_aux(_p) (_p); for (; *(_p) && *(_p) != '\t'; ++(_p)); *(_p)++ = 0 // this is different in that it does not test *(_p)=='\t'
+#define _get_mem(type_t, _x, _s, _l) ks_resize((_s), (_s)->l + (_l)); *(_x) = (type_t*)((_s)->s + (_s)->l); (_s)->l += (_l)
+#define _parse_err(cond, msg) do { if ((cond) && hts_verbose >= 1) { fprintf(stderr, "[E::%s] " msg "\n", __func__); goto err_ret; } } while (0)
+#define _parse_warn(cond, msg) if ((cond) && hts_verbose >= 2) fprintf(stderr, "[W::%s] " msg "\n", __func__)
+
+    uint8_t *t;
+    char *p = s->s, *q;
+    int i;
+    kstring_t str;
+    bam1_core_t *c = &b->core;
+
+    str.l = b->l_data = 0;
+    str.s = (char*)b->data; str.m = b->m_data;
+    memset(c, 0, 32);
+    if (h->cigar_tab == 0) {
+        h->cigar_tab = (int8_t*) malloc(128);
+        for (i = 0; i < 128; ++i)
+            h->cigar_tab[i] = -1;
+        for (i = 0; BAM_CIGAR_STR[i]; ++i)
+            h->cigar_tab[(int)BAM_CIGAR_STR[i]] = i;
+    }
+    // qname
+    q = _read_token(p);
+    kputsn_(q, p - q, &str);
+    c->l_qname = p - q;
+    // flag
+    c->flag = strtol(p, &p, 0);
+    if (*p++ != '\t') goto err_ret; // malformated flag
+    // chr
+    q = _read_token(p);
+    if (strcmp(q, "*")) {
+        _parse_err(h->n_targets == 0, "missing SAM header");
+        c->tid = bam_name2id(h, q);
+        _parse_warn(c->tid < 0, "urecognized reference name; treated as unmapped");
+    } else c->tid = -1;
+    // pos
+    c->pos = strtol(p, &p, 10) - 1;
+    if (*p++ != '\t') goto err_ret;
+    if (c->pos < 0 && c->tid >= 0) {
+        _parse_warn(1, "mapped query cannot have zero coordinate; treated as unmapped");
+        c->tid = -1;
+    }
+    if (c->tid < 0) c->flag |= BAM_FUNMAP;
+    // mapq
+    c->qual = strtol(p, &p, 10);
+    if (*p++ != '\t') goto err_ret;
+    // cigar
+    if (*p != '*') {
+        uint32_t *cigar;
+        size_t n_cigar = 0;
+        for (q = p; *p && *p != '\t'; ++p)
+            if (!isdigit(*p)) ++n_cigar;
+        if (*p++ != '\t') goto err_ret;
+        _parse_err(n_cigar >= 65536, "too many CIGAR operations");
+        c->n_cigar = n_cigar;
+        _get_mem(uint32_t, &cigar, &str, c->n_cigar<<2);
+        for (i = 0; i < c->n_cigar; ++i, ++q) {
+            int op;
+            cigar[i] = strtol(q, &q, 10)<<BAM_CIGAR_SHIFT;
+            op = (uint8_t)*q >= 128? -1 : h->cigar_tab[(int)*q];
+            _parse_err(op < 0, "unrecognized CIGAR operator");
+            cigar[i] |= op;
+        }
+        i = bam_cigar2rlen(c->n_cigar, cigar);
+    } else {
+        _parse_warn(!(c->flag&BAM_FUNMAP), "mapped query must have a CIGAR; treated as unmapped");
+        c->flag |= BAM_FUNMAP;
+        q = _read_token(p);
+        i = 1;
+    }
+    c->bin = hts_reg2bin(c->pos, c->pos + i, 14, 5);
+    // mate chr
+    q = _read_token(p);
+    if (strcmp(q, "=") == 0) c->mtid = c->tid;
+    else if (strcmp(q, "*") == 0) c->mtid = -1;
+    else c->mtid = bam_name2id(h, q);
+    // mpos
+    c->mpos = strtol(p, &p, 10) - 1;
+    if (*p++ != '\t') goto err_ret;
+    if (c->mpos < 0 && c->mtid >= 0) {
+        _parse_warn(1, "mapped mate cannot have zero coordinate; treated as unmapped");
+        c->mtid = -1;
+    }
+    // tlen
+    c->isize = strtol(p, &p, 10);
+    if (*p++ != '\t') goto err_ret;
+    // seq
+    q = _read_token(p);
+    if (strcmp(q, "*")) {
+        c->l_qseq = p - q - 1;
+        i = bam_cigar2qlen(c->n_cigar, (uint32_t*)(str.s + c->l_qname));
+        _parse_err(c->n_cigar && i != c->l_qseq, "CIGAR and query sequence are of different length");
+        i = (c->l_qseq + 1) >> 1;
+        _get_mem(uint8_t, &t, &str, i);
+        memset(t, 0, i);
+        for (i = 0; i < c->l_qseq; ++i)
+            t[i>>1] |= seq_nt16_table[(int)q[i]] << ((~i&1)<<2);
+    } else c->l_qseq = 0;
+    // qual
+    q = _read_token_aux(p);
+    _get_mem(uint8_t, &t, &str, c->l_qseq);
+    if (strcmp(q, "*")) {
+        _parse_err(p - q - 1 != c->l_qseq, "SEQ and QUAL are of different length");
+        for (i = 0; i < c->l_qseq; ++i) t[i] = q[i] - 33;
+    } else memset(t, 0xff, c->l_qseq);
+    // aux
+    // Note that (like the bam1_core_t fields) this aux data in b->data is
+    // stored in host endianness; so there is no byte swapping needed here.
+    while (p < s->s + s->l) {
+        uint8_t type;
+        q = _read_token_aux(p); // FIXME: can be accelerated for long 'B' arrays
+        _parse_err(p - q - 1 < 6, "incomplete aux field");
+        kputsn_(q, 2, &str);
+        q += 3; type = *q++; ++q; // q points to value
+        if (type == 'A' || type == 'a' || type == 'c' || type == 'C') {
+            kputc_('A', &str);
+            kputc_(*q, &str);
+        } else if (type == 'i' || type == 'I') {
+            if (*q == '-') {
+                long x = strtol(q, &q, 10);
+                if (x >= INT8_MIN) {
+                    kputc_('c', &str); kputc_(x, &str);
+                } else if (x >= INT16_MIN) {
+                    int16_t y = x;
+                    kputc_('s', &str); kputsn_((char*)&y, 2, &str);
+                } else {
+                    int32_t y = x;
+                    kputc_('i', &str); kputsn_(&y, 4, &str);
+                }
+            } else {
+                unsigned long x = strtoul(q, &q, 10);
+                if (x <= UINT8_MAX) {
+                    kputc_('C', &str); kputc_(x, &str);
+                } else if (x <= UINT16_MAX) {
+                    uint16_t y = x;
+                    kputc_('S', &str); kputsn_(&y, 2, &str);
+                } else {
+                    uint32_t y = x;
+                    kputc_('I', &str); kputsn_(&y, 4, &str);
+                }
+            }
+        } else if (type == 'f') {
+            float x;
+            x = strtod(q, &q);
+            kputc_('f', &str); kputsn_(&x, 4, &str);
+        } else if (type == 'd') {
+            double x;
+            x = strtod(q, &q);
+            kputc_('d', &str); kputsn_(&x, 8, &str);
+        } else if (type == 'Z' || type == 'H') {
+            kputc_(type, &str);kputsn_(q, p - q, &str); // note that this include the trailing NULL
+        } else if (type == 'B') {
+            int32_t n;
+            char *r;
+            _parse_err(p - q - 1 < 3, "incomplete B-typed aux field");
+            type = *q++; // q points to the first ',' following the typing byte
+            for (r = q, n = 0; *r; ++r)
+                if (*r == ',') ++n;
+            kputc_('B', &str); kputc_(type, &str); kputsn_(&n, 4, &str);
+            // FIXME: to evaluate which is faster: a) aligned array and then memmove(); b) unaligned array; c) kputsn_()
+            if (type == 'c')      while (q + 1 < p) { int8_t   x = strtol(q + 1, &q, 0); kputc_(x, &str); }
+            else if (type == 'C') while (q + 1 < p) { uint8_t  x = strtoul(q + 1, &q, 0); kputc_(x, &str); }
+            else if (type == 's') while (q + 1 < p) { int16_t  x = strtol(q + 1, &q, 0); kputsn_(&x, 2, &str); }
+            else if (type == 'S') while (q + 1 < p) { uint16_t x = strtoul(q + 1, &q, 0); kputsn_(&x, 2, &str); }
+            else if (type == 'i') while (q + 1 < p) { int32_t  x = strtol(q + 1, &q, 0); kputsn_(&x, 4, &str); }
+            else if (type == 'I') while (q + 1 < p) { uint32_t x = strtoul(q + 1, &q, 0); kputsn_(&x, 4, &str); }
+            else if (type == 'f') while (q + 1 < p) { float    x = strtod(q + 1, &q);    kputsn_(&x, 4, &str); }
+            else _parse_err(1, "unrecognized type");
+        } else _parse_err(1, "unrecognized type");
+    }
+    b->data = (uint8_t*)str.s; b->l_data = str.l; b->m_data = str.m;
+    return 0;
+
+#undef _parse_warn
+#undef _parse_err
+#undef _get_mem
+#undef _read_token_aux
+#undef _read_token
+err_ret:
+    b->data = (uint8_t*)str.s; b->l_data = str.l; b->m_data = str.m;
+    return -2;
+}
+
+
+// The formatter that sam_format1() replaced
+static int ref_format1(const bam_hdr_t *h, const bam1_t *b, kstring_t *str)
+{
+    int i;
+    uint8_t *s;
+    const bam1_core_t *c = &b->core;
+
+    str->l = 0;
+    kputsn(bam_get_qname(b), c->l_qname-1, str); kputc('\t', str); // query name
+    kputw(c->flag, str); kputc('\t', str); // flag
+    if (c->tid >= 0) { // chr
+        kputs(h->target_name[c->tid] , str);
+        kputc('\t', str);
+    } else kputsn("*\t", 2, str);
+    kputw(c->pos + 1, str); kputc('\t', str); // pos
+    kputw(c->qual, str); kputc('\t', str); // qual
+    if (c->n_cigar) { // cigar
+        uint32_t *cigar = bam_get_cigar(b);
+        for (i = 0; i < c->n_cigar; ++i) {
+            kputw(bam_cigar_oplen(cigar[i]), str);
+            kputc(bam_cigar_opchr(cigar[i]), str);
+        }
+    } else kputc('*', str);
+    kputc('\t', str);
+    if (c->mtid < 0) kputsn("*\t", 2, str); // mate chr
+    else if (c->mtid == c->tid) kputsn("=\t", 2, str);
+    else {
+        kputs(h->target_name[c->mtid], str);
+        kputc('\t', str);
+    }
+    kputw(c->mpos + 1, str); kputc('\t', str); // mate pos
+    kputw(c->isize, str); kputc('\t', str); // template len
+    if (c->l_qseq) { // seq and qual
+        uint8_t *s = bam_get_seq(b);
+        for (i = 0; i < c->l_qseq; ++i) kputc("=ACMGRSVTWYHKDBN"[bam_seqi(s, i)], str);
+        kputc('\t', str);
+        s = bam_get_qual(b);
+        if (s[0] == 0xff) kputc('*', str);
+        else for (i = 0; i < c->l_qseq; ++i) kputc(s[i] + 33, str);
+    } else kputsn("*\t*", 3, str);
+    s = bam_get_aux(b); // aux
+    while (s+4 <= b->data + b->l_data) {
+        uint8_t type, key[2];
+        key[0] = s[0]; key[1] = s[1];
+        s += 2; type = *s++;
+        kputc('\t', str); kputsn((char*)key, 2, str); kputc(':', str);
+        if (type == 'A') {
+            kputsn("A:", 2, str);
+            kputc(*s, str);
+            ++s;
+        } else if (type == 'C') {
+            kputsn("i:", 2, str);
+            kputw(*s, str);
+            ++s;
+        } else if (type == 'c') {
+            kputsn("i:", 2, str);
+            kputw(*(int8_t*)s, str);
+            ++s;
+        } else if (type == 'S') {
+            if (s+2 <= b->data + b->l_data) {
+                kputsn("i:", 2, str);
+                kputw(*(uint16_t*)s, str);
+                s += 2;
+            } else return -1;
+        } else if (type == 's') {
+            if (s+2 <= b->data + b->l_data) {
+                kputsn("i:", 2, str);
+                kputw(*(int16_t*)s, str);
+                s += 2;
+            } else return -1;
+        } else if (type == 'I') {
+            if (s+4 <= b->data + b->l_data) {
+                kputsn("i:", 2, str);
+                kputuw(*(uint32_t*)s, str);
+                s += 4;
+            } else return -1;
+        } else if (type == 'i') {
+            if (s+4 <= b->data + b->l_data) {
+                kputsn("i:", 2, str);
+                kputw(*(int32_t*)s, str);
+                s += 4;
+            } else return -1;
+        } else if (type == 'f') {
+            if (s+4 <= b->data + b->l_data) {
+                ksprintf(str, "f:%g", *(float*)s);
+                s += 4;
+            } else return -1;
+
+        } else if (type == 'd') {
+            if (s+8 <= b->data + b->l_data) {
+                ksprintf(str, "d:%g", *(double*)s);
+                s += 8;
+            } else return -1;
+        } else if (type == 'Z' || type == 'H') {
+            kputc(type, str); kputc(':', str);
+            while (s < b->data + b->l_data && *s) kputc(*s++, str);
+            if (s >= b->data + b->l_data)
+                return -1;
+            ++s;
+        } else if (type == 'B') {
+            uint8_t sub_type = *(s++);
+            int32_t n;
+            memcpy(&n, s, 4);
+            s += 4; // no point to the start of the array
+            if (s + n >= b->data + b->l_data)
+                return -1;
+            kputsn("B:", 2, str); kputc(sub_type, str); // write the typing
+            for (i = 0; i < n; ++i) { // FIXME: for better performance, put the loop after "if"
+                kputc(',', str);
+                if ('c' == sub_type)      { kputw(*(int8_t*)s, str); ++s; }
+                else if ('C' == sub_type) { kputw(*(uint8_t*)s, str); ++s; }
+                else if ('s' == sub_type) { kputw(*(int16_t*)s, str); s += 2; }
+                else if ('S' == sub_type) { kputw(*(uint16_t*)s, str); s += 2; }
+                else if ('i' == sub_type) { kputw(*(int32_t*)s, str); s += 4; }
+                else if ('I' == sub_type) { kputuw(*(uint32_t*)s, str); s += 4; }
+                else if ('f' == sub_type) { ksprintf(str, "%g", *(float*)s); s += 4; }
+            }
+        }
+    }
+    return str->l;
+}
+
+typedef struct {
+    int n, m;
+    kstring_t *lines;
+} lines_t;
+
+static double now(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+static void add_line(lines_t *ls, const char *s, size_t l)
+{
+    kstring_t *line;
+    if (ls->n == ls->m) {
+        ls->m = ls->m? ls->m * 2 : 1024;
+        ls->lines = (kstring_t*)realloc(ls->lines, ls->m * sizeof(kstring_t));
+        if (ls->lines == NULL) { perror("realloc"); exit(EXIT_FAILURE); }
+    }
+    line = &ls->lines[ls->n++];
+    line->l = line->m = 0;
+    line->s = NULL;
+    kputsn(s, l, line);
+}
+
+// Valid but unusual records, which must take the slower paths
+static const char *odd_lines[] = {
+    "odd1\t0x10\tchr1\t+100\t 30\t5M\t*\t0\t0\tACGTN\t*",
+    "odd2\t020\tchr2\t0000000000000000000100\t30\t4S30M\t=\t50\t-0\t"
+        "acgtnACGTN=.ACGTNRYKMSWBDHVACGTNAC\tIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIII\t"
+        "XB:B:c,1,,-3,\tXC:B:C,0x10,010,255\tXI:i:+7\tXU:i:4294967295\tXL:i:-2147483648",
+    "odd3\t4\t*\t0\t0\t*\t*\t0\t0\t*\t*",
+    "odd4\t0\tchr3\t1\t60\t32M\t*\t0\t0\tACGTACGTACGTACGTACGTACGTACGTACGT\t"
+        "ABCDEFGHIJABCDEFGHIJABCDEFGHIJAB\tXA:A:x\tXD:d:1e300\tXH:H:1AE301\t"
+        "XF:f:-1.5e-30\tXG:B:f,0.25,-3e38\tXS:B:S,65535,0\tXT:B:i,-2147483648,7\tXV:B:I,4294967295",
+};
+
+// Typical short-read alignments: 150bp with soft clips, indels, Ns and
+// lower-case bases now and then, and assorted aux fields
+static void make_lines(lines_t *ls, int n)
+{
+    static const char *aux[] = { "NM:i:%d", "AS:i:-%d", "XS:i:%d", "RG:Z:grp%d",
+                                 "MD:Z:%d", "XF:f:%d.5", "ZB:B:s,%d,-2,300,4" };
+    kstring_t s = { 0, 0, NULL };
+    int i, j;
+    srand(15);
+    for (i = 0; i < sizeof odd_lines / sizeof odd_lines[0]; i++)
+        add_line(ls, odd_lines[i], strlen(odd_lines[i]));
+    for (i = 0; i < n; i++) {
+        int clip = (rand() % 4 == 0)? rand() % 20 + 1 : 0, del = rand() % 5 == 0;
+        s.l = 0;
+        ksprintf(&s, "read%d\t%d\tchr%d\t%d\t%d\t", i, (rand() % 2) * 16 | 1 | 2 | 64,
+                 rand() % 3 + 1, rand() % 1000000 + 1, rand() % 61);
+        if (clip) ksprintf(&s, "%dS", clip);
+        if (del) ksprintf(&s, "%dM2D%dM", 70 - clip, 80);
+        else ksprintf(&s, "%dM", 150 - clip);
+        ksprintf(&s, "\t=\t%d\t%d\t", rand() % 1000000 + 1, rand() % 1000 - 500);
+        for (j = 0; j < 150; j++)
+            kputc((rand() % 200 == 0)? 'N' : (rand() % 300 == 0)? "acgt"[rand() % 4] : "ACGT"[rand() % 4], &s);
+        kputc('\t', &s);
+        for (j = 0; j < 150; j++) kputc('#' + rand() % 40, &s);
+        for (j = 0; j < sizeof aux / sizeof aux[0]; j++)
+            if (rand() % 3) {
+                kputc('\t', &s);
+                ksprintf(&s, aux[j], rand() % 100);
+            }
+        add_line(ls, s.s, s.l);
+    }
+    free(s.s);
+}
+
+// Parses each line with the given parser, returning the time taken
+static double parse_all(const lines_t *ls, bam_hdr_t *h, bam1_t *b, kstring_t *tmp,
+                        int (*parse)(kstring_t *, bam_hdr_t *, bam1_t *))
+{
+    double t = now();
+    int i;
+    for (i = 0; i < ls->n; i++) {
+        tmp->l = 0;
+        kputsn(ls->lines[i].s, ls->lines[i].l, tmp);
+        parse(tmp, h, b);
+    }
+    return now() - t;
+}
+
+static double format_all(bam1_t **recs, int n, bam_hdr_t *h, kstring_t *tmp,
+                         int (*format)(const bam_hdr_t *, const bam1_t *, kstring_t *))
+{
+    double t = now();
+    int i;
+    for (i = 0; i < n; i++) format(h, recs[i], tmp);
+    return now() - t;
+}
+
+int main(int argc, char **argv)
+{
+    static const char synth_hdr[] = "@SQ\tSN:chr1\tLN:2000000\n@SQ\tSN:chr2\tLN:2000000\n@SQ\tSN:chr3\tLN:2000000\n";
+    lines_t ls = { 0, 0, NULL };
+    kstring_t tmp = { 0, 0, NULL };
+    bam_hdr_t *h = NULL;
+    kstring_t out1 = { 0, 0, NULL }, out2 = { 0, 0, NULL };
+    bam1_t *b1 = bam_init1(), *b2 = bam_init1(), **recs;
+    int c, i, n_synth = 0, reps = 0, bad = 0;
+    double t1 = 0, t2 = 0, t3 = 0, t4 = 0;
+
+    while ((c = getopt(argc, argv, "n:r:")) >= 0) {
+        switch (c) {
+        case 'n': n_synth = atoi(optarg); break;
+        case 'r': reps = atoi(optarg); break;
+        default:
+            fprintf(stderr, "Usage: sam_parse [-n synthetic_records] [-r repeats] [in.sam]\n");
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (optind < argc) {
+        samFile *in = sam_open(argv[optind], "r");
+        if (in == NULL || (h = sam_hdr_read(in)) == NULL) {
+            fprintf(stderr, "Error reading \"%s\"\n", argv[optind]);
+            return EXIT_FAILURE;
+        }
+        while (sam_read1(in, h, b1) >= 0) {
+            tmp.l = 0;
+            if (sam_format1(h, b1, &tmp) < 0) return EXIT_FAILURE;
+            add_line(&ls, tmp.s, tmp.l);
+        }
+        sam_close(in);
+    }
+    else {
+        h = sam_hdr_parse(sizeof synth_hdr - 1, synth_hdr);
+        make_lines(&ls, n_synth > 0? n_synth : 20000);
+    }
+
+    // Both parsers must give identical records, and both formatters
+    // identical text for them
+    recs = malloc(ls.n * sizeof recs[0]);
+    if (recs == NULL) return EXIT_FAILURE;
+    for (i = 0; i < ls.n; i++) {
+        int r1, r2;
+        tmp.l = 0; kputsn(ls.lines[i].s, ls.lines[i].l, &tmp);
+        r1 = ref_parse1(&tmp, h, b1);
+        tmp.l = 0; kputsn(ls.lines[i].s, ls.lines[i].l, &tmp);
+        r2 = sam_parse1(&tmp, h, b2);
+        if (r1 != r2 || memcmp(&b1->core, &b2->core, sizeof b1->core) != 0
+            || b1->l_data != b2->l_data || memcmp(b1->data, b2->data, b1->l_data) != 0) {
+            fprintf(stderr, "Records differ for line %d: %s\n", i + 1, ls.lines[i].s);
+            bad++;
+        }
+        if (ref_format1(h, b2, &out1) != sam_format1(h, b2, &out2)
+            || strcmp(out1.s, out2.s) != 0) {
+            fprintf(stderr, "Text differs for line %d:\n%s\n%s\n", i + 1, out1.s, out2.s);
+            bad++;
+        }
+        recs[i] = bam_dup1(b2);
+    }
+
+    for (i = 0; i < reps; i++) {
+        t1 += parse_all(&ls, h, b1, &tmp, ref_parse1);
+        t2 += parse_all(&ls, h, b2, &tmp, sam_parse1);
+        t3 += format_all(recs, ls.n, h, &tmp, ref_format1);
+        t4 += format_all(recs, ls.n, h, &tmp, sam_format1);
+    }
+    if (reps > 0) {
+        printf("%d records x %d: original %.3fs, sam_parse1 %.3fs (%.2fx)\n",
+               ls.n, reps, t1, t2, t1 / t2);
+        printf("%d records x %d: original %.3fs, sam_format1 %.3fs (%.2fx)\n",
+               ls.n, reps, t3, t4, t3 / t4);
+    }
+
+    for (i = 0; i < ls.n; i++) {
+        free(ls.lines[i].s);
+        bam_destroy1(recs[i]);
+    }
+    free(ls.lines);
+    free(recs);
+    free(tmp.s);
+    free(out1.s);
+    free(out2.s);
+    bam_destroy1(b1);
+    bam_destroy1(b2);
+    bam_hdr_destroy(h);
+    return bad? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,1229 @@
+/*  test/test-index.c -- index and iterator test harness.
+
+    Copyright (C) 2015 DNAnexus, Inc.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.  */
+
+/*
+ * Writes sorted BAM, CRAM, BCF and bgzipped VCF files with the given prefix,
+ * each record named by its position in its file, and checks the indexes and
+ * iterators of each against each other.
+ */
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <htslib/hts.h>
+#include <htslib/sam.h>
+#include <htslib/vcf.h>
+#include <htslib/tbx.h>
+#include <htslib/bgzf.h>
+#include <htslib/faidx.h>
+#include <htslib/kstring.h>
+
+#define N_REFS 4
+static const char *ref_name[N_REFS] = { "chr1", "chr2", "chr3", "chr4" };
+static const int ref_len[N_REFS] = { 300000, 150000, 100000, 50000 };
+static const int ref_used[N_REFS] = { 1, 1, 0, 1 };   // chr3 has no records
+static char *ref_seq[N_REFS];
+#define N_UNPLACED 300
+#define READ_LEN 50
+
+// Where each record lies, as iterators see it, numbered in file order
+static hts_region_t *sam_recs, *vcf_recs;
+static int n_sam_recs, n_vcf_recs;
+
+void error(const char *format, ...)
+{
+    va_list ap;
+    va_start(ap, format);
+    vfprintf(stderr, format, ap);
+    va_end(ap);
+    exit(1);
+}
+
+static uint32_t seed = 1;
+static int rnd(int n)
+{
+    seed = seed * 1103515245 + 12345;
+    return (seed >> 8) % n;
+}
+
+static void add_rec(hts_region_t **recs, int *n_recs, int tid, int beg, int end)
+{
+    if ((*n_recs & (*n_recs - 1)) == 0)
+        *recs = realloc(*recs, (*n_recs? *n_recs * 2 : 1) * sizeof(hts_region_t));
+    (*recs)[*n_recs].tid = tid, (*recs)[*n_recs].beg = beg, (*recs)[*n_recs].end = end;
+    ++*n_recs;
+}
+
+static char *fname(const char *prefix, const char *ext)
+{
+    static kstring_t str = { 0, 0, NULL };
+    str.l = 0;
+    ksprintf(&str, "%s%s", prefix, ext);
+    return str.s;
+}
+
+static void write_fasta(const char *prefix)
+{
+    char *fn = fname(prefix, ".fa");
+    FILE *fp = fopen(fn, "w");
+    int i, j;
+    if (!fp) error("Could not write %s\n", fn);
+    for (i = 0; i < N_REFS; ++i) {
+        ref_seq[i] = malloc(ref_len[i] + 1);
+        for (j = 0; j < ref_len[i]; ++j) ref_seq[i][j] = "ACGT"[rnd(4)];
+        ref_seq[i][j] = 0;
+        fprintf(fp, ">%s\n", ref_name[i]);
+        for (j = 0; j < ref_len[i]; j += 60) fprintf(fp, "%.60s\n", ref_seq[i] + j);
+    }
+    fclose(fp);
+    if (fai_build(fn) != 0) error("Could not index %s\n", fn);
+}
+
+// Mostly 50-base reads, with a few long spliced ones crossing bins and some
+// unmapped reads placed with their mates, then unplaced reads at the end
+static void write_sam(const char *prefix)
+{
+    kstring_t str = { 0, 0, NULL };
+    htsFile *out[2];
+    bam_hdr_t *h;
+    bam1_t *b = bam_init1();
+    int i, j, tid;
+
+    out[0] = hts_open(fname(prefix, ".bam"), "wb");
+    out[1] = hts_open(fname(prefix, ".cram"), "wc");
+    if (!out[0] || !out[1]) error("Could not write %s.bam or .cram\n", prefix);
+    hts_set_opt(out[1], CRAM_OPT_REFERENCE, fname(prefix, ".fa"));
+    hts_set_opt(out[1], CRAM_OPT_SEQS_PER_SLICE, 1000);
+
+    kputs("@HD\tVN:1.4\tSO:coordinate\n", &str);
+    for (i = 0; i < N_REFS; ++i) ksprintf(&str, "@SQ\tSN:%s\tLN:%d\n", ref_name[i], ref_len[i]);
+    h = sam_hdr_parse(str.l, str.s);
+    h->l_text = str.l; h->text = ks_release(&str);
+    for (j = 0; j < 2; ++j)
+        if (sam_hdr_write(out[j], h) < 0) error("Could not write the header\n");
+
+    for (tid = 0; tid <= N_REFS; ++tid) {
+        int pos = 0, n = tid < N_REFS? (ref_used[tid]? INT_MAX : 0) : N_UNPLACED;
+        for (i = 0; i < n; ++i) {
+            str.l = 0;
+            ksprintf(&str, "r%07d\t", n_sam_recs);
+            if (tid == N_REFS) {
+                kputs("4\t*\t0\t0\t*\t*\t0\t0\t", &str);
+                for (j = 0; j < READ_LEN; ++j) kputc("ACGT"[rnd(4)], &str);
+                add_rec(&sam_recs, &n_sam_recs, -1, -1, 0);
+            } else {
+                const char *seq = ref_seq[tid];
+                pos += rnd(20);
+                if (pos > ref_len[tid] - 25000) break;
+                if (rnd(100) == 0) {
+                    ksprintf(&str, "4\t%s\t%d\t0\t*\t*\t0\t0\t%.*s", ref_name[tid], pos+1, READ_LEN, seq + pos);
+                    add_rec(&sam_recs, &n_sam_recs, tid, pos, pos + 1);
+                } else if (rnd(50) == 0) {
+                    int skip = 1 + rnd(20000), half = READ_LEN/2;
+                    ksprintf(&str, "0\t%s\t%d\t60\t%dM%dN%dM\t*\t0\t0\t%.*s%.*s", ref_name[tid], pos+1,
+                             half, skip, half, half, seq + pos, half, seq + pos + half + skip);
+                    add_rec(&sam_recs, &n_sam_recs, tid, pos, pos + READ_LEN + skip);
+                } else {
+                    ksprintf(&str, "%d\t%s\t%d\t60\t%dM\t*\t0\t0\t%.*s", rnd(2)? 16 : 0, ref_name[tid], pos+1,
+                             READ_LEN, READ_LEN, seq + pos);
+                    add_rec(&sam_recs, &n_sam_recs, tid, pos, pos + READ_LEN);
+                }
+            }
+            kputs("\t*", &str);
+            if (sam_parse1(&str, h, b) < 0) error("Could not parse %s\n", str.s);
+            for (j = 0; j < 2; ++j)
+                if (sam_write1(out[j], h, b) < 0) error("Could not write %s\n", str.s);
+        }
+    }
+    for (j = 0; j < 2; ++j)
+        if (hts_close(out[j]) < 0) error("Could not close the output\n");
+    if (bam_index_build(fname(prefix, ".bam"), 0) < 0) error("Could not index %s.bam\n", prefix);
+    if (bam_index_build(fname(prefix, ".cram"), 0) < 0) error("Could not index %s.cram\n", prefix);
+    bam_hdr_destroy(h);
+    bam_destroy1(b);
+    free(str.s);
+}
+
+// Single-base variants, with a few long deletions ending at INFO/END
+static void write_vcf(const char *prefix)
+{
+    kstring_t str = { 0, 0, NULL };
+    BGZF *out = bgzf_open(fname(prefix, ".vcf.gz"), "w");
+    htsFile *in, *bcf;
+    bcf_hdr_t *h;
+    bcf1_t *v;
+    int i, tid;
+
+    if (!out) error("Could not write %s.vcf.gz\n", prefix);
+    kputs("##fileformat=VCFv4.1\n", &str);
+    for (i = 0; i < N_REFS; ++i) ksprintf(&str, "##contig=<ID=%s,length=%d>\n", ref_name[i], ref_len[i]);
+    kputs("##INFO=<ID=END,Number=1,Type=Integer,Description=\"End position\">\n", &str);
+    kputs("#CHROM\tPOS\tID\tREF\tALT\tQUAL\tFILTER\tINFO\n", &str);
+    for (tid = 0; tid < N_REFS; ++tid) {
+        int pos = 0;
+        if (!ref_used[tid]) continue;
+        while ((pos += rnd(20)) <= ref_len[tid] - 25000) {
+            int end = pos + 1;
+            ksprintf(&str, "%s\t%d\tv%07d\t%c\t", ref_name[tid], pos+1, n_vcf_recs, ref_seq[tid][pos]);
+            if (rnd(50) == 0) ksprintf(&str, "<DEL>\t.\t.\tEND=%d\n", end = pos + 2 + rnd(20000));
+            else kputs("A\t.\t.\t.\n", &str);
+            add_rec(&vcf_recs, &n_vcf_recs, tid, pos, end);
+            if (str.l > 60000) {
+                if (bgzf_write(out, str.s, str.l) < 0) error("Could not write %s.vcf.gz\n", prefix);
+                str.l = 0;
+            }
+        }
+    }
+    if (bgzf_write(out, str.s, str.l) < 0 || bgzf_close(out) < 0) error("Could not write %s.vcf.gz\n", prefix);
+    if (tbx_index_build(fname(prefix, ".vcf.gz"), 0, &tbx_conf_vcf) < 0) error("Could not index %s.vcf.gz\n", prefix);
+
+    in = hts_open(fname(prefix, ".vcf.gz"), "r");
+    bcf = hts_open(fname(prefix, ".bcf"), "wb");
+    if (!in || !bcf) error("Could not convert %s.vcf.gz to BCF\n", prefix);
+    h = bcf_hdr_read(in);
+    v = bcf_init1();
+    bcf_hdr_write(bcf, h);
+    while (bcf_read(in, h, v) >= 0)
+        if (bcf_write(bcf, h, v) < 0) error("Could not write %s.bcf\n", prefix);
+    if (hts_close(bcf) < 0) error("Could not close %s.bcf\n", prefix);
+    if (bcf_index_build(fname(prefix, ".bcf"), 14) < 0) error("Could not index %s.bcf\n", prefix);
+    hts_close(in);
+    bcf_hdr_destroy(h);
+    bcf_destroy1(v);
+    free(str.s);
+}
+
+static char *read_file(const char *fn, size_t *len)
+{
+    FILE *fp = fopen(fn, "rb");
+    char *buf = NULL;
+    long size;
+    if (!fp || fseek(fp, 0, SEEK_END) < 0 || (size = ftell(fp)) < 0) error("Could not read %s\n", fn);
+    rewind(fp);
+    buf = malloc(size + 1);
+    if (fread(buf, 1, size, fp) != (size_t) size) error("Could not read %s\n", fn);
+    fclose(fp);
+    *len = size;
+    return buf;
+}
+
+// Reads the uncompressed contents of a BGZF file
+static char *read_bgzf(const char *fn, size_t *len)
+{
+    BGZF *fp = bgzf_open(fn, "r");
+    char *buf = NULL;
+    size_t m = 0;
+    ssize_t n;
+    *len = 0;
+    if (!fp) error("Could not read %s\n", fn);
+    do {
+        if (*len + 65536 > m) buf = realloc(buf, m = *len + 65536);
+        if ((n = bgzf_read(fp, buf + *len, 65536)) < 0) error("Could not read %s\n", fn);
+        *len += n;
+    } while (n > 0);
+    bgzf_close(fp);
+    return buf;
+}
+
+static void write_bgzf(const char *fn, const char *buf, size_t len)
+{
+    BGZF *fp = bgzf_open(fn, "w");
+    if (!fp || bgzf_write(fp, buf, len) != (ssize_t) len || bgzf_close(fp) < 0)
+        error("Could not write %s\n", fn);
+}
+
+typedef int build_func(const char *fn, int min_shift, int n_threads);
+
+static int tbx_vcf_build_mt(const char *fn, int min_shift, int n_threads)
+{
+    return tbx_index_build_mt(fn, min_shift, &tbx_conf_vcf, n_threads);
+}
+
+// Checks that indexes built with threads are the same as one built without
+static void check_index_build(const char *prefix, const char *ext, const char *idx_ext, int min_shift, build_func *build)
+{
+    char *fn = strdup(fname(prefix, ext)), *serial, *threaded;
+    size_t l_serial, l_threaded;
+    int n_threads;
+
+    if (build(fn, min_shift, 0) < 0) error("Could not index %s\n", fn);
+    serial = read_file(fname(fn, idx_ext), &l_serial);
+    for (n_threads = 1; n_threads <= 4; n_threads *= 2) {
+        if (build(fn, min_shift, n_threads) < 0) error("Could not index %s with %d threads\n", fn, n_threads);
+        threaded = read_file(fname(fn, idx_ext), &l_threaded);
+        if (l_threaded != l_serial || memcmp(threaded, serial, l_serial) != 0)
+            error("%s: the %s index built with %d threads differs\n", ext + 1, idx_ext, n_threads);
+        free(threaded);
+    }
+    printf("%s: %s indexes built with threads match\n", ext + 1, idx_ext);
+    free(serial);
+    free(fn);
+}
+
+static void test_index_build(const char *prefix)
+{
+    check_index_build(prefix, ".bam", ".bai", 0, bam_index_build_mt);
+    check_index_build(prefix, ".bam", ".csi", 14, bam_index_build_mt);
+    check_index_build(prefix, ".bcf", ".csi", 14, bcf_index_build_mt);
+    check_index_build(prefix, ".vcf.gz", ".tbi", 0, tbx_vcf_build_mt);
+    check_index_build(prefix, ".vcf.gz", ".csi", 14, tbx_vcf_build_mt);
+    // Leave the .bai and .tbi to be used by the other tests
+    remove(fname(prefix, ".bam.csi"));
+    remove(fname(prefix, ".vcf.gz.csi"));
+}
+
+// Checks that the index made while writing a copy of the file with
+// sam_idx_init() or bcf_idx_init() is the same as one built afterwards
+static void check_idx_init(const char *prefix, const char *ext, const char *mode, const char *idx_ext, int min_shift)
+{
+    char *in_fn = strdup(fname(prefix, ext)), *out_fn = strdup(fname(prefix, ".otf"));
+    char *on_the_fly, *built;
+    size_t l_on_the_fly, l_built;
+    htsFile *in = hts_open(in_fn, "r"), *out;
+    int ret;
+
+    out_fn = realloc(out_fn, strlen(out_fn) + strlen(ext) + 1);
+    strcat(out_fn, ext);
+    if (!in || !(out = hts_open(out_fn, mode))) error("Could not copy %s to %s\n", in_fn, out_fn);
+    if (in->format.category == sequence_data) {
+        bam_hdr_t *h = sam_hdr_read(in);
+        bam1_t *b = bam_init1();
+        if (sam_hdr_write(out, h) < 0 || sam_idx_init(out, h, min_shift) < 0) error("Could not index %s\n", out_fn);
+        while ((ret = sam_read1(in, h, b)) >= 0)
+            if (sam_write1(out, h, b) < 0) error("Could not write %s\n", out_fn);
+        bam_hdr_destroy(h);
+        bam_destroy1(b);
+    } else {
+        bcf_hdr_t *h = bcf_hdr_read(in);
+        bcf1_t *v = bcf_init1();
+        if (bcf_hdr_write(out, h) < 0 || bcf_idx_init(out, h, min_shift) < 0) error("Could not index %s\n", out_fn);
+        while ((ret = bcf_read(in, h, v)) >= 0)
+            if (bcf_write(out, h, v) < 0) error("Could not write %s\n", out_fn);
+        bcf_hdr_destroy(h);
+        bcf_destroy1(v);
+    }
+    if (ret < -1) error("Could not read %s\n", in_fn);
+    if (hts_close(out) < 0) error("Could not write %s and its index\n", out_fn);
+    hts_close(in);
+
+    on_the_fly = read_file(fname(out_fn, idx_ext), &l_on_the_fly);
+    if (strcmp(ext, ".vcf.gz") == 0) ret = tbx_index_build(out_fn, min_shift, &tbx_conf_vcf);
+    else if (strcmp(ext, ".bcf") == 0) ret = bcf_index_build(out_fn, min_shift);
+    else ret = bam_index_build(out_fn, min_shift);
+    if (ret < 0) error("Could not index %s\n", out_fn);
+    built = read_file(fname(out_fn, idx_ext), &l_built);
+    if (l_built != l_on_the_fly || memcmp(built, on_the_fly, l_built) != 0)
+        error("%s: the %s index made while writing differs from one built afterwards\n", ext + 1, idx_ext);
+    printf("%s: %s index made while writing matches\n", ext + 1, idx_ext);
+    free(on_the_fly);
+    free(built);
+    free(in_fn);
+    free(out_fn);
+}
+
+// Writes a VCF whose records' contigs are not in the header's order, and
+// one in the header is left without records
+static void write_unordered_vcf(const char *prefix)
+{
+    static const char text[] =
+        "##fileformat=VCFv4.1\n##contig=<ID=a>\n##contig=<ID=b>\n##contig=<ID=c>\n##contig=<ID=d>\n"
+        "#CHROM\tPOS\tID\tREF\tALT\tQUAL\tFILTER\tINFO\n"
+        "d\t10\t.\tA\tC\t.\t.\t.\nd\t20\t.\tA\tC\t.\t.\t.\n"
+        "a\t5\t.\tA\tC\t.\t.\t.\nc\t1\t.\tA\tC\t.\t.\t.\n";
+    write_bgzf(fname(prefix, ".vcf.gz"), text, sizeof(text) - 1);
+}
+
+static void test_idx_init(const char *prefix)
+{
+    char *unordered = strdup(fname(prefix, ".unordered"));
+    check_idx_init(prefix, ".bam", "wb", ".bai", 0);
+    check_idx_init(prefix, ".bam", "wb", ".csi", 14);
+    check_idx_init(prefix, ".bcf", "wb", ".csi", 14);
+    check_idx_init(prefix, ".vcf.gz", "wz", ".tbi", 0);
+    check_idx_init(prefix, ".vcf.gz", "wz", ".csi", 14);
+    write_unordered_vcf(unordered);
+    check_idx_init(unordered, ".vcf.gz", "wz", ".tbi", 0);
+    free(unordered);
+}
+
+// An indexed file of one of the formats written above
+typedef struct {
+    const char *name;
+    char *fn;
+    enum htsExactFormat format;
+    const hts_region_t *recs;
+    int n_recs;
+    htsFile *fp;
+    hts_idx_t *idx;
+    tbx_t *tbx;
+    bam_hdr_t *bam_hdr;
+    bcf_hdr_t *bcf_hdr;
+    bam1_t *b;
+    bcf1_t *v;
+    kstring_t line;
+} data_t;
+
+static data_t *data_open(const char *prefix, const char *ext)
+{
+    data_t *d = calloc(1, sizeof(data_t));
+    const char *fn = d->fn = strdup(fname(prefix, ext));
+    d->name = ext + 1;
+    if (!(d->fp = hts_open(fn, "r"))) error("Could not read %s\n", fn);
+    d->format = d->fp->format.format;
+    switch (d->format) {
+    case cram:
+        hts_set_opt(d->fp, CRAM_OPT_REFERENCE, fname(prefix, ".fa"));
+        /* fall-through */
+    case bam:
+        d->recs = sam_recs, d->n_recs = n_sam_recs;
+        d->bam_hdr = sam_hdr_read(d->fp);
+        d->idx = sam_index_load(d->fp, fn);
+        d->b = bam_init1();
+        break;
+    case bcf:
+        d->recs = vcf_recs, d->n_recs = n_vcf_recs;
+        d->bcf_hdr = bcf_hdr_read(d->fp);
+        d->idx = bcf_index_load(fn);
+        d->v = bcf_init1();
+        break;
+    case vcf:
+        d->recs = vcf_recs, d->n_recs = n_vcf_recs;
+        if ((d->tbx = tbx_index_load(fn))) d->idx = d->tbx->idx;
+        break;
+    default:
+        error("Unexpected format of %s\n", fn);
+    }
+    if (!d->idx) error("Could not load the index of %s\n", fn);
+    return d;
+}
+
+// Replaces the index with that of fn, as loaded by hts_idx_load() or
+// hts_idx_load_mapped()
+static void data_load_idx(data_t *d, const char *fn, int mapped)
+{
+    int fmt = (d->format == bam)? HTS_FMT_BAI : (d->format == bcf)? HTS_FMT_CSI : HTS_FMT_TBI;
+    hts_idx_t *idx = mapped? hts_idx_load_mapped(fn, fmt) : hts_idx_load(fn, fmt);
+    if (!idx) error("Could not load the index of %s\n", fn);
+    hts_idx_destroy(d->idx);
+    d->idx = idx;
+    if (d->tbx) d->tbx->idx = idx;
+}
+
+static void data_close(data_t *d)
+{
+    if (d->tbx) tbx_destroy(d->tbx);
+    else if (d->format != cram) hts_idx_destroy(d->idx);
+    else free(d->idx);
+    if (d->bam_hdr) bam_hdr_destroy(d->bam_hdr);
+    if (d->bcf_hdr) bcf_hdr_destroy(d->bcf_hdr);
+    if (d->b) bam_destroy1(d->b);
+    if (d->v) bcf_destroy1(d->v);
+    free(d->line.s);
+    free(d->fn);
+    hts_close(d->fp);
+    free(d);
+}
+
+// Tabix numbers only the references that have records, so converts tid to
+// tabix's number, or -1 if it has no records
+static int data_tid(data_t *d, int tid)
+{
+    return (d->format == vcf && tid >= 0)? tbx_name2id(d->tbx, ref_name[tid]) : tid;
+}
+
+// As data_tid() for a list of regions, leaving out any with no records
+static hts_region_t *data_regs(data_t *d, const hts_region_t *regs, int *n_regs)
+{
+    hts_region_t *r = malloc(*n_regs * sizeof(hts_region_t));
+    int i, n = 0;
+    for (i = 0; i < *n_regs; ++i) {
+        r[n] = regs[i];
+        if ((r[n].tid = data_tid(d, regs[i].tid)) >= 0 || regs[i].tid < 0) ++n;
+    }
+    *n_regs = n;
+    return r;
+}
+
+static hts_itr_t *data_query(data_t *d, int tid, int beg, int end)
+{
+    hts_itr_t *iter;
+    switch (d->format) {
+    case bcf: iter = bcf_itr_queryi(d->idx, tid, beg, end); break;
+    case vcf: iter = tbx_itr_queryi(d->tbx, tid, beg, end); break;
+    default:  iter = sam_itr_queryi(d->idx, tid, beg, end); break;
+    }
+    if (!iter) error("%s: could not query %d:%d-%d\n", d->name, tid, beg, end);
+    return iter;
+}
+
+static hts_itr_t *data_regions(data_t *d, const hts_region_t *regs, int n_regs)
+{
+    hts_itr_t *iter;
+    switch (d->format) {
+    case bcf: iter = bcf_itr_regions(d->idx, regs, n_regs); break;
+    case vcf: iter = tbx_itr_regions(d->tbx, regs, n_regs); break;
+    default:  iter = sam_itr_regions(d->idx, regs, n_regs); break;
+    }
+    if (!iter) error("%s: could not query %d regions\n", d->name, n_regs);
+    return iter;
+}
+
+static void data_requery(data_t *d, hts_itr_t *iter, int tid, int beg, int end)
+{
+    int ret;
+    switch (d->format) {
+    case bcf: ret = bcf_itr_requery(d->idx, iter, tid, beg, end); break;
+    case vcf: ret = tbx_itr_requery(d->tbx, iter, tid, beg, end); break;
+    default:  ret = sam_itr_requery(d->idx, iter, tid, beg, end); break;
+    }
+    if (ret < 0) error("%s: could not requery %d:%d-%d\n", d->name, tid, beg, end);
+}
+
+// Returns the number of the next record, or -1 at the end of the iterator
+static int data_next(data_t *d, hts_itr_t *iter)
+{
+    const char *name;
+    int ret;
+    switch (d->format) {
+    case bcf:
+        if ((ret = bcf_itr_next(d->fp, iter, d->v)) < 0) break;
+        bcf_unpack(d->v, BCF_UN_STR);
+        name = d->v->d.id;
+        break;
+    case vcf:
+        if ((ret = tbx_itr_next(d->fp, d->tbx, iter, &d->line)) < 0) break;
+        name = strchr(strchr(d->line.s, '\t') + 1, '\t') + 1;
+        break;
+    default:
+        if ((ret = sam_itr_next(d->fp, iter, d->b)) < 0) break;
+        name = bam_get_qname(d->b);
+        break;
+    }
+    if (ret < -1) error("%s: failed to read a record\n", d->name);
+    return ret < 0? -1 : atoi(name + 1);
+}
+
+// Checks that iter returns the records overlapping tid:beg-end, or the
+// unplaced records if tid is negative, in file order, returning how many
+static int check_iter(data_t *d, hts_itr_t *iter, int tid, int beg, int end)
+{
+    int i, r, n_expected = 0, n_returned = 0, last = -1;
+    for (i = 0; i < d->n_recs; ++i) {
+        const hts_region_t *rec = &d->recs[i];
+        if (tid < 0? rec->tid < 0 : (rec->tid == tid && rec->beg < end && rec->end > beg)) ++n_expected;
+    }
+    while ((r = data_next(d, iter)) >= 0) {
+        const hts_region_t *rec = &d->recs[r];
+        if (r <= last) error("%s: %d:%d-%d returned record %d after %d\n", d->name, tid, beg, end, r, last);
+        if (tid < 0? rec->tid >= 0 : (rec->tid != tid || rec->beg >= end || rec->end <= beg))
+            error("%s: %d:%d-%d returned record %d at %d:%d-%d\n", d->name, tid, beg, end, r, rec->tid, rec->beg, rec->end);
+        last = r, ++n_returned;
+    }
+    if (n_returned != n_expected)
+        error("%s: %d:%d-%d returned %d records rather than %d\n", d->name, tid, beg, end, n_returned, n_expected);
+    return n_returned;
+}
+
+// Queries tid:beg-end, numbered as in ref_name, checking the records returned
+static int check_query(data_t *d, int tid, int beg, int end)
+{
+    int d_tid = data_tid(d, tid), n;
+    hts_itr_t *iter;
+    if (tid >= 0 && d_tid < 0) return 0;  // not in the tabix index
+    iter = data_query(d, tid >= 0? d_tid : HTS_IDX_NOCOOR, beg, end);
+    n = check_iter(d, iter, tid, beg, end);
+    hts_itr_destroy(iter);
+    return n;
+}
+
+// Checks that a multi-region iterator returns the records found by querying
+// each region in turn, in file order and once each
+static void check_regions(data_t *d, const char *desc, const hts_region_t *regs, int n_regs)
+{
+    uint8_t *found = calloc(d->n_recs, 1);
+    int i, r, n = n_regs, n_expected = 0, n_returned = 0, last = -1;
+    hts_region_t *d_regs = data_regs(d, regs, &n);
+    hts_itr_t *iter;
+
+    for (i = 0; i < n; ++i) {
+        iter = data_query(d, d_regs[i].tid, d_regs[i].beg, d_regs[i].end);
+        while ((r = data_next(d, iter)) >= 0)
+            if (!found[r]) found[r] = 1, ++n_expected;
+        hts_itr_destroy(iter);
+    }
+    iter = data_regions(d, d_regs, n);
+    while ((r = data_next(d, iter)) >= 0) {
+        if (r <= last) error("%s: %s regions returned record %d after %d\n", d->name, desc, r, last);
+        if (found[r] != 1) error("%s: %s regions returned record %d, which is in none of them\n", d->name, desc, r);
+        found[r] = 2, last = r, ++n_returned;
+    }
+    hts_itr_destroy(iter);
+    if (n_returned != n_expected)
+        error("%s: %s regions returned %d records rather than %d\n", d->name, desc, n_returned, n_expected);
+    printf("%s: %d records in %d %s regions\n", d->name, n_returned, n_regs, desc);
+    free(d_regs);
+    free(found);
+}
+
+static void test_regions(data_t *d)
+{
+    static const hts_region_t mixed[] = {
+        { 0, 60000, 61000 },                        // out of order
+        { 0, 1000, 5000 }, { 0, 4000, 9000 },       // overlapping
+        { 0, 9000, 12000 }, { 0, 12000, 15000 },    // adjacent
+        { 0, 100000, 160000 }, { 0, 150000, 150001 }, // one inside another
+        { 3, 20000, 30000 },
+        { 1, 70000, 70100 }, { 1, 140000, 1000000 },  // past the end
+        { 2, 0, 100000 },                           // no records
+    };
+    hts_region_t adjacent[400];
+    int i;
+
+    check_regions(d, "mixed", mixed, sizeof(mixed) / sizeof(mixed[0]));
+    for (i = 0; i < 400; ++i) {
+        adjacent[i].tid = i < 300? 1 : 3;
+        adjacent[i].beg = i < 300? 20000 + i * 300 : (i - 300) * 200;
+        adjacent[i].end = adjacent[i].beg + (i < 300? 300 : 250);
+    }
+    check_regions(d, "adjacent", adjacent, 400);
+}
+
+// Some queries, each of a reference not queried just before
+static int check_queries(data_t *d)
+{
+    static const hts_region_t queries[] = {
+        { 1, 30000, 40000 }, { 0, 50000, 52000 }, { 3, 1000, 9000 }, { 1, 30000, 40000 },
+        { 2, 0, 100000 }, { 0, 0, 1000 }, { 1, 124000, 150000 }, { 0, 50000, 52000 },
+    };
+    int i, n = 0;
+    for (i = 0; i < sizeof(queries) / sizeof(queries[0]); ++i)
+        n += check_query(d, queries[i].tid, queries[i].beg, queries[i].end);
+    return n;
+}
+
+// Checks queries of the lazily decoded references of a newly loaded index,
+// also when cached
+static void test_lazy_load(const char *prefix, const char *ext, int mapped)
+{
+    data_t *d = data_open(prefix, ext);
+    int n;
+    data_load_idx(d, d->fn, mapped);
+    n = check_queries(d);
+    if (hts_idx_set_cache(d->idx, 4) < 0) error("%s: could not set a cache\n", d->name);
+    if (check_queries(d) != n || check_queries(d) != n) error("%s: cached queries differ\n", d->name);
+    hts_idx_set_cache(d->idx, 0);
+    if (check_queries(d) != n) error("%s: uncached queries differ\n", d->name);
+    printf("%s: %d records from queries of an index loaded by %s\n", d->name, n, mapped? "hts_idx_load_mapped()" : "hts_idx_load()");
+    data_close(d);
+}
+
+// Checks that reusing an iterator with data_requery() returns the same as
+// new iterators, for random, repeated and nearby queries, some of them
+// started after the previous query was only partly read
+static void test_requery(data_t *d, int cache)
+{
+    hts_region_t q[300];
+    hts_itr_t *iter = NULL;
+    int i, j, n_fresh = 0, n_requeried = 0;
+
+    if (cache && hts_idx_set_cache(d->idx, 16) < 0) error("%s: could not set a cache\n", d->name);
+    for (i = 0; i < 300; ++i) {
+        if (i % 5 == 4) q[i] = q[rnd(i)];
+        else if (i % 5 == 3) {
+            int shift = rnd(2000);
+            q[i] = q[i-1], q[i].beg += shift, q[i].end += shift;
+        }
+        else {
+            q[i].tid = rnd(N_REFS);
+            q[i].beg = rnd(ref_len[q[i].tid]);
+            q[i].end = q[i].beg + 1 + rnd(rnd(10) == 0? 50000 : 5000);
+        }
+    }
+    for (i = 0; i < 300; ++i) {
+        int tid = data_tid(d, q[i].tid);
+        hts_itr_t *fresh;
+        if (tid < 0) continue;  // not in the tabix index
+        fresh = data_query(d, tid, q[i].beg, q[i].end);
+        n_fresh += check_iter(d, fresh, q[i].tid, q[i].beg, q[i].end);
+        hts_itr_destroy(fresh);
+        if (iter == NULL) iter = data_query(d, tid, q[i].beg, q[i].end);
+        else data_requery(d, iter, tid, q[i].beg, q[i].end);
+        if (i % 7 == 3) {
+            // leave this one unfinished and requery it
+            for (j = 0; j < 3 && data_next(d, iter) >= 0; ++j) {}
+            data_requery(d, iter, tid, q[i].beg, q[i].end);
+        }
+        n_requeried += check_iter(d, iter, q[i].tid, q[i].beg, q[i].end);
+    }
+    hts_itr_destroy(iter);
+    if (cache) hts_idx_set_cache(d->idx, 0);
+    if (n_requeried != n_fresh) error("%s: requeries returned %d records rather than %d\n", d->name, n_requeried, n_fresh);
+    printf("%s: %d records from requeries%s\n", d->name, n_requeried, cache? " with a cache" : "");
+}
+
+static int cmp_region(const void *av, const void *bv)
+{
+    const hts_region_t *a = (const hts_region_t *) av, *b = (const hts_region_t *) bv;
+    if (a->tid != b->tid) return a->tid < b->tid? -1 : 1;
+    return a->beg < b->beg? -1 : a->beg > b->beg;
+}
+
+// Adds regions ending and starting at the first record of each BGZF block
+// whose records start after those of the block before, so that requeries
+// move from one block to the next.  Returns the new number of regions.
+static int add_block_regions(data_t *d, hts_region_t *regs, int n, int m)
+{
+    int tid, r;
+    for (tid = 0; tid < N_REFS; ++tid) {
+        int64_t prev_block = -1;
+        int prev_beg = -1, d_tid = data_tid(d, tid);
+        hts_itr_t *iter;
+        if (d_tid < 0) continue;
+        iter = data_query(d, d_tid, 0, ref_len[tid]);
+        while ((r = data_next(d, iter)) >= 0) {
+            int64_t block = iter->rec_off >> 16;
+            int beg = d->recs[r].beg;
+            if (prev_block >= 0 && block != prev_block && beg > prev_beg && n + 2 <= m) {
+                regs[n].tid = tid, regs[n].beg = beg - 1 - rnd(200), regs[n++].end = beg;
+                regs[n].tid = tid, regs[n].beg = beg, regs[n++].end = beg + 1 + rnd(200);
+            }
+            prev_block = block, prev_beg = beg;
+        }
+        hts_itr_destroy(iter);
+    }
+    return n;
+}
+
+// Checks that a monotonic iterator requeried over sorted regions returns,
+// for each region, the records a new iterator would that were not returned
+// for an earlier region, in the same order
+static void test_monotonic(data_t *d)
+{
+    hts_region_t regs[1000];
+    uint8_t *found = calloc(d->n_recs, 1);
+    int *expected = malloc(d->n_recs * sizeof(int));
+    int i, j, r, n = 0, n_regs = 0, n_returned = 0;
+    hts_itr_t *iter = NULL;
+
+    for (n = 0; n < 400; ++n) {
+        regs[n].tid = rnd(N_REFS);
+        regs[n].beg = rnd(ref_len[regs[n].tid]);
+        regs[n].end = regs[n].beg + 1 + rnd(rnd(10) == 0? 20000 : 2000);
+    }
+    n = add_block_regions(d, regs, n, 1000);
+    qsort(regs, n, sizeof(hts_region_t), cmp_region);
+
+    for (i = 0; i < n; ++i) {
+        int tid = data_tid(d, regs[i].tid), n_expected = 0;
+        hts_itr_t *fresh;
+        if (tid < 0) continue;  // not in the tabix index
+        fresh = data_query(d, tid, regs[i].beg, regs[i].end);
+        while ((r = data_next(d, fresh)) >= 0)
+            if (!found[r]) found[r] = 1, expected[n_expected++] = r;
+        hts_itr_destroy(fresh);
+
+        if (iter == NULL) {
+            iter = data_query(d, tid, regs[i].beg, regs[i].end);
+            iter->monotonic = 1;
+        }
+        else data_requery(d, iter, tid, regs[i].beg, regs[i].end);
+        for (j = 0; (r = data_next(d, iter)) >= 0; ++j)
+            if (j >= n_expected || r != expected[j])
+                error("%s: monotonic requery of %d:%d-%d returned record %d rather than %d\n",
+                      d->name, regs[i].tid, regs[i].beg, regs[i].end, r, j < n_expected? expected[j] : -1);
+        if (j != n_expected)
+            error("%s: monotonic requery of %d:%d-%d returned %d records rather than %d\n",
+                  d->name, regs[i].tid, regs[i].beg, regs[i].end, j, n_expected);
+        n_returned += j, ++n_regs;
+    }
+    hts_itr_destroy(iter);
+    printf("%s: %d records from monotonic requeries of %d sorted regions\n", d->name, n_returned, n_regs);
+    free(expected);
+    free(found);
+}
+
+// Loads a copy of the .bai and truncates it, which is harmless as the index
+// is read into memory, before querying references not yet decoded
+static void test_truncated_index(const char *prefix)
+{
+    data_t *d = data_open(prefix, ".bam");
+    char *copy = strdup(fname(prefix, ".copy.bam")), *buf;
+    size_t len;
+    FILE *fp;
+    buf = read_file(fname(prefix, ".bam.bai"), &len);
+    if (!(fp = fopen(fname(copy, ".bai"), "wb")) || fwrite(buf, 1, len, fp) != len || fclose(fp) != 0)
+        error("Could not write %s.bai\n", copy);
+    data_load_idx(d, copy, 0);
+    if (truncate(fname(copy, ".bai"), 0) < 0) error("Could not truncate %s.bai\n", copy);
+    printf("%s: %d records from queries after truncating the index\n", d->name, check_queries(d));
+    free(buf);
+    free(copy);
+    data_close(d);
+}
+
+// Checks that sam_read_columns() in batches of batch records returns the
+// selected fields of the records sam_read1() reads, returning the number of
+// records that continue into the next BGZF block of a BAM file
+static int check_read_columns(const char *prefix, const char *ext, uint32_t fields, int batch)
+{
+    data_t *d = data_open(prefix, ext), *c = data_open(prefix, ext);
+    bam_columns_t *cols = bam_columns_init(batch, fields);
+    int i, ret, n = 0, n_across = 0;
+
+    if (!cols) error("%s: could not allocate columns\n", d->name);
+    while ((ret = sam_read_columns(c->fp, c->bam_hdr, cols)) >= 0) {
+        if (ret != cols->n || ret > batch) error("%s: read %d records in columns, of %d\n", d->name, ret, batch);
+        for (i = 0; i < cols->n; ++i, ++n) {
+            const bam1_core_t *core = &d->b->core;
+            uint64_t off = d->format == bam? bgzf_tell(d->fp->fp.bgzf) : 0;
+            if (sam_read1(d->fp, d->bam_hdr, d->b) < 0) error("%s: more records read in columns than by sam_read1()\n", d->name);
+            if (d->format == bam && bgzf_tell(d->fp->fp.bgzf) >> 16 != off >> 16
+                && (bgzf_tell(d->fp->fp.bgzf) & 0xffff) != 0) ++n_across;
+            if ((cols->tid && cols->tid[i] != core->tid) || (cols->pos && cols->pos[i] != core->pos)
+                || (cols->endpos && cols->endpos[i] != bam_endpos(d->b)) || (cols->flag && cols->flag[i] != core->flag)
+                || (cols->mapq && cols->mapq[i] != core->qual) || (cols->mtid && cols->mtid[i] != core->mtid)
+                || (cols->mpos && cols->mpos[i] != core->mpos) || (cols->isize && cols->isize[i] != core->isize))
+                error("%s: record %d read in columns differs from %s\n", d->name, n, bam_get_qname(d->b));
+        }
+    }
+    if (ret < -1) error("%s: failed to read records in columns\n", d->name);
+    if (sam_read1(d->fp, d->bam_hdr, d->b) >= 0) error("%s: fewer records read in columns than by sam_read1()\n", d->name);
+    if (n != d->n_recs) error("%s: read %d records in columns rather than %d\n", d->name, n, d->n_recs);
+    bam_columns_destroy(cols);
+    data_close(c);
+    data_close(d);
+    return n_across;
+}
+
+// Checks that reading CRAM in columns leaves later queries decoding whole
+// records
+static void test_columns_then_query(const char *prefix)
+{
+    data_t *d = data_open(prefix, ".cram");
+    bam_columns_t *cols = bam_columns_init(100, SAM_FLAG | SAM_MAPQ);
+    if (!cols || sam_read_columns(d->fp, d->bam_hdr, cols) != 100) error("cram: could not read records in columns\n");
+    printf("cram: %d records from a query after reading in columns\n", check_query(d, N_REFS - 1, 0, ref_len[N_REFS - 1]));
+    bam_columns_destroy(cols);
+    data_close(d);
+}
+
+static void test_read_columns(const char *prefix, const char *ext)
+{
+    const uint32_t all = SAM_RNAME | SAM_POS | SAM_CIGAR | SAM_FLAG | SAM_MAPQ | SAM_RNEXT | SAM_PNEXT | SAM_TLEN;
+    int n_across = check_read_columns(prefix, ext, all, 1000);
+    if (strcmp(ext, ".split.bam") == 0 && n_across == 0) error("bam: no records continue into the next block\n");
+    if (check_read_columns(prefix, ext, all, 1) != n_across || check_read_columns(prefix, ext, all, 4093) != n_across)
+        error("%s: the batch size changed the records read\n", ext + 1);
+    // Fewer fields, so for CRAM only some data series are decoded, and
+    // without the alignments' ends also no sequences
+    check_read_columns(prefix, ext, SAM_FLAG | SAM_MAPQ, 1000);
+    check_read_columns(prefix, ext, SAM_POS | SAM_CIGAR, 1000);
+    if (strcmp(ext, ".cram") == 0) printf("%s: records read in columns match sam_read1()\n", ext + 1);
+    else printf("%s: records read in columns match sam_read1(), %d of them across BGZF blocks\n", ext + 1, n_across);
+}
+
+// Copies the BAM file into full BGZF blocks, as bam_write1() does not, so
+// that records continue from one block into the next
+static void write_split_bam(const char *prefix)
+{
+    size_t len;
+    char *buf = read_bgzf(fname(prefix, ".bam"), &len);
+    write_bgzf(fname(prefix, ".split.bam"), buf, len);
+    if (bam_index_build(fname(prefix, ".split.bam"), 0) < 0) error("Could not index %s.split.bam\n", prefix);
+    free(buf);
+}
+
+// Checks that bam_read_batch() on a BAM file truncated within a record
+// returns the records before it, and then the error
+static void test_truncated_batch(const char *prefix)
+{
+    size_t len;
+    char *buf = read_bgzf(fname(prefix, ".split.bam"), &len);
+    const char *fn = fname(prefix, ".trunc.bam");
+    bam_batch_t *batch = bam_batch_init(n_sam_recs + 1);
+    bam1_t *b = bam_init1();
+    bam_hdr_t *h;
+    BGZF *fp;
+    int n = 0, r;
+
+    write_bgzf(fn, buf, len - 10);
+    if (!(fp = bgzf_open(fn, "r")) || !(h = bam_hdr_read(fp))) error("Could not read %s\n", fn);
+    while ((r = bam_read1(fp, b)) >= 0) ++n;
+    if (r >= -1) error("bam: no error reading %s\n", fn);
+    bam_hdr_destroy(h);
+    bgzf_close(fp);
+
+    if (!(fp = bgzf_open(fn, "r")) || !(h = bam_hdr_read(fp))) error("Could not read %s\n", fn);
+    if ((r = bam_read_batch(fp, batch)) != n) error("bam: read %d records in a batch before the error, not %d\n", r, n);
+    if ((r = bam_read_batch(fp, batch)) >= -1) error("bam: no error from the batch after the good records\n");
+    printf("bam: %d records in a batch before its error %d\n", n, r);
+    bam_hdr_destroy(h);
+    bgzf_close(fp);
+    bam_batch_destroy(batch);
+    bam_destroy1(b);
+    free(buf);
+}
+
+static int get_u32(const char *p)
+{
+    const uint8_t *u = (const uint8_t *) p;
+    return u[0] | u[1] << 8 | u[2] << 16 | (uint32_t) u[3] << 24;
+}
+
+// Checks that a lazily loaded index with a reference that cannot be decoded,
+// here for a repeated bin number, is not saved with that reference empty
+static void test_save_corrupt(const char *prefix)
+{
+    char *copy = strdup(fname(prefix, ".dup.bam")), *buf;
+    size_t len, bin1;
+    hts_idx_t *idx;
+    FILE *fp;
+    int verbose = hts_verbose;
+
+    buf = read_file(fname(prefix, ".bam.bai"), &len);
+    if (get_u32(buf + 8) < 2) error("bam: too few bins to repeat one\n");
+    bin1 = 20 + 16 * (size_t) get_u32(buf + 16);
+    memcpy(buf + bin1, buf + 12, 4);
+    if (!(fp = fopen(fname(copy, ".bai"), "wb")) || fwrite(buf, 1, len, fp) != len || fclose(fp) != 0)
+        error("Could not write %s.bai\n", copy);
+    if (!(idx = hts_idx_load(copy, HTS_FMT_BAI))) error("Could not load %s.bai\n", copy);
+    hts_verbose = 0;
+    if (hts_idx_save(idx, fname(prefix, ".resaved.bam"), HTS_FMT_BAI) == 0)
+        error("bam: saved an index with a reference that could not be decoded\n");
+    hts_verbose = verbose;
+    if (access(fname(prefix, ".resaved.bam.bai"), F_OK) == 0) error("bam: a partial index was left behind\n");
+    printf("bam: an index with an undecodable reference is not saved\n");
+    hts_idx_destroy(idx);
+    free(buf);
+    free(copy);
+}
+
+// Checks the summaries hts_idx_ref_stat() makes from the index against
+// hts_idx_get_stat() and against a full pass through the file, which finds
+// the offsets and positions spanned by each reference's records
+static void test_ref_stat(const char *prefix, const char *ext)
+{
+    data_t *d = data_open(prefix, ext);
+    BGZF *fp = hts_get_bgzfp(d->fp);
+    uint64_t first[N_REFS], last[N_REFS], off, mapped, unmapped, sum;
+    int64_t bin_end;
+    int n_recs[N_REFS], beg[N_REFS], end[N_REFS], tid, last_tid = -1, r, i, n_refs = 0;
+
+    memset(n_recs, 0, sizeof(n_recs));
+    for (;;) {
+        off = bgzf_tell(fp);
+        switch (d->format) {
+        case bcf:
+            if ((r = bcf_read(d->fp, d->bcf_hdr, d->v)) < 0) break;
+            bcf_unpack(d->v, BCF_UN_STR);
+            r = atoi(d->v->d.id + 1);
+            break;
+        case vcf:
+            do off = bgzf_tell(fp), r = bgzf_getline(fp, '\n', &d->line);
+            while (r >= 0 && d->line.s[0] == '#');
+            if (r >= 0) r = atoi(strchr(strchr(d->line.s, '\t') + 1, '\t') + 1 + 1);
+            break;
+        default:
+            if ((r = sam_read1(d->fp, d->bam_hdr, d->b)) < 0) break;
+            r = atoi(bam_get_qname(d->b) + 1);
+            break;
+        }
+        if (r < 0) break;
+        if ((last_tid = tid = d->recs[r].tid) < 0) continue;
+        if (n_recs[tid]++ == 0) first[tid] = off, beg[tid] = d->recs[r].beg, end[tid] = 0;
+        if (d->recs[r].end > end[tid]) end[tid] = d->recs[r].end;
+        last[tid] = bgzf_tell(fp);
+    }
+    if (r < -1) error("%s: failed to read a record\n", d->name);
+    // The end of the file's last record is taken from after the EOF block
+    if (last_tid >= 0) last[last_tid] = bgzf_tell(fp);
+
+    for (tid = 0; tid < N_REFS; ++tid) {
+        int d_tid = data_tid(d, tid);
+        hts_ref_stat_t *st;
+        if (d_tid < 0) continue;  // not in the tabix index
+        if ((st = hts_idx_ref_stat(d->idx, d_tid)) == NULL) error("%s: no statistics for %d\n", d->name, tid);
+        if (n_recs[tid] == 0) {
+            if (st->n_mapped + st->n_unmapped != 0 || st->n_bins != 0 || st->bytes != 0)
+                error("%s: statistics for %d, which has no records, are not empty\n", d->name, tid);
+            hts_ref_stat_destroy(st);
+            continue;
+        }
+        if (hts_idx_get_stat(d->idx, d_tid, &mapped, &unmapped) < 0)
+            error("%s: hts_idx_get_stat() failed for %d\n", d->name, tid);
+        if (st->n_mapped != mapped || st->n_unmapped != unmapped)
+            error("%s: %d has %llu mapped and %llu unmapped records rather than %llu and %llu\n", d->name, tid,
+                  (unsigned long long) st->n_mapped, (unsigned long long) st->n_unmapped,
+                  (unsigned long long) mapped, (unsigned long long) unmapped);
+        if (mapped + unmapped != n_recs[tid])
+            error("%s: %d has %llu records rather than %d\n", d->name, tid, (unsigned long long) (mapped + unmapped), n_recs[tid]);
+
+        // Its data spans from the first record to the end of the last, and
+        // its bins cover their positions
+        if (st->off_beg != first[tid] || st->off_end != last[tid])
+            error("%s: %d spans offsets %llx-%llx rather than %llx-%llx\n", d->name, tid,
+                  (unsigned long long) st->off_beg, (unsigned long long) st->off_end,
+                  (unsigned long long) first[tid], (unsigned long long) last[tid]);
+        if (st->bytes == 0 || st->n_bins == 0 || st->bins[0].beg > beg[tid])
+            error("%s: the bins of %d do not cover its records\n", d->name, tid);
+        for (i = 0, bin_end = 0; i < st->n_bins; ++i)
+            if (st->bins[i].end > bin_end) bin_end = st->bins[i].end;
+        if (bin_end < end[tid]) error("%s: the bins of %d end at %lld, before its records\n", d->name, tid, (long long) bin_end);
+
+        // The bins and windows share out the size and records, up to rounding
+        for (i = 0, sum = 0; i < st->n_bins; ++i) sum += st->bins[i].bytes;
+        if (sum + st->n_bins < st->bytes || sum > st->bytes + st->n_bins)
+            error("%s: the bins of %d hold %llu bytes rather than %llu\n", d->name, tid, (unsigned long long) sum, (unsigned long long) st->bytes);
+        for (i = 0, sum = 0; i < st->n_bins; ++i) sum += st->bins[i].n_records;
+        if (sum + st->n_bins < n_recs[tid] || sum > n_recs[tid] + st->n_bins)
+            error("%s: the bins of %d hold %llu records rather than %d\n", d->name, tid, (unsigned long long) sum, n_recs[tid]);
+        for (i = 0, sum = 0; i < st->n_windows; ++i) sum += st->window_bytes[i];
+        if (st->n_windows == 0 || sum + st->n_windows < st->bytes || sum > st->bytes + st->n_windows)
+            error("%s: the windows of %d hold %llu bytes rather than %llu\n", d->name, tid, (unsigned long long) sum, (unsigned long long) st->bytes);
+        hts_ref_stat_destroy(st);
+        ++n_refs;
+    }
+    printf("%s: index statistics of %d references match a full pass\n", d->name, n_refs);
+    data_close(d);
+}
+
+// Counts of the records processed by the shards of a file
+typedef struct {
+    pthread_mutex_t lock;
+    const char *name;
+    const hts_region_t *recs;
+    int *count, n_shards;
+} shard_count_t;
+
+// Counts record r, checking that it starts in the shard
+static void count_shard_rec(shard_count_t *c, const hts_region_t *shard, int r)
+{
+    const hts_region_t *rec = &c->recs[r];
+    if (shard->tid < 0? rec->tid >= 0 : (rec->tid != shard->tid || rec->beg < shard->beg || rec->beg >= shard->end))
+        error("%s: shard %d:%d-%d returned record %d at %d:%d-%d\n", c->name,
+              shard->tid, shard->beg, shard->end, r, rec->tid, rec->beg, rec->end);
+    pthread_mutex_lock(&c->lock);
+    ++c->count[r];
+    pthread_mutex_unlock(&c->lock);
+}
+
+static int count_sam_shard(samFile *fp, bam_hdr_t *h, hts_itr_t *iter, const hts_region_t *shard, void *data)
+{
+    shard_count_t *c = (shard_count_t *) data;
+    bam1_t *b = bam_init1();
+    int ret;
+    while ((ret = sam_itr_next(fp, iter, b)) >= 0)
+        count_shard_rec(c, shard, atoi(bam_get_qname(b) + 1));
+    bam_destroy1(b);
+    pthread_mutex_lock(&c->lock);
+    ++c->n_shards;
+    pthread_mutex_unlock(&c->lock);
+    return ret < -1? -1 : 0;
+}
+
+static int count_bcf_shard(htsFile *fp, bcf_hdr_t *h, hts_itr_t *iter, const hts_region_t *shard, void *data)
+{
+    shard_count_t *c = (shard_count_t *) data;
+    bcf1_t *v = bcf_init1();
+    int ret;
+    while ((ret = bcf_itr_next(fp, iter, v)) >= 0) {
+        bcf_unpack(v, BCF_UN_STR);
+        count_shard_rec(c, shard, atoi(v->d.id + 1));
+    }
+    bcf_destroy1(v);
+    pthread_mutex_lock(&c->lock);
+    ++c->n_shards;
+    pthread_mutex_unlock(&c->lock);
+    return ret < -1? -1 : 0;
+}
+
+// Checks that processing the shards of a file returns each record of a full
+// pass through it exactly once, with one thread and with several
+static void test_shards(const char *prefix, const char *ext)
+{
+    data_t *d = data_open(prefix, ext);
+    int *full = calloc(d->n_recs, sizeof(int));
+    int i, r, n_threads, n_full = 0;
+
+    // The full pass
+    for (;;) {
+        if (d->format == bcf) {
+            if ((r = bcf_read(d->fp, d->bcf_hdr, d->v)) < 0) break;
+            bcf_unpack(d->v, BCF_UN_STR);
+            r = atoi(d->v->d.id + 1);
+        }
+        else {
+            if ((r = sam_read1(d->fp, d->bam_hdr, d->b)) < 0) break;
+            r = atoi(bam_get_qname(d->b) + 1);
+        }
+        ++full[r], ++n_full;
+    }
+    if (r < -1) error("%s: failed to read a record\n", d->name);
+    if (n_full != d->n_recs) error("%s: read %d records rather than %d\n", d->name, n_full, d->n_recs);
+
+    for (n_threads = 1; n_threads <= 4; n_threads *= 4) {
+        shard_count_t c;
+        int ret;
+        pthread_mutex_init(&c.lock, NULL);
+        c.name = d->name, c.recs = d->recs, c.n_shards = 0;
+        c.count = calloc(d->n_recs, sizeof(int));
+        ret = d->format == bcf? bcf_process_shards(d->fn, d->idx, n_threads, count_bcf_shard, &c)
+                              : sam_process_shards(d->fn, d->idx, n_threads, count_sam_shard, &c);
+        if (ret < 0) error("%s: could not process the shards with %d threads\n", d->name, n_threads);
+        for (i = 0; i < d->n_recs; ++i)
+            if (c.count[i] != full[i])
+                error("%s: shards with %d threads returned record %d %d times rather than %d\n",
+                      d->name, n_threads, i, c.count[i], full[i]);
+        printf("%s: %d records, each once, from %d shards with %d thread%s\n", d->name, n_full, c.n_shards, n_threads, n_threads > 1? "s" : "");
+        free(c.count);
+        pthread_mutex_destroy(&c.lock);
+    }
+    free(full);
+    data_close(d);
+}
+
+// Runs the same random queries with the index loaded from fn, returning
+// the number of records
+static int check_csi_queries(data_t *d, const char *fn, const hts_region_t *q, int n_q)
+{
+    int i, n = 0;
+    data_load_idx(d, fn, 0);
+    for (i = 0; i < n_q; ++i) n += check_query(d, q[i].tid, q[i].beg, q[i].end);
+    return n;
+}
+
+// Checks that a CSI with a dense linear index (bam_index_build_dense(), as
+// used by tabix -D) differs from the plain CSI only by a trailer on its meta
+// data, that queries using it return the same records, and that the index
+// still loads and gives the same records if the trailer is not recognised,
+// as by readers that do not know of it
+static void test_dense(const char *prefix)
+{
+    char *fn = strdup(fname(prefix, ".bam"));
+    char *plain_fn = strdup(fname(prefix, ".plain.bam")), *other_fn = strdup(fname(prefix, ".other.bam"));
+    char *plain, *dense, *buf;
+    size_t l_plain, l_dense, len;
+    int i, l_meta, l_trailer, l_got, n_plain, n_dense, n_other, verbose;
+    hts_region_t q[200];
+    data_t *d;
+
+    if (bam_index_build(fn, 14) < 0) error("Could not index %s\n", fn);
+    plain = read_bgzf(fname(fn, ".csi"), &l_plain);
+    write_bgzf(fname(plain_fn, ".csi"), plain, l_plain);
+    verbose = hts_verbose, hts_verbose = 0;
+    if (bam_index_build_dense(fn, 0, 0, 16) == 0) error("bam: a BAI was built with dense offsets it cannot store\n");
+    hts_verbose = verbose;
+    if (bam_index_build_dense(fn, 14, 0, 16) < 0) error("Could not build a dense index of %s\n", fn);
+    dense = read_bgzf(fname(fn, ".csi"), &l_dense);
+    if (bam_index_build_dense(fn, 14, 2, 16) < 0) error("Could not build a dense index of %s with threads\n", fn);
+    buf = read_bgzf(fname(fn, ".csi"), &len);
+    if (len != l_dense || memcmp(buf, dense, len) != 0) error("bam: the dense index built with threads differs\n");
+    free(buf);
+
+    l_meta = get_u32(plain + 12);
+    l_trailer = get_u32(dense + 12) - l_meta;
+    if (l_trailer < 16 || l_dense != l_plain + l_trailer || memcmp(dense, plain, 12) != 0
+        || memcmp(dense + 16, plain + 16, l_meta) != 0
+        || memcmp(dense + 16 + l_meta + l_trailer, plain + 16 + l_meta, l_plain - 16 - l_meta) != 0)
+        error("bam: the dense index differs from the plain one other than in its meta data\n");
+    if (memcmp(dense + 16 + l_meta + l_trailer - 4, "DLI\1", 4) != 0)
+        error("bam: the dense index has no trailer\n");
+    dense[16 + l_meta + l_trailer - 1] = 0;  // as if from an unknown version
+    write_bgzf(fname(other_fn, ".csi"), dense, l_dense);
+
+    for (i = 0; i < 200; ++i) {
+        q[i].tid = rnd(N_REFS);
+        q[i].beg = rnd(ref_len[q[i].tid]);
+        q[i].end = q[i].beg + 1 + rnd(i % 4 == 0? 20000 : 500);
+    }
+    d = data_open(prefix, ".bam");
+    n_plain = check_csi_queries(d, plain_fn, q, 200);
+    n_dense = check_csi_queries(d, fn, q, 200);
+    if (hts_idx_get_meta(d->idx, &l_got) != NULL || l_got != 0)
+        error("bam: the dense index trailer was left in the meta data\n");
+    n_other = check_csi_queries(d, other_fn, q, 200);
+    if (hts_idx_get_meta(d->idx, &l_got) == NULL || l_got != l_trailer)
+        error("bam: an unknown trailer was not kept as meta data\n");
+    if (n_dense != n_plain || n_other != n_plain)
+        error("bam: queries returned %d and %d records rather than %d\n", n_dense, n_other, n_plain);
+    printf("bam: %d records from queries of a dense .csi and of a plain one\n", n_dense);
+    data_close(d);
+
+    // Leave the .bai to be used by the other tests
+    remove(fname(fn, ".csi"));
+    free(plain);
+    free(dense);
+    free(fn);
+    free(plain_fn);
+    free(other_fn);
+}
+
+int main(int argc, char **argv)
+{
+    static const char *exts[] = { ".bam", ".cram", ".bcf", ".vcf.gz" };
+    const char *prefix = argc > 1? argv[1] : "test-index.tmp";
+    int i;
+
+    // Threads reading the CRAM file find the reference by its @SQ UR: tags,
+    // without first looking it up by MD5 on the network
+    setenv("REF_PATH", ":", 1);
+    write_fasta(prefix);
+    write_sam(prefix);
+    write_vcf(prefix);
+    printf("%d alignments, %d variants\n", n_sam_recs, n_vcf_recs);
+    test_index_build(prefix);
+    test_idx_init(prefix);
+
+    for (i = 0; i < 4; ++i) {
+        data_t *d = data_open(prefix, exts[i]);
+        test_regions(d);
+        test_requery(d, 0);
+        if (d->format != cram) {
+            test_requery(d, 1);
+            test_monotonic(d);  // hts_itr_requery() does not handle CRAM
+        }
+        data_close(d);
+        if (strcmp(exts[i], ".vcf.gz") != 0) test_shards(prefix, exts[i]);
+    }
+    for (i = 0; i < 4; ++i) {
+        if (strcmp(exts[i], ".cram") == 0) continue;
+        test_lazy_load(prefix, exts[i], 0);
+        test_lazy_load(prefix, exts[i], 1);
+        test_ref_stat(prefix, exts[i]);
+    }
+    test_truncated_index(prefix);
+    test_save_corrupt(prefix);
+    test_dense(prefix);
+    write_split_bam(prefix);
+    test_read_columns(prefix, ".bam");
+    test_read_columns(prefix, ".split.bam");
+    test_truncated_batch(prefix);
+    test_read_columns(prefix, ".cram");
+    test_columns_then_query(prefix);
+
+    for (i = 0; i < N_REFS; ++i) free(ref_seq[i]);
+    return 0;
+}
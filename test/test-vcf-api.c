@@ -23,9 +23,11 @@ FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
 DEALINGS IN THE SOFTWARE.  */
 
 #include <stdio.h>
+#include <unistd.h>
 #include <htslib/hts.h>
 #include <htslib/vcf.h>
 #include <htslib/kstring.h>
+#include <htslib/bgzf.h>
 #include <htslib/kseq.h>
 
 void write_bcf(char *fname)
@@ -271,11 +273,228 @@ void iterator(const char *fname)
     }
 }
 
+void threaded_read(const char *fname, int truncated)
+{
+    // parse a VCF serially and on worker threads
+    htsFile *fp = hts_open(fname,"r");
+    htsFile *fp_mt = hts_open(fname,"r");
+    if ( !fp || !fp_mt )
+    {
+        fprintf(stderr,"Could not read: %s\n", fname);
+        exit(1);
+    }
+    bcf_hdr_t *hdr = bcf_hdr_read(fp);
+    bcf_hdr_t *hdr_mt = bcf_hdr_read(fp_mt);
+    if ( hts_set_threads(fp_mt, 2) < 0 )
+    {
+        fprintf(stderr,"hts_set_threads(%s) failed\n", fname);
+        exit(1);
+    }
+
+    bcf1_t *rec = bcf_init1(), *rec_mt = bcf_init1();
+    kstring_t str = {0,0,0}, str_mt = {0,0,0};
+    int ret, ret_mt, nrec = 0;
+    do
+    {
+        ret = bcf_read(fp, hdr, rec);
+        ret_mt = bcf_read(fp_mt, hdr_mt, rec_mt);
+        if ( ret!=ret_mt )
+        {
+            fprintf(stderr,"bcf_read(%s): %d vs %d at record %d\n", fname, ret, ret_mt, nrec);
+            exit(1);
+        }
+        if ( ret<0 ) break;
+        str.l = str_mt.l = 0;
+        vcf_format(hdr, rec, &str);
+        vcf_format(hdr_mt, rec_mt, &str_mt);
+        if ( str.l!=str_mt.l || memcmp(str.s,str_mt.s,str.l) )
+        {
+            fprintf(stderr,"Threaded parse differs at record %d:\n%s%s", nrec, str.s, str_mt.s);
+            exit(1);
+        }
+        nrec++;
+    }
+    while (1);
+    if ( truncated ? ret!=-2 : ret!=-1 )
+    {
+        fprintf(stderr,"bcf_read(%s): returned %d after %d records\n", fname, ret, nrec);
+        exit(1);
+    }
+
+    // both headers have had the same lines added
+    int len, len_mt;
+    char *htxt = bcf_hdr_fmt_text(hdr, 0, &len);
+    char *htxt_mt = bcf_hdr_fmt_text(hdr_mt, 0, &len_mt);
+    if ( len!=len_mt || memcmp(htxt,htxt_mt,len) )
+    {
+        fprintf(stderr,"Threaded parse gives a different header:\n%s%s", htxt, htxt_mt);
+        exit(1);
+    }
+    free(htxt);
+    free(htxt_mt);
+
+    free(str.s);
+    free(str_mt.s);
+    bcf_destroy1(rec);
+    bcf_destroy1(rec_mt);
+    bcf_hdr_destroy(hdr);
+    bcf_hdr_destroy(hdr_mt);
+    if ( (ret=hts_close(fp)) || (ret=hts_close(fp_mt)) )
+    {
+        fprintf(stderr,"hts_close(%s): non-zero status %d\n",fname,ret);
+        exit(ret);
+    }
+}
+
+void write_undefined(const char *fname, int truncate)
+{
+    // records using contigs, FILTERs, INFO and FORMAT fields missing from
+    // the header, spread over many batches of lines for the threads
+    htsFile *fp = hts_open(fname,"wz");
+    if ( !fp )
+    {
+        fprintf(stderr,"Could not write: %s\n", fname);
+        exit(1);
+    }
+    BGZF *bgzf = fp->fp.bgzf;
+    kstring_t str = {0,0,0};
+    ksprintf(&str, "##fileformat=VCFv4.1\n"
+        "##contig=<ID=1>\n"
+        "##FORMAT=<ID=GT,Number=1,Type=String,Description=\"Genotype\">\n"
+        "#CHROM\tPOS\tID\tREF\tALT\tQUAL\tFILTER\tINFO\tFORMAT\tA\tB\n");
+    int i;
+    for (i=0; i<20000; i++)
+    {
+        int chr = i < 12000 ? 1 : 2;
+        ksprintf(&str, "%d\t%d\t.\tA\tC\t%d\t%s\tDP=%d%s\tGT%s\t0/1%s\t1/1%s\n",
+            chr, i * 10 + 1, i % 100,
+            i % 7 ? "PASS" : "q10",
+            i, i >= 10000 && i % 3 == 0 ? ";XX=abc" : "",
+            i >= 5000 ? ":DP" : "", i >= 5000 ? ":5" : "", i >= 5000 ? ":7" : "");
+        if ( str.l > 60000 || i == 19999 )
+        {
+            if ( bgzf_write(bgzf, str.s, str.l) < 0 )
+            {
+                fprintf(stderr,"Could not write: %s\n", fname);
+                exit(1);
+            }
+            str.l = 0;
+        }
+    }
+    free(str.s);
+    int ret;
+    if ( (ret=hts_close(fp)) )
+    {
+        fprintf(stderr,"hts_close(%s): non-zero status %d\n",fname,ret);
+        exit(ret);
+    }
+    if ( truncate )
+    {
+        // cut the file part way into its last block of records
+        FILE *f = fopen(fname,"r+");
+        if ( !f || fseek(f, 0, SEEK_END) || ftruncate(fileno(f), ftell(f) - 1000) || fclose(f) )
+        {
+            fprintf(stderr,"Could not truncate: %s\n", fname);
+            exit(1);
+        }
+    }
+}
+
+void threaded_write(const char *fname, int use_pool)
+{
+    // rewrite the VCF from bcf_to_vcf() as BGZF-compressed VCF on worker threads
+    char *gz_fname = (char*) malloc(strlen(fname)+4);
+    snprintf(gz_fname,strlen(fname)+4,"%s.gz",fname);
+    char *mt_fname = (char*) malloc(strlen(fname)+8);
+    snprintf(mt_fname,strlen(fname)+8,"%s.mt.gz",fname);
+    htsFile *fp = hts_open(gz_fname,"r");
+    htsFile *out = hts_open(mt_fname,"wz");
+    if ( !fp || !out )
+    {
+        fprintf(stderr,"Could not open: %s, %s\n", gz_fname, mt_fname);
+        exit(1);
+    }
+    htsThreadPool p = { NULL, 0 };
+    if ( use_pool )
+    {
+        if ( !(p.pool = hts_tpool_init(2)) || hts_set_thread_pool(out, &p) < 0 )
+        {
+            fprintf(stderr,"hts_set_thread_pool(%s) failed\n", mt_fname);
+            exit(1);
+        }
+    }
+    else if ( hts_set_threads(out, 2) < 0 )
+    {
+        fprintf(stderr,"hts_set_threads(%s) failed\n", mt_fname);
+        exit(1);
+    }
+    bcf_hdr_t *hdr = bcf_hdr_read(fp);
+    bcf_hdr_write(out, hdr);
+    bcf1_t *rec = bcf_init1();
+    while ( bcf_read(fp, hdr, rec)>=0 ) bcf_write(out, hdr, rec);
+    bcf_destroy1(rec);
+    bcf_hdr_destroy(hdr);
+    int ret;
+    if ( (ret=hts_close(fp)) || (ret=hts_close(out)) )
+    {
+        fprintf(stderr,"hts_close(%s): non-zero status %d\n",mt_fname,ret);
+        exit(ret);
+    }
+    hts_tpool_destroy(p.pool);
+
+    // the records read back are those written
+    fp = hts_open(gz_fname,"r");
+    htsFile *fp_mt = hts_open(mt_fname,"r");
+    if ( !fp || !fp_mt )
+    {
+        fprintf(stderr,"Could not read: %s, %s\n", gz_fname, mt_fname);
+        exit(1);
+    }
+    kstring_t str = {0,0,0}, str_mt = {0,0,0};
+    int ret_mt;
+    do
+    {
+        ret = hts_getline(fp, KS_SEP_LINE, &str);
+        ret_mt = hts_getline(fp_mt, KS_SEP_LINE, &str_mt);
+        if ( ret<0 && ret_mt<0 ) break;
+        if ( ret<0 || ret_mt<0 || (str.s[0]=='#' ? str.s[0]!=str_mt.s[0] : strcmp(str.s,str_mt.s)!=0) )
+        {
+            fprintf(stderr,"Threaded write differs:\n%s\n%s\n", ret<0 ? "EOF" : str.s, ret_mt<0 ? "EOF" : str_mt.s);
+            exit(1);
+        }
+    }
+    while (1);
+    free(str.s);
+    free(str_mt.s);
+    if ( (ret=hts_close(fp)) || (ret=hts_close(fp_mt)) )
+    {
+        fprintf(stderr,"hts_close(%s): non-zero status %d\n",mt_fname,ret);
+        exit(ret);
+    }
+    free(gz_fname);
+    free(mt_fname);
+}
+
 int main(int argc, char **argv)
 {
     char *fname = argc>1 ? argv[1] : "rmme.bcf";
     write_bcf(fname);
     bcf_to_vcf(fname);
+    char *tmp_fname = (char*) malloc(strlen(fname)+16);
+    sprintf(tmp_fname,"%s.gz",fname);
+    threaded_read(tmp_fname, 0);
+    sprintf(tmp_fname,"%s.undef.gz",fname);
+    write_undefined(tmp_fname, 0);
+    threaded_read(tmp_fname, 0);
+    sprintf(tmp_fname,"%s.trunc.gz",fname);
+    write_undefined(tmp_fname, 1);
+    int verbose = hts_verbose;
+    hts_verbose = 0;    // the read error is reported from another thread
+    threaded_read(tmp_fname, 1);
+    hts_verbose = verbose;
+    free(tmp_fname);
+    threaded_write(fname, 0);
+    threaded_write(fname, 1);
     iterator(fname);
     return 0;
 }
@@ -34,6 +34,8 @@ my $opts = parse_params();
 
 test_vcf_api($opts,out=>'test-vcf-api.out');
 test_vcf_sweep($opts,out=>'test-vcf-sweep.out');
+test_index($opts,out=>'test-index.out');
+test_tabix_threads($opts,out=>'test-tabix-threads.out');
 
 print "\nNumber of tests:\n";
 printf "    total   .. %d\n", $$opts{nok}+$$opts{nfailed};
@@ -200,3 +202,16 @@ sub test_vcf_sweep
     test_cmd($opts,%args,cmd=>"$$opts{path}/test-vcf-sweep $$opts{tmp}/test-vcf-api.bcf");
 }
 
+sub test_index
+{
+    my ($opts,%args) = @_;
+    test_cmd($opts,%args,cmd=>"$$opts{path}/test-index $$opts{tmp}/test-index");
+}
+
+sub test_tabix_threads
+{
+    my ($opts,%args) = @_;
+    my $vcf = "$$opts{tmp}/test-index.vcf.gz";
+    test_cmd($opts,%args,cmd=>"$$opts{bin}/tabix -f -p vcf $vcf && mv $vcf.tbi $vcf.serial.tbi && " .
+        "$$opts{bin}/tabix -f -p vcf -@ 4 $vcf && cmp $vcf.tbi $vcf.serial.tbi && $$opts{bin}/tabix $vcf chr2:20001-30000 | wc -l");
+}
@@ -118,10 +118,11 @@ int main(int argc, char *argv[])
     bam1_t *b;
     htsFile *out;
     char modew[8];
-    int r = 0, exit_code = 0;
+    int r = 0, exit_code = 0, nthreads = 0, batch_size = 0;
     hts_opt *in_opts = NULL, *out_opts = NULL, *last = NULL;
+    htsThreadPool p = { NULL, 0 };
 
-    while ((c = getopt(argc, argv, "IbDCSl:t:i:o:")) >= 0) {
+    while ((c = getopt(argc, argv, "IbDCSl:t:i:o:@:B:")) >= 0) {
         switch (c) {
         case 'S': flag |= 1; break;
         case 'b': flag |= 2; break;
@@ -132,10 +133,12 @@ int main(int argc, char *argv[])
         case 'I': ignore_sam_err = 1; break;
         case 'i': if (add_option(&in_opts,  optarg)) return 1; break;
         case 'o': if (add_option(&out_opts, optarg)) return 1; break;
+        case '@': nthreads = atoi(optarg); break;
+        case 'B': batch_size = atoi(optarg); break;
         }
     }
     if (argc == optind) {
-        fprintf(stderr, "Usage: samview [-bSCSI] [-l level] [-o option=value] <in.bam>|<in.sam>|<in.cram> [region]\n");
+        fprintf(stderr, "Usage: samview [-bSCSI] [-l level] [-o option=value] [-@ threads] [-B batch] <in.bam>|<in.sam>|<in.cram> [region]\n");
         return 1;
     }
     strcpy(moder, "r");
@@ -183,6 +186,16 @@ int main(int argc, char *argv[])
     for (; out_opts;  out_opts = (last=out_opts)->next, free(last))
         hts_set_opt(out, out_opts->opt,  out_opts->val);
 
+    // Input and output share a single pool of worker threads
+    if (nthreads > 0) {
+        if (!(p.pool = hts_tpool_init(nthreads))) {
+            fprintf(stderr, "Error creating thread pool\n");
+            return EXIT_FAILURE;
+        }
+        hts_set_thread_pool(in, &p);
+        hts_set_thread_pool(out, &p);
+    }
+
     sam_hdr_write(out, h);
     if (optind + 1 < argc && !(flag&1)) { // BAM input and has a region
         int i;
@@ -207,6 +220,24 @@ int main(int argc, char *argv[])
             hts_itr_destroy(iter);
         }
         hts_idx_destroy(idx);
+    } else if (batch_size > 0 && in->format.format == bam) {
+        // BAM input read a batch of records at a time
+        bam_batch_t *batch = bam_batch_init(batch_size);
+        int i;
+        if (batch == NULL) {
+            fprintf(stderr, "Error allocating batch\n");
+            return EXIT_FAILURE;
+        }
+        while (exit_code == 0 && (r = bam_read_batch(in->fp.bgzf, batch)) >= 0) {
+            for (i = 0; i < batch->n; i++) {
+                if (sam_write1(out, h, &batch->b[i]) < 0) {
+                    fprintf(stderr, "Error writing output.\n");
+                    exit_code = 1;
+                    break;
+                }
+            }
+        }
+        bam_batch_destroy(batch);
     } else while ((r = sam_read1(in, h, b)) >= 0) {
         if (sam_write1(out, h, b) < 0) {
             fprintf(stderr, "Error writing output.\n");
@@ -235,5 +266,7 @@ int main(int argc, char *argv[])
         exit_code = 1;
     }
 
+    if (p.pool) hts_tpool_destroy(p.pool);
+
     return exit_code;
 }
@@ -52,6 +52,10 @@ foreach my $sam (glob("*#*.sam")) {
     test "./test_view $bam > $bam.sam_";
     test "./compare_sam.pl $sam $bam.sam_";
 
+    # BAM -> SAM, read in batches
+    test "./test_view -B 3 $bam > $bam.batch.sam_";
+    test "./compare_sam.pl $sam $bam.batch.sam_";
+
     # SAM -> CRAM -> SAM
     test "./test_view -t $ref -S -C $sam > $cram";
     test "./test_view -D $cram > $cram.sam_";
@@ -63,6 +67,16 @@ foreach my $sam (glob("*#*.sam")) {
     test "./test_view -b -D $cram > $cram.bam";
     test "./test_view $cram.bam > $cram.bam.sam_";
     test "./compare_sam.pl -nomd $sam $cram.bam.sam_";
+
+    # SAM -> BAM -> SAM, multi-threaded
+    test "./test_view -@ 4 -S -b $sam > $bam.mt.bam";
+    test "./test_view -@ 4 $bam.mt.bam > $bam.mt.bam.sam_";
+    test "./compare_sam.pl $sam $bam.mt.bam.sam_";
+
+    # BAM -> CRAM -> SAM, multi-threaded
+    test "./test_view -@ 4 -t $ref -C $bam.mt.bam > $bam.mt.cram";
+    test "./test_view -@ 4 -D $bam.mt.cram > $bam.mt.cram.sam_";
+    test "./compare_sam.pl -nomd $sam $bam.mt.cram.sam_";
 }
 
 print "\nSuccesses $suc_count\n";
@@ -1152,6 +1152,19 @@ bcf1_t *bcf_dup(bcf1_t *src)
     return bcf_copy(out, src);
 }
 
+// Index the record just written, for bcf_idx_init()
+static int bcf_idx_push1(htsFile *fp, bcf1_t *v)
+{
+    if ( bgzf_idx_push(fp->fp.bgzf, fp->idx, v->rid, v->pos, v->pos + v->rlen, 1) < 0 )
+    {
+        // unsorted; abandon the index
+        hts_idx_destroy(fp->idx);
+        fp->idx = NULL;
+        return -1;
+    }
+    return 0;
+}
+
 int bcf_write(htsFile *hfp, const bcf_hdr_t *h, bcf1_t *v)
 {
     if ( h->dirty )
@@ -1191,6 +1204,7 @@ int bcf_write(htsFile *hfp, const bcf_hdr_t *h, bcf1_t *v)
     if ( bgzf_write(fp, x, 32) != 32 ) return -1;
     if ( bgzf_write(fp, v->shared.s, v->shared.l) != v->shared.l ) return -1;
     if ( bgzf_write(fp, v->indiv.s, v->indiv.l) != v->indiv.l ) return -1;
+    if ( hfp->idx && bcf_idx_push1(hfp, v) < 0 ) return -1;
     return 0;
 }
 
@@ -1491,7 +1505,7 @@ static inline void align_mem(kstring_t *s)
 }
 
 // p,q is the start and the end of the FORMAT field
-int _vcf_parse_format(kstring_t *s, const bcf_hdr_t *h, bcf1_t *v, char *p, char *q)
+int _vcf_parse_format(kstring_t *s, const bcf_hdr_t *h, bcf1_t *v, char *p, char *q, kstring_t *mem)
 {
     if ( !bcf_hdr_nsamples(h) ) return 0;
 
@@ -1500,7 +1514,8 @@ int _vcf_parse_format(kstring_t *s, const bcf_hdr_t *h, bcf1_t *v, char *p, char
     khint_t k;
     ks_tokaux_t aux1;
     vdict_t *d = (vdict_t*)h->dict[BCF_DT_ID];
-    kstring_t *mem = (kstring_t*)&h->mem;
+    int extend_hdr = (mem == NULL);
+    if (extend_hdr) mem = (kstring_t*)&h->mem;
     mem->l = 0;
 
     // count the number of format fields
@@ -1519,6 +1534,7 @@ int _vcf_parse_format(kstring_t *s, const bcf_hdr_t *h, bcf1_t *v, char *p, char
         *(char*)aux1.p = 0;
         k = kh_get(vdict, d, t);
         if (k == kh_end(d) || kh_val(d, k).info[BCF_HL_FMT] == 15) {
+            if (!extend_hdr) return HTS_TEXT_SERIAL;
             fprintf(stderr, "[W::%s] FORMAT '%s' is not defined in the header, assuming Type=String\n", __func__, t);
             kstring_t tmp = {0,0,0};
             int l;
@@ -1728,9 +1744,12 @@ int _vcf_parse_format(kstring_t *s, const bcf_hdr_t *h, bcf1_t *v, char *p, char
     return 0;
 }
 
-int vcf_parse(kstring_t *s, const bcf_hdr_t *h, bcf1_t *v)
+// Parses a VCF line, using h->mem as scratch space and adding any contigs
+// and tags missing from the header to it.  Given other scratch space, the
+// header is left unchanged and HTS_TEXT_SERIAL returned instead.
+static int vcf_parse_core(kstring_t *s, const bcf_hdr_t *h, bcf1_t *v, kstring_t *mem)
 {
-    int i = 0;
+    int i = 0, extend_hdr = (mem == NULL);
     char *p, *q, *r, *t;
     kstring_t *str;
     khint_t k;
@@ -1747,6 +1766,7 @@ int vcf_parse(kstring_t *s, const bcf_hdr_t *h, bcf1_t *v)
             k = kh_get(vdict, d, p);
             if (k == kh_end(d))
             {
+                if (!extend_hdr) return HTS_TEXT_SERIAL;
                 // Simple error recovery for chromosomes not defined in the header. It will not help when VCF header has
                 // been already printed, but will enable tools like vcfcheck to proceed.
                 fprintf(stderr, "[W::%s] contig '%s' is not defined in the header. (Quick workaround: index the file with tabix.)\n", __func__, p);
@@ -1800,6 +1820,7 @@ int vcf_parse(kstring_t *s, const bcf_hdr_t *h, bcf1_t *v)
                     k = kh_get(vdict, d, t);
                     if (k == kh_end(d))
                     {
+                        if (!extend_hdr) return HTS_TEXT_SERIAL;
                         // Simple error recovery for FILTERs not defined in the header. It will not help when VCF header has
                         // been already printed, but will enable tools like vcfcheck to proceed.
                         fprintf(stderr, "[W::%s] FILTER '%s' is not defined in the header\n", __func__, t);
@@ -1839,6 +1860,7 @@ int vcf_parse(kstring_t *s, const bcf_hdr_t *h, bcf1_t *v)
                     k = kh_get(vdict, d, key);
                     if (k == kh_end(d) || kh_val(d, k).info[BCF_HL_INFO] == 15)
                     {
+                        if (!extend_hdr) return HTS_TEXT_SERIAL;
                         fprintf(stderr, "[W::%s] INFO '%s' is not defined in the header, assuming Type=String\n", __func__, key);
                         kstring_t tmp = {0,0,0};
                         int l;
@@ -1899,16 +1921,78 @@ int vcf_parse(kstring_t *s, const bcf_hdr_t *h, bcf1_t *v)
             }
             if ( v->max_unpack && !(v->max_unpack>>3) ) return 0;
         } else if (i == 8) // FORMAT
-            return _vcf_parse_format(s, h, v, p, q);
+            return _vcf_parse_format(s, h, v, p, q, mem);
     }
     return 0;
 }
 
+int vcf_parse(kstring_t *s, const bcf_hdr_t *h, bcf1_t *v)
+{
+    return vcf_parse_core(s, h, v, NULL);
+}
+
+static void *vcf_text_init(const void *proto)
+{
+    bcf1_t *v = bcf_init1();
+    if (v) v->max_unpack = ((const bcf1_t*)proto)->max_unpack;
+    return v;
+}
+
+static void vcf_text_destroy(void *rec)
+{
+    bcf_destroy1((bcf1_t*)rec);
+}
+
+// The workers' copy keeps any samples subset as well
+static void *vcf_text_hdr_dup(const void *hdr)
+{
+    const bcf_hdr_t *h0 = (const bcf_hdr_t*)hdr;
+    bcf_hdr_t *h = bcf_hdr_dup(h0);
+    if (h && h0->keep_samples) {
+        size_t narr = bit_array_size(h0->nsamples_ori);
+        if ((h->keep_samples = (uint8_t*)malloc(narr)) == NULL) {
+            bcf_hdr_destroy(h);
+            return NULL;
+        }
+        memcpy(h->keep_samples, h0->keep_samples, narr);
+        h->nsamples_ori = h0->nsamples_ori;
+    }
+    return h;
+}
+
+static void vcf_text_hdr_destroy(void *hdr)
+{
+    bcf_hdr_destroy((bcf_hdr_t*)hdr);
+}
+
+static int vcf_text_parse(kstring_t *line, void *hdr, void *rec, kstring_t *tmp)
+{
+    return vcf_parse_core(line, (const bcf_hdr_t*)hdr, (bcf1_t*)rec, tmp);
+}
+
+// Parsing only adds header lines, and the tags or contigs they define
+static int64_t vcf_text_hdr_size(const void *hdr)
+{
+    const bcf_hdr_t *h = (const bcf_hdr_t*)hdr;
+    return (int64_t) h->nhrec + h->n[BCF_DT_ID] + h->n[BCF_DT_CTG];
+}
+
+static const hts_text_parser_t vcf_text_parser = {
+    sizeof(bcf1_t), vcf_text_init, vcf_text_destroy,
+    vcf_text_hdr_dup, vcf_text_hdr_destroy, vcf_text_parse,
+    vcf_text_hdr_size
+};
+
 int vcf_read(htsFile *fp, const bcf_hdr_t *h, bcf1_t *v)
 {
     int ret;
+    if (fp->text_mt) {
+        ret = hts_text_mt_read(fp, &vcf_text_parser, (void*)h, v);
+        if (ret == -3) return -2; // read error
+        return ret;
+    }
     ret = hts_getline(fp, KS_SEP_LINE, &fp->line);
-    if (ret < 0) return -1;
+    if (ret < 0) return (ret == -1)? -1 : -2;
     return vcf_parse1(&fp->line, h, v);
 }
 
@@ -2132,6 +2216,7 @@ int vcf_write(htsFile *fp, const bcf_hdr_t *h, bcf1_t *v)
         ret = bgzf_write(fp->fp.bgzf, fp->line.s, fp->line.l);
     else
         ret = hwrite(fp->fp.hfile, fp->line.s, fp->line.l);
+    if ( ret==fp->line.l && fp->idx && bcf_idx_push1(fp, v) < 0 ) return -1;
     return ret==fp->line.l ? 0 : -1;
 }
 
@@ -2152,15 +2237,40 @@ int bcf_hdr_id2int(const bcf_hdr_t *h, int which, const char *id)
  *** BCF indexing ***
  ********************/
 
-hts_idx_t *bcf_index(htsFile *fp, int min_shift)
+// Callbacks for hts_idx_push_mt()
+static size_t bcf_idx_split(void *data, const uint8_t *buf, size_t len)
+{
+    size_t pos = 0;
+    while (len - pos >= 8) {
+        uint32_t x[2];
+        memcpy(x, buf + pos, 8);
+        // A bad length ends the record here, so bcf_idx_parse() rejects it
+        if (x[0] < 24) return pos + 8;
+        if ((uint64_t)x[0] + x[1] > len - pos - 8) break;
+        pos += 8 + (uint64_t)x[0] + x[1];
+    }
+    return pos;
+}
+
+static int bcf_idx_parse(void *data, uint8_t *buf, size_t len, hts_idx_rec_t *r)
+{
+    uint32_t x[5];
+    if (len < 32) return -1;
+    memcpy(x, buf, 20);
+    if (x[0] < 24 || (uint64_t)x[0] + x[1] > len - 8 || (uint64_t)x[0] + x[1] + 8 > INT_MAX) return -1;
+    r->tid = x[2];
+    r->beg = x[3];
+    r->end = (int32_t)x[3] + (int32_t)x[4];
+    r->is_mapped = 1;
+    r->name = NULL;
+    return 8 + x[0] + x[1];
+}
+
+// A CSI index with enough levels for the longest contig in the header
+static hts_idx_t *bcf_idx_new(const bcf_hdr_t *h, int min_shift, uint64_t offset0)
 {
     int n_lvls, i;
-    bcf1_t *b;
-    hts_idx_t *idx;
-    bcf_hdr_t *h;
     int64_t max_len = 0, s;
-    h = bcf_hdr_read(fp);
-    if ( !h ) return NULL;
     int nids = 0;
     for (i = 0; i < h->n[BCF_DT_CTG]; ++i)
     {
@@ -2171,7 +2281,22 @@ hts_idx_t *bcf_index(htsFile *fp, int min_shift)
     if ( !max_len ) max_len = ((int64_t)1<<31) - 1;  // In case contig line is broken.
     max_len += 256;
     for (n_lvls = 0, s = 1<<min_shift; max_len > s; ++n_lvls, s <<= 3);
-    idx = hts_idx_init(nids, HTS_FMT_CSI, bgzf_tell(fp->fp.bgzf), min_shift, n_lvls);
+    return hts_idx_init(nids, HTS_FMT_CSI, offset0, min_shift, n_lvls);
+}
+
+static hts_idx_t *bcf_index_mt(htsFile *fp, int min_shift, hts_tpool *pool)
+{
+    bcf1_t *b;
+    hts_idx_t *idx;
+    bcf_hdr_t *h;
+    h = bcf_hdr_read(fp);
+    if ( !h ) return NULL;
+    idx = bcf_idx_new(h, min_shift, bgzf_tell(fp->fp.bgzf));
+    if (fp->format.format == bcf && hts_idx_push_mt(idx, fp->fp.bgzf, pool, bcf_idx_split, bcf_idx_parse, NULL, NULL) < 0) {
+        hts_idx_destroy(idx);
+        bcf_hdr_destroy(h);
+        return NULL;
+    }
     b = bcf_init1();
     while (bcf_read1(fp,h, b) >= 0) {
         int ret;
@@ -2189,18 +2314,118 @@ hts_idx_t *bcf_index(htsFile *fp, int min_shift)
     return idx;
 }
 
+hts_idx_t *bcf_index(htsFile *fp, int min_shift)
+{
+    return bcf_index_mt(fp, min_shift, NULL);
+}
+
+typedef struct {
+    bcf_shard_func *func;
+    void *data;
+} bcf_shard_data_t;
+
+static void *bcf_shard_hdr_read(htsFile *fp)
+{
+    if (fp->format.format != bcf) {
+        if (hts_verbose >= 1) fprintf(stderr, "[E::%s] only BCF files can be processed in shards\n", __func__);
+        return NULL;
+    }
+    return bcf_hdr_read(fp);
+}
+
+static void bcf_shard_hdr_destroy(void *h)
+{
+    bcf_hdr_destroy((bcf_hdr_t *) h);
+}
+
+static hts_itr_t *bcf_shard_query(const hts_idx_t *idx, int tid, int beg, int end)
+{
+    return hts_itr_query(idx, tid, beg, end, bcf_readrec);
+}
+
+static int bcf_shard_call(htsFile *fp, void *h, hts_itr_t *iter, const hts_region_t *shard, void *data)
+{
+    bcf_shard_data_t *d = (bcf_shard_data_t *) data;
+    return d->func(fp, (bcf_hdr_t *) h, iter, shard, d->data);
+}
+
+int bcf_process_shards(const char *fn, const hts_idx_t *idx, int n_threads, bcf_shard_func *func, void *data)
+{
+    hts_shard_ops_t ops = { bcf_shard_hdr_read, bcf_shard_hdr_destroy, NULL, bcf_shard_query };
+    bcf_shard_data_t d = { func, data };
+    hts_region_t *shards;
+    int n, ret;
+    // A few shards per thread, as in sam_process_shards()
+    if ((shards = hts_idx_shards(idx, 4 * (n_threads > 1? n_threads : 1), &n)) == NULL) return n;
+    ret = hts_process_shards(fn, idx, shards, n, n_threads, &ops, bcf_shard_call, &d);
+    free(shards);
+    return ret;
+}
+
 int bcf_index_build(const char *fn, int min_shift)
+{
+    return bcf_index_build_mt(fn, min_shift, 0);
+}
+
+int bcf_index_build_mt(const char *fn, int min_shift, int n_threads)
 {
     htsFile *fp;
     hts_idx_t *idx;
+    hts_tpool *pool = NULL;
+    int ret;
     if ((fp = hts_open(fn, "rb")) == 0) return -1;
     if ( fp->format.compression!=bgzf ) { hts_close(fp); return -1; }
-    idx = bcf_index(fp, min_shift);
+    if ( n_threads > 0 && (pool = hts_tpool_init(n_threads)) != NULL )
+        bgzf_thread_pool(fp->fp.bgzf, pool, 0);
+    idx = bcf_index_mt(fp, min_shift, pool);
     hts_close(fp);
+    hts_tpool_destroy(pool);
     if ( !idx ) return -1;
-    hts_idx_save(idx, fn, HTS_FMT_CSI);
+    ret = hts_idx_save(idx, fn, HTS_FMT_CSI);
     hts_idx_destroy(idx);
-    return 0;
+    return ret;
+}
+
+// A tabix index of a VCF, listing all the header's contigs so that the
+// contig ids can be used as they are; hts_close() drops those left empty
+// and renumbers the rest in the order they appear in the file
+static hts_idx_t *vcf_idx_new(const bcf_hdr_t *h, int min_shift, uint64_t offset0)
+{
+    int i, n_lvls, fmt, l_nm = 0, n = h->n[BCF_DT_CTG];
+    uint32_t x[7];
+    uint8_t *meta;
+    hts_idx_t *idx;
+    if (min_shift > 0) n_lvls = (TBX_MAX_SHIFT - min_shift + 2) / 3, fmt = HTS_FMT_CSI;
+    else min_shift = 14, n_lvls = 5, fmt = HTS_FMT_TBI;
+    if ( !(idx = hts_idx_init(n, fmt, offset0, min_shift, n_lvls)) ) return NULL;
+    for (i = 0; i < n; ++i) l_nm += strlen(bcf_hdr_id2name(h, i)) + 1;
+    if ( !(meta = (uint8_t*)malloc(28 + l_nm)) ) { hts_idx_destroy(idx); return NULL; }
+    memcpy(x, &tbx_conf_vcf, 24);
+    x[6] = l_nm;
+    if (ed_is_big())
+        for (i = 0; i < 7; ++i) x[i] = ed_swap_4(x[i]);
+    memcpy(meta, x, 28);
+    for (l_nm = 28, i = 0; i < n; ++i) {
+        int l = strlen(bcf_hdr_id2name(h, i)) + 1;
+        memcpy(meta + l_nm, bcf_hdr_id2name(h, i), l);
+        l_nm += l;
+    }
+    hts_idx_set_meta(idx, l_nm, meta, 0);
+    return idx;
+}
+
+int bcf_idx_init(htsFile *fp, bcf_hdr_t *h, int min_shift)
+{
+    if ( !fp->is_write || fp->idx || !strcmp(fp->fn, "-") ) return -1;
+    if ( fp->format.compression==no_compression ) return -1;
+    // Start the records in a new block, so that the initial offset is
+    // known even if compression is multi-threaded
+    if ( bgzf_flush(fp->fp.bgzf) < 0 ) return -1;
+    if ( fp->format.format==vcf || fp->format.format==text_format )
+        fp->idx = vcf_idx_new(h, min_shift, bgzf_tell(fp->fp.bgzf));
+    else
+        fp->idx = bcf_idx_new(h, min_shift > 0 ? min_shift : 14, bgzf_tell(fp->fp.bgzf));
+    return fp->idx ? 0 : -1;
 }
 
 /*****************
@@ -0,0 +1 @@
+#define HTS_VERSION "9dd46ad-dirty"